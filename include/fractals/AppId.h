@@ -4,6 +4,9 @@
 #include <fractals/app/Client.h>
 
 #include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
 
 namespace fractals
 {
@@ -17,9 +20,28 @@ class Fractals
         return APPID;
     }
 
+    // Port to accept peers on, can be overridden with FRACTALS_LISTEN_PORT
+    static uint16_t initListenPort()
+    {
+        if (const char *port = std::getenv("FRACTALS_LISTEN_PORT"))
+        {
+            const auto value = std::strtoul(port, nullptr, 10);
+            if (value > 0 && value <= UINT16_MAX)
+            {
+                LISTEN_PORT = value;
+            }
+        }
+
+        return LISTEN_PORT;
+    }
+
+    static constexpr uint16_t DEFAULT_LISTEN_PORT = 6882;
+
     static common::AppId APPID;
+    static uint16_t LISTEN_PORT;
 };
 
 inline common::AppId Fractals::APPID = {};
+inline uint16_t Fractals::LISTEN_PORT = Fractals::DEFAULT_LISTEN_PORT;
 
 } // namespace fractals
\ No newline at end of file
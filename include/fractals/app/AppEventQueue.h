@@ -8,5 +8,7 @@
 namespace fractals::app
 {
     static constexpr uint32_t WORK_QUEUE_SIZE = 256;
-    using AppEventQueue = common::FullDuplexQueue<WORK_QUEUE_SIZE, ResponseToApp, RequestFromApp>;
+    // Low volume, so let the app push requests from any of its threads
+    using AppEventQueue = common::FullDuplexQueue<WORK_QUEUE_SIZE, ResponseToApp, RequestFromApp,
+                                                  common::MpscQueue>;
 }
\ No newline at end of file
@@ -85,10 +85,37 @@ struct PeerStats
     uint64_t torrId;
     uint16_t knownPeerCount;
     uint16_t connectedPeersCount;
+    // Bytes per second transferred with peers and the configured limits, 0 is unlimited
+    uint64_t downloadRate{0};
+    uint64_t uploadRate{0};
+    uint64_t downloadLimit{0};
+    uint64_t uploadLimit{0};
+    // Bytes received in endgame for blocks that another peer already delivered
+    uint64_t wastedBytes{0};
 };
 
-using RequestFromApp =
-    std::variant<AddTorrent, RemoveTorrent, StopTorrent, StartTorrent, ResumeTorrent, Shutdown, RequestStats>;
+struct SetRateLimit
+{
+    enum class Scope
+    {
+        Global,
+        Torrent,
+        // Applies to every single peer
+        Peer
+    };
+
+    Scope scope;
+    // Only used for Scope::Torrent
+    common::InfoHash infoHash;
+    // Bytes per second, 0 is unlimited
+    uint64_t downloadRate;
+    uint64_t uploadRate;
+    // Bytes, 0 picks a default
+    uint64_t burst{0};
+};
+
+using RequestFromApp = std::variant<AddTorrent, RemoveTorrent, StopTorrent, StartTorrent,
+                                    ResumeTorrent, Shutdown, RequestStats, SetRateLimit>;
 using ResponseToApp = std::variant<AddedTorrent, AddTorrentError, ResumedTorrent, CompletedTorrent,
                                    RemovedTorrent, StoppedTorrent, ShutdownConfirmation, PeerStats>;
 } // namespace fractals::app
\ No newline at end of file
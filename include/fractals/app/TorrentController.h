@@ -45,6 +45,8 @@ class TorrentController
     void removeTorrent(uint64_t torrentId);
     void stopTorrent(uint64_t torrentId);
     void resumeTorrent(uint64_t torrentId);
+    void limitRate(app::SetRateLimit::Scope scope, uint64_t torrentId, uint64_t downloadRate,
+                   uint64_t uploadRate);
 
     void readResponses();
     void refreshStats();
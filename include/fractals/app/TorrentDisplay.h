@@ -7,6 +7,7 @@
 #include <ftxui/component/component_base.hpp> // for ComponentBase
 #include <ftxui/dom/elements.hpp>
 
+#include <fractals/app/Event.h>
 #include <fractals/app/Feedback.h>
 #include <fractals/app/TorrentDisplayEntry.h>
 
@@ -42,6 +43,8 @@ class TorrentDisplayBase : public ftxui::ComponentBase
     std::function<void(uint64_t)> onRemove;
     std::function<void(uint64_t)> onStop;
     std::function<void(uint64_t)> onResume;
+    // scope, torrent id (only for torrent scope), download and upload rate in bytes per second
+    std::function<void(SetRateLimit::Scope, uint64_t, uint64_t, uint64_t)> onLimit;
 
     TorrentDisplayBase(ftxui::Component terminalInput,
                        const std::unordered_map<uint64_t, TorrentDisplayEntry> &torrents);
@@ -45,6 +45,13 @@ class TorrentDisplayEntry
     // speeds are reported in number of bytes per second
     uint64_t getDownloadSpeed() const;
     uint64_t getUploadSpeed() const;
+    // rates measured on the network connections, limits of 0 are unlimited
+    uint64_t getDownloadRate() const;
+    uint64_t getUploadRate() const;
+    uint64_t getDownloadLimit() const;
+    uint64_t getUploadLimit() const;
+    // bytes received in endgame that another peer already delivered
+    uint64_t getWastedBytes() const;
     uint64_t getTotalSeeders() const;
     uint64_t getConnectedSeeders() const;
     uint64_t getTotalLeechers() const;
@@ -67,6 +74,12 @@ class TorrentDisplayEntry
     std::chrono::nanoseconds prevTime{0};
     uint64_t downloadSpeed{0};
     uint64_t uploadSpeed{0};
+
+    uint64_t downloadRate{0};
+    uint64_t uploadRate{0};
+    uint64_t downloadLimit{0};
+    uint64_t uploadLimit{0};
+    uint64_t wastedBytes{0};
 };
 
 } // namespace fractals::app
\ No newline at end of file
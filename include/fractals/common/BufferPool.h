@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+namespace fractals::common
+{
+
+struct BufferPoolConfig
+{
+    // Max bytes of all buffers, handed out or cached
+    uint64_t memoryLimit{512 * 1024 * 1024};
+    // Max bytes of returned buffers that are kept for reuse
+    uint64_t cacheLimit{64 * 1024 * 1024};
+    // Back buffers of at least a huge page with transparent huge pages
+    bool hugePages{false};
+};
+
+struct BufferPoolStats
+{
+    uint64_t inUse{0};
+    uint64_t cached{0};
+    uint64_t acquired{0};
+    uint64_t reused{0};
+    // Acquires that were refused because the memory limit was reached
+    uint64_t refused{0};
+};
+
+class BufferPool;
+
+/**
+Buffer of a piece that is being downloaded. Returns its memory to the pool once destroyed,
+from whichever thread that happens on. A buffer that is not taken from a pool owns a plain
+heap allocation.
+*/
+class PieceBuffer
+{
+    friend class BufferPool;
+    struct Arena;
+
+  public:
+    PieceBuffer() = default;
+    explicit PieceBuffer(uint64_t size);
+    PieceBuffer(const PieceBuffer &) = delete;
+    PieceBuffer &operator=(const PieceBuffer &) = delete;
+    PieceBuffer(PieceBuffer &&other) noexcept;
+    PieceBuffer &operator=(PieceBuffer &&other) noexcept;
+    ~PieceBuffer();
+
+    explicit operator bool() const;
+    char *data();
+    const char *data() const;
+    uint64_t size() const;
+    // Bytes taken from the pool, the size rounded up to its size class
+    uint64_t capacity() const;
+    std::string_view view() const;
+
+    const char *begin() const;
+    const char *end() const;
+
+  private:
+    PieceBuffer(std::shared_ptr<Arena> arena, char *data, uint64_t size, uint64_t capacity);
+    void release();
+
+    std::shared_ptr<Arena> mArena;
+    char *mData{nullptr};
+    uint64_t mSize{0};
+    uint64_t mCapacity{0};
+};
+
+/**
+Pool of piece buffers with a global memory limit. Sizes are rounded up to a power of two size
+class and returned buffers are kept per class, so that the buffers of finished pieces are
+reused for the next pieces instead of going back to the allocator.
+
+Acquiring fails once the limit is reached, the caller is expected to hold off starting new
+pieces until the disk service wrote some of the completed ones.
+*/
+class BufferPool
+{
+  public:
+    static constexpr uint64_t MIN_SIZE_CLASS = 16 * 1024;
+    static constexpr uint64_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+    explicit BufferPool(BufferPoolConfig config = {});
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    // Empty buffer if the memory limit does not allow for it
+    PieceBuffer acquire(uint64_t size);
+    void setMemoryLimit(uint64_t limit);
+    // Frees the cached buffers
+    void trim();
+
+    BufferPoolStats getStats() const;
+    static uint64_t sizeClass(uint64_t size);
+
+  private:
+    std::shared_ptr<PieceBuffer::Arena> mArena;
+};
+
+} // namespace fractals::common
@@ -1,28 +1,39 @@
 #pragma once
 
 #include <fractals/common/WorkQueue.h>
-#include <condition_variable>
+#include <fractals/sync/Notifier.h>
+
+#include <chrono>
 #include <cstdint>
+#include <spdlog/spdlog.h>
+#include <string_view>
 
 namespace fractals::common
 {
-template <uint32_t SIZE, typename LeftEventIn, typename RightEventIn> class FullDuplexQueue
+/**
+Pair of queues between two threads. Each end pushes to one queue and pops from the other. By
+default both directions are single producer, pass MpscQueue when several threads push from the
+same end.
+*/
+template <uint32_t SIZE, typename LeftEventIn, typename RightEventIn,
+          template <uint32_t, typename> typename Queue = SpscQueue>
+class FullDuplexQueue
 {
   public:
     template <typename PushEvent, typename PopEvent> struct QueueEndPoint
     {
       public:
-        QueueEndPoint(WorkQueueImpl<SIZE, PushEvent> &pushEnd, WorkQueueImpl<SIZE, PopEvent> &popEnd)
+        QueueEndPoint(Queue<SIZE, PushEvent> &pushEnd, Queue<SIZE, PopEvent> &popEnd)
             : pushEnd(pushEnd), popEnd(popEnd){};
 
-        void push(PushEvent &&event)
+        bool push(PushEvent &&event)
         {
-            pushEnd.push(std::move(event));
+            return pushEnd.push(std::move(event));
         }
 
-        PopEvent &&pop()
+        PopEvent pop()
         {
-            return std::move(popEnd.pop());
+            return popEnd.pop();
         }
 
         bool canPop() const
@@ -32,7 +43,7 @@ template <uint32_t SIZE, typename LeftEventIn, typename RightEventIn> class Full
 
         bool canPush() const
         {
-            return !pushEnd.size() == SIZE;
+            return pushEnd.canPush();
         }
 
         uint32_t numToRead() const
@@ -40,9 +51,23 @@ template <uint32_t SIZE, typename LeftEventIn, typename RightEventIn> class Full
             return popEnd.size();
         }
 
-        void attachNotifier(std::mutex& mutex, std::condition_variable &cv)
+        // Policy for events pushed from this end
+        void setOverflowPolicy(OverflowPolicy policy,
+                               std::chrono::milliseconds blockTimeout =
+                                   Queue<SIZE, PushEvent>::DEFAULT_BLOCK_TIMEOUT)
+        {
+            pushEnd.setOverflowPolicy(policy, blockTimeout);
+        }
+
+        QueueStats getPushStats() const
+        {
+            return pushEnd.getStats();
+        }
+
+        // Signal the notifier when an event arrives at this end
+        void attachNotifier(sync::Notifier &notifier, uint32_t source)
         {
-            popEnd.attachNotifier(mutex, cv);
+            popEnd.attachNotifier(notifier, source);
         }
 
         void notify()
@@ -51,15 +76,20 @@ template <uint32_t SIZE, typename LeftEventIn, typename RightEventIn> class Full
         }
 
       private:
-        WorkQueueImpl<SIZE, PushEvent> &pushEnd;
-        WorkQueueImpl<SIZE, PopEvent> &popEnd;
+        Queue<SIZE, PushEvent> &pushEnd;
+        Queue<SIZE, PopEvent> &popEnd;
     };
 
   public:
     using LeftEndPoint = QueueEndPoint<LeftEventIn, RightEventIn>;
     using RightEndPoint = QueueEndPoint<RightEventIn, LeftEventIn>;
 
-    FullDuplexQueue(){};
+    // Nothing is lost by default, a queue that falls behind grows instead
+    FullDuplexQueue()
+    {
+        leftQueue.setOverflowPolicy(OverflowPolicy::Overflow);
+        rightQueue.setOverflowPolicy(OverflowPolicy::Overflow);
+    };
 
     QueueEndPoint<LeftEventIn, RightEventIn> getLeftEnd()
     {
@@ -71,12 +101,22 @@ template <uint32_t SIZE, typename LeftEventIn, typename RightEventIn> class Full
         return QueueEndPoint<RightEventIn, LeftEventIn>(rightQueue, leftQueue);
     }
 
+    void logStats(std::string_view name) const
+    {
+        auto log = [&](std::string_view direction, const QueueStats &stats)
+        {
+            spdlog::info("{} {}: pushed={} maxDepth={}/{} rejected={} blocked={} timedOut={} "
+                         "overflowed={}",
+                         name, direction, stats.pushed, stats.maxDepth, SIZE, stats.rejected,
+                         stats.blocked, stats.timedOut, stats.overflowed);
+        };
+
+        log("left to right", leftQueue.getStats());
+        log("right to left", rightQueue.getStats());
+    }
+
   private:
-    WorkQueueImpl<SIZE, LeftEventIn> leftQueue;
-    std::mutex leftMutex;
-    std::condition_variable leftCv;
-    WorkQueueImpl<SIZE, RightEventIn> rightQueue;
-    std::mutex rightMutex;
-    std::condition_variable rightCv;
+    Queue<SIZE, LeftEventIn> leftQueue;
+    Queue<SIZE, RightEventIn> rightQueue;
 };
 } // namespace fractals::common
\ No newline at end of file
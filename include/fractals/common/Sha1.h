@@ -0,0 +1,68 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <span>
+#include <string_view>
+
+namespace fractals::common
+{
+
+// Implementations of the batched SHA1
+enum class Sha1Kernel : uint8_t
+{
+    // One buffer after the other through OpenSSL
+    OpenSsl,
+    // SHA extensions of x86 CPUs, one buffer at a time
+    ShaNi,
+    // Eight buffers at once, one in every 32 bit lane of the AVX2 registers
+    Avx2
+};
+
+/**
+Running SHA1 digest. Data may be added in parts as it arrives, the digest is the same as that of
+all data added at once. The context can be copied or moved, so a partially hashed piece can be
+handed to another thread to finish it there. A moved from context must be reset before reuse.
+
+Complete buffers can also be hashed in batches, e.g. when many pieces are verified at once. The
+batch uses OpenSSL unless another kernel is asked for, see benchSha1 for how they compare.
+*/
+class Sha1
+{
+  public:
+    static constexpr size_t DIGEST_SIZE = SHA_DIGEST_LENGTH;
+    using Digest = std::array<char, DIGEST_SIZE>;
+
+    Sha1();
+    Sha1(const Sha1 &other);
+    Sha1(Sha1 &&other) noexcept;
+    Sha1 &operator=(const Sha1 &other);
+    Sha1 &operator=(Sha1 &&other) noexcept;
+    ~Sha1();
+
+    void update(std::string_view data);
+    // Digest of the data added so far, the context starts over afterwards
+    Digest finalize();
+    void reset();
+
+    static Digest digest(std::string_view data);
+
+    // Writes the digest of every input to the digest at the same index, the spans must be
+    // of equal size
+    static void digestMany(std::span<const std::string_view> inputs, std::span<Digest> digests);
+    // Uses the kernel if the CPU supports it, OpenSSL otherwise
+    static void digestMany(std::span<const std::string_view> inputs, std::span<Digest> digests,
+                           Sha1Kernel kernel);
+
+    static bool isSupported(Sha1Kernel kernel);
+    // Kernel that digestMany uses by default
+    static Sha1Kernel getKernel();
+
+  private:
+    EVP_MD_CTX *mCtx{nullptr};
+};
+
+} // namespace fractals::common
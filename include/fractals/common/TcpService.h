@@ -8,6 +8,7 @@
 #include <spdlog/spdlog.h>
 #include <string>
 #include <sys/socket.h>
+#include <unistd.h>
 
 namespace fractals::common
 {
@@ -51,5 +52,49 @@ class TcpService
 
         return fd;
     }
+
+    // Non-blocking listening socket on all interfaces. SO_REUSEPORT allows every reactor to
+    // bind its own socket to the same port and have the kernel spread connections over them.
+    int32_t listen(uint16_t port, int backlog = SOMAXCONN)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        if (fd < 0)
+        {
+            spdlog::error("TCPService::listen. Failed to create socket");
+            return fd;
+        }
+
+        int enable = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0)
+        {
+            spdlog::error("TCPService::listen. Could not set socket options {}", strerror(errno));
+            close(fd);
+            return -1;
+        }
+
+        struct sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            spdlog::error("TCPService::listen. bind to port {} fail {}", port, strerror(errno));
+            close(fd);
+            return -1;
+        }
+
+        if (::listen(fd, backlog) < 0)
+        {
+            spdlog::error("TCPService::listen. listen fail {}", strerror(errno));
+            close(fd);
+            return -1;
+        }
+
+        return fd;
+    }
 };
 } // namespace fractals::common
\ No newline at end of file
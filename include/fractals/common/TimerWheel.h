@@ -0,0 +1,293 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <vector>
+
+namespace fractals::common
+{
+
+/**
+Hierarchical timer wheel. Scheduling and cancelling a timer are O(1). Advancing the wheel costs
+O(1) per elapsed tick plus the timers that expire or move down a level.
+
+Deadlines are rounded up to the tick, so a timer never fires early.
+*/
+template <typename Payload> class TimerWheel
+{
+    static constexpr uint32_t SLOT_BITS = 6;
+    static constexpr uint32_t SLOTS = 1 << SLOT_BITS;
+    static constexpr uint32_t LEVELS = 4;
+    static constexpr uint32_t NIL = std::numeric_limits<uint32_t>::max();
+
+    struct Timer
+    {
+        uint64_t expireTick{0};
+        uint32_t generation{0};
+        uint32_t prev{NIL};
+        uint32_t next{NIL};
+        uint16_t level{0};
+        uint16_t slot{0};
+        bool active{false};
+        std::optional<Payload> payload;
+    };
+
+    using Slots = std::array<uint32_t, SLOTS>;
+
+  public:
+    using TimerId = uint64_t;
+    static constexpr TimerId INVALID_TIMER = std::numeric_limits<TimerId>::max();
+
+    TimerWheel(std::chrono::milliseconds tick, std::chrono::nanoseconds now)
+        : tick(tick), currentTick(toTick(now))
+    {
+        for (auto &level : wheel)
+        {
+            level.fill(NIL);
+        }
+    }
+
+    TimerId schedule(std::chrono::nanoseconds deadline, Payload payload)
+    {
+        uint32_t index;
+        if (freeList.empty())
+        {
+            index = timers.size();
+            timers.emplace_back();
+        }
+        else
+        {
+            index = freeList.back();
+            freeList.pop_back();
+        }
+
+        auto &timer = timers[index];
+        timer.expireTick = std::max(toTickCeil(deadline), currentTick + 1);
+        timer.active = true;
+        timer.payload = std::move(payload);
+        insert(index);
+        ++numActive;
+
+        return (static_cast<TimerId>(timer.generation) << 32) | index;
+    }
+
+    bool cancel(TimerId id)
+    {
+        const uint32_t index = id & 0xffffffff;
+        if (index >= timers.size())
+        {
+            return false;
+        }
+
+        auto &timer = timers[index];
+        if (!timer.active || timer.generation != (id >> 32))
+        {
+            return false;
+        }
+
+        unlink(index);
+        release(index);
+        return true;
+    }
+
+    // Fire all timers with a deadline up to now
+    template <typename OnExpire> void advance(std::chrono::nanoseconds now, OnExpire &&onExpire)
+    {
+        const auto nowTick = toTick(now);
+        if (numActive == 0)
+        {
+            currentTick = std::max(currentTick, nowTick);
+            return;
+        }
+
+        while (currentTick < nowTick && numActive > 0)
+        {
+            ++currentTick;
+
+            // Bring timers of the higher levels closer once the lower level wrapped around
+            for (uint32_t level = 1; level < LEVELS; ++level)
+            {
+                if (slotOf(currentTick, level - 1) != 0)
+                {
+                    break;
+                }
+                cascade(level, slotOf(currentTick, level));
+            }
+
+            auto &head = wheel[0][slotOf(currentTick, 0)];
+            while (head != NIL)
+            {
+                const auto index = head;
+                unlink(index);
+                auto payload = std::move(*timers[index].payload);
+                release(index);
+                onExpire(std::move(payload));
+            }
+        }
+
+        currentTick = std::max(currentTick, nowTick);
+    }
+
+    // Time at which advance should next be called. May be earlier than the actual deadline
+    // of a timer that still has to move down a level.
+    std::optional<std::chrono::nanoseconds> nextExpiry() const
+    {
+        std::optional<uint64_t> next;
+        for (uint32_t level = 0; level < LEVELS; ++level)
+        {
+            const auto distance = nextOccupied(level);
+            if (!distance)
+            {
+                continue;
+            }
+
+            const auto shift = level * SLOT_BITS;
+            const auto candidate = level == 0
+                                       ? currentTick + *distance
+                                       : (((currentTick >> shift) + *distance) << shift);
+            if (!next || candidate < *next)
+            {
+                next = candidate;
+            }
+        }
+
+        if (!next)
+        {
+            return std::nullopt;
+        }
+
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(tick * *next);
+    }
+
+    size_t size() const
+    {
+        return numActive;
+    }
+
+    bool empty() const
+    {
+        return numActive == 0;
+    }
+
+  private:
+    uint64_t toTick(std::chrono::nanoseconds time) const
+    {
+        return std::max<int64_t>(0, time / tick);
+    }
+
+    uint64_t toTickCeil(std::chrono::nanoseconds time) const
+    {
+        const auto ticks = toTick(time);
+        return tick * ticks < time ? ticks + 1 : ticks;
+    }
+
+    static uint32_t slotOf(uint64_t expireTick, uint32_t level)
+    {
+        return (expireTick >> (level * SLOT_BITS)) & (SLOTS - 1);
+    }
+
+    void insert(uint32_t index)
+    {
+        auto &timer = timers[index];
+        const auto delta = timer.expireTick - currentTick;
+
+        uint32_t level = 0;
+        while (level + 1 < LEVELS && delta >= (uint64_t{1} << ((level + 1) * SLOT_BITS)))
+        {
+            ++level;
+        }
+
+        // Beyond the range of the wheel, park in the furthest slot and cascade again later
+        auto slot = slotOf(timer.expireTick, level);
+        if (delta >= (uint64_t{1} << (LEVELS * SLOT_BITS)))
+        {
+            slot = (slotOf(currentTick, level) + SLOTS - 1) & (SLOTS - 1);
+        }
+
+        timer.level = level;
+        timer.slot = slot;
+        timer.prev = NIL;
+        timer.next = wheel[level][slot];
+        if (timer.next != NIL)
+        {
+            timers[timer.next].prev = index;
+        }
+        wheel[level][slot] = index;
+        occupied[level] |= uint64_t{1} << slot;
+    }
+
+    void unlink(uint32_t index)
+    {
+        auto &timer = timers[index];
+        if (timer.prev != NIL)
+        {
+            timers[timer.prev].next = timer.next;
+        }
+        else
+        {
+            wheel[timer.level][timer.slot] = timer.next;
+        }
+
+        if (timer.next != NIL)
+        {
+            timers[timer.next].prev = timer.prev;
+        }
+
+        if (wheel[timer.level][timer.slot] == NIL)
+        {
+            occupied[timer.level] &= ~(uint64_t{1} << timer.slot);
+        }
+    }
+
+    void release(uint32_t index)
+    {
+        auto &timer = timers[index];
+        timer.active = false;
+        timer.payload.reset();
+        ++timer.generation;
+        freeList.push_back(index);
+        --numActive;
+    }
+
+    void cascade(uint32_t level, uint32_t slot)
+    {
+        auto index = wheel[level][slot];
+        wheel[level][slot] = NIL;
+        occupied[level] &= ~(uint64_t{1} << slot);
+
+        while (index != NIL)
+        {
+            const auto next = timers[index].next;
+            insert(index);
+            index = next;
+        }
+    }
+
+    // Distance in slots of the level to the first occupied slot after the current one
+    std::optional<uint64_t> nextOccupied(uint32_t level) const
+    {
+        if (!occupied[level])
+        {
+            return std::nullopt;
+        }
+
+        const auto current = slotOf(currentTick, level);
+        const auto rotated = std::rotr(occupied[level], (current + 1) & (SLOTS - 1));
+        return std::countr_zero(rotated) + 1;
+    }
+
+    std::chrono::milliseconds tick;
+    uint64_t currentTick;
+    size_t numActive{0};
+
+    std::array<Slots, LEVELS> wheel;
+    std::array<uint64_t, LEVELS> occupied{};
+    std::vector<Timer> timers;
+    std::vector<uint32_t> freeList;
+};
+
+} // namespace fractals::common
@@ -1,112 +1,509 @@
 #pragma once
 
-#include <array>
-#include <cmath>
-#include <condition_variable>
+#include <fractals/sync/Notifier.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
-#include <functional>
-#include <iostream>
+#include <deque>
+#include <memory>
 #include <mutex>
+#include <new>
 #include <optional>
 #include <spdlog/spdlog.h>
+#include <thread>
 
 namespace fractals::common
 {
-template <uint32_t SIZE, typename Event> class WorkQueueImpl
+
+static constexpr size_t CACHE_LINE_SIZE = 64;
+
+/**
+Wakes up the consumer of a queue by marking the queue ready on the consumer's Notifier
+*/
+class QueueNotifier
 {
-    static constexpr uint32_t QUEUE_SIZE = SIZE;
-    std::array<Event, QUEUE_SIZE> mEvents;
-    int32_t mHead{0};
-    int32_t mTail{0};
-    std::mutex *mutex{nullptr};
-    std::condition_variable *cv{nullptr};
+  public:
+    void attachNotifier(sync::Notifier &notifier, uint32_t source)
+    {
+        this->notifier = &notifier;
+        this->source = source;
+    }
+
+    void notify()
+    {
+        if (notifier != nullptr)
+        {
+            notifier->notify(source);
+        }
+    }
 
   private:
-    void calibrate()
+    sync::Notifier *notifier{nullptr};
+    uint32_t source{0};
+};
+
+enum class OverflowPolicy : uint8_t
+{
+    // push returns false, the caller decides what to do with the event
+    Reject,
+    // Wait for the consumer to make room, reject once the timeout expires
+    Block,
+    // Queue the event in an unbounded segment behind the ring
+    Overflow
+};
+
+struct QueueStats
+{
+    uint64_t pushed{0};
+    uint64_t rejected{0};
+    // Pushes that had to wait for room, and those that gave up after the timeout
+    uint64_t blocked{0};
+    uint64_t timedOut{0};
+    uint64_t overflowed{0};
+    // Highest number of events queued at once
+    uint64_t maxDepth{0};
+};
+
+/**
+Overflow handling and counters shared by the ring queues. The ring is only bypassed once it is
+full, so the policies cost nothing while the consumer keeps up.
+
+Derived rings provide ringPush, which moves the event only if it succeeds, ringPop, ringEmpty,
+ringSize and ringPushed.
+*/
+template <typename Ring, uint32_t SIZE, typename Event> class RingQueue : public QueueNotifier
+{
+  public:
+    static constexpr uint32_t QUEUE_SIZE = SIZE;
+    static constexpr std::chrono::milliseconds DEFAULT_BLOCK_TIMEOUT{100};
+
+    // Configure before the queue is shared between threads
+    void setOverflowPolicy(OverflowPolicy policy,
+                           std::chrono::milliseconds blockTimeout = DEFAULT_BLOCK_TIMEOUT)
+    {
+        this->policy = policy;
+        this->blockTimeout = blockTimeout;
+    }
+
+    OverflowPolicy getOverflowPolicy() const
+    {
+        return policy;
+    }
+
+    bool push(Event &&event)
+    {
+        const bool pushed = (overflowSize.load(std::memory_order_acquire) == 0 &&
+                             ring().ringPush(event)) ||
+                            pushFull(event);
+        if (!pushed)
+        {
+            return false;
+        }
+
+        notify();
+        return true;
+    }
+
+    bool isEmpty()
+    {
+        return ring().ringEmpty() && overflowSize.load(std::memory_order_acquire) == 0;
+    }
+
+    // Must only be called by the consumer after isEmpty returned false
+    Event pop()
     {
-        const int32_t divisor = mTail / QUEUE_SIZE;
-        const auto queueStart = QUEUE_SIZE * divisor;
-        if (mutex != nullptr)
+        // Once events overflow, later pushes queue up behind them until the segment drained. The
+        // ring only holds older events.
+        if (!ring().ringEmpty())
         {
-            std::unique_lock<std::mutex> _lock(*mutex);
-            mHead = mHead - queueStart;
+            return ring().ringPop();
         }
-        else
+
+        std::lock_guard<std::mutex> _lock(overflowMutex);
+        assert(!overflow.empty());
+        Event res{std::move(overflow.front())};
+        overflow.pop_front();
+        overflowSize.fetch_sub(1, std::memory_order_release);
+
+        return res;
+    }
+
+    std::optional<Event> tryPop()
+    {
+        if (isEmpty())
         {
-            mHead = mHead - queueStart;
+            return std::nullopt;
         }
 
-        mTail = mTail - queueStart;
-        
+        return pop();
     }
 
-  public:
-    WorkQueueImpl(){};
+    size_t size() const
+    {
+        return ring().ringSize() + overflowSize.load(std::memory_order_acquire);
+    }
 
-    WorkQueueImpl(const WorkQueueImpl<SIZE, Event> &) = delete;
-    WorkQueueImpl(WorkQueueImpl<SIZE, Event> &&) = delete;
+    // Whether a push would succeed without waiting
+    bool canPush() const
+    {
+        return policy == OverflowPolicy::Overflow || size() < SIZE;
+    }
 
-    void push(Event &&event)
+    QueueStats getStats() const
     {
-        if (size() == QUEUE_SIZE)
+        QueueStats stats;
+        stats.overflowed = overflowed.load(std::memory_order_relaxed);
+        stats.pushed = ring().ringPushed() + stats.overflowed;
+        stats.rejected = rejected.load(std::memory_order_relaxed);
+        stats.blocked = blocked.load(std::memory_order_relaxed);
+        stats.timedOut = timedOut.load(std::memory_order_relaxed);
+        stats.maxDepth = maxDepth.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+  protected:
+    // Rings report the depth whenever they observe it anyway, to keep the counter off the hot
+    // path
+    void noteDepth(uint64_t depth)
+    {
+        auto current = maxDepth.load(std::memory_order_relaxed);
+        while (depth > current &&
+               !maxDepth.compare_exchange_weak(current, depth, std::memory_order_relaxed))
         {
-            spdlog::error("WorkQueue::push -> droppping msg");
-            return;
         }
-        mEvents[mHead % QUEUE_SIZE] = event;
+    }
 
-        if (mutex != nullptr)
+  private:
+    Ring &ring()
+    {
+        return static_cast<Ring &>(*this);
+    }
+
+    const Ring &ring() const
+    {
+        return static_cast<const Ring &>(*this);
+    }
+
+    bool pushFull(Event &event)
+    {
+        switch (policy)
         {
-            std::unique_lock<std::mutex> _lock(*mutex);
-            ++mHead;
+        case OverflowPolicy::Reject:
+            rejected.fetch_add(1, std::memory_order_relaxed);
+            spdlog::error("WorkQueue::push -> queue full, rejecting msg");
+            return false;
+        case OverflowPolicy::Block:
+            return pushBlocking(event);
+        case OverflowPolicy::Overflow:
+            return pushOverflow(event);
         }
-        else
+
+        return false;
+    }
+
+    bool pushOverflow(Event &event)
+    {
+        std::lock_guard<std::mutex> _lock(overflowMutex);
+        overflow.emplace_back(std::move(event));
+        const auto queued = overflowSize.fetch_add(1, std::memory_order_release) + 1;
+        overflowed.fetch_add(1, std::memory_order_relaxed);
+        noteDepth(SIZE + queued);
+        return true;
+    }
+
+    // Blocking is the exceptional path, so poll with a growing sleep rather than making every
+    // pop check for waiting producers
+    bool pushBlocking(Event &event)
+    {
+        static constexpr std::chrono::microseconds MAX_BACKOFF{1000};
+
+        blocked.fetch_add(1, std::memory_order_relaxed);
+        const auto deadline = std::chrono::steady_clock::now() + blockTimeout;
+        std::chrono::microseconds backoff{10};
+        while (std::chrono::steady_clock::now() < deadline)
         {
-            ++mHead;
+            std::this_thread::sleep_for(backoff);
+            backoff = std::min(backoff * 2, MAX_BACKOFF);
+
+            if (ring().ringPush(event))
+            {
+                return true;
+            }
         }
-        
-        notify();
+
+        timedOut.fetch_add(1, std::memory_order_relaxed);
+        spdlog::error("WorkQueue::push -> queue still full after {}ms, rejecting msg",
+                      blockTimeout.count());
+        return false;
     }
 
-    bool isEmpty()
+    OverflowPolicy policy{OverflowPolicy::Reject};
+    std::chrono::milliseconds blockTimeout{DEFAULT_BLOCK_TIMEOUT};
+
+    std::atomic<uint64_t> overflowSize{0};
+    std::mutex overflowMutex;
+    std::deque<Event> overflow;
+
+    std::atomic<uint64_t> rejected{0};
+    std::atomic<uint64_t> blocked{0};
+    std::atomic<uint64_t> timedOut{0};
+    std::atomic<uint64_t> overflowed{0};
+    std::atomic<uint64_t> maxDepth{0};
+};
+
+/**
+Bounded lock-free ring for a single producer and a single consumer thread.
+
+Head and tail are monotonic counters on separate cache lines. Each side keeps a cached copy of
+the other side's counter and only reloads it when the ring looks full or empty. Events are moved
+into the slot on push and moved out again on pop.
+*/
+template <uint32_t SIZE, typename Event>
+class SpscQueue : public RingQueue<SpscQueue<SIZE, Event>, SIZE, Event>
+{
+    static_assert(SIZE > 0);
+
+    friend class RingQueue<SpscQueue<SIZE, Event>, SIZE, Event>;
+
+    struct Slot
     {
-        return size() == 0;
+        alignas(Event) std::byte storage[sizeof(Event)];
+
+        Event *get()
+        {
+            return std::launder(reinterpret_cast<Event *>(storage));
+        }
+    };
+
+  public:
+    SpscQueue() : mSlots(std::make_unique<Slot[]>(SIZE)){};
+    SpscQueue(const SpscQueue<SIZE, Event> &) = delete;
+    SpscQueue(SpscQueue<SIZE, Event> &&) = delete;
+
+    ~SpscQueue()
+    {
+        while (this->tryPop())
+        {
+        }
     }
 
-    Event &&pop()
+  private:
+    bool ringPush(Event &event)
     {
-        auto &&res = std::move(mEvents[mTail % QUEUE_SIZE]);
-        calibrate();
-        ++mTail;
+        const auto head = mHead.load(std::memory_order_relaxed);
+        if (head - mCachedTail == SIZE)
+        {
+            mCachedTail = mTail.load(std::memory_order_acquire);
+            if (head - mCachedTail == SIZE)
+            {
+                this->noteDepth(SIZE);
+                return false;
+            }
+        }
 
-        return std::move(res);
+        new (mSlots[head % SIZE].storage) Event(std::move(event));
+        mHead.store(head + 1, std::memory_order_release);
+        return true;
     }
 
-    template <typename F> void forEach(F f)
+    bool ringEmpty()
     {
-        for (auto ptr = mTail; ptr < mHead; ++ptr)
+        const auto tail = mTail.load(std::memory_order_relaxed);
+        if (tail != mCachedHead)
         {
-            f(mEvents[ptr]);
+            return false;
         }
+
+        mCachedHead = mHead.load(std::memory_order_acquire);
+        this->noteDepth(mCachedHead - tail);
+        return tail == mCachedHead;
     }
 
-    size_t size()
+    Event ringPop()
     {
-        return mHead - mTail;
+        const auto tail = mTail.load(std::memory_order_relaxed);
+        auto *event = mSlots[tail % SIZE].get();
+
+        Event res{std::move(*event)};
+        event->~Event();
+        mTail.store(tail + 1, std::memory_order_release);
+
+        return res;
     }
 
-    void attachNotifier(std::mutex& mutex, std::condition_variable &cv)
+    // Exact when called from either end, a snapshot when called from any other thread
+    size_t ringSize() const
     {
-        this->mutex = &mutex;
-        this->cv = &cv;
+        const auto tail = mTail.load(std::memory_order_acquire);
+        return mHead.load(std::memory_order_acquire) - tail;
     }
 
-    void notify()
+    uint64_t ringPushed() const
     {
-        if (cv != nullptr)
+        return mHead.load(std::memory_order_relaxed);
+    }
+
+    // Written by the producer
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> mHead{0};
+    uint64_t mCachedTail{0};
+
+    // Written by the consumer
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> mTail{0};
+    uint64_t mCachedHead{0};
+
+    alignas(CACHE_LINE_SIZE) std::unique_ptr<Slot[]> mSlots;
+};
+
+/**
+Bounded lock-free ring for any number of producers and a single consumer thread.
+
+Every slot carries a sequence number that tells whose turn it is. Producers claim a position
+with a CAS on the head and publish the slot by advancing its sequence, so a producer that is
+slow to finish its move only holds back the consumer, never the other producers.
+*/
+template <uint32_t SIZE, typename Event>
+class MpscQueue : public RingQueue<MpscQueue<SIZE, Event>, SIZE, Event>
+{
+    // A single slot can't tell a published event from a free slot of the next lap
+    static_assert(SIZE > 1);
+
+    friend class RingQueue<MpscQueue<SIZE, Event>, SIZE, Event>;
+
+    struct Slot
+    {
+        std::atomic<uint64_t> sequence{0};
+        alignas(Event) std::byte storage[sizeof(Event)];
+
+        Event *get()
+        {
+            return std::launder(reinterpret_cast<Event *>(storage));
+        }
+    };
+
+  public:
+    MpscQueue() : mSlots(std::make_unique<Slot[]>(SIZE))
+    {
+        for (uint32_t i = 0; i < SIZE; ++i)
+        {
+            mSlots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    };
+    MpscQueue(const MpscQueue<SIZE, Event> &) = delete;
+    MpscQueue(MpscQueue<SIZE, Event> &&) = delete;
+
+    ~MpscQueue()
+    {
+        while (this->tryPop())
         {
-            cv->notify_all();
         }
     }
+
+  private:
+    bool ringPush(Event &event)
+    {
+        auto head = mHead.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (true)
+        {
+            slot = &mSlots[head % SIZE];
+            const auto sequence = slot->sequence.load(std::memory_order_acquire);
+            const auto diff = static_cast<int64_t>(sequence - head);
+            if (diff == 0)
+            {
+                if (mHead.compare_exchange_weak(head, head + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                this->noteDepth(SIZE);
+                return false;
+            }
+            else
+            {
+                head = mHead.load(std::memory_order_relaxed);
+            }
+        }
+
+        new (slot->storage) Event(std::move(event));
+        slot->sequence.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool ringEmpty()
+    {
+        const auto tail = mTail.load(std::memory_order_relaxed);
+        return mSlots[tail % SIZE].sequence.load(std::memory_order_acquire) != tail + 1;
+    }
+
+    Event ringPop()
+    {
+        const auto tail = mTail.load(std::memory_order_relaxed);
+        auto &slot = mSlots[tail % SIZE];
+        auto *event = slot.get();
+
+        Event res{std::move(*event)};
+        event->~Event();
+        slot.sequence.store(tail + SIZE, std::memory_order_release);
+        mTail.store(tail + 1, std::memory_order_release);
+
+        this->noteDepth(ringSize() + 1);
+        return res;
+    }
+
+    // Counts pushes that claimed a slot but may not have published it yet
+    size_t ringSize() const
+    {
+        const auto tail = mTail.load(std::memory_order_acquire);
+        const auto head = mHead.load(std::memory_order_acquire);
+        return head > tail ? std::min<uint64_t>(head - tail, SIZE) : 0;
+    }
+
+    uint64_t ringPushed() const
+    {
+        return mHead.load(std::memory_order_relaxed);
+    }
+
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> mHead{0};
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> mTail{0};
+    alignas(CACHE_LINE_SIZE) std::unique_ptr<Slot[]> mSlots;
+};
+
+template <uint32_t SIZE, typename Event> using WorkQueueImpl = SpscQueue<SIZE, Event>;
+
+/**
+Consumer side of a queue that a service keeps to itself, e.g. for results of its worker threads.
+Registers with the QueueCoordinator like the end points of a FullDuplexQueue.
+*/
+template <typename Queue> class PopEndPoint
+{
+  public:
+    explicit PopEndPoint(Queue &queue) : queue(&queue)
+    {
+    }
+
+    void attachNotifier(sync::Notifier &notifier, uint32_t source)
+    {
+        queue->attachNotifier(notifier, source);
+    }
+
+    bool canPop() const
+    {
+        return !queue->isEmpty();
+    }
+
+    auto pop()
+    {
+        return queue->pop();
+    }
+
+  private:
+    Queue *queue;
 };
-} // namespace fractals::common
\ No newline at end of file
+
+} // namespace fractals::common
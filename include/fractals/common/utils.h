@@ -7,6 +7,7 @@
 #include <functional>
 #include <iomanip>
 #include <iterator>
+#include <optional>
 #include <set>
 #include <sstream>
 #include <string>
@@ -185,6 +186,10 @@ std::vector<bool> bytesToBitfield(int len, std::string_view bitfields);
 std::string ppBytes(int64_t bytes);
 std::string ppBytesPerSecond(int64_t bytes);
 std::string ppTime(int64_t seconds);
+/**
+Parse an amount of bytes such as 500, 1.5M or 20KB. Units are powers of 1000 like ppBytes.
+*/
+std::optional<uint64_t> parseBytes(std::string_view s);
 
 template <typename T>
 std::string toString(const T& t)
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "IOLayer.h"
+#include "WriteCache.h"
+#include "WriteEngine.h"
 
 #include <fractals/common/Tagged.h>
 #include <fractals/common/utils.h>
@@ -10,6 +12,8 @@
 #include <fractals/torrent/Bencode.h>
 #include <fractals/torrent/MetaInfo.h>
 #include <fractals/torrent/TorrentMeta.h>
+#include <algorithm>
+#include <chrono>
 #include <condition_variable>
 #include <cstdint>
 #include <filesystem>
@@ -20,10 +24,13 @@ namespace fractals::disk
 template <typename IOLayer> class DiskIOServiceImpl
 {
   public:
-    DiskIOServiceImpl(sync::QueueCoordinator &coordinator, DiskEventQueue::RightEndPoint queue)
-        : coordinator(coordinator), queue(queue)
+    DiskIOServiceImpl(sync::QueueCoordinator &coordinator, DiskEventQueue::RightEndPoint queue,
+                      WriteEngineConfig writeConfig = {}, WriteCacheConfig cacheConfig = {})
+        : coordinator(coordinator), queue(queue), writeCache(cacheConfig),
+          writeEngine(writeConfig), completions(writeEngine.getCompletionEndPoint())
     {
-        coordinator.addAsPublisherForDiskService<DiskEventQueue>(queue);
+        coordinator.addPublisher(sync::QueueCoordinator::Consumer::DiskService, queue);
+        coordinator.addPublisher(sync::QueueCoordinator::Consumer::DiskService, completions);
     }
 
     void run()
@@ -31,13 +38,28 @@ template <typename IOLayer> class DiskIOServiceImpl
         isActive = true;
         while (isActive)
         {
-            coordinator.waitOnDiskServiceUpdate();
-            assert(queue.canPop());
+            // Wakes up when the oldest cached piece is due to be written
+            coordinator.wait(sync::QueueCoordinator::Consumer::DiskService, untilFlush());
 
             while (queue.canPop())
             {
                 processRequest();
             }
+
+            while (completions.canPop())
+            {
+                complete(completions.pop());
+            }
+
+            write(writeCache.takeExpired(WriteCache::Clock::now()));
+        }
+
+        // Cached pieces and pieces that are still being written are reported before shutting down
+        write(writeCache.takeAll());
+        writeEngine.stop();
+        while (completions.canPop())
+        {
+            complete(completions.pop());
         }
 
         spdlog::info("DIS::run. Shutdown");
@@ -45,12 +67,12 @@ template <typename IOLayer> class DiskIOServiceImpl
 
     void processRequest()
     {
-        auto &&request = std::move(queue.pop());
+        auto request = queue.pop();
         std::visit(common::overloaded{[&](const Shutdown _)
                                       {
                                           stop();
                                       },
-                                      [&](const auto &request)
+                                      [&](auto &request)
                                       {
                                           process(request);
                                       }},
@@ -90,7 +112,7 @@ template <typename IOLayer> class DiskIOServiceImpl
         queue.push(ReadSuccess{tm, fpath, "./"});
     }
 
-    void process(const WriteData &writeData)
+    void process(WriteData &writeData)
     {
         spdlog::info("DIS::process(WriteData)");
 
@@ -101,32 +123,15 @@ template <typename IOLayer> class DiskIOServiceImpl
             return;
         }
 
-        uint64_t index = 0;
-        uint64_t offset = writeData.offset;
-        std::string_view view(writeData.mData.begin(), writeData.mData.end());
-        std::string dirName = it->second.first.dirName;
-        for (auto &fi : it->second.second)
+        // Verified pieces are held back so that adjacent ones are written at once
+        writeCache.add(CachedPiece{writeData.infoHash, writeData.mPieceIndex, writeData.offset,
+                                   std::move(writeData.mData)},
+                       WriteCache::Clock::now());
+        if (writeCache.isOverLimit())
         {
-            if (offset >= index && offset < index + fi.length)
-            {
-                uint64_t remainingBytesForFile = index + fi.length - offset;
-                if (remainingBytesForFile > 0)
-                {
-                    const auto offsetInFile = offset - index;
-                    const int64_t bytesToWrite = std::min(view.size(), remainingBytesForFile);
-                    writeToFile(writeData.mPieceIndex, toFilePath(dirName, fi.dirName, fi.fileName), offsetInFile,
-                                view, bytesToWrite);
-
-                    // offset should be starting point for next file
-                    view.remove_prefix(bytesToWrite);
-                    offset += bytesToWrite;
-                }
-            }
-
-            index += fi.length;
+            spdlog::debug("DIS::process(WriteData). Cache is full bytes={}", writeCache.getBytes());
+            write(writeCache.takeOldest(writeCache.getConfig().memoryLimit / 2));
         }
-
-        queue.push(WriteSuccess{writeData.infoHash, writeData.mPieceIndex});
     }
 
     void process(const InitTorrent &it)
@@ -164,6 +169,12 @@ template <typename IOLayer> class DiskIOServiceImpl
         spdlog::error("DIS::process(DeleteTorrent) not implemented");
     }
 
+    void process(const Flush &)
+    {
+        spdlog::info("DIS::process(Flush). pieces={}", writeCache.getNumPieces());
+        write(writeCache.takeAll());
+    }
+
     void process(const Shutdown &shut)
     {
         spdlog::info("DIS::process(Shutdown)");
@@ -175,28 +186,158 @@ template <typename IOLayer> class DiskIOServiceImpl
         return ioLayer;
     }
 
+    WriteCache &getWriteCache()
+    {
+        return writeCache;
+    }
+
+    WriteEngineImpl<IOLayer> &getWriteEngine()
+    {
+        return writeEngine;
+    }
+
   private:
-    void writeToFile(uint32_t piece, const std::filesystem::path &path, uint64_t offset,
-                     std::string_view buffer, uint64_t numBytes)
+    // Run of pieces of which the writes are in flight
+    struct PendingWrite
+    {
+        common::InfoHash infoHash;
+        std::vector<CachedPiece> pieces;
+        uint32_t remaining{0};
+        bool failed{false};
+    };
+
+    void write(std::vector<WriteRun> &&runs)
+    {
+        for (auto &run : runs)
+        {
+            write(std::move(run));
+        }
+    }
+
+    void write(WriteRun &&run)
     {
-        if (!ioLayer.open(path))
+        const auto it = torrents.find(run.infoHash);
+        if (it == torrents.end())
         {
-            spdlog::error("DIS::Cannot open file: {}", path.string());
+            spdlog::error("DIS::write could not match infoHash to Torrent {}", run.infoHash);
             return;
         }
 
-        spdlog::debug(
-            "DIS::writeToFile. Piece={} OffsetBeg={} OffsetEnd={} numBytes={} bufSize={} path={}",
-            piece, offset, offset + numBytes, numBytes, buffer.size(), path.c_str());
-        ioLayer.writeFrom(offset, buffer, numBytes);
+        const auto ticket = nextTicket++;
+        auto &pending = pendingWrites[ticket];
+        pending.infoHash = run.infoHash;
+        pending.pieces = std::move(run.pieces);
 
-        ioLayer.close();
+        // Every file that the run spans gets a single positional write on the write engine with
+        // a buffer per piece, the buffers are kept until all of them completed
+        const uint64_t runEnd = run.offset + run.size;
+        const std::string &dirName = it->second.first.dirName;
+        auto piece = pending.pieces.begin();
+        uint64_t index = 0;
+        for (auto &fi : it->second.second)
+        {
+            const uint64_t fileBegin = index;
+            index += fi.length;
+            const auto begin = std::max(fileBegin, run.offset);
+            const auto end = std::min(index, runEnd);
+            if (begin >= end)
+            {
+                continue;
+            }
+
+            WriteJob job{ticket, toFilePath(dirName, fi.dirName, fi.fileName), begin - fileBegin,
+                         {}};
+            while (piece != pending.pieces.end() && piece->offset < end)
+            {
+                const auto pieceEnd = piece->offset + piece->data.size();
+                const auto sliceBegin = std::max(piece->offset, begin);
+                const auto sliceEnd = std::min(pieceEnd, end);
+                job.buffers.push_back(
+                    piece->data.view().substr(sliceBegin - piece->offset, sliceEnd - sliceBegin));
+
+                // Piece continues in the next file
+                if (pieceEnd > end)
+                {
+                    break;
+                }
+
+                ++piece;
+            }
+
+            spdlog::debug("DIS::write. Pieces={} OffsetBeg={} OffsetEnd={} path={}",
+                          job.buffers.size(), job.offset, job.offset + end - begin,
+                          job.path.c_str());
+            ++pending.remaining;
+            writeEngine.submit(std::move(job));
+        }
+
+        if (pending.remaining == 0)
+        {
+            finish(ticket);
+        }
+    }
+
+    void complete(const WriteCompletion &completion)
+    {
+        const auto it = pendingWrites.find(completion.ticket);
+        if (it == pendingWrites.end())
+        {
+            spdlog::error("DIS::complete. Unknown write {}", completion.ticket);
+            return;
+        }
+
+        it->second.failed |= !completion.success;
+        if (--it->second.remaining == 0)
+        {
+            finish(completion.ticket);
+        }
+    }
+
+    void finish(uint64_t ticket)
+    {
+        auto node = pendingWrites.extract(ticket);
+        auto &pending = node.mapped();
+
+        // Buffers are back in the pool before the network thread hears about the write
+        std::vector<uint32_t> pieceIndices;
+        pieceIndices.reserve(pending.pieces.size());
+        for (const auto &piece : pending.pieces)
+        {
+            pieceIndices.push_back(piece.pieceIndex);
+        }
+        pending.pieces.clear();
+
+        for (const auto pieceIndex : pieceIndices)
+        {
+            if (pending.failed)
+            {
+                spdlog::error("DIS::Cannot write piece {}", pieceIndex);
+                queue.push(WriteError{pending.infoHash, pieceIndex, "Unable to write piece"});
+            }
+            else
+            {
+                queue.push(WriteSuccess{pending.infoHash, pieceIndex});
+            }
+        }
+    }
+
+    std::chrono::milliseconds untilFlush() const
+    {
+        // Zero waits for the next request
+        const auto remaining = writeCache.untilExpired(WriteCache::Clock::now());
+        if (!remaining)
+        {
+            return std::chrono::milliseconds{0};
+        }
+
+        return std::max(std::chrono::ceil<std::chrono::milliseconds>(*remaining),
+                        std::chrono::milliseconds{1});
     }
 
     void stop()
     {
         isActive = false;
-        coordinator.forceNotifyDiskService();
+        coordinator.forceNotify(sync::QueueCoordinator::Consumer::DiskService);
     }
 
     std::filesystem::path toFilePath(const std::string &torrDir,
@@ -214,6 +355,14 @@ template <typename IOLayer> class DiskIOServiceImpl
     std::unordered_map<common::InfoHash,
                        std::pair<persist::TorrentModel, std::vector<persist::FileModel>>>
         torrents;
+
+    WriteCache writeCache;
+    uint64_t nextTicket{0};
+    std::unordered_map<uint64_t, PendingWrite> pendingWrites;
+    // Declared after the pending writes, the engine stops writing from their buffers before they
+    // are freed
+    WriteEngineImpl<IOLayer> writeEngine;
+    typename WriteEngineImpl<IOLayer>::CompletionEndPoint completions;
 };
 
 using DiskIOService = DiskIOServiceImpl<IOLayer>;
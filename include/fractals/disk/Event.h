@@ -1,3 +1,4 @@
+#include <fractals/common/BufferPool.h>
 #include <fractals/common/Tagged.h>
 #include <fractals/persist/Models.h>
 #include <fractals/torrent/TorrentMeta.h>
@@ -35,7 +36,7 @@ struct WriteData
 {
     common::InfoHash infoHash;
     uint32_t mPieceIndex;
-    std::vector<char> mData;
+    common::PieceBuffer mData;
     uint64_t offset;
 };
 
@@ -44,6 +45,11 @@ struct DeleteTorrent
     common::InfoHash infoHash;
 };
 
+// Writes the cached pieces, e.g. when no buffers are left to download new pieces into
+struct Flush
+{
+};
+
 struct Shutdown
 {
 };
@@ -56,6 +62,8 @@ struct WriteSuccess
 
 struct WriteError
 {
+    common::InfoHash infoHash;
+    uint32_t pieceIndex;
     std::string error;
 };
 
@@ -64,7 +72,7 @@ struct TorrentInitialized
     common::InfoHash infoHash;
 };
 
-using DiskRequest = std::variant<Read, InitTorrent, WriteData, DeleteTorrent, Shutdown>;
+using DiskRequest = std::variant<Read, InitTorrent, WriteData, DeleteTorrent, Flush, Shutdown>;
 using DiskResponse =
     std::variant<ReadSuccess, ReadError, WriteSuccess, WriteError, TorrentInitialized>;
 } // namespace fractals::disk
\ No newline at end of file
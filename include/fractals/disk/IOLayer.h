@@ -1,16 +1,29 @@
 #pragma once
 
 #include <fractals/common/utils.h>
+#include <cstddef>
+#include <cstdint>
 #include <filesystem>
 #include <fstream>
+#include <list>
+#include <span>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 namespace fractals::disk
 {
+/**
+File access of the disk service. Torrent data is written with pwrite/pwritev at absolute
+offsets, through file descriptors that stay open between writes. The least recently written
+files are closed once more than the max number of files are open.
+*/
 class IOLayer
 {
   public:
+    static constexpr size_t DEFAULT_MAX_OPEN_FILES = 128;
+
     ~IOLayer();
     bool createDirectories(const std::filesystem::path& dir);
     bool createFile(const std::filesystem::path &path);
@@ -21,8 +34,31 @@ class IOLayer
     void writeFrom(int64_t offset, std::string_view bytes, uint64_t numBytes);
     std::istream& getStream();
 
+    // Writes the buffers back to back from the offset in the file, as one vectored write
+    bool writeAt(const std::filesystem::path &filePath, uint64_t offset,
+                 std::span<const std::string_view> buffers);
+    bool writeAt(const std::filesystem::path &filePath, uint64_t offset, std::string_view bytes);
+
+    void setMaxOpenFiles(size_t maxOpen);
+    size_t getNumOpenFiles() const;
+    void closeFile(const std::filesystem::path &filePath);
+    void closeFiles();
+
   private:
-  
+    struct OpenFile
+    {
+        std::string path;
+        int fd;
+    };
+
+    // Opens the file if it is not open yet, -1 on error
+    int getFd(const std::filesystem::path &filePath);
+
     std::fstream stream;
+
+    size_t maxOpenFiles{DEFAULT_MAX_OPEN_FILES};
+    // Most recently written first
+    std::list<OpenFile> lru;
+    std::unordered_map<std::string, std::list<OpenFile>::iterator> openFiles;
 };
 } // namespace fractals::disk
\ No newline at end of file
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <fractals/common/BufferPool.h>
+#include <fractals/common/Tagged.h>
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+namespace fractals::disk
+{
+
+struct WriteCacheConfig
+{
+    // Max bytes of verified pieces that are held before they are written. Zero writes every
+    // piece straight away.
+    uint64_t memoryLimit{64 * 1024 * 1024};
+    // Max time that a piece is held before it is written
+    std::chrono::milliseconds flushDeadline{1000};
+};
+
+struct CachedPiece
+{
+    common::InfoHash infoHash;
+    uint32_t pieceIndex{0};
+    // Offset of the piece in the data of the torrent
+    uint64_t offset{0};
+    common::PieceBuffer data;
+};
+
+// Pieces of a torrent that follow each other without a gap, written as one sequential write
+struct WriteRun
+{
+    common::InfoHash infoHash;
+    uint64_t offset{0};
+    uint64_t size{0};
+    std::vector<CachedPiece> pieces;
+};
+
+/**
+Write-back cache of the disk service. Verified pieces are held until they are old enough or the
+cache is full, pieces of a torrent that are adjacent by then are merged into a single run. Rarest
+first downloads neighbouring pieces at different times, merging them turns many small scattered
+writes into fewer large sequential ones.
+*/
+class WriteCache
+{
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit WriteCache(WriteCacheConfig config = {});
+
+    // Replaces a piece at the same offset
+    void add(CachedPiece &&piece, Clock::time_point now);
+    bool isOverLimit() const;
+
+    // Runs that hold a piece that was added at least the flush deadline ago
+    std::vector<WriteRun> takeExpired(Clock::time_point now);
+    // Runs with the oldest pieces until no more than target bytes are held
+    std::vector<WriteRun> takeOldest(uint64_t target);
+    std::vector<WriteRun> takeAll();
+
+    // Time until the oldest piece expires, nullopt if the cache is empty
+    std::optional<Clock::duration> untilExpired(Clock::time_point now) const;
+
+    uint64_t getBytes() const;
+    size_t getNumPieces() const;
+    const WriteCacheConfig &getConfig() const;
+
+  private:
+    struct Entry
+    {
+        CachedPiece piece;
+        Clock::time_point addedAt;
+    };
+
+    // Run of adjacent entries of a torrent, first and last offset included
+    struct Span
+    {
+        common::InfoHash infoHash;
+        uint64_t first;
+        uint64_t last;
+        Clock::time_point oldest;
+    };
+
+    std::vector<Span> getSpans() const;
+    WriteRun take(const Span &span);
+
+    WriteCacheConfig mConfig;
+    std::unordered_map<common::InfoHash, std::map<uint64_t, Entry>> mTorrents;
+    uint64_t mBytes{0};
+    size_t mNumPieces{0};
+};
+
+} // namespace fractals::disk
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <fractals/common/WorkQueue.h>
+#include <fractals/disk/IOLayer.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace fractals::disk
+{
+
+struct WriteEngineConfig
+{
+    // Writes in flight per device. NVMe needs many to reach its bandwidth, spinning disks a
+    // few so that the elevator can order them.
+    uint32_t threadsPerDevice{4};
+    // Files kept open by every writer thread
+    size_t maxOpenFiles{IOLayer::DEFAULT_MAX_OPEN_FILES};
+};
+
+// Part of a write that goes to a single file. The buffers must stay valid until the job
+// completed.
+struct WriteJob
+{
+    uint64_t ticket{0};
+    std::filesystem::path path;
+    uint64_t offset{0};
+    std::vector<std::string_view> buffers;
+};
+
+struct WriteCompletion
+{
+    uint64_t ticket{0};
+    bool success{false};
+};
+
+/**
+Writes file segments on a pool of threads per device, so that many writes are in flight while
+the disk service keeps handling requests. Every file is written by a single thread of its
+device, which keeps the writes to a file in the order in which they were submitted and keeps
+its file descriptor in one cache.
+
+Completions are queued for the consumer of the completion end point.
+*/
+template <typename IOLayerT> class WriteEngineImpl
+{
+  public:
+    static constexpr uint32_t COMPLETION_QUEUE_SIZE = 1024;
+    using CompletionQueue = common::MpscQueue<COMPLETION_QUEUE_SIZE, WriteCompletion>;
+    using CompletionEndPoint = common::PopEndPoint<CompletionQueue>;
+
+    explicit WriteEngineImpl(WriteEngineConfig config = {});
+    WriteEngineImpl(const WriteEngineImpl &) = delete;
+    WriteEngineImpl &operator=(const WriteEngineImpl &) = delete;
+    ~WriteEngineImpl();
+
+    // Number of threads for the device that holds the path. Only applies to devices that were
+    // not written to yet.
+    bool setDeviceConcurrency(const std::filesystem::path &path, uint32_t threads);
+
+    void submit(WriteJob &&job);
+    // Finishes the submitted jobs and stops the threads
+    void stop();
+
+    CompletionEndPoint getCompletionEndPoint();
+    // Jobs that were submitted and did not complete yet
+    size_t getInFlight() const;
+    size_t getNumThreads() const;
+
+  private:
+    struct Writer
+    {
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<WriteJob> jobs;
+        bool stopped{false};
+        IOLayerT io;
+    };
+
+    using Device = std::vector<std::unique_ptr<Writer>>;
+
+    Writer &getWriter(const std::filesystem::path &path);
+    void work(Writer &writer);
+
+    WriteEngineConfig config;
+    std::unordered_map<dev_t, uint32_t> deviceThreads;
+    std::unordered_map<dev_t, Device> devices;
+    // Device of every directory that was written to, to avoid a stat per write
+    std::unordered_map<std::string, dev_t> directoryDevices;
+
+    std::atomic<size_t> inFlight{0};
+    CompletionQueue completions;
+};
+
+using WriteEngine = WriteEngineImpl<IOLayer>;
+
+} // namespace fractals::disk
@@ -0,0 +1,163 @@
+#include <fractals/disk/WriteEngine.h>
+
+#include <algorithm>
+#include <functional>
+#include <spdlog/spdlog.h>
+#include <sys/stat.h>
+#include <utility>
+
+namespace fractals::disk
+{
+
+template <typename IOLayerT>
+WriteEngineImpl<IOLayerT>::WriteEngineImpl(WriteEngineConfig config) : config(config)
+{
+    // Completions must never be lost, the disk service holds on to the buffers until then
+    completions.setOverflowPolicy(common::OverflowPolicy::Overflow);
+}
+
+template <typename IOLayerT> WriteEngineImpl<IOLayerT>::~WriteEngineImpl()
+{
+    stop();
+}
+
+template <typename IOLayerT>
+bool WriteEngineImpl<IOLayerT>::setDeviceConcurrency(const std::filesystem::path &path,
+                                                     uint32_t threads)
+{
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0)
+    {
+        spdlog::error("WriteEngine::setDeviceConcurrency. Cannot stat {}", path.c_str());
+        return false;
+    }
+
+    deviceThreads[st.st_dev] = std::max<uint32_t>(threads, 1);
+    return true;
+}
+
+template <typename IOLayerT> void WriteEngineImpl<IOLayerT>::submit(WriteJob &&job)
+{
+    auto &writer = getWriter(job.path);
+    ++inFlight;
+    {
+        std::lock_guard<std::mutex> _lock(writer.mutex);
+        writer.jobs.push_back(std::move(job));
+    }
+
+    writer.cv.notify_one();
+}
+
+template <typename IOLayerT> void WriteEngineImpl<IOLayerT>::stop()
+{
+    for (auto &[_, device] : devices)
+    {
+        for (auto &writer : device)
+        {
+            {
+                std::lock_guard<std::mutex> _lock(writer->mutex);
+                writer->stopped = true;
+            }
+            writer->cv.notify_one();
+        }
+    }
+
+    for (auto &[_, device] : devices)
+    {
+        for (auto &writer : device)
+        {
+            if (writer->thread.joinable())
+            {
+                writer->thread.join();
+            }
+        }
+    }
+}
+
+template <typename IOLayerT>
+typename WriteEngineImpl<IOLayerT>::CompletionEndPoint
+WriteEngineImpl<IOLayerT>::getCompletionEndPoint()
+{
+    return CompletionEndPoint{completions};
+}
+
+template <typename IOLayerT> size_t WriteEngineImpl<IOLayerT>::getInFlight() const
+{
+    return inFlight.load();
+}
+
+template <typename IOLayerT> size_t WriteEngineImpl<IOLayerT>::getNumThreads() const
+{
+    size_t numThreads{0};
+    for (const auto &[_, device] : devices)
+    {
+        numThreads += device.size();
+    }
+
+    return numThreads;
+}
+
+template <typename IOLayerT>
+typename WriteEngineImpl<IOLayerT>::Writer &
+WriteEngineImpl<IOLayerT>::getWriter(const std::filesystem::path &path)
+{
+    // Files that can't be looked up go to a device of their own, where the write fails
+    const auto directory = path.parent_path().native();
+    auto dirIt = directoryDevices.find(directory);
+    if (dirIt == directoryDevices.end())
+    {
+        struct stat st;
+        const dev_t dev = ::stat(directory.empty() ? "." : directory.c_str(), &st) == 0
+                              ? st.st_dev
+                              : dev_t{0};
+        dirIt = directoryDevices.emplace(directory, dev).first;
+    }
+
+    auto &device = devices[dirIt->second];
+    if (device.empty())
+    {
+        const auto threadsIt = deviceThreads.find(dirIt->second);
+        const auto numThreads =
+            threadsIt != deviceThreads.end() ? threadsIt->second : config.threadsPerDevice;
+        for (uint32_t i = 0; i < std::max<uint32_t>(numThreads, 1); ++i)
+        {
+            auto writer = std::make_unique<Writer>();
+            writer->io.setMaxOpenFiles(config.maxOpenFiles);
+            writer->thread = std::thread(&WriteEngineImpl::work, this, std::ref(*writer));
+            device.push_back(std::move(writer));
+        }
+    }
+
+    return *device[std::hash<std::string>{}(path.native()) % device.size()];
+}
+
+template <typename IOLayerT> void WriteEngineImpl<IOLayerT>::work(Writer &writer)
+{
+    while (true)
+    {
+        WriteJob job;
+        {
+            std::unique_lock<std::mutex> lock(writer.mutex);
+            writer.cv.wait(lock,
+                           [&writer]()
+                           {
+                               return writer.stopped || !writer.jobs.empty();
+                           });
+
+            // Submitted jobs are written before the thread stops
+            if (writer.jobs.empty())
+            {
+                return;
+            }
+
+            job = std::move(writer.jobs.front());
+            writer.jobs.pop_front();
+        }
+
+        const bool success = writer.io.writeAt(job.path, job.offset, job.buffers);
+        --inFlight;
+        completions.push(WriteCompletion{job.ticket, success});
+    }
+}
+
+} // namespace fractals::disk
@@ -22,7 +22,7 @@ AnnounceServiceImpl<TrackerClientT>::AnnounceServiceImpl(sync::QueueCoordinator
                                                          TrackerClientT &client)
     : coordinator(coordinator), requestQueue(queue), client(client)
 {
-    coordinator.addAsPublisherForAnnounceService<AnnounceEventQueue>(queue);
+    coordinator.addPublisher(sync::QueueCoordinator::Consumer::AnnounceService, queue);
 }
 
 template <typename TrackerClientT> TrackerClientT &AnnounceServiceImpl<TrackerClientT>::getClient()
@@ -43,11 +43,12 @@ template <typename TrackerClientT> void AnnounceServiceImpl<TrackerClientT>::run
     {
         if (!executedRequests.empty() || !delayedRequests.empty())
         {
-            coordinator.waitOnAnnounceServiceUpdate(std::chrono::milliseconds(500));
+            coordinator.wait(sync::QueueCoordinator::Consumer::AnnounceService,
+                             std::chrono::milliseconds(500));
         }
         else
         {
-            coordinator.waitOnAnnounceServiceUpdate();
+            coordinator.wait(sync::QueueCoordinator::Consumer::AnnounceService);
         }
 
         pollOnce();
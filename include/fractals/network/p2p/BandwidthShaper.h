@@ -0,0 +1,167 @@
+#pragma once
+
+#include <fractals/common/Tagged.h>
+#include <fractals/network/http/Peer.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <optional>
+#include <unordered_map>
+
+namespace fractals::network::p2p
+{
+
+enum class Direction : uint8_t
+{
+    Down,
+    Up
+};
+
+struct RateLimit
+{
+    // Bytes per second, 0 is unlimited
+    uint64_t rate{0};
+    // Max bytes that may be transferred at once after a quiet period. 0 picks a default.
+    uint64_t burst{0};
+
+    bool operator==(const RateLimit &) const = default;
+};
+
+struct TransferRates
+{
+    // Measured bytes per second
+    uint64_t download{0};
+    uint64_t upload{0};
+    RateLimit downloadLimit;
+    RateLimit uploadLimit;
+};
+
+/**
+Token bucket. Tokens are added at the configured rate up to the burst size. A bucket without
+a rate is unlimited.
+*/
+class TokenBucket
+{
+  public:
+    // Default burst of a limit is a second worth of tokens, but not less than a block
+    static constexpr uint64_t MIN_BURST = 16 * 1024;
+
+    TokenBucket() = default;
+
+    void reconfigure(RateLimit limit, std::chrono::nanoseconds now);
+    bool isLimited() const;
+    const RateLimit &getLimit() const;
+
+    uint64_t available(std::chrono::nanoseconds now);
+    void consume(uint64_t bytes);
+    void refund(uint64_t bytes);
+    // Time until the bucket holds the requested number of tokens
+    std::chrono::nanoseconds timeUntil(uint64_t bytes) const;
+
+  private:
+    void refill(std::chrono::nanoseconds now);
+
+    RateLimit limit;
+    double tokens{0};
+    std::chrono::nanoseconds lastRefill{0};
+};
+
+/**
+Measures the transfer rate over windows of about a second. Safe to update from several
+shards at once.
+*/
+class RateMeter
+{
+  public:
+    void add(uint64_t bytes, std::chrono::nanoseconds now);
+    uint64_t rate(std::chrono::nanoseconds now);
+
+  private:
+    void roll(std::chrono::nanoseconds now);
+
+    std::atomic<uint64_t> windowBytes{0};
+    std::atomic<int64_t> windowStart{0};
+    std::atomic<uint64_t> lastRate{0};
+};
+
+/**
+Limits the bandwidth of peers with a hierarchy of token buckets. Bytes transferred by a peer
+are taken from its own bucket, the bucket of its torrent and the global bucket, so that the
+tightest of the three limits applies.
+
+Shared by all EpollService shards, the reactors acquire tokens before reading or writing and
+defer the peer if none are available. While no limit is set the buckets are skipped and the
+shards only share a reader lock to update the meters.
+*/
+class BandwidthShaper
+{
+    struct Node
+    {
+        std::array<TokenBucket, 2> buckets;
+        std::array<RateMeter, 2> meters;
+    };
+
+    struct PeerNode : Node
+    {
+        std::optional<common::InfoHash> torrent;
+    };
+
+  public:
+    using Clock = std::function<std::chrono::nanoseconds()>;
+
+    // Throttled peers are retried once this many bytes are available
+    static constexpr uint64_t MIN_GRANT = 4 * 1024;
+
+    BandwidthShaper();
+    explicit BandwidthShaper(Clock clock);
+    BandwidthShaper(const BandwidthShaper &) = delete;
+    BandwidthShaper(BandwidthShaper &&) = delete;
+
+    void setGlobalLimit(Direction dir, RateLimit limit);
+    void setTorrentLimit(const common::InfoHash &torrent, Direction dir, RateLimit limit);
+    // Limit applied to every single peer
+    void setPeerLimit(Direction dir, RateLimit limit);
+
+    void assignPeer(const http::PeerId &peer, const common::InfoHash &torrent);
+    void removePeer(const http::PeerId &peer);
+    void removeTorrent(const common::InfoHash &torrent);
+
+    // Take up to wanted bytes from the peer's buckets. Returns 0 if the peer must wait.
+    uint64_t acquire(const http::PeerId &peer, Direction dir, uint64_t wanted);
+    // Account for the bytes transferred with the tokens of an acquire and return the rest
+    void release(const http::PeerId &peer, Direction dir, uint64_t granted, uint64_t used);
+    // Time until the peer can be expected to acquire tokens again
+    std::chrono::nanoseconds retryAfter(const http::PeerId &peer, Direction dir);
+
+    TransferRates getRates();
+    TransferRates getRates(const common::InfoHash &torrent);
+
+  private:
+    static size_t index(Direction dir);
+    static TransferRates ratesOf(Node &node, std::chrono::nanoseconds now);
+    // Called with the exclusive lock held after a limit changes
+    void updateLimited();
+    void addTransfer(const http::PeerId &peer, size_t i, uint64_t used,
+                     std::chrono::nanoseconds now);
+
+    // Creates the node of a peer that is assigned to a torrent
+    PeerNode &peerNode(const http::PeerId &peer, std::chrono::nanoseconds now);
+    PeerNode *findPeer(const http::PeerId &peer);
+    Node *torrentNode(const PeerNode &peer);
+
+    Clock clock;
+    std::shared_mutex mutex;
+    // Any bucket has a rate
+    std::atomic<bool> limited{false};
+    Node global;
+    std::array<RateLimit, 2> peerLimits;
+    std::unordered_map<common::InfoHash, Node> torrents;
+    std::unordered_map<http::PeerId, PeerNode> peers;
+};
+
+} // namespace fractals::network::p2p
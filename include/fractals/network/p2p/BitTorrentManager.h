@@ -3,16 +3,20 @@
 #include <fractals/app/AppEventQueue.h>
 #include <fractals/app/Client.h>
 #include <fractals/app/Event.h>
+#include <fractals/common/BufferPool.h>
 #include <fractals/common/Tagged.h>
+#include <fractals/common/TimerWheel.h>
 #include <fractals/disk/DiskEventQueue.h>
 #include <fractals/network/http/Announce.h>
 #include <fractals/network/http/AnnounceEventQueue.h>
 #include <fractals/network/http/Peer.h>
+#include <fractals/network/p2p/BandwidthShaper.h>
 #include <fractals/network/p2p/BitTorrentMsg.h>
 #include <fractals/network/p2p/BufferedQueueManager.h>
 #include <fractals/network/p2p/EpollMsgQueue.h>
 #include <fractals/network/p2p/EpollServiceEvent.h>
 #include <fractals/network/p2p/EventHandlers.h>
+#include <fractals/network/p2p/HashService.h>
 #include <fractals/network/p2p/PeerEvent.h>
 #include <fractals/network/p2p/PeerService.h>
 #include <fractals/network/p2p/PeerTracker.h>
@@ -24,6 +28,7 @@
 #include <fractals/sync/QueueCoordinator.h>
 #include <fractals/torrent/TorrentMeta.h>
 
+#include <array>
 #include <chrono>
 #include <condition_variable>
 #include <type_traits>
@@ -35,6 +40,7 @@ template <typename PeerServiceT> class BitTorrentManagerImpl
 {
   public:
     using ThisType = BitTorrentManagerImpl<PeerServiceT>;
+    using Consumer = sync::QueueCoordinator::Consumer;
 
     struct TorrentState
     {
@@ -49,6 +55,25 @@ template <typename PeerServiceT> class BitTorrentManagerImpl
         Deactivating
     };
 
+    // Peer is considered to snub us when none of our block requests is answered for this long
+    static constexpr std::chrono::seconds REQUEST_TIMEOUT{5};
+    static constexpr std::chrono::milliseconds TIMER_TICK{100};
+    // Queues that eval drains, in order of priority
+    enum class EventSource : uint8_t
+    {
+        App,
+        Persist,
+        Announce,
+        Disk,
+        Hash,
+        Peer
+    };
+    static constexpr size_t NUM_EVENT_SOURCES = 6;
+
+    // Max number of events handled per source in a single eval
+    static constexpr std::array<size_t, NUM_EVENT_SOURCES> DEFAULT_BUDGETS{16, 16, 16,
+                                                                           64, 64, 256};
+
     BitTorrentManagerImpl(sync::QueueCoordinator &coordinator, PeerServiceT &peerService,
                           persist::PersistEventQueue::LeftEndPoint persistQueue,
                           disk::DiskEventQueue::LeftEndPoint diskQueue,
@@ -56,7 +81,14 @@ template <typename PeerServiceT> class BitTorrentManagerImpl
                           app::AppEventQueue::LeftEndPoint appQueue);
 
     void run();
-    void eval();
+    // Returns true if any queue has events left after its budget was spent
+    bool eval();
+
+    void setBudget(EventSource source, size_t budget);
+    // Number of events handled per source since start up
+    const std::array<uint64_t, NUM_EVENT_SOURCES> &getServiceCounts() const;
+    // Memory of the pieces that are being downloaded, shared by all torrents
+    common::BufferPool &getBufferPool();
 
     void shutdown();
     void onShutdown(uint8_t token);
@@ -69,7 +101,22 @@ template <typename PeerServiceT> class BitTorrentManagerImpl
         auto it = connections.find(peerId);
         if (it != connections.end())
         {
-            return {it->second.onMessage(msg, currTime), it->second.getInfoHash()};
+            const auto state = it->second.onMessage(msg, currTime);
+            armRequestTimer(peerId, it->second);
+            if constexpr (std::is_same_v<Msg, Piece>)
+            {
+                sendCancels(it->second.getInfoHash());
+            }
+            return {state, it->second.getInfoHash()};
+        }
+
+        // Inbound peers pick their torrent with the handshake
+        if constexpr (std::is_same_v<Msg, HandShake>)
+        {
+            if (inboundPeers.contains(peerId))
+            {
+                return acceptInbound(peerId, msg);
+            }
         }
 
         return {ProtocolState::CLOSED, {}};
@@ -83,6 +130,7 @@ template <typename PeerServiceT> class BitTorrentManagerImpl
     void process(const app::ResumeTorrent &req);
     void process(const app::Shutdown &req);
     void process(const app::RequestStats& req);
+    void process(const app::SetRateLimit &req);
     void process(const persist::AddedTorrent &resp);
     void process(const persist::TorrentExists &resp);
     void process(const persist::Pieces &);
@@ -93,15 +141,49 @@ template <typename PeerServiceT> class BitTorrentManagerImpl
     void process(const disk::WriteSuccess &);
     void process(const disk::WriteError &);
     void process(const disk::TorrentInitialized &);
+    void process(HashResult &);
     void process(const http::Announce &);
     void process(const p2p::ConnectionDisconnected &);
     void process(const p2p::ConnectionEstablished &);
+    void process(const p2p::IncomingConnection &);
 
     void disconnectPeer(const http::PeerId &peer);
     void peerCompletedTorrent(const http::PeerId &peer, const common::InfoHash &ih);
     void updateTorrentCompleted(const common::InfoHash &ih);
 
   private:
+    struct RequestTimeout
+    {
+        http::PeerId peer;
+    };
+
+    struct ReconnectPeer
+    {
+        http::PeerId peer;
+    };
+
+    using Timer = std::variant<RequestTimeout, ReconnectPeer>;
+
+    // How long run may block before a timer is due
+    std::chrono::milliseconds nextWait() const;
+    void processTimers();
+    void onTimer(const RequestTimeout &timer);
+    void onTimer(const ReconnectPeer &timer);
+    void armRequestTimer(const http::PeerId &peer, const Protocol<PeerServiceT> &protocol);
+    void disarmRequestTimer(const http::PeerId &peer);
+    // Peers of the torrents that have nothing outstanding ask for blocks again
+    void resumeIdlePeers(const std::unordered_set<common::InfoHash> &torrents);
+    // Asks the disk service to write its cached pieces once a torrent has no memory left
+    void requestFlush();
+    // In endgame other peers are told to no longer send the blocks that arrived
+    void sendCancels(const common::InfoHash &infoHash);
+
+    template <typename Queue, typename Handler>
+    bool drain(EventSource source, Queue &queue, Handler &handler);
+    bool drainPeers();
+
+    std::pair<ProtocolState, common::InfoHash> acceptInbound(const http::PeerId &peer,
+                                                             const HandShake &hs);
     void handlePeerCommands(const std::vector<PeerCommand> &cmds);
     bool isComplete(const common::InfoHash &ih) const;
 
@@ -112,6 +194,7 @@ template <typename PeerServiceT> class BitTorrentManagerImpl
 
     PeerEventHandler<ThisType> peerEventHandler;
     DiskEventHandler<ThisType> diskEventHandler;
+    HashEventHandler<ThisType> hashEventHandler;
     AnnounceEventHandler<ThisType> announceEventHandler;
     PersistEventHandler<ThisType> persistEventHandler;
     AppEventHandler<ThisType> appEventHandler;
@@ -121,9 +204,25 @@ template <typename PeerServiceT> class BitTorrentManagerImpl
     PeerServiceT &peerService;
 
     // Internal state of pieces downloaded and missing
+    common::BufferPool bufferPool;
+    // Verifies the pieces that were not hashed as they arrived
+    HashService hashService;
+    HashService::ResultEndPoint hashResults;
     std::unordered_map<common::InfoHash, PieceStateManager> pieceMan;
     std::unordered_map<common::InfoHash, TorrentState> torrents;
     std::unordered_map<http::PeerId, Protocol<PeerServiceT>> connections;
+    // Accepted peers that have not sent their handshake yet
+    std::unordered_set<http::PeerId> inboundPeers;
+    // Flush was sent to the disk service and no piece was written since
+    bool flushRequested{false};
+    // Reused between loops to avoid allocating for every batch
+    std::vector<PeerEvent> peerEvents;
+
+    std::array<size_t, NUM_EVENT_SOURCES> budgets{DEFAULT_BUDGETS};
+    std::array<uint64_t, NUM_EVENT_SOURCES> serviceCounts{};
+
+    common::TimerWheel<Timer> timers;
+    std::unordered_map<http::PeerId, typename common::TimerWheel<Timer>::TimerId> requestTimers;
 
     // Queues
     sync::QueueCoordinator &coordinator;
@@ -37,76 +37,241 @@ BitTorrentManagerImpl<PeerServiceT>::BitTorrentManagerImpl(
     disk::DiskEventQueue::LeftEndPoint diskQueue,
     http::AnnounceEventQueue::LeftEndPoint announceQueue, app::AppEventQueue::LeftEndPoint appQueue)
     : appId(Fractals::APPID), peerEventHandler{this}, diskEventHandler{this},
-      announceEventHandler{this}, persistEventHandler{this}, appEventHandler(this),
-      peerService(peerService), coordinator(coordinator), persistQueue(persistQueue),
+      hashEventHandler{this}, announceEventHandler{this}, persistEventHandler{this},
+      appEventHandler(this),
+      peerService(peerService), hashResults(hashService.getResultEndPoint()),
+      timers(TIMER_TICK, std::chrono::system_clock::now().time_since_epoch()),
+      coordinator(coordinator), persistQueue(persistQueue),
       diskQueue(diskQueue), announceQueue(announceQueue), appQueue(appQueue)
 {
-    coordinator.addAsPublisherForBitTorrentManager<EpollMsgQueue>(peerService.getQueueEndPoint());
-    coordinator.addAsPublisherForBitTorrentManager<persist::PersistEventQueue>(persistQueue);
-    coordinator.addAsPublisherForBitTorrentManager<disk::DiskEventQueue>(diskQueue);
-    coordinator.addAsPublisherForBitTorrentManager<http::AnnounceEventQueue>(announceQueue);
-    coordinator.addAsPublisherForBitTorrentManager<app::AppEventQueue>(appQueue);
+    for (auto endPoint : peerService.getQueueEndPoints())
+    {
+        coordinator.addPublisher(Consumer::BitTorrentManager, endPoint);
+    }
+    coordinator.addPublisher(Consumer::BitTorrentManager, persistQueue);
+    coordinator.addPublisher(Consumer::BitTorrentManager, diskQueue);
+    coordinator.addPublisher(Consumer::BitTorrentManager, announceQueue);
+    coordinator.addPublisher(Consumer::BitTorrentManager, appQueue);
+    coordinator.addPublisher(Consumer::BitTorrentManager, hashResults);
 };
 
 template <typename PeerServiceT> void BitTorrentManagerImpl<PeerServiceT>::run()
 {
     state = State::Active;
 
+    bool pending{false};
     while (state != State::InActive)
     {
-        coordinator.waitOnBtManUpdate(std::chrono::milliseconds{0});
+        // Events left over from the previous loop are handled without waiting
+        if (!pending)
+        {
+            coordinator.wait(Consumer::BitTorrentManager, nextWait());
+        }
         currTime = std::chrono::system_clock::now().time_since_epoch();
 
-        eval();
+        pending = eval();
 
+        processTimers();
         for (const auto &event : peerService.activityCheck(currTime))
         {
             process(event);
         }
     }
 
-    spdlog::info("BtMan::run. Shutdown");
+    spdlog::info(
+        "BtMan::run. Shutdown. Handled app={} persist={} announce={} disk={} hash={} peer={}",
+        serviceCounts[0], serviceCounts[1], serviceCounts[2], serviceCounts[3], serviceCounts[4],
+        serviceCounts[5]);
 }
 
-template <typename PeerServiceT> void BitTorrentManagerImpl<PeerServiceT>::eval()
+template <typename PeerServiceT>
+std::chrono::milliseconds BitTorrentManagerImpl<PeerServiceT>::nextWait() const
 {
-    if (peerService.canRead())
+    auto deadline = timers.nextExpiry();
+    if (const auto peerDeadline = peerService.nextTimeout())
     {
-        auto event = peerService.read(currTime);
+        deadline = deadline ? std::min(*deadline, *peerDeadline) : peerDeadline;
+    }
 
-        if (event)
-        {
-            peerEventHandler.handleEvent(event.value());
-        }
-        // do something
+    // Zero waits until an event arrives
+    if (!deadline)
+    {
+        return std::chrono::milliseconds{0};
     }
 
-    if (persistQueue.canPop())
+    const auto now = std::chrono::system_clock::now().time_since_epoch();
+    const auto wait = std::chrono::ceil<std::chrono::milliseconds>(*deadline - now);
+    return std::max(wait, std::chrono::milliseconds{1});
+}
+
+template <typename PeerServiceT> void BitTorrentManagerImpl<PeerServiceT>::processTimers()
+{
+    std::vector<Timer> expired;
+    timers.advance(currTime,
+                   [&](Timer timer)
+                   {
+                       expired.push_back(std::move(timer));
+                   });
+
+    for (const auto &timer : expired)
     {
-        auto &&event = persistQueue.pop();
+        std::visit(
+            [&](const auto &t)
+            {
+                onTimer(t);
+            },
+            timer);
+    }
+}
+
+template <typename PeerServiceT>
+void BitTorrentManagerImpl<PeerServiceT>::onTimer(const RequestTimeout &timer)
+{
+    requestTimers.erase(timer.peer);
 
-        persistEventHandler.handleEvent(event);
+    const auto it = connections.find(timer.peer);
+    if (it == connections.end())
+    {
+        return;
     }
 
-    if (announceQueue.canPop())
+    // Blocks that the peer did not deliver in time are handed to other peers
+    it->second.expireRequests(currTime);
+
+    // Peer may have answered and new requests were sent since the timer was armed
+    const auto sentAt = it->second.getPendingRequestTime();
+    if (!sentAt || *sentAt + REQUEST_TIMEOUT > currTime)
     {
-        auto &&event = announceQueue.pop();
-        announceEventHandler.handleEvent(event);
+        armRequestTimer(timer.peer, it->second);
+        return;
     }
 
-    if (diskQueue.canPop())
+    spdlog::info("BtMan::onTimer(RequestTimeout). peer={} did not answer block request",
+                 timer.peer.toString());
+    disconnectPeer(timer.peer);
+}
+
+template <typename PeerServiceT>
+void BitTorrentManagerImpl<PeerServiceT>::onTimer(const ReconnectPeer &timer)
+{
+    handlePeerCommands(peerTracker.onReconnectDue(timer.peer));
+}
+
+template <typename PeerServiceT>
+void BitTorrentManagerImpl<PeerServiceT>::armRequestTimer(const http::PeerId &peer,
+                                                          const Protocol<PeerServiceT> &protocol)
+{
+    if (requestTimers.contains(peer))
+    {
+        return;
+    }
+
+    // Due at the first block deadline, or when the peer is considered to snub us
+    std::optional<std::chrono::nanoseconds> due = protocol.getNextDeadline();
+    if (const auto sentAt = protocol.getPendingRequestTime())
     {
-        auto &&event = diskQueue.pop();
-        diskEventHandler.handleEvent(event);
+        due = std::min(due.value_or(*sentAt + REQUEST_TIMEOUT), *sentAt + REQUEST_TIMEOUT);
     }
 
-    if (appQueue.canPop())
+    if (due)
     {
-        auto &&event = appQueue.pop();
-        appEventHandler.handleEvent(event);
+        requestTimers.emplace(peer, timers.schedule(*due, RequestTimeout{peer}));
     }
 }
 
+template <typename PeerServiceT>
+void BitTorrentManagerImpl<PeerServiceT>::sendCancels(const common::InfoHash &infoHash)
+{
+    const auto pieceIt = pieceMan.find(infoHash);
+    if (pieceIt == pieceMan.end() || !pieceIt->second.isEndgame())
+    {
+        return;
+    }
+
+    for (auto &[peer, protocol] : connections)
+    {
+        if (protocol.getInfoHash() == infoHash)
+        {
+            protocol.cancelReceived(currTime);
+        }
+    }
+}
+
+template <typename PeerServiceT>
+void BitTorrentManagerImpl<PeerServiceT>::disarmRequestTimer(const http::PeerId &peer)
+{
+    const auto it = requestTimers.find(peer);
+    if (it != requestTimers.end())
+    {
+        timers.cancel(it->second);
+        requestTimers.erase(it);
+    }
+}
+
+template <typename PeerServiceT> bool BitTorrentManagerImpl<PeerServiceT>::eval()
+{
+    // Control messages come first, then disk completions and only then peer data. Every source
+    // is limited to its budget so that none of them is starved.
+    bool pending = drain(EventSource::App, appQueue, appEventHandler);
+    pending |= drain(EventSource::Persist, persistQueue, persistEventHandler);
+    pending |= drain(EventSource::Announce, announceQueue, announceEventHandler);
+    pending |= drain(EventSource::Disk, diskQueue, diskEventHandler);
+    pending |= drain(EventSource::Hash, hashResults, hashEventHandler);
+    pending |= drainPeers();
+    requestFlush();
+
+    return pending;
+}
+
+template <typename PeerServiceT>
+template <typename Queue, typename Handler>
+bool BitTorrentManagerImpl<PeerServiceT>::drain(EventSource source, Queue &queue, Handler &handler)
+{
+    const auto index = static_cast<size_t>(source);
+    size_t handled{0};
+    while (handled < budgets[index] && queue.canPop())
+    {
+        handler.handleEvent(queue.pop());
+        ++handled;
+    }
+
+    serviceCounts[index] += handled;
+    return queue.canPop();
+}
+
+template <typename PeerServiceT> bool BitTorrentManagerImpl<PeerServiceT>::drainPeers()
+{
+    const auto index = static_cast<size_t>(EventSource::Peer);
+
+    // Messages written to peers while handling the batch are flushed with one wakeup per reactor
+    peerEvents.clear();
+    if (peerService.readMany(currTime, peerEvents, budgets[index]))
+    {
+        peerService.beginBatch();
+        for (const auto &event : peerEvents)
+        {
+            peerEventHandler.handleEvent(event);
+        }
+        peerService.endBatch();
+    }
+
+    serviceCounts[index] += peerEvents.size();
+    return peerService.canRead();
+}
+
+template <typename PeerServiceT>
+void BitTorrentManagerImpl<PeerServiceT>::setBudget(EventSource source, size_t budget)
+{
+    budgets[static_cast<size_t>(source)] = std::max<size_t>(budget, 1);
+}
+
+template <typename PeerServiceT>
+const std::array<uint64_t, BitTorrentManagerImpl<PeerServiceT>::NUM_EVENT_SOURCES> &
+BitTorrentManagerImpl<PeerServiceT>::getServiceCounts() const
+{
+    return serviceCounts;
+}
+
 template <typename PeerServiceT>
 void BitTorrentManagerImpl<PeerServiceT>::process(const app::AddTorrent &req)
 {
@@ -121,12 +286,17 @@ void BitTorrentManagerImpl<PeerServiceT>::process(const app::RemoveTorrent &req)
     handlePeerCommands(peerTracker.deactivateTorrent(req.infoHash));
     pieceMan.erase(req.infoHash);
     torrents.erase(req.infoHash);
+    if (auto *shaper = peerService.getShaper())
+    {
+        shaper->removeTorrent(req.infoHash);
+    }
 
     auto it = connections.begin();
     while (it != connections.end())
     {
         if (it->second.getInfoHash() == req.infoHash)
         {
+            disarmRequestTimer(it->first);
             it = connections.erase(it);
         }
         else
@@ -176,7 +346,9 @@ void BitTorrentManagerImpl<PeerServiceT>::process(const app::StartTorrent &req)
         {
             PieceStateManager psm;
             psm.setActive(true);
-            pieceMan.emplace(req.infoHash, psm);
+            psm.setBufferPool(&bufferPool);
+            psm.setHashService(&hashService);
+            pieceMan.emplace(req.infoHash, std::move(psm));
         }
 
         appQueue.push(app::ResumedTorrent{req.infoHash});
@@ -198,14 +370,58 @@ void BitTorrentManagerImpl<PeerServiceT>::process(const app::Shutdown &req)
     state = State::InActive;
 }
 
+template <typename PeerServiceT>
+common::BufferPool &BitTorrentManagerImpl<PeerServiceT>::getBufferPool()
+{
+    return bufferPool;
+}
+
 template <typename PeerServiceT>
 void BitTorrentManagerImpl<PeerServiceT>::process(const app::RequestStats &req)
 {
     spdlog::info("BtMan::process(RequestStats)");
+    auto *shaper = peerService.getShaper();
     for (const auto &[torrId, infoHash] : req.requested)
     {
+        const auto rates = shaper ? shaper->getRates(infoHash) : TransferRates{};
+        const auto pieceIt = pieceMan.find(infoHash);
+        const auto wasted =
+            pieceIt != pieceMan.end() ? pieceIt->second.getEndgameStats().wastedBytes : 0;
         appQueue.push(app::PeerStats{torrId, peerTracker.getKnownPeerCount(infoHash),
-                                     peerTracker.getConnectedPeerCount(infoHash)});
+                                     peerTracker.getConnectedPeerCount(infoHash), rates.download,
+                                     rates.upload, rates.downloadLimit.rate,
+                                     rates.uploadLimit.rate, wasted});
+    }
+}
+
+template <typename PeerServiceT>
+void BitTorrentManagerImpl<PeerServiceT>::process(const app::SetRateLimit &req)
+{
+    spdlog::info("BtMan::process(SetRateLimit) down={} up={} burst={}", req.downloadRate,
+                 req.uploadRate, req.burst);
+    auto *shaper = peerService.getShaper();
+    if (!shaper)
+    {
+        spdlog::warn("BtMan::process(SetRateLimit). Bandwidth is not shaped");
+        return;
+    }
+
+    const RateLimit down{req.downloadRate, req.burst};
+    const RateLimit up{req.uploadRate, req.burst};
+    switch (req.scope)
+    {
+    case app::SetRateLimit::Scope::Global:
+        shaper->setGlobalLimit(Direction::Down, down);
+        shaper->setGlobalLimit(Direction::Up, up);
+        break;
+    case app::SetRateLimit::Scope::Torrent:
+        shaper->setTorrentLimit(req.infoHash, Direction::Down, down);
+        shaper->setTorrentLimit(req.infoHash, Direction::Up, up);
+        break;
+    case app::SetRateLimit::Scope::Peer:
+        shaper->setPeerLimit(Direction::Down, down);
+        shaper->setPeerLimit(Direction::Up, up);
+        break;
     }
 }
 
@@ -280,6 +496,8 @@ void BitTorrentManagerImpl<PeerServiceT>::process(const persist::Pieces &resp)
     spdlog::info("BtMan::process(Pieces). NumPieces={}", resp.result.size());
 
     auto &psm = pieceMan[resp.infoHash];
+    psm.setBufferPool(&bufferPool);
+    psm.setHashService(&hashService);
     psm.populate(resp.result);
 
     if (!psm.isAllComplete())
@@ -315,12 +533,104 @@ template <typename PeerServiceT>
 void BitTorrentManagerImpl<PeerServiceT>::process(const disk::WriteSuccess &resp)
 {
     persistQueue.push(persist::PieceComplete{resp.infoHash, resp.pieceIndex});
+    flushRequested = false;
+
+    // Written piece returned its buffer, idle peers of torrents that waited for memory continue
+    std::unordered_set<common::InfoHash> waiting;
+    for (const auto &[infoHash, psm] : pieceMan)
+    {
+        if (psm.isWaitingForMemory())
+        {
+            waiting.emplace(infoHash);
+        }
+    }
+
+    resumeIdlePeers(waiting);
+}
+
+template <typename PeerServiceT>
+void BitTorrentManagerImpl<PeerServiceT>::process(HashResult &result)
+{
+    const auto it = pieceMan.find(result.infoHash);
+    if (it == pieceMan.end())
+    {
+        spdlog::warn("BtMan::process(HashResult). Torrent {} was removed", result.infoHash);
+        return;
+    }
+
+    auto &psm = it->second;
+    psm.finishVerification(result.pieceIndex);
+    auto *ps = psm.getPieceState(result.pieceIndex);
+    if (ps == nullptr)
+    {
+        return;
+    }
+
+    if (!result.valid)
+    {
+        // Blocks may have come from several peers, so none of them is blamed
+        spdlog::error("BtMan::process(HashResult). HashCheckFail piece={}", result.pieceIndex);
+        psm.discard(result.pieceIndex);
+    }
+    else
+    {
+        diskQueue.push(disk::WriteData{result.infoHash, result.pieceIndex,
+                                       std::move(result.data), ps->getOffset()});
+        psm.makeCompleted(result.pieceIndex);
+        if (psm.isAllComplete())
+        {
+            updateTorrentCompleted(result.infoHash);
+            return;
+        }
+    }
+
+    resumeIdlePeers({result.infoHash});
+}
+
+template <typename PeerServiceT>
+void BitTorrentManagerImpl<PeerServiceT>::resumeIdlePeers(
+    const std::unordered_set<common::InfoHash> &torrents)
+{
+    if (torrents.empty())
+    {
+        return;
+    }
+
+    for (auto &[peer, protocol] : connections)
+    {
+        if (torrents.contains(protocol.getInfoHash()) && protocol.getPipeline().empty())
+        {
+            protocol.resumeRequests(currTime);
+            armRequestTimer(peer, protocol);
+        }
+    }
+}
+
+template <typename PeerServiceT> void BitTorrentManagerImpl<PeerServiceT>::requestFlush()
+{
+    // Verified pieces that the disk service holds on to keep their buffers from the pool
+    if (flushRequested)
+    {
+        return;
+    }
+
+    for (const auto &[infoHash, psm] : pieceMan)
+    {
+        if (psm.isWaitingForMemory())
+        {
+            spdlog::debug("BtMan::requestFlush. No memory for torrent {}", infoHash);
+            diskQueue.push(disk::Flush{});
+            flushRequested = true;
+            return;
+        }
+    }
 }
 
 template <typename PeerServiceT>
 void BitTorrentManagerImpl<PeerServiceT>::process(const disk::WriteError &resp)
 {
     spdlog::error("BtMan::process(WriteError). Not Implemented");
+    flushRequested = false;
 }
 
 template <typename PeerServiceT>
@@ -336,7 +646,14 @@ void BitTorrentManagerImpl<PeerServiceT>::process(const p2p::ConnectionDisconnec
 {
     spdlog::info("BtMan::process(ConnectionDisconnected). peer={}", resp.peerId.toString());
 
-    connections.erase(resp.peerId);
+    inboundPeers.erase(resp.peerId);
+    disarmRequestTimer(resp.peerId);
+    const auto it = connections.find(resp.peerId);
+    if (it != connections.end())
+    {
+        it->second.onDisconnect();
+        connections.erase(it);
+    }
     handlePeerCommands(peerTracker.onPeerDisconnect(resp.peerId));
 }
 
@@ -349,6 +666,11 @@ void BitTorrentManagerImpl<PeerServiceT>::process(const p2p::ConnectionEstablish
 
     if (it != connections.end())
     {
+        if (auto *shaper = peerService.getShaper())
+        {
+            shaper->assignPeer(resp.peer, it->second.getInfoHash());
+        }
+
         handlePeerCommands(peerTracker.onPeerConnect(resp.peer));
         it->second.sendHandShake(currTime);
     }
@@ -360,6 +682,47 @@ void BitTorrentManagerImpl<PeerServiceT>::process(const p2p::ConnectionEstablish
     }
 }
 
+template <typename PeerServiceT>
+void BitTorrentManagerImpl<PeerServiceT>::process(const p2p::IncomingConnection &resp)
+{
+    spdlog::info("BtMan::process(IncomingConnection). peer={}", resp.peer.toString());
+
+    inboundPeers.emplace(resp.peer);
+}
+
+template <typename PeerServiceT>
+std::pair<ProtocolState, common::InfoHash>
+BitTorrentManagerImpl<PeerServiceT>::acceptInbound(const http::PeerId &peer, const HandShake &hs)
+{
+    inboundPeers.erase(peer);
+
+    const common::InfoHash infoHash{hs.getInfoHash()};
+    auto pieceIt = pieceMan.find(infoHash);
+    if (!torrents.contains(infoHash) || pieceIt == pieceMan.end() || !pieceIt->second.isActive())
+    {
+        spdlog::info("BtMan::acceptInbound. peer={} requested unknown or inactive torrent={}",
+                     peer.toString(), infoHash);
+        return {ProtocolState::CLOSED, infoHash};
+    }
+
+    if (!peerTracker.onInboundPeer(peer, infoHash))
+    {
+        return {ProtocolState::CLOSED, infoHash};
+    }
+
+    spdlog::info("BtMan::acceptInbound. peer={} torrent={}", peer.toString(), infoHash);
+    if (auto *shaper = peerService.getShaper())
+    {
+        shaper->assignPeer(peer, infoHash);
+    }
+
+    auto [connIt, _] = connections.emplace(
+        peer, Protocol{appId, peer, infoHash, peerService, diskQueue, pieceIt->second});
+
+    connIt->second.sendHandShake(currTime);
+    return {connIt->second.onMessage(hs, currTime), infoHash};
+}
+
 template <typename PeerServiceT>
 void BitTorrentManagerImpl<PeerServiceT>::disconnectPeer(const http::PeerId &peer)
 {
@@ -420,6 +783,11 @@ void BitTorrentManagerImpl<PeerServiceT>::handlePeerCommands(const std::vector<P
             spdlog::info("BtMan::handlePeerCommands. Disconnect peer {}", cmd.peer.toString());
             peerService.disconnectClient(cmd.peer);
             break;
+        case PeerCommandFlag::RECONNECT_LATER:
+            spdlog::info("BtMan::handlePeerCommands. Reconnect to peer {} in {}ms",
+                         cmd.peer.toString(), cmd.delay.count());
+            timers.schedule(currTime + cmd.delay, ReconnectPeer{cmd.peer});
+            break;
         case PeerCommandFlag::NOTHING:
             break;
         }
@@ -5,144 +5,119 @@
 #include <fractals/network/http/Peer.h>
 #include <fractals/network/p2p/BitTorrentMsg.h>
 #include <fractals/network/p2p/PeerFd.h>
+#include <fractals/network/p2p/ReadRingBuffer.h>
 
+#include <algorithm>
 #include <cassert>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
 #include <span>
 #include <string_view>
+#include <sys/uio.h>
 #include <unordered_map>
 #include <vector>
 
 namespace fractals::network::p2p
 {
-class ReadMsgState
+class WriteMsgState
 {
   public:
-    bool isComplete() const;
-    bool isInitialized() const;
-    void initialize(uint32_t length);
-
-    template <typename Container> void append(Container &&data, int bytes)
-    {
-        buffer.insert(buffer.end(), data.begin(), data.begin() + bytes);
-    }
-
-    std::vector<char> &&flush();
-
-    void reset();
-
-    std::string_view getBuffer() const;
+    WriteMsgState(std::vector<char> &&data);
 
-    int32_t getRemaining() const;
+    bool isComplete() const;
+    std::string_view &getBuffer();
+    uint32_t remaining() const;
+    // Shift should be equal to amount of data written
+    void flush(uint32_t shift);
 
   private:
-    int32_t mLength{-1};
+    std::string_view mBufferedQueueManagerView;
     std::vector<char> buffer;
 };
 
-class WriteMsgState
+/**
+Outbound messages of a single peer, in the order they are to be sent. Messages are
+gathered into iovecs so that many of them can be flushed with a single writev.
+*/
+class WriteQueue
 {
   public:
-    WriteMsgState(std::vector<char> &&data);
+    void push(std::vector<char> &&data);
 
     bool isComplete() const;
+    // Number of messages not yet fully written
+    size_t size() const;
+    // Total number of bytes not yet written
+    size_t remaining() const;
+
+    // Unwritten part of the message at the front of the queue
     std::string_view &getBuffer();
-    uint32_t remaining() const;
-    // Shift should be equal to amount of data written
-    void flush(uint32_t shift);
+
+    // Fill iovs with the unwritten data, up to maxBytes. Returns the number of iovecs used.
+    size_t gather(std::span<iovec> iovs, size_t maxBytes);
+
+    // Shift should be equal to amount of data written. Returns the number of completed messages.
+    uint32_t flush(size_t shift);
 
   private:
-    std::string_view mBufferedQueueManagerView;
-    std::vector<char> buffer;
+    std::deque<WriteMsgState> mMessages;
+    std::string_view mEmptyView;
+    size_t mRemaining{0};
 };
 
 class BufferedQueueManager
 {
   public:
-    BufferedQueueManager() = default;
+    BufferedQueueManager(uint32_t readBufferCapacity = ReadRingBuffer::DEFAULT_CAPACITY);
 
-    template <typename Container> bool addToReadBuffer(const PeerFd &p, Container &&data)
-    {
-        std::string_view view(data.begin(), data.end());
-        bool hasCompletedMessage{false};
-        while (!view.empty())
-        {
-            hasCompletedMessage = hasCompletedMessage | parseMessage(p, view);
-        }
+    // Free space of the peer's receive ring, to be read into directly from the socket.
+    // Empty if the ring is stalled on outstanding leases or could not be created.
+    std::span<char> reserveRead(const PeerFd &p);
 
-        return hasCompletedMessage;
-    }
+    // Marks bytes as received. Returns true if at least one complete message is available.
+    bool commitRead(const PeerFd &p, uint32_t bytes);
 
-    bool parseMessage(const PeerFd &p, std::string_view &data)
-    {
-        const auto it = mReadBuffers.find(p);
+    std::optional<ReadLease> popMessage(const PeerFd &p);
 
-        int32_t bytes = 0;
-        bool complete = false;
+    bool isReadStalled(const PeerFd &p) const;
+    // Peer announced a message that does not fit in its receive ring
+    bool isReadOversized(const PeerFd &p) const;
 
-        // Not aware of Peer yet, therefore we see handshake first
-        if (it == mReadBuffers.end())
-        {
-            ReadMsgState m;
-            uint8_t len = data[0];
-            m.initialize(49 + len); // Size of HandShake message without len
-            bytes = std::min(m.getRemaining(), static_cast<int32_t>(data.size()));
-            m.append(data, bytes);
-            mReadBuffers[p].emplace_back(m);
-
-            complete = m.isComplete();
-        }
-        // Already aware of peer, and we've already received enough bytes to determine length
-        else if (!it->second.empty() && it->second.back().isInitialized() &&
-                 !it->second.back().isComplete())
-        {
-            bytes = std::min(it->second.back().getRemaining(), static_cast<int32_t>(data.size()));
-            it->second.back().append(data, bytes);
+    void removeFromReadBuffer(const PeerFd &p);
 
-            complete = it->second.size() > 1 || it->second.back().isComplete();
-        }
-        // Already aware of peer, but not yet clear how much data we are receiving
-        else
+    // Called from the consuming thread when a stalled ring frees up space
+    void onReadSpaceAvailable(std::function<void()> callback);
+
+    template <typename Container> bool addToReadBuffer(const PeerFd &p, Container &&data)
+    {
+        std::string_view view(data.begin(), data.end());
+        while (!view.empty())
         {
-            if (it->second.empty() || it->second.back().isComplete())
+            auto space = reserveRead(p);
+            if (space.empty())
             {
-                it->second.push_back(ReadMsgState{});
+                return false;
             }
 
-            ReadMsgState &m = it->second.back();
-
-            bytes = std::min(4, static_cast<int32_t>(data.size()));
-            m.append(data, bytes);
-
-            if (m.getBuffer().size() >= 4)
-            {
-                auto bufView = m.getBuffer();
-                const auto len = common::bytesToInt<uint32_t>(bufView);
-                m.initialize(len + 4);
-            }
+            const auto bytes = std::min(space.size(), view.size());
+            std::copy(view.begin(), view.begin() + bytes, space.begin());
+            view.remove_prefix(bytes);
 
-            complete = m.isComplete();
+            commitRead(p, bytes);
         }
 
-        data.remove_prefix(bytes);
-        return complete;
+        const auto *ring = getReadBuffer(p);
+        return ring && ring->hasMessage();
     }
 
-    std::deque<ReadMsgState> &getReadBuffers(const PeerFd &p)
-    {
-        return mReadBuffers[p];
-    }
+    ReadRingBuffer *getReadBuffer(const PeerFd &p);
+    const ReadRingBuffer *getReadBuffer(const PeerFd &p) const;
 
     void addToWriteBuffer(const PeerFd &p, std::vector<char> &&m)
     {
-        auto it = mWriteBuffers.find(p);
-        if (it == mWriteBuffers.end())
-        {
-            mWriteBuffers.emplace(p, WriteMsgState(std::move(m)));
-        }
-        else if (it->second.isComplete())
-        {
-            it->second = WriteMsgState(std::move(m));
-        }
+        mWriteBuffers[p].push(std::move(m));
     }
 
     void removeFromWriteBuffer(const PeerFd &p)
@@ -150,24 +125,7 @@ class BufferedQueueManager
         mWriteBuffers.erase(p);
     }
 
-    const ReadMsgState *getReadBuffer(const PeerFd &p) const
-    {
-        return getReadBuffer(p);
-    }
-
-    ReadMsgState *getReadBuffer(const PeerFd &p)
-    {
-        auto it = mReadBuffers.find(p);
-
-        if (it != mReadBuffers.end())
-        {
-            return &(it->second.back());
-        }
-
-        return nullptr;
-    }
-
-    WriteMsgState *getWriteBuffer(const PeerFd &p)
+    WriteQueue *getWriteBuffer(const PeerFd &p)
     {
         auto it = mWriteBuffers.find(p);
 
@@ -180,8 +138,10 @@ class BufferedQueueManager
     }
 
   private:
-    std::unordered_map<PeerFd, std::deque<ReadMsgState>> mReadBuffers;
-    std::unordered_map<PeerFd, WriteMsgState> mWriteBuffers;
+    uint32_t mReadBufferCapacity;
+    std::function<void()> mOnReadSpaceAvailable;
+    std::unordered_map<PeerFd, std::shared_ptr<ReadRingBuffer>> mReadBuffers;
+    std::unordered_map<PeerFd, WriteQueue> mWriteBuffers;
 };
 
 } // namespace fractals::network::p2p
\ No newline at end of file
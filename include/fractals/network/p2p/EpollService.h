@@ -1,13 +1,18 @@
 #pragma once
 
 #include "PeerFd.h"
+#include <fractals/network/p2p/BandwidthShaper.h>
 #include <fractals/network/p2p/BufferedQueueManager.h>
 #include <fractals/network/p2p/EpollMsgQueue.h>
+#include <fractals/sync/Notifier.h>
 
 #include <epoll_wrapper/Epoll.h>
 #include <epoll_wrapper/Error.h>
 #include <epoll_wrapper/Event.h>
 
+#include <chrono>
+#include <optional>
+
 namespace fractals::network::p2p
 {
 
@@ -21,9 +26,29 @@ class EpollServiceImpl
         Inactive,
         Deactivating
     };
+
+    // Edge triggered peers are read from and written to until EAGAIN
+    enum class TriggerMode
+    {
+        Level,
+        Edge
+    };
+
     using Epoll = EpollT;
 
-    EpollServiceImpl(Epoll &epoll, BufferedQueueManagerT &rq, typename EpollMsgQueue::RightEndPoint queue);
+    // Max bytes read from or written to a single peer before other peers are serviced
+    static constexpr uint32_t DEFAULT_IO_BUDGET = 256 * 1024;
+    // Max number of queued messages flushed with a single writev
+    static constexpr size_t MAX_IOVECS = 64;
+    // Max connections accepted from a listener before other peers are serviced
+    static constexpr size_t MAX_ACCEPT_BATCH = 64;
+    // Shortest time a peer is throttled for once the shaper ran out of tokens
+    static constexpr std::chrono::milliseconds MIN_THROTTLE{1};
+
+    EpollServiceImpl(Epoll &epoll, BufferedQueueManagerT &rq,
+                     typename EpollMsgQueue::RightEndPoint queue,
+                     TriggerMode triggerMode = TriggerMode::Level,
+                     uint32_t ioBudget = DEFAULT_IO_BUDGET, BandwidthShaper *shaper = nullptr);
     EpollServiceImpl(const EpollServiceImpl &) = delete;
     EpollServiceImpl(EpollServiceImpl &&) = delete;
 
@@ -37,22 +62,61 @@ class EpollServiceImpl
     bool isActive() const;
 
   private:
+    enum class IoStatus
+    {
+        Drained,
+        BudgetExhausted,
+        Stalled,
+        Throttled,
+        Closed,
+        Failed
+    };
+
     void subscribe(const Peer &peer);
     void unsubscribe(const Peer &peer);
+    void listen(const Peer &listener);
+    void closeListeners();
     epoll_wrapper::CtlAction disableWrite(const Peer &peer);
     epoll_wrapper::CtlAction enableWrite(const Peer &peer);
+    // Stop polling for input while the peer's read buffer is full
+    epoll_wrapper::CtlAction pauseRead(const Peer &peer);
+    void resumeReads();
+    // Stop polling the peer in the given direction until the shaper has tokens for it again
+    void throttle(const Peer &peer, Direction dir);
+    void resumeThrottled();
+    epoll_wrapper::CtlAction updateInterest(const Peer &peer);
     State stop();
 
     PeerFd createNotifyFd();
-    int readMany(const Peer &peer);
-    std::tuple<std::vector<char>, int> readOnce(const Peer &peer);
-    void writeToBuffer(const Peer& peer, std::vector<char>&& data, int bytes);
-
-    int notifyPipe[2];
+    PeerFd createThrottleTimer();
+    void handleRead(const Peer &peer);
+    void handleWrite(const Peer &peer);
+    IoStatus readMany(const Peer &peer);
+    IoStatus writeMany(const Peer &peer, WriteQueue *writeQueue);
+    void acceptMany(const Peer &listener);
+    // Revisit peers that ran out of budget, epoll won't report them again in edge triggered mode
+    void serviceReadyPeers();
+
+    // Requests are pushed to the queue, the eventfd of the notifier wakes up epoll
+    sync::Notifier wakeup;
     PeerFd notifyPeer;
+    // Fires once throttled peers may be serviced again
+    PeerFd throttleTimer;
+    std::optional<std::chrono::nanoseconds> throttleDeadline;
 
     State state{State::Inactive};
+    std::unordered_set<PeerFd> listeners;
     std::unordered_set<PeerFd> pending;
+    std::unordered_set<PeerFd> pausedReads;
+    std::unordered_set<PeerFd> writeEnabled;
+    std::unordered_set<PeerFd> readyReads;
+    std::unordered_set<PeerFd> readyWrites;
+    std::unordered_set<PeerFd> throttledReads;
+    std::unordered_set<PeerFd> throttledWrites;
+
+    TriggerMode triggerMode;
+    uint32_t ioBudget;
+    BandwidthShaper *shaper;
 
     std::mutex mMutex;
     Epoll &mEpoll;
@@ -1,4 +1,5 @@
 #include <fractals/common/utils.h>
+#include <fractals/network/p2p/BandwidthShaper.h>
 #include <fractals/network/http/Peer.h>
 #include <fractals/network/p2p/BitTorrentMsg.h>
 #include <fractals/network/p2p/BufferedQueueManager.h>
@@ -9,19 +10,27 @@
 #include <fractals/network/p2p/PeerFd.h>
 #include <fractals/network/p2p/Socket.h>
 
+#include <algorithm>
+#include <arpa/inet.h>
+#include <array>
 #include <bitset>
 #include <cassert>
+#include <cerrno>
 #include <chrono>
+#include <cstring>
 #include <epoll_wrapper/Epoll.h>
 #include <epoll_wrapper/EpollImpl.h>
 #include <epoll_wrapper/Error.h>
 #include <epoll_wrapper/Event.h>
 #include <mutex>
+#include <netinet/in.h>
 #include <spdlog/spdlog.h>
 #include <sstream>
 #include <stdexcept>
 #include <sys/epoll.h>
-#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 
 namespace fractals::network::p2p
 {
@@ -32,17 +41,46 @@ namespace fractals::network::p2p
 
 TEMPLATE
 PREFIX::EpollServiceImpl(Epoll &epoll, BufferedQueueManagerT &bufMan,
-                         typename EpollMsgQueue::RightEndPoint queue)
-    : mEpoll(epoll), buffMan(bufMan), notifyPeer(createNotifyFd()), queue(queue)
+                         typename EpollMsgQueue::RightEndPoint queue, TriggerMode triggerMode,
+                         uint32_t ioBudget, BandwidthShaper *shaper)
+    : mEpoll(epoll), buffMan(bufMan), notifyPeer(createNotifyFd()), queue(queue),
+      triggerMode(triggerMode), ioBudget(ioBudget), shaper(shaper)
 {
     mEpoll.add(notifyPeer, epoll_wrapper::EventCode::EpollIn);
+
+    if (shaper)
+    {
+        throttleTimer = createThrottleTimer();
+        if (throttleTimer.getFileDescriptor() < 0)
+        {
+            spdlog::error("EpollService. Could not create throttle timer, bandwidth is not shaped");
+            this->shaper = nullptr;
+        }
+        else
+        {
+            mEpoll.add(throttleTimer, epoll_wrapper::EventCode::EpollIn);
+        }
+    }
+
+    // Consumer released a lease of a stalled read buffer
+    buffMan.onReadSpaceAvailable(
+        [this]()
+        {
+            notify();
+        });
 }
 
 TEMPLATE
 void PREFIX::subscribe(const Peer &peer)
 {
-    const auto ctl =
-        mEpoll.add(peer, epoll_wrapper::EventCode::EpollIn | epoll_wrapper::EventCode::EpollOut);
+    auto events = epoll_wrapper::EventCode::EpollIn | epoll_wrapper::EventCode::EpollOut;
+    if (triggerMode == TriggerMode::Edge)
+    {
+        events = events | epoll_wrapper::EventCode::EpollET;
+    }
+
+    const auto ctl = mEpoll.add(peer, events);
+    writeEnabled.emplace(peer);
     queue.push(CtlResponse{peer, std::to_string(ctl.getError())});
 }
 
@@ -50,29 +88,183 @@ TEMPLATE
 void PREFIX::unsubscribe(const Peer &peer)
 {
     pending.erase(peer); // may not be known to peer
+    pausedReads.erase(peer);
+    writeEnabled.erase(peer);
+    readyReads.erase(peer);
+    readyWrites.erase(peer);
+    throttledReads.erase(peer);
+    throttledWrites.erase(peer);
+    if (shaper)
+    {
+        shaper->removePeer(peer.getId());
+    }
+    buffMan.removeFromReadBuffer(peer);
+    buffMan.removeFromWriteBuffer(peer);
     const auto pr = peer;
     const auto ctl = mEpoll.erase(peer);
     close(peer.getFileDescriptor());
     queue.push(CtlResponse{pr, std::to_string(ctl.getError())});
 }
 
+TEMPLATE
+void PREFIX::listen(const Peer &listener)
+{
+    // Level triggered, a batch of accepts may leave connections in the backlog
+    const auto ctl = mEpoll.add(listener, epoll_wrapper::EventCode::EpollIn);
+    if (ctl.getError() == epoll_wrapper::ErrorCode::None)
+    {
+        listeners.emplace(listener);
+    }
+    else
+    {
+        close(listener.getFileDescriptor());
+    }
+
+    queue.push(CtlResponse{listener, std::to_string(ctl.getError())});
+}
+
+TEMPLATE
+void PREFIX::closeListeners()
+{
+    for (const auto &listener : listeners)
+    {
+        mEpoll.erase(listener);
+        close(listener.getFileDescriptor());
+    }
+
+    listeners.clear();
+}
+
 TEMPLATE
 epoll_wrapper::CtlAction PREFIX::disableWrite(const Peer &peer)
 {
-    return mEpoll.mod(peer, epoll_wrapper::EventCode::EpollIn);
+    writeEnabled.erase(peer);
+    return updateInterest(peer);
 }
 
 TEMPLATE
 epoll_wrapper::CtlAction PREFIX::enableWrite(const Peer &peer)
 {
-    return mEpoll.mod(peer, epoll_wrapper::EventCode::EpollIn | epoll_wrapper::EventCode::EpollOut);
+    writeEnabled.emplace(peer);
+    return updateInterest(peer);
+}
+
+TEMPLATE
+epoll_wrapper::CtlAction PREFIX::pauseRead(const Peer &peer)
+{
+    pausedReads.emplace(peer);
+    return updateInterest(peer);
+}
+
+TEMPLATE
+void PREFIX::resumeReads()
+{
+    for (auto it = pausedReads.begin(); it != pausedReads.end();)
+    {
+        if (!buffMan.isReadStalled(*it))
+        {
+            const auto peer = *it;
+            it = pausedReads.erase(it);
+            updateInterest(peer);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+TEMPLATE
+void PREFIX::throttle(const Peer &peer, Direction dir)
+{
+    auto &throttled = dir == Direction::Down ? throttledReads : throttledWrites;
+    throttled.emplace(peer);
+    updateInterest(peer);
+
+    const auto now = std::chrono::steady_clock::now().time_since_epoch();
+    const auto deadline =
+        now + std::max<std::chrono::nanoseconds>(shaper->retryAfter(peer.getId(), dir),
+                                                 MIN_THROTTLE);
+    if (throttleDeadline && *throttleDeadline <= deadline)
+    {
+        return;
+    }
+
+    // steady_clock is CLOCK_MONOTONIC
+    itimerspec spec{};
+    spec.it_value.tv_sec = std::chrono::duration_cast<std::chrono::seconds>(deadline).count();
+    spec.it_value.tv_nsec = (deadline % std::chrono::seconds{1}).count();
+    if (timerfd_settime(throttleTimer.getFileDescriptor(), TFD_TIMER_ABSTIME, &spec, nullptr) < 0)
+    {
+        spdlog::error("EpollService::throttle. Could not arm throttle timer: {}", strerror(errno));
+        return;
+    }
+
+    throttleDeadline = deadline;
+}
+
+TEMPLATE
+void PREFIX::resumeThrottled()
+{
+    uint64_t expirations;
+    read(throttleTimer.getFileDescriptor(), &expirations, sizeof(expirations));
+    throttleDeadline.reset();
+
+    auto reads = std::move(throttledReads);
+    auto writes = std::move(throttledWrites);
+    throttledReads.clear();
+    throttledWrites.clear();
+
+    // Peers that still find the buckets empty are throttled again with a new deadline
+    for (const auto &peer : reads)
+    {
+        if (isSubscribed(peer))
+        {
+            updateInterest(peer);
+            if (triggerMode == TriggerMode::Edge)
+            {
+                readyReads.emplace(peer);
+            }
+        }
+    }
+
+    for (const auto &peer : writes)
+    {
+        if (isSubscribed(peer))
+        {
+            updateInterest(peer);
+            if (triggerMode == TriggerMode::Edge)
+            {
+                readyWrites.emplace(peer);
+            }
+        }
+    }
+}
+
+TEMPLATE
+epoll_wrapper::CtlAction PREFIX::updateInterest(const Peer &peer)
+{
+    auto events = epoll_wrapper::EventCode{};
+    if (!pausedReads.contains(peer) && !throttledReads.contains(peer))
+    {
+        events = events | epoll_wrapper::EventCode::EpollIn;
+    }
+    if (writeEnabled.contains(peer) && !throttledWrites.contains(peer))
+    {
+        events = events | epoll_wrapper::EventCode::EpollOut;
+    }
+    if (triggerMode == TriggerMode::Edge)
+    {
+        events = events | epoll_wrapper::EventCode::EpollET;
+    }
+
+    return mEpoll.mod(peer, events);
 }
 
 TEMPLATE
 void PREFIX::notify()
 {
-    uint8_t buf[1]{0};
-    write(notifyPipe[1], buf, 1);
+    wakeup.notify(0);
 }
 
 TEMPLATE
@@ -84,64 +276,294 @@ bool PREFIX::isSubscribed(const Peer &peer)
 TEMPLATE
 PeerFd PREFIX::createNotifyFd()
 {
-    pipe(notifyPipe);
+    assert(wakeup.isValid());
+    return PeerFd{http::PeerId{"", 0}, wakeup.getFileDescriptor()};
+}
+
+TEMPLATE
+PeerFd PREFIX::createThrottleTimer()
+{
+    const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    return PeerFd{http::PeerId{"", 1}, fd};
+}
+
+TEMPLATE
+typename PREFIX::IoStatus PREFIX::readMany(const Peer &peer)
+{
+    // Read straight into the peer's receive buffer and hand out complete messages as leases
+    uint32_t total{0};
+    while (total < ioBudget)
+    {
+        const auto space = buffMan.reserveRead(peer);
+        if (space.empty())
+        {
+            if (buffMan.isReadStalled(peer))
+            {
+                pauseRead(peer);
+                return IoStatus::Stalled;
+            }
+
+            spdlog::error("EpollService::readMany. No space to receive message from peer={}",
+                          peer.getId().toString());
+            return IoStatus::Failed;
+        }
+
+        size_t toRead = std::min<size_t>(space.size(), ioBudget - total);
+        if (shaper)
+        {
+            toRead = shaper->acquire(peer.getId(), Direction::Down, toRead);
+            if (toRead == 0)
+            {
+                throttle(peer, Direction::Down);
+                return IoStatus::Throttled;
+            }
+        }
+
+        const ssize_t n = read(peer.getFileDescriptor(), space.data(), toRead);
+        if (shaper)
+        {
+            shaper->release(peer.getId(), Direction::Down, toRead, std::max<ssize_t>(n, 0));
+        }
+        if (n == 0)
+        {
+            return IoStatus::Closed;
+        }
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return IoStatus::Drained;
+            }
+
+            spdlog::error("EpollService::readMany. Failed to read from peer={} error={}",
+                          peer.getId().toString(), strerror(errno));
+            return IoStatus::Failed;
+        }
+
+        total += n;
+        if (buffMan.commitRead(peer, n))
+        {
+            while (auto msg = buffMan.popMessage(peer))
+            {
+                queue.push(ReadEvent{peer, std::move(*msg)});
+            }
+        }
+
+        // Peer announced a message that can never be received, waiting for it would stall forever
+        if (buffMan.isReadOversized(peer))
+        {
+            spdlog::error("EpollService::readMany. Message of peer={} exceeds the receive buffer",
+                          peer.getId().toString());
+            return IoStatus::Failed;
+        }
 
-    int32_t fd = eventfd(0, EFD_NONBLOCK);
-    assert(fd > 0);
-    return PeerFd{http::PeerId{"", 0}, notifyPipe[0]};
+        // A short read drained the socket. Level triggered epoll reports the peer again once
+        // more data arrives, so we need not wait for EAGAIN.
+        if (triggerMode == TriggerMode::Level && static_cast<size_t>(n) < toRead)
+        {
+            return IoStatus::Drained;
+        }
+    }
+
+    return IoStatus::BudgetExhausted;
 }
 
 TEMPLATE
-int PREFIX::readMany(const Peer &peer)
+typename PREFIX::IoStatus PREFIX::writeMany(const Peer &peer, WriteQueue *writeQueue)
 {
-    auto [bytes, n] = readOnce(peer);
+    // Flush as many queued messages as possible per syscall
+    std::array<iovec, MAX_IOVECS> iovs;
+    uint32_t total{0};
+    while (!writeQueue->isComplete())
+    {
+        if (total >= ioBudget)
+        {
+            return IoStatus::BudgetExhausted;
+        }
+
+        uint64_t toWrite = ioBudget - total;
+        if (shaper)
+        {
+            toWrite = shaper->acquire(peer.getId(), Direction::Up, toWrite);
+            if (toWrite == 0)
+            {
+                throttle(peer, Direction::Up);
+                return IoStatus::Throttled;
+            }
+        }
+
+        const auto count = writeQueue->gather(iovs, toWrite);
+        const ssize_t n = writev(peer.getFileDescriptor(), iovs.data(), count);
+        if (shaper)
+        {
+            shaper->release(peer.getId(), Direction::Up, toWrite, std::max<ssize_t>(n, 0));
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return IoStatus::Drained;
+            }
 
-    writeToBuffer(peer, std::move(bytes), n);
+            spdlog::error("EpollService::writeMany. Failed to write to peer={} error={}",
+                          peer.getId().toString(), strerror(errno));
+            return IoStatus::Failed;
+        }
 
-    return n;
+        writeQueue->flush(n);
+        total += n;
+    }
+
+    return IoStatus::Drained;
 }
 
 TEMPLATE
-std::tuple<std::vector<char>, int> PREFIX::readOnce(const Peer &peer)
+void PREFIX::handleRead(const Peer &peer)
 {
-    std::vector<char> buf(16 * 1024);
-    int n = read(peer.getFileDescriptor(), &buf[0], 16 * 1024);
-    if (n < 0)
+    switch (readMany(peer))
     {
-        spdlog::error("Error reading less than 0 bytes {}", strerror(errno));
+    case IoStatus::Closed:
+    case IoStatus::Failed:
+        queue.push(ConnectionCloseEvent{peer.getId()});
+        unsubscribe(peer);
+        break;
+    case IoStatus::BudgetExhausted:
+        if (triggerMode == TriggerMode::Edge)
+        {
+            readyReads.emplace(peer);
+        }
+        break;
+    case IoStatus::Drained:
+    case IoStatus::Stalled:
+    case IoStatus::Throttled:
+        break;
     }
-    return std::make_tuple(buf, n);
 }
 
 TEMPLATE
-void PREFIX::writeToBuffer(const Peer &peer, std::vector<char> &&data, int bytes)
+void PREFIX::handleWrite(const Peer &peer)
 {
-    std::vector<char> v(data.begin(), data.begin() + bytes);
-    bool isComplete = buffMan.addToReadBuffer(peer, v);
-    if (isComplete)
+    if (pending.count(peer))
     {
-        auto &msgs = buffMan.getReadBuffers(peer);
-        for (auto it = msgs.begin(); it != msgs.end();)
+        queue.push(ConnectionAccepted{peer});
+        pending.erase(peer);
+    }
+
+    auto *writeQueue = buffMan.getWriteBuffer(peer);
+    if (!writeQueue || writeQueue->isComplete())
+    {
+        disableWrite(peer);
+        return;
+    }
+
+    const auto queued = writeQueue->size();
+    const auto status = writeMany(peer, writeQueue);
+    if (status == IoStatus::Failed)
+    {
+        queue.push(WriteEventResponse{peer, "Could not write any data to peer"});
+    }
+    else if (writeQueue->size() < queued)
+    {
+        queue.push(WriteEventResponse{peer, ""});
+    }
+
+    if (writeQueue->isComplete())
+    {
+        disableWrite(peer);
+    }
+    else if (status == IoStatus::BudgetExhausted && triggerMode == TriggerMode::Edge)
+    {
+        readyWrites.emplace(peer);
+    }
+}
+
+TEMPLATE
+void PREFIX::acceptMany(const Peer &listener)
+{
+    for (size_t i = 0; i < MAX_ACCEPT_BATCH; ++i)
+    {
+        sockaddr_in addr{};
+        socklen_t addrLen = sizeof(addr);
+        const int fd = accept4(listener.getFileDescriptor(), reinterpret_cast<sockaddr *>(&addr),
+                               &addrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
         {
-            if (it->isComplete())
+            if (errno == EINTR || errno == ECONNABORTED)
             {
-                queue.push(ReadEvent{peer, std::move(it->flush())});
-                it = msgs.erase(it);
+                continue;
             }
-            else
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
             {
-                ++it;
+                spdlog::error("EpollService::acceptMany. Failed to accept connection: {}",
+                              strerror(errno));
             }
+            return;
+        }
+
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+        const Peer peer{http::PeerId{ip, ntohs(addr.sin_port)}, fd};
+
+        // Nothing to write until the peer's handshake has been answered
+        auto events = epoll_wrapper::EventCode::EpollIn;
+        if (triggerMode == TriggerMode::Edge)
+        {
+            events = events | epoll_wrapper::EventCode::EpollET;
+        }
+
+        const auto ctl = mEpoll.add(peer, events);
+        if (ctl.getError() != epoll_wrapper::ErrorCode::None)
+        {
+            spdlog::error("EpollService::acceptMany. Could not subscribe peer={} error={}",
+                          peer.getId().toString(), std::to_string(ctl.getError()));
+            close(fd);
+            continue;
         }
+
+        queue.push(PeerAccepted{peer});
     }
 }
 
-template <typename Peer> int writeData(const Peer &peer, WriteMsgState *msgState)
+TEMPLATE
+void PREFIX::serviceReadyPeers()
 {
-    int n = write(peer.getFileDescriptor(), msgState->getBuffer().data(), msgState->remaining());
-    msgState->flush(n);
+    auto reads = std::move(readyReads);
+    readyReads.clear();
+    for (const auto &peer : reads)
+    {
+        if (isSubscribed(peer) && !pausedReads.contains(peer) && !throttledReads.contains(peer))
+        {
+            handleRead(peer);
+        }
+    }
 
-    return n;
+    auto writes = std::move(readyWrites);
+    readyWrites.clear();
+    for (const auto &peer : writes)
+    {
+        if (isSubscribed(peer) && !throttledWrites.contains(peer))
+        {
+            handleWrite(peer);
+        }
+    }
+
+    // Make sure the next wait returns immediately
+    if (!readyReads.empty() || !readyWrites.empty())
+    {
+        notify();
+    }
 }
 
 TEMPLATE
@@ -153,6 +575,8 @@ void PREFIX::run()
     {
         const auto wa = mEpoll.wait();
 
+        resumeReads();
+
         while (queue.canPop())
         {
             const auto req = queue.pop();
@@ -167,6 +591,10 @@ void PREFIX::run()
                                               unsubscribe(unsub.peer);
                                               queue.push(ConnectionCloseEvent{unsub.peer.getId()});
                                           },
+                                          [&](Listen req)
+                                          {
+                                              listen(req.listener);
+                                          },
                                           [&](Deactivate stop)
                                           {
                                               state = State::Inactive;
@@ -193,6 +621,7 @@ void PREFIX::run()
             state = State::Inactive;
             spdlog::error("EpollService::run error={}", std::to_string(wa.getError()));
             queue.push(EpollError{wa.getError()});
+            closeListeners();
             return;
         }
 
@@ -200,8 +629,19 @@ void PREFIX::run()
         {
             if (peer == notifyPeer)
             {
-                uint8_t buf[1];
-                read(notifyPeer.getFileDescriptor(), buf, 1);
+                wakeup.take();
+                continue;
+            }
+
+            if (shaper && peer == throttleTimer)
+            {
+                resumeThrottled();
+                continue;
+            }
+
+            if (listeners.contains(peer))
+            {
+                acceptMany(peer);
                 continue;
             }
 
@@ -226,42 +666,15 @@ void PREFIX::run()
                 if (event.mEvents &
                     (epoll_wrapper::EventCode::EpollIn | epoll_wrapper::EventCode::EpollPri))
                 {
-                    if (!readMany(peer))
+                    handleRead(peer);
+                    if (!isSubscribed(peer))
                     {
-                        queue.push(ConnectionCloseEvent{peer.getId()});
-                        unsubscribe(peer);
                         continue;
                     }
                 }
                 if (event.mEvents & epoll_wrapper::EventCode::EpollOut)
                 {
-                    if (pending.count(peer))
-                    {
-                        queue.push(ConnectionAccepted{peer});
-                        pending.erase(peer);
-                    }
-
-                    auto *writeMsg = buffMan.getWriteBuffer(peer);
-                    if (!writeMsg)
-                    {
-                        spdlog::error("EpollService::run. could not find write buffer for peer={}",
-                                      peer.getId().toString());
-                        disableWrite(peer);
-                        continue;
-                    }
-
-                    if (!writeData(peer, writeMsg))
-                    {
-                        queue.push(WriteEventResponse{peer, "Could not write any data to peer"});
-                    }
-
-                    if (writeMsg->isComplete())
-                    {
-                        queue.push(WriteEventResponse{peer, ""});
-                        buffMan.removeFromWriteBuffer(peer);
-                    }
-
-                    disableWrite(peer);
+                    handleWrite(peer);
                 }
             }
             else
@@ -270,8 +683,11 @@ void PREFIX::run()
                               peer.getId().toString());
             }
         }
+
+        serviceReadyPeers();
     }
 
+    closeListeners();
     spdlog::info("EpollService::run. Shutdown");
 }
 
@@ -3,6 +3,7 @@
 #include <fractals/network/http/Peer.h>
 #include <fractals/network/p2p/BitTorrentMsg.h>
 #include <fractals/network/p2p/PeerFd.h>
+#include <fractals/network/p2p/ReadRingBuffer.h>
 
 #include <deque>
 #include <epoll_wrapper/Error.h>
@@ -40,7 +41,7 @@ std::ostream &operator<<(std::ostream &os, const ReadEventResponse &e);
 struct ReadEvent
 {
     PeerFd peer;
-    std::vector<char> mMessage;
+    ReadLease mMessage;
 
     bool operator==(const ReadEvent &obj) const
     {
@@ -87,6 +88,36 @@ struct ConnectionAccepted
     PeerFd peer;
 };
 
+// Listening socket for inbound connections
+struct Listen
+{
+    Listen() = default;
+    Listen(const PeerFd &listener) : listener(listener)
+    {
+    }
+    PeerFd listener;
+
+    bool operator==(const Listen &obj) const
+    {
+        return listener == obj.listener;
+    }
+};
+
+std::ostream &operator<<(std::ostream &os, const Listen &e);
+
+// Connection accepted on a listening socket, already subscribed
+struct PeerAccepted
+{
+    PeerFd peer;
+
+    bool operator==(const PeerAccepted &obj) const
+    {
+        return peer == obj.peer;
+    }
+};
+
+std::ostream &operator<<(std::ostream &os, const PeerAccepted &e);
+
 struct CtlResponse
 {
     CtlResponse() = default;
@@ -186,10 +217,10 @@ struct Deactivate
 
 std::ostream &operator<<(std::ostream &os, const Deactivate &e);
 
-using EpollServiceRequest = std::variant<WriteEvent, Subscribe, UnSubscribe, Deactivate>;
+using EpollServiceRequest = std::variant<WriteEvent, Subscribe, UnSubscribe, Listen, Deactivate>;
 using EpollServiceResponse =
     std::variant<EpollError, ReadEventResponse, ReadEvent, WriteEventResponse, ConnectionAccepted,
-                 CtlResponse, ConnectionCloseEvent, ConnectionError>;
+                 PeerAccepted, CtlResponse, ConnectionCloseEvent, ConnectionError>;
 
 std::ostream &operator<<(std::ostream &os, const EpollServiceRequest &pe);
 std::ostream &operator<<(std::ostream &os, const EpollServiceResponse &pe);
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <fractals/network/p2p/BandwidthShaper.h>
+#include <fractals/network/p2p/BufferedQueueManager.h>
+#include <fractals/network/p2p/EpollMsgQueue.h>
+#include <fractals/network/p2p/EpollService.h>
+
+#include <algorithm>
+#include <memory>
+#include <spdlog/spdlog.h>
+#include <thread>
+#include <vector>
+
+namespace fractals::network::p2p
+{
+
+/**
+Runs a number of EpollService reactors, each on its own thread with its own epoll instance,
+BufferedQueueManager and EpollMsgQueue. Peers are assigned to a shard by the PeerService.
+All shards take their bandwidth from the same BandwidthShaper.
+*/
+template <typename EpollServiceT, typename BufferedQueueManagerT> class EpollServicePoolImpl
+{
+    using Epoll = typename EpollServiceT::Epoll;
+    using CreateAction = decltype(Epoll::epollCreate());
+
+    struct Shard
+    {
+        Shard(CreateAction &&epoll, typename EpollServiceT::TriggerMode triggerMode,
+              BandwidthShaper &shaper)
+            : epoll(std::move(epoll)),
+              service(this->epoll.getEpoll(), bufMan, queue.getRightEnd(), triggerMode,
+                      EpollServiceT::DEFAULT_IO_BUDGET, &shaper)
+        {
+        }
+
+        CreateAction epoll;
+        BufferedQueueManagerT bufMan;
+        EpollMsgQueue queue;
+        EpollServiceT service;
+        std::thread thread;
+    };
+
+  public:
+    static size_t defaultNumShards()
+    {
+        return std::max(1u, std::thread::hardware_concurrency() / 2);
+    }
+
+    EpollServicePoolImpl(size_t numShards = defaultNumShards(),
+                         typename EpollServiceT::TriggerMode triggerMode =
+                             EpollServiceT::TriggerMode::Edge)
+    {
+        for (size_t i = 0; i < numShards; ++i)
+        {
+            auto epoll = Epoll::epollCreate();
+            if (!epoll)
+            {
+                spdlog::error("EpollServicePool. Could not create epoll instance for shard {}", i);
+                continue;
+            }
+
+            shards.emplace_back(std::make_unique<Shard>(std::move(epoll), triggerMode, shaper));
+        }
+    }
+
+    EpollServicePoolImpl(const EpollServicePoolImpl &) = delete;
+    EpollServicePoolImpl(EpollServicePoolImpl &&) = delete;
+
+    ~EpollServicePoolImpl()
+    {
+        join();
+
+        for (size_t i = 0; i < shards.size(); ++i)
+        {
+            shards[i]->queue.logStats(fmt::format("Epoll queue {}", i));
+        }
+    }
+
+    void run()
+    {
+        for (auto &shard : shards)
+        {
+            shard->thread = std::thread(
+                [&service = shard->service]()
+                {
+                    service.run();
+                });
+        }
+    }
+
+    void join()
+    {
+        for (auto &shard : shards)
+        {
+            if (shard->thread.joinable())
+            {
+                shard->thread.join();
+            }
+        }
+    }
+
+    size_t size() const
+    {
+        return shards.size();
+    }
+
+    EpollServiceT &getService(size_t shard)
+    {
+        return shards[shard]->service;
+    }
+
+    EpollMsgQueue::LeftEndPoint getQueueEndPoint(size_t shard)
+    {
+        return shards[shard]->queue.getLeftEnd();
+    }
+
+    BandwidthShaper &getShaper()
+    {
+        return shaper;
+    }
+
+  private:
+    BandwidthShaper shaper;
+    std::vector<std::unique_ptr<Shard>> shards;
+};
+
+using EpollServicePool = EpollServicePoolImpl<EpollService, BufferedQueueManager>;
+
+} // namespace fractals::network::p2p
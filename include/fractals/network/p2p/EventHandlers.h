@@ -3,6 +3,7 @@
 #include <fractals/app/Event.h>
 #include <fractals/common/utils.h>
 #include <fractals/network/http/Announce.h>
+#include <fractals/network/p2p/HashService.h>
 #include <fractals/network/p2p/PeerEvent.h>
 #include <fractals/network/p2p/Protocol.h>
 #include <chrono>
@@ -30,6 +31,10 @@ template <typename Caller> class PeerEventHandler
                                       {
                                           caller->process(msg);
                                       },
+                                      [&](const IncomingConnection &msg)
+                                      {
+                                          caller->process(msg);
+                                      },
                                       [&](const Message &msg)
                                       {
                                           handleMessage(msg);
@@ -99,6 +104,22 @@ template <typename Caller> class DiskEventHandler
     Caller *caller;
 };
 
+template <typename Caller> class HashEventHandler
+{
+  public:
+    HashEventHandler(Caller *caller) : caller(caller)
+    {
+    }
+
+    void handleEvent(HashResult &&event)
+    {
+        caller->process(event);
+    }
+
+  private:
+    Caller *caller;
+};
+
 template <typename Caller> class AnnounceEventHandler
 {
   public:
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <fractals/common/BufferPool.h>
+#include <fractals/common/Sha1.h>
+#include <fractals/common/Tagged.h>
+#include <fractals/common/WorkQueue.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fractals::network::p2p
+{
+
+struct HashRequest
+{
+    common::InfoHash infoHash;
+    uint32_t pieceIndex{0};
+    common::PieceBuffer data;
+    // Digest of the first hashedBytes of the data, the rest still has to be added
+    common::Sha1 hasher;
+    uint64_t hashedBytes{0};
+    common::PieceHash expected;
+};
+
+struct HashResult
+{
+    common::InfoHash infoHash;
+    uint32_t pieceIndex{0};
+    // Buffer of the request, handed back so that a valid piece can be written out
+    common::PieceBuffer data;
+    bool valid{false};
+};
+
+/**
+Verifies completed pieces on a pool of worker threads, so that hashing large pieces does not hold
+up the BitTorrentManager. Results are queued for the consumer of the result end point, which is
+woken up through its Notifier like for any other queue.
+
+Pieces that were not hashed at all as they arrived are taken by a worker in batches, which are
+hashed with the batched SHA1 kernels. Without workers a piece is hashed on the thread that pushes
+it, the result is queued all the same.
+*/
+class HashService
+{
+  public:
+    static constexpr uint32_t RESULT_QUEUE_SIZE = 256;
+    // Max number of unhashed pieces that a worker takes at once
+    static constexpr size_t MAX_BATCH = 8;
+    using ResultQueue = common::MpscQueue<RESULT_QUEUE_SIZE, HashResult>;
+    using ResultEndPoint = common::PopEndPoint<ResultQueue>;
+
+    explicit HashService(uint32_t numWorkers = defaultWorkers());
+    HashService(const HashService &) = delete;
+    HashService &operator=(const HashService &) = delete;
+    ~HashService();
+
+    void push(HashRequest &&request);
+    // Waits for the pieces that are being hashed, pieces that were not started are dropped
+    void stop();
+
+    ResultEndPoint getResultEndPoint();
+    // Pieces that were pushed and have not been hashed yet
+    size_t getPending() const;
+
+    // Half the cores, but no more than four
+    static uint32_t defaultWorkers();
+    static HashResult verify(HashRequest &&request);
+    // Pieces that were not hashed yet are digested as one batch
+    static void verifyBatch(std::vector<HashRequest> &batch, std::vector<HashResult> &results);
+
+  private:
+    void work();
+    // Next job, followed by the unhashed jobs behind it if it is unhashed itself
+    void takeBatch(std::vector<HashRequest> &batch);
+
+    mutable std::mutex mMutex;
+    std::condition_variable mCv;
+    std::deque<HashRequest> mJobs;
+    bool mStopped{false};
+
+    ResultQueue mResults;
+    std::vector<std::thread> mWorkers;
+};
+
+} // namespace fractals::network::p2p
@@ -20,6 +20,19 @@ struct ConnectionEstablished
 
 std::ostream &operator<<(std::ostream &os, const ConnectionEstablished &e);
 
+// Peer connected to our listener. Its torrent is not known until it sends a handshake.
+struct IncomingConnection
+{
+    http::PeerId peer;
+
+    bool operator==(const IncomingConnection &obj) const
+    {
+        return peer == obj.peer;
+    }
+};
+
+std::ostream &operator<<(std::ostream &os, const IncomingConnection &e);
+
 struct Message
 {
     http::PeerId peer;
@@ -56,7 +69,8 @@ struct Shutdown
 std::ostream &operator<<(std::ostream &os, const Shutdown &e);
 
 
-using PeerEvent = std::variant<ConnectionEstablished, Message, ConnectionDisconnected, Shutdown>;
+using PeerEvent = std::variant<ConnectionEstablished, IncomingConnection, Message,
+                               ConnectionDisconnected, Shutdown>;
 
 std::ostream &operator<<(std::ostream &os, const PeerEvent &pe);
 } // namespace fractals::network::p2p
\ No newline at end of file
@@ -2,8 +2,10 @@
 
 #include "EpollService.h"
 #include <fractals/common/TcpService.h>
+#include <fractals/common/TimerWheel.h>
 #include <fractals/common/utils.h>
 #include <fractals/network/http/Peer.h>
+#include <fractals/network/p2p/BandwidthShaper.h>
 #include <fractals/network/p2p/BitTorrentEncoder.h>
 #include <fractals/network/p2p/BitTorrentMsg.h>
 #include <fractals/network/p2p/BufferedQueueManager.h>
@@ -11,8 +13,10 @@
 #include <fractals/network/p2p/EpollServiceEvent.h>
 #include <fractals/network/p2p/PeerEvent.h>
 #include <fractals/network/p2p/PeerFd.h>
+#include <algorithm>
 #include <arpa/inet.h>
 #include <asm-generic/errno.h>
+#include <cassert>
 #include <chrono>
 #include <condition_variable>
 #include <fcntl.h>
@@ -21,6 +25,7 @@
 #include <ratio>
 #include <string>
 #include <variant>
+#include <vector>
 
 namespace fractals::network::p2p
 {
@@ -28,28 +33,75 @@ namespace fractals::network::p2p
 template <typename EpollService, typename TcpService> class PeerServiceImpl
 {
   public:
+    // Peer is disconnected when no messages were exchanged for this long
+    static constexpr std::chrono::seconds INACTIVITY_TIMEOUT{10};
+    // KeepAlive is sent when nothing was written to the peer for this long
+    static constexpr std::chrono::seconds KEEP_ALIVE_INTERVAL{90};
+    static constexpr std::chrono::milliseconds TIMER_TICK{100};
+
+    // A single EpollService reactor and the queue to communicate with it
+    struct Shard
+    {
+        EpollMsgQueue::LeftEndPoint queue;
+        EpollService &epollService;
+    };
+
     PeerServiceImpl(EpollMsgQueue::LeftEndPoint queue, EpollService &epollService,
                     TcpService &tcpService)
-        : queue(queue), epollService(epollService), tcpService(tcpService)
+        : PeerServiceImpl(std::vector<Shard>{Shard{queue, epollService}}, tcpService)
     {
     }
 
-    EpollMsgQueue::LeftEndPoint getQueueEndPoint()
+    PeerServiceImpl(std::vector<Shard> shards, TcpService &tcpService)
+        : shards(std::move(shards)), shardLoad(this->shards.size(), 0),
+          notifyPending(this->shards.size(), false), tcpService(tcpService),
+          timers(TIMER_TICK, std::chrono::system_clock::now().time_since_epoch())
     {
-        return queue;
+        assert(!this->shards.empty());
     }
 
-    bool connect(http::PeerId peer, std::chrono::nanoseconds time)
+    template <typename EpollServicePool>
+    PeerServiceImpl(EpollServicePool &pool, TcpService &tcpService)
+        : PeerServiceImpl(shardsOf(pool), tcpService)
+    {
+        shaper = &pool.getShaper();
+    }
+
+    // Null if bandwidth is not shaped
+    BandwidthShaper *getShaper()
     {
-        if (!epollService.isActive())
+        return shaper;
+    }
+
+    std::vector<EpollMsgQueue::LeftEndPoint> getQueueEndPoints()
+    {
+        std::vector<EpollMsgQueue::LeftEndPoint> endPoints;
+        for (auto &shard : shards)
         {
-            spdlog::error("PeerService::connect. EpollService not ready");
-            return false;
+            endPoints.push_back(shard.queue);
         }
 
+        return endPoints;
+    }
+
+    bool connect(http::PeerId peer, std::chrono::nanoseconds time)
+    {
+        releaseShard(peer);
+        disarmTimer(peer);
         peerFds.erase(peer);
         handShaked.erase(peer);
 
+        // Least loaded reactor takes on the new connection
+        const size_t shardIndex =
+            std::min_element(shardLoad.begin(), shardLoad.end()) - shardLoad.begin();
+        auto &shard = shards[shardIndex];
+
+        if (!shard.epollService.isActive())
+        {
+            spdlog::error("PeerService::connect. EpollService not ready");
+            return false;
+        }
+
         int32_t fd = tcpService.connect(peer.ip, peer.port);
 
         if (fd < 0)
@@ -60,21 +112,39 @@ template <typename EpollService, typename TcpService> class PeerServiceImpl
         spdlog::info("PeerService::connect to peer={}", peer.toString());
         const PeerFd peerFd{peer, fd};
         peerFds.emplace(peer, peerFd);
-        timestamps.emplace(peer, time);
-        queue.push(Subscribe{peerFd});
-        epollService.notify();
+        peerShards.emplace(peer, shardIndex);
+        ++shardLoad[shardIndex];
+        timestamps[peer] = time;
+        lastWrites[peer] = time;
+        armTimer(peer, time);
+        shard.queue.push(Subscribe{peerFd});
+        notifyShard(shardIndex);
 
         return true;
     }
 
-    bool write(http::PeerId peer, BitTorrentMessage &&msg, std::chrono::nanoseconds time)
+    // Every reactor accepts connections on its own socket bound to the same port
+    bool listen(uint16_t port)
     {
-        if (!epollService.isActive())
+        for (auto &shard : shards)
         {
-            spdlog::error("PeerService::write. EpollService not ready");
-            return false;
+            int32_t fd = tcpService.listen(port);
+
+            if (fd < 0)
+            {
+                return false;
+            }
+
+            shard.queue.push(Listen{PeerFd{http::PeerId{"0.0.0.0", port}, fd}});
+            shard.epollService.notify();
         }
 
+        spdlog::info("PeerService::listen. Listening on port={}", port);
+        return true;
+    }
+
+    bool write(http::PeerId peer, BitTorrentMessage &&msg, std::chrono::nanoseconds time)
+    {
         const auto it = peerFds.find(peer);
         if (it == peerFds.end())
         {
@@ -82,22 +152,174 @@ template <typename EpollService, typename TcpService> class PeerServiceImpl
             return false;
         }
 
-        queue.push(WriteEvent{it->second, std::move(encoder.encode(msg))});
+        const auto shardIndex = peerShards.at(peer);
+        auto &shard = shards[shardIndex];
+        if (!shard.epollService.isActive())
+        {
+            spdlog::error("PeerService::write. EpollService not ready");
+            return false;
+        }
+
+        shard.queue.push(WriteEvent{it->second, std::move(encoder.encode(msg))});
 
-        epollService.notify();
+        notifyShard(shardIndex);
 
         timestamps[peer] = time;
+        lastWrites[peer] = time;
 
         return true;
     }
 
     std::optional<PeerEvent> read(std::chrono::nanoseconds time)
     {
-        if (!epollService.isActive())
+        // Round robin over the reactors so that a busy one does not starve the others
+        Shard *shard{nullptr};
+        for (size_t i = 0; i < shards.size(); ++i)
+        {
+            auto &candidate = shards[(nextReadShard + i) % shards.size()];
+            if (candidate.epollService.isActive() && candidate.queue.canPop())
+            {
+                shard = &candidate;
+                nextReadShard = (nextReadShard + i + 1) % shards.size();
+                break;
+            }
+        }
+
+        if (!shard)
         {
             return std::nullopt;
         }
 
+        return handleResponse(*shard, shard->queue.pop(), time);
+    }
+
+    // Drain up to maxEvents responses of the reactors in one go. Returns the number of events
+    // appended.
+    size_t readMany(std::chrono::nanoseconds time, std::vector<PeerEvent> &events,
+                    size_t maxEvents)
+    {
+        const auto before = events.size();
+        size_t popped{0};
+        bool drained{false};
+        while (popped < maxEvents && !drained)
+        {
+            // Take a turn on every reactor so that a busy one does not starve the others
+            drained = true;
+            for (size_t i = 0; i < shards.size() && popped < maxEvents; ++i)
+            {
+                auto &shard = shards[(nextReadShard + i) % shards.size()];
+                if (!shard.epollService.isActive() || !shard.queue.canPop())
+                {
+                    continue;
+                }
+
+                drained = false;
+                ++popped;
+                if (auto event = handleResponse(shard, shard.queue.pop(), time))
+                {
+                    events.push_back(std::move(*event));
+                }
+            }
+        }
+
+        nextReadShard = (nextReadShard + 1) % shards.size();
+        return events.size() - before;
+    }
+
+    // Notifications of the reactors are held back until endBatch, so that all messages written
+    // while handling a batch of events are picked up with a single wakeup per reactor
+    void beginBatch()
+    {
+        batching = true;
+    }
+
+    void endBatch()
+    {
+        batching = false;
+        for (size_t i = 0; i < shards.size(); ++i)
+        {
+            if (notifyPending[i])
+            {
+                notifyPending[i] = false;
+                shards[i].epollService.notify();
+            }
+        }
+    }
+
+    void shutdown()
+    {
+        for (auto &shard : shards)
+        {
+            shard.queue.push(Deactivate{});
+            shard.epollService.notify();
+        }
+    }
+
+    // Epoll tells us client is disconnected
+    void onClientDisconnect(http::PeerId peer)
+    {
+        if (peerFds.count(peer))
+        {
+            releaseShard(peer);
+            disarmTimer(peer);
+            peerFds.erase(peer);
+            handShaked.erase(peer);
+            timestamps.erase(peer);
+            lastWrites.erase(peer);
+        }
+    }
+
+    // We tell epoll to disconnect client
+    void disconnectClient(http::PeerId peer)
+    {
+        if (peerFds.count(peer))
+        {
+            const auto shardIndex = peerShards.at(peer);
+            shards[shardIndex].queue.push(UnSubscribe{peerFds[peer]});
+            notifyShard(shardIndex);
+        }
+    }
+
+    bool canRead()
+    {
+        return std::any_of(shards.begin(), shards.end(),
+                           [](auto &shard)
+                           {
+                               return shard.queue.numToRead() && shard.epollService.isActive();
+                           });
+    }
+
+    // Only visits the peers whose timer expired
+    [[nodiscard]] std::vector<p2p::ConnectionDisconnected>
+    activityCheck(std::chrono::nanoseconds now)
+    {
+        std::vector<http::PeerId> expired;
+        timers.advance(now,
+                       [&](http::PeerId peer)
+                       {
+                           expired.push_back(peer);
+                       });
+
+        std::vector<p2p::ConnectionDisconnected> discs;
+        for (const auto &peer : expired)
+        {
+            peerTimers.erase(peer);
+            checkActivity(peer, now);
+        }
+
+        return discs;
+    }
+
+    // Time of the next peer timer, if any
+    std::optional<std::chrono::nanoseconds> nextTimeout() const
+    {
+        return timers.nextExpiry();
+    }
+
+  private:
+    std::optional<PeerEvent> handleResponse(Shard &shard, EpollServiceResponse &&response,
+                                            std::chrono::nanoseconds time)
+    {
         return std::visit(
             common::overloaded{
                 [&](EpollError &&event) -> std::optional<PeerEvent>
@@ -115,14 +337,16 @@ template <typename EpollService, typename TcpService> class PeerServiceImpl
                 },
                 [&](ReadEvent &&event) -> std::optional<PeerEvent>
                 {
+                    // Hand the buffer space back to the EpollService once decoded
+                    const ReadLease message = std::move(event.mMessage);
+
                     auto checkParseError = [&](const auto &decoded) -> std::optional<PeerEvent>
                     {
                         if (std::holds_alternative<SerializeError>(decoded))
                         {
                             static constexpr size_t MAX_SIZE{150};
-                            int cappedSize = std::min(MAX_SIZE, event.mMessage.size());
-                            std::string_view vw(event.mMessage.begin(),
-                                                   event.mMessage.begin() + cappedSize);
+                            int cappedSize = std::min(MAX_SIZE, message.size());
+                            std::string_view vw(message.begin(), message.begin() + cappedSize);
 
                             const auto serError = std::get<SerializeError>(decoded);
                             spdlog::error("PeerService::ReadEvent. Serialization error. Peer={} "
@@ -141,12 +365,12 @@ template <typename EpollService, typename TcpService> class PeerServiceImpl
 
                     if (handShaked.contains(event.peer.getId()))
                     {
-                        return checkParseError(encoder.decode(event.mMessage));
+                        return checkParseError(encoder.decode(message));
                     }
                     else
                     {
                         handShaked.emplace(event.peer.getId());
-                        return checkParseError(encoder.decodeHandShake(event.mMessage));
+                        return checkParseError(encoder.decodeHandShake(message));
                     }
                 },
                 [&](ConnectionAccepted &&event) -> std::optional<PeerEvent>
@@ -155,6 +379,31 @@ template <typename EpollService, typename TcpService> class PeerServiceImpl
                     timestamps[event.peer.getId()] = time;
                     return ConnectionEstablished{event.peer.getId()};
                 },
+                [&](PeerAccepted &&event) -> std::optional<PeerEvent>
+                {
+                    const auto peer = event.peer.getId();
+                    const size_t shardIndex = &shard - shards.data();
+                    // Same address as a connection we still track, which must be stale by now.
+                    // Connections are identified by address so both are dropped.
+                    if (peerFds.contains(peer))
+                    {
+                        spdlog::warn("PeerService::PeerAccepted. Already connected to peer={}",
+                                     peer.toString());
+                        disconnectClient(peer);
+                        shard.queue.push(UnSubscribe{event.peer});
+                        notifyShard(shardIndex);
+                        return std::nullopt;
+                    }
+
+                    spdlog::info("PeerService::PeerAccepted. peer={}", peer.toString());
+                    peerFds.emplace(peer, event.peer);
+                    peerShards.emplace(peer, shardIndex);
+                    ++shardLoad[shardIndex];
+                    timestamps[peer] = time;
+                    lastWrites[peer] = time;
+                    armTimer(peer, time);
+                    return IncomingConnection{peer};
+                },
                 [&](WriteEventResponse &&event) -> std::optional<PeerEvent>
                 {
                     if (event.errorMsg.empty())
@@ -199,73 +448,108 @@ template <typename EpollService, typename TcpService> class PeerServiceImpl
                     onClientDisconnect(event.peerId);
                     return ConnectionDisconnected{event.peerId};
                 },
-            } // namespace fractals::network::p2p
-            ,
-            std::move(queue.pop()));
+            },
+            std::move(response));
     }
 
-    void shutdown()
+    void notifyShard(size_t shardIndex)
     {
-        queue.push(Deactivate{});
-        epollService.notify();
+        if (batching)
+        {
+            notifyPending[shardIndex] = true;
+        }
+        else
+        {
+            shards[shardIndex].epollService.notify();
+        }
     }
 
-    // Epoll tells us client is disconnected
-    void onClientDisconnect(http::PeerId peer)
+    void checkActivity(http::PeerId peer, std::chrono::nanoseconds now)
     {
-        if (peerFds.count(peer))
+        const auto it = timestamps.find(peer);
+        if (it == timestamps.end())
         {
-            peerFds.erase(peer);
-            handShaked.erase(peer);
-            timestamps.erase(peer);
+            return;
+        }
+
+        if (it->second + INACTIVITY_TIMEOUT <= now)
+        {
+            spdlog::info("PeerService::activityCheck. No activity with peer {}", peer.toString());
+            disconnectClient(peer);
+            timestamps.erase(it);
+            return;
+        }
+
+        // Not counted as activity, otherwise a silent peer would never time out
+        auto &lastWrite = lastWrites[peer];
+        if (lastWrite + KEEP_ALIVE_INTERVAL <= now)
+        {
+            const auto shardIndex = peerShards.at(peer);
+            shards[shardIndex].queue.push(WriteEvent{peerFds.at(peer), encoder.encode(KeepAlive{})});
+            notifyShard(shardIndex);
+            lastWrite = now;
         }
+
+        armTimer(peer, now);
     }
 
-    // We tell epoll to disconnect client
-    void disconnectClient(http::PeerId peer)
+    // Single timer per peer for whichever of inactivity or keep alive is due first.
+    // Activity only updates the timestamps, the timer re-evaluates them when it fires.
+    void armTimer(http::PeerId peer, std::chrono::nanoseconds now)
     {
-        if (peerFds.count(peer))
+        const auto deadline =
+            std::min(timestamps[peer] + INACTIVITY_TIMEOUT, lastWrites[peer] + KEEP_ALIVE_INTERVAL);
+        peerTimers[peer] = timers.schedule(std::max(deadline, now), peer);
+    }
+
+    void disarmTimer(http::PeerId peer)
+    {
+        const auto it = peerTimers.find(peer);
+        if (it != peerTimers.end())
         {
-            queue.push(UnSubscribe{peerFds[peer]});
-            epollService.notify();
+            timers.cancel(it->second);
+            peerTimers.erase(it);
         }
     }
 
-    bool canRead()
+    template <typename EpollServicePool> static std::vector<Shard> shardsOf(EpollServicePool &pool)
     {
-        return queue.numToRead() && epollService.isActive();
+        std::vector<Shard> shards;
+        for (size_t i = 0; i < pool.size(); ++i)
+        {
+            shards.push_back(Shard{pool.getQueueEndPoint(i), pool.getService(i)});
+        }
+
+        return shards;
     }
 
-    [[nodiscard]] std::vector<p2p::ConnectionDisconnected>
-    activityCheck(std::chrono::nanoseconds now)
+    void releaseShard(http::PeerId peer)
     {
-        std::vector<p2p::ConnectionDisconnected> discs;
-        auto it = timestamps.begin();
-        while (it != timestamps.end())
+        const auto it = peerShards.find(peer);
+        if (it != peerShards.end())
         {
-            const auto current = it;
-            ++it;
-            if (current->second + std::chrono::seconds(10) < now)
-            {
-                spdlog::info("PeerService::activityCheck. No activity with peer {}",
-                             current->first.toString());
-                disconnectClient(current->first);
-                timestamps.erase(current);
-            }
+            --shardLoad[it->second];
+            peerShards.erase(it);
         }
-
-        return discs;
     }
 
-  private:
-    EpollMsgQueue::LeftEndPoint queue;
-    EpollService &epollService;
+    std::vector<Shard> shards;
+    std::vector<uint32_t> shardLoad;
+    size_t nextReadShard{0};
+    // Reactors to notify at the end of the current batch
+    std::vector<bool> notifyPending;
+    bool batching{false};
+    BandwidthShaper *shaper{nullptr};
 
     BitTorrentEncoder encoder;
     TcpService &tcpService;
 
     std::unordered_map<http::PeerId, PeerFd> peerFds;
+    std::unordered_map<http::PeerId, size_t> peerShards;
     std::unordered_map<http::PeerId, std::chrono::nanoseconds> timestamps;
+    std::unordered_map<http::PeerId, std::chrono::nanoseconds> lastWrites;
+    common::TimerWheel<http::PeerId> timers;
+    std::unordered_map<http::PeerId, common::TimerWheel<http::PeerId>::TimerId> peerTimers;
     std::unordered_set<http::PeerId> handShaked;
 };
 
@@ -3,6 +3,7 @@
 #include <fractals/common/Tagged.h>
 #include <fractals/network/http/Announce.h>
 #include <fractals/network/http/Peer.h>
+#include <chrono>
 #include <cstdint>
 
 namespace fractals::network::p2p
@@ -12,6 +13,7 @@ enum class PeerCommandFlag
     TRY_CONNECT,
     DISCONNECT,
     DO_ANNOUNCE,
+    RECONNECT_LATER,
     NOTHING,
 };
 
@@ -20,6 +22,8 @@ struct PeerCommand
     PeerCommandFlag command{PeerCommandFlag::NOTHING};
     http::PeerId peer;
     common::InfoHash torrent;
+    // Only set for RECONNECT_LATER
+    std::chrono::milliseconds delay{0};
 };
 
 class PeersInfo
@@ -61,6 +65,10 @@ class PeerTracker
         http::PeerId peer;
         common::InfoHash torrent;
         bool hasConnectedBefore{false};
+        bool inbound{false};
+        // Waiting for the reconnect delay to pass
+        bool backingOff{false};
+        uint8_t failures{0};
     };
 
   public:
@@ -68,7 +76,11 @@ class PeerTracker
     std::vector<PeerCommand> deactivateTorrent(const common::InfoHash &ih);
     [[nodiscard]] std::vector<PeerCommand> onPeerDisconnect(const http::PeerId &peer);
     [[nodiscard]] std::vector<PeerCommand> onPeerConnect(const http::PeerId &peer);
+    // Returns false if the peer can not be accepted for the torrent
+    [[nodiscard]] bool onInboundPeer(const http::PeerId &peer, const common::InfoHash &torrent);
     [[nodiscard]] std::vector<PeerCommand> onAnnounce(const http::Announce &announce);
+    // Reconnect delay of a disconnected peer has passed
+    [[nodiscard]] std::vector<PeerCommand> onReconnectDue(const http::PeerId &peer);
 
     uint16_t getKnownPeerCount(const common::InfoHash&) const;
     uint16_t getConnectedPeerCount(const common::InfoHash&) const;
@@ -80,10 +92,14 @@ class PeerTracker
     Peer *findNotConnectedPeer(const common::InfoHash &torrent);
     Peer *findConnectingPeer(const common::InfoHash &torrent);
     PeerCommand requestAnnounce(const common::InfoHash &torrent);
+    std::chrono::milliseconds reconnectDelay(uint8_t failures) const;
 
     uint16_t maxConnectedPeers{200};
     uint16_t currConnectedPeers{0};
     uint16_t maxPeersPerTorrent{20};
+    uint8_t maxReconnects{5};
+    std::chrono::milliseconds minReconnectDelay{std::chrono::seconds(5)};
+    std::chrono::milliseconds maxReconnectDelay{std::chrono::minutes(5)};
 
     State state{State::NotActive};
     std::unordered_map<http::PeerId, Peer> peerMap;
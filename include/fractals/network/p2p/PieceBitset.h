@@ -0,0 +1,99 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fractals::network::p2p
+{
+
+/**
+Set of piece indices packed into 64 bit words, one bit per piece of the torrent.
+
+The bulk operations work on whole words and use AVX2 or NEON when the compiler targets them,
+e.g. with FRACTALS_NATIVE_ARCH. Operations on two sets of different sizes only look at the
+pieces that both sets can hold.
+*/
+class PieceBitset
+{
+  public:
+    static constexpr uint32_t NPOS = UINT32_MAX;
+
+    PieceBitset() = default;
+    explicit PieceBitset(uint32_t numPieces);
+    PieceBitset(uint32_t numPieces, std::initializer_list<uint32_t> pieces);
+
+    // Bitfield message payload, the high bit of the first byte is piece 0. Spare bits and
+    // bytes past numPieces are ignored.
+    static PieceBitset fromBitfield(uint32_t numPieces, std::string_view bytes);
+    std::string toBitfield() const;
+
+    uint32_t size() const;
+    // Keeps the pieces below the new size
+    void resize(uint32_t numPieces);
+
+    bool test(uint32_t piece) const;
+    // Returns false if the piece was already set or is out of range
+    bool set(uint32_t piece);
+    // Returns false if the piece was not set
+    bool reset(uint32_t piece);
+    void clear();
+
+    uint32_t count() const;
+    bool none() const;
+    // Number of pieces in both sets
+    uint32_t countAnd(const PieceBitset &other) const;
+    bool intersects(const PieceBitset &other) const;
+
+    PieceBitset &operator&=(const PieceBitset &other);
+    PieceBitset &operator|=(const PieceBitset &other);
+    // Removes the pieces of the other set
+    PieceBitset &andNot(const PieceBitset &other);
+
+    // First piece from the given one onwards, NPOS if there is none
+    uint32_t findFirst(uint32_t from = 0) const;
+    // First piece from the given one onwards that is also in the other set
+    uint32_t findFirstAnd(const PieceBitset &other, uint32_t from = 0) const;
+
+    // Calls fn(piece) for every piece in the set, in increasing order
+    template <typename Fn> void forEach(Fn &&fn) const
+    {
+        for (size_t w = 0; w < mWords.size(); ++w)
+        {
+            forEachBit(mWords[w], w, fn);
+        }
+    }
+
+    // Calls fn(piece) for every piece in both sets
+    template <typename Fn> void forEachAnd(const PieceBitset &other, Fn &&fn) const
+    {
+        const auto numWords = std::min(mWords.size(), other.mWords.size());
+        for (size_t w = 0; w < numWords; ++w)
+        {
+            forEachBit(mWords[w] & other.mWords[w], w, fn);
+        }
+    }
+
+    bool operator==(const PieceBitset &other) const = default;
+
+  private:
+    template <typename Fn> static void forEachBit(uint64_t word, size_t w, Fn &fn)
+    {
+        while (word)
+        {
+            fn(static_cast<uint32_t>(w * 64 + std::countr_zero(word)));
+            word &= word - 1;
+        }
+    }
+
+    void trimTail();
+
+    std::vector<uint64_t> mWords;
+    uint32_t mSize{0};
+};
+
+} // namespace fractals::network::p2p
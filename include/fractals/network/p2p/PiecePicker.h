@@ -0,0 +1,107 @@
+#pragma once
+
+#include <fractals/network/p2p/PieceBitset.h>
+
+#include <cstdint>
+#include <optional>
+#include <random>
+#include <vector>
+
+namespace fractals::network::p2p
+{
+
+/**
+Keeps the pieces that we still want ordered by availability, the number of connected peers
+that have the piece. Every availability has a bucket, a PieceBitset of the wanted pieces with
+that availability. Changing the availability of a piece moves its bit to the next bucket and
+removing a wanted piece clears its bit, so updates are O(1).
+
+Picks intersect the buckets with the pieces of the peer word by word, from the rarest bucket
+onwards, and only call accept for pieces that the peer has. Within a bucket pieces are picked
+in index order.
+*/
+class PiecePicker
+{
+  public:
+    PiecePicker() = default;
+
+    // Starts out wanting every piece, without any peer having them
+    void resize(uint32_t numPieces);
+
+    void addAvailability(uint32_t piece);
+    void removeAvailability(uint32_t piece);
+    uint32_t getAvailability(uint32_t piece) const;
+
+    bool isWanted(uint32_t piece) const;
+    // Stops picking the piece, e.g. once it is completed
+    void remove(uint32_t piece);
+
+    // Rarest wanted piece that the peer has and for which accept(piece) holds
+    template <typename Accept>
+    std::optional<uint32_t> pickRarest(const PieceBitset &peerPieces, Accept &&accept) const
+    {
+        for (size_t availability = 1; availability < mBuckets.size(); ++availability)
+        {
+            if (mBucketSize[availability] == 0)
+            {
+                continue;
+            }
+
+            const auto &bucket = mBuckets[availability];
+            for (auto piece = bucket.findFirstAnd(peerPieces); piece != PieceBitset::NPOS;
+                 piece = bucket.findFirstAnd(peerPieces, piece + 1))
+            {
+                if (accept(piece))
+                {
+                    return piece;
+                }
+            }
+        }
+
+        return std::nullopt;
+    }
+
+    // Random wanted piece that the peer has and for which accept(piece) holds
+    template <typename Accept, typename Rng>
+    std::optional<uint32_t> pickRandom(const PieceBitset &peerPieces, Accept &&accept,
+                                       Rng &rng) const
+    {
+        if (mWanted.size() == 0)
+        {
+            return std::nullopt;
+        }
+
+        // Search onwards from a random piece and wrap around
+        const auto start = std::uniform_int_distribution<uint32_t>{0, mWanted.size() - 1}(rng);
+        for (auto piece = mWanted.findFirstAnd(peerPieces, start); piece != PieceBitset::NPOS;
+             piece = mWanted.findFirstAnd(peerPieces, piece + 1))
+        {
+            if (accept(piece))
+            {
+                return piece;
+            }
+        }
+
+        for (auto piece = mWanted.findFirstAnd(peerPieces); piece < start;
+             piece = mWanted.findFirstAnd(peerPieces, piece + 1))
+        {
+            if (accept(piece))
+            {
+                return piece;
+            }
+        }
+
+        return std::nullopt;
+    }
+
+  private:
+    void move(uint32_t piece, uint32_t from, uint32_t to);
+
+    std::vector<uint32_t> mAvailability;
+    PieceBitset mWanted;
+    // Wanted pieces by availability
+    std::vector<PieceBitset> mBuckets;
+    std::vector<uint32_t> mBucketSize;
+};
+
+} // namespace fractals::network::p2p
@@ -1,30 +1,67 @@
 #pragma once
 
+#include <fractals/common/BufferPool.h>
+#include <fractals/common/Sha1.h>
 #include <fractals/common/Tagged.h>
 #include <fractals/common/encode.h>
 #include <fractals/common/utils.h>
+#include <fractals/network/p2p/HashService.h>
+#include <fractals/network/p2p/PieceBitset.h>
+#include <fractals/network/p2p/PiecePicker.h>
 #include <fractals/persist/Models.h>
 #include <cstdint>
+#include <optional>
+#include <random>
 #include <spdlog/spdlog.h>
 #include <unordered_map>
-#include <unordered_set>
 #include <vector>
 
 namespace fractals::network::p2p
 {
+struct BlockRange
+{
+    uint32_t begin{0};
+    uint32_t length{0};
+
+    bool operator==(const BlockRange &) const = default;
+};
+
+/**
+Download state of a single piece. The piece is split up in blocks of BLOCK_SIZE bytes that may
+arrive in any order and from different peers. Every block is written into the buffer at its
+offset, a bitmap keeps track of the blocks that were received. Blocks that some peer was asked
+for are reserved by that peer, only the owner of a reservation can release it again.
+
+A block that is answered with less data than requested is kept as partially received, the
+remainder can then be requested from its first missing byte.
+
+In endgame a reserved block may also be requested from other peers, the number of those
+duplicate requests is counted per block.
+
+Data that continues the hashed prefix of the piece is added to a running digest right away,
+while it is still in cache. Pieces that arrive in order then only need a finalize once complete.
+*/
 class PieceState
 {
   public:
+    static constexpr uint32_t BLOCK_SIZE = 1 << 14; // 16 KB
+    static constexpr uint32_t NO_OWNER = 0;
+
     PieceState(uint32_t pieceIndex, uint64_t maxSize, uint64_t offset);
 
-    void initialize();
+    // Allocates the buffer, from the pool if there is one, and the bitmaps. No-op if already
+    // allocated, returns false if the pool has no memory left.
+    bool initialize(common::BufferPool *pool = nullptr);
+    bool isInitialized() const;
 
+    // Forgets all data and reservations and releases the buffer
     void clear();
 
     uint64_t getRemainingSize() const;
 
     uint64_t getMaxSize() const;
 
+    // Offset of the first byte that has not been received yet
     uint32_t getNextBeginIndex() const;
 
     uint32_t getPieceIndex() const;
@@ -33,50 +70,196 @@ class PieceState
 
     bool isComplete() const;
 
-    void addBlock(const std::string_view block);
+    uint32_t getNumBlocks() const;
+    bool hasBlock(uint32_t block) const;
+    bool isReserved(uint32_t block) const;
+    uint32_t getOwner(uint32_t block) const;
+    // True if some block is neither received nor reserved
+    bool hasFreeBlocks() const;
+
+    // Reserves the first free block for the owner and returns the part that is still missing
+    std::optional<BlockRange> reserveBlock(uint32_t owner);
+    // Makes the block that contains the offset available again, if the owner reserved it
+    void releaseBlock(uint32_t begin, uint32_t owner);
+
+    // Reserved block of another owner, that was requested from less than maxDuplicates other
+    // peers and for which skip(blockBegin) does not hold. Counts as a duplicate request.
+    template <typename Skip>
+    std::optional<BlockRange> duplicateBlock(uint32_t owner, uint32_t maxDuplicates, Skip &&skip)
+    {
+        for (uint32_t block = 0; block < mOwners.size(); ++block)
+        {
+            if (!mReceived[block] && mOwners[block] != NO_OWNER && mOwners[block] != owner &&
+                mDuplicates[block] < maxDuplicates && !skip(block * BLOCK_SIZE))
+            {
+                ++mDuplicates[block];
+                return missingRange(block);
+            }
+        }
+
+        return std::nullopt;
+    }
+    // Duplicate request for the block that contains the offset was given up on
+    void releaseDuplicate(uint32_t begin);
+    // Number of blocks that were not received yet
+    uint32_t getMissingBlocks() const;
+
+    // Copies the data into the buffer at the offset. Rejects data outside of the piece, data
+    // that was already received and data that does not continue a partially received block.
+    bool addBlock(uint32_t begin, const std::string_view block);
+
+    // Length of the prefix that was added to the running digest
+    uint64_t getHashedBytes() const;
+    const common::Sha1 &getHasher() const;
 
     std::string_view getBuffer();
-    std::vector<char> &&extractData();
+    // Hands the buffer over, e.g. to the disk service which returns it to the pool once written
+    common::PieceBuffer extractData();
 
   private:
-    std::vector<char> mPieceData;
+    uint32_t blockLength(uint32_t block) const;
+    BlockRange missingRange(uint32_t block) const;
+
+    common::PieceBuffer mPieceData;
+    common::Sha1 mHasher;
+    uint64_t mHashedBytes{0};
+    std::vector<bool> mReceived;
+    // Owner of the reservation of each block
+    std::vector<uint32_t> mOwners;
+    std::vector<uint8_t> mDuplicates;
+    // Bytes received of blocks that were only partially answered
+    std::unordered_map<uint32_t, uint32_t> mPartial;
+    uint32_t mNumReceived{0};
+    uint32_t mNumReserved{0};
+    uint64_t mReceivedBytes{0};
     uint32_t mPieceIndex;
     uint64_t mMaxSize{0};
     uint64_t offset;
 };
 
+struct EndgameConfig
+{
+    // Endgame starts once no more than this many blocks are missing, 0 disables it
+    uint32_t blockThreshold{32};
+    // Max number of peers that a block is requested from, on top of the peer that reserved it
+    uint32_t maxDuplicates{2};
+};
+
+struct EndgameStats
+{
+    uint64_t duplicateRequests{0};
+    uint64_t cancels{0};
+    // Bytes received for blocks that were already complete
+    uint64_t wastedBytes{0};
+};
+
+/**
+Download state of all pieces of a torrent. Pieces are picked for a peer in this order:
+- pieces that some peer started on already, so that they are completed and written out soon
+- a random piece, until the first few pieces are completed, so that we quickly have
+  something to offer to other peers
+- the rarest piece among the connected peers, so that pieces do not disappear from the swarm
+
+Complete pieces are verified against their hash before they count as completed. Pieces that
+were not fully hashed as their blocks arrived are finished by the hash service, if there is one.
+
+Near the end of the download the last blocks may sit with slow peers. In endgame the blocks
+that other peers reserved are requested from more peers, the first copy to arrive wins and the
+other requests are cancelled.
+*/
 class PieceStateManager
 {
   public:
+    static constexpr uint32_t RANDOM_FIRST_PIECES = 4;
+
+    enum class Verification
+    {
+        Valid,
+        Invalid,
+        // Hash service has the buffer, the outcome arrives as a HashResult
+        Pending
+    };
+
     PieceStateManager() = default;
 
     void populate(const std::vector<persist::PieceModel>& pieces);
 
     PieceState *getPieceState(uint32_t pieceIndex);
 
-    PieceState *nextAvailablePiece(const std::unordered_set<uint32_t> &peerPieces);
+    // Piece of the peer that still has blocks that nobody was asked for
+    PieceState *nextAvailablePiece(const PieceBitset &peerPieces);
+    // Same query as nextAvailablePiece, without starting the piece
+    bool hasAvailablePiece(const PieceBitset &peerPieces) const;
 
-    bool isCompleted(uint32_t pieceIndex);
-    bool isAllComplete() const;
-    bool isActive() const;
-    void setActive(bool);
-    void makeCompleted(uint32_t pieceIndex);
+    // A connected peer announced that it has the piece, or the peer went away
+    void addAvailability(uint32_t pieceIndex);
+    void removeAvailability(uint32_t pieceIndex);
+    uint32_t getAvailability(uint32_t pieceIndex) const;
+    // Piece buffers are taken from the pool, without one they are allocated on demand
+    void setBufferPool(common::BufferPool *pool);
+    // Last piece that was picked could not be started because the pool ran out of memory
+    bool isWaitingForMemory() const;
+    // Number of completed pieces before switching from random to rarest first
+    void setRandomFirstPieces(uint32_t numPieces);
+    // Unique owner id with which a peer reserves blocks
+    uint32_t registerOwner();
 
-    template <typename Container> bool hashCheck(uint32_t pieceIndex, const Container &pieceData)
+    void setEndgameConfig(const EndgameConfig &config);
+    const EndgameConfig &getEndgameConfig() const;
+    bool isEndgame() const;
+    // Endgame block of the peer's pieces, that the owner did not reserve and for which
+    // skip(piece, blockBegin) does not hold
+    template <typename Skip>
+    std::optional<std::pair<PieceState *, BlockRange>>
+    duplicateBlock(const PieceBitset &peerPieces, uint32_t owner, Skip &&skip)
     {
-        const auto it = mHashes.find(pieceIndex);
-        if (it != mHashes.end())
+        for (auto piece = mInProgress.findFirstAnd(peerPieces); piece != PieceBitset::NPOS;
+             piece = mInProgress.findFirstAnd(peerPieces, piece + 1))
         {
-            const auto sha1 = common::sha1_encode<20>(pieceData);
-            const auto sha1Hex = common::bytesToHex<20>(sha1);
-            const auto storedHex = common::bytesToHex<20>(it->second.underlying);
-            spdlog::info("PSM::hashCheck. Storedhash={} computedHash={}",storedHex, sha1Hex);
-            return common::sha1_encode<20>(pieceData) == it->second;
+            auto it = mAllPieces.find(piece);
+            if (it == mAllPieces.end())
+            {
+                continue;
+            }
+
+            const auto range =
+                it->second.duplicateBlock(owner, mEndgameConfig.maxDuplicates,
+                                          [&](uint32_t begin)
+                                          {
+                                              return skip(piece, begin);
+                                          });
+            if (range)
+            {
+                ++mEndgameStats.duplicateRequests;
+                return std::make_pair(&it->second, *range);
+            }
         }
 
-        spdlog::error("PSM::hashCheck. Could not find hash for piece={}", pieceIndex);
-        return false;
+        return std::nullopt;
     }
+    void countCancel();
+    void countWastedBytes(uint64_t bytes);
+    const EndgameStats &getEndgameStats() const;
+
+    bool isCompleted(uint32_t pieceIndex);
+    bool isAllComplete() const;
+    // Peer has a piece that we still need
+    bool isInteresting(const PieceBitset &peerPieces) const;
+    uint32_t getNumPieces() const;
+    bool isActive() const;
+    void setActive(bool);
+    void makeCompleted(uint32_t pieceIndex);
+    // Piece failed its hash check, it is downloaded again from scratch
+    void discard(uint32_t pieceIndex);
+
+    // Pieces that are not fully hashed on completion are verified off-thread if there is a
+    // service, otherwise the rest of the piece is hashed inline
+    void setHashService(HashService *service);
+    Verification verify(const common::InfoHash &infoHash, PieceState &ps);
+    // Hash service returned the result of the piece
+    void finishVerification(uint32_t pieceIndex);
+    bool isVerifying() const;
+    bool hashCheck(uint32_t pieceIndex, const common::Sha1::Digest &digest) const;
 
     std::unordered_map<uint32_t, PieceState>::iterator begin();
 
@@ -84,9 +267,20 @@ class PieceStateManager
 
     bool active{false};
     std::unordered_map<uint32_t, PieceState> mAllPieces;
-    std::unordered_set<uint32_t> mAvailable;
-    std::unordered_set<uint32_t> mInProgress;
-    std::unordered_set<uint32_t> mCompletedPieces;
+    PieceBitset mAvailable;
+    PieceBitset mInProgress;
+    PieceBitset mCompletedPieces;
+    PieceBitset mVerifying;
     std::unordered_map<uint32_t, common::PieceHash> mHashes;
+
+    PiecePicker mPicker;
+    uint32_t mRandomFirstPieces{RANDOM_FIRST_PIECES};
+    uint32_t mLastOwner{PieceState::NO_OWNER};
+    common::BufferPool *mBufferPool{nullptr};
+    HashService *mHashService{nullptr};
+    bool mWaitingForMemory{false};
+    EndgameConfig mEndgameConfig;
+    EndgameStats mEndgameStats;
+    std::mt19937 mRng{std::random_device{}()};
 };
 } // namespace fractals::network::p2p
\ No newline at end of file
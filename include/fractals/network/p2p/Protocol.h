@@ -6,13 +6,15 @@
 #include <fractals/network/p2p/BitTorrentMsg.h>
 #include <fractals/network/p2p/BufferedQueueManager.h>
 #include <fractals/network/p2p/PeerService.h>
+#include <fractals/network/p2p/PieceBitset.h>
 #include <fractals/network/p2p/PieceStateManager.h>
 #include <fractals/network/p2p/ProtocolState.h>
+#include <fractals/network/p2p/RequestPipeline.h>
 #include <fractals/persist/PersistEventQueue.h>
 
 #include <chrono>
 #include <cstdint>
-#include <unordered_set>
+#include <optional>
 
 namespace fractals::network::p2p
 {
@@ -39,10 +41,28 @@ template <typename PeerServiceT> class Protocol
     ProtocolState onMessage(const Port &hs, std::chrono::nanoseconds now);
 
     const common::InfoHash &getInfoHash() const;
+    // Time since which the peer has not answered any of our block requests
+    std::optional<std::chrono::nanoseconds> getPendingRequestTime() const;
+    // Earliest deadline of the outstanding block requests
+    std::optional<std::chrono::nanoseconds> getNextDeadline() const;
+    // Gives up on the requests of which the deadline passed. Returns the number of requests.
+    size_t expireRequests(std::chrono::nanoseconds now);
+    const RequestPipeline &getPipeline() const;
+    // Returns the blocks of the outstanding requests to the pool, e.g. after a choke
+    void releaseRequests();
+    // Releases the requests and the peer's pieces no longer count towards their availability
+    void onDisconnect();
+    // Requests blocks again, e.g. once memory for new pieces is available
+    void resumeRequests(std::chrono::nanoseconds now);
+    // Cancels the requests for blocks that were received from other peers, e.g. in endgame.
+    // Returns the number of cancelled requests.
+    size_t cancelReceived(std::chrono::nanoseconds now);
 
   private:
     void sendInterested(std::chrono::nanoseconds now);
     ProtocolState requestNextPiece(std::chrono::nanoseconds now);
+    std::optional<BlockRequest> nextBlock();
+    void releaseRequest(const BlockRequest &request);
     PieceState *getNextAvailablePiece();
 
   private:
@@ -50,13 +70,17 @@ template <typename PeerServiceT> class Protocol
     bool mAmInterested{false};
     bool mPeerChoking{true};
     bool mPeerInterested{false};
+    std::optional<std::chrono::nanoseconds> mWaitingSince;
+    RequestPipeline mPipeline;
 
     common::AppId appId;
     http::PeerId peer;
     common::InfoHash infoHash;
-    std::unordered_set<uint32_t> availablePieces;
+    PieceBitset availablePieces;
     PeerServiceT &peerService;
     disk::DiskEventQueue::LeftEndPoint diskQueue;
     PieceStateManager &pieceRepository;
+    // Owner id of the blocks that this peer reserved
+    uint32_t mOwner;
 };
 } // namespace fractals::network::p2p
\ No newline at end of file
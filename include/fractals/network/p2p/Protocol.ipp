@@ -6,7 +6,9 @@
 #include <fractals/network/p2p/PeerService.h>
 #include <fractals/network/p2p/PieceStateManager.h>
 #include <fractals/network/p2p/Protocol.h>
+#include <fractals/network/p2p/RequestPipeline.h>
 #include <boost/mp11/algorithm.hpp>
+#include <algorithm>
 #include <chrono>
 #include <cstdint>
 #include <new>
@@ -19,7 +21,8 @@ Protocol<PeerServiceT>::Protocol(const common::AppId &appId, http::PeerId peer,
                                  disk::DiskEventQueue::LeftEndPoint diskQueue,
                                  PieceStateManager &pieceRepository)
     : appId(appId), peer(peer), infoHash(infoHash), peerService(peerService),
-       diskQueue(diskQueue), pieceRepository(pieceRepository)
+       diskQueue(diskQueue), pieceRepository(pieceRepository),
+       mOwner(pieceRepository.registerOwner())
 {
 }
 
@@ -55,6 +58,8 @@ ProtocolState Protocol<PeerServiceT>::onMessage(const Choke &hs, std::chrono::na
     spdlog::info("Protocol({}, {}). Received Choke", peer.toString(), infoHash);
     spdlog::info("Protocol({}). Received Choke", infoHash);
     mPeerChoking = true;
+    // Peer discards our requests when it chokes us, other peers may download the blocks now
+    releaseRequests();
     return ProtocolState::OPEN;
 }
 
@@ -95,9 +100,14 @@ template <typename PeerServiceT>
 ProtocolState Protocol<PeerServiceT>::onMessage(const Have &hs, std::chrono::nanoseconds now)
 {
     spdlog::info("Protocol({}, {}). Received Have", peer.toString(), infoHash);
+    availablePieces.resize(pieceRepository.getNumPieces());
+    if (availablePieces.set(hs.getPieceIndex()))
+    {
+        pieceRepository.addAvailability(hs.getPieceIndex());
+    }
+
     if (!pieceRepository.isCompleted(hs.getPieceIndex()))
     {
-        availablePieces.emplace(hs.getPieceIndex());
         sendInterested(now);
     }
 
@@ -108,26 +118,24 @@ template <typename PeerServiceT>
 ProtocolState Protocol<PeerServiceT>::onMessage(const Bitfield &hs, std::chrono::nanoseconds now)
 {
     spdlog::info("Protocol({}, {}). Received Bitfield", peer.toString(), infoHash);
-    const auto vb = common::bytesToBitfield(hs.getBitfield().size(), hs.getBitfield());
-    std::stringstream ss;
-    for (auto i : vb)
-    {
-        ss << std::to_string(i);
-    }
-
-    uint32_t pieceIndex = 0;
-    for (bool b : vb)
-    {
-        if (b)
+    auto announced = PieceBitset::fromBitfield(pieceRepository.getNumPieces(), hs.getBitfield());
+    availablePieces.resize(announced.size());
+
+    // Pieces that the peer announced before already count towards their availability
+    auto added = announced;
+    added.andNot(availablePieces);
+    added.forEach(
+        [this](uint32_t piece)
         {
-            availablePieces.emplace(pieceIndex);
-        }
+            pieceRepository.addAvailability(piece);
+        });
+    availablePieces |= announced;
 
-        pieceIndex++;
+    if (pieceRepository.isInteresting(availablePieces))
+    {
+        sendInterested(now);
     }
 
-    sendInterested(now);
-
     return ProtocolState::OPEN;
 }
 
@@ -143,51 +151,68 @@ template <typename PeerServiceT>
 ProtocolState Protocol<PeerServiceT>::onMessage(const Piece &p, std::chrono::nanoseconds now)
 {
     spdlog::info("Protocol({}, {}). Received Piece", peer.toString(), infoHash);
-    PieceState *ps = pieceRepository.getPieceState(p.getPieceIndex());
+    const auto pieceIndex = p.getPieceIndex();
+    const auto begin = p.getPieceBegin();
+    const auto block = p.getBlock();
+
+    // Peer is making progress
+    mWaitingSince = now;
+    const auto request = mPipeline.complete(pieceIndex, begin, block.size(), now);
+
+    PieceState *ps = pieceRepository.getPieceState(pieceIndex);
     if (ps == nullptr)
     {
-        if (pieceRepository.isCompleted(p.getPieceIndex()))
-        {
-            spdlog::info("Protocol::onMessage(piece). Piece already completed {}",
-                         p.getPieceIndex());
-            return ProtocolState::OPEN;
-        }
-
         spdlog::error("Protocol::onMessage(Piece). Unable to find PieceState for {}",
-                      p.getPieceIndex());
+                      pieceIndex);
         return ProtocolState::ERROR;
     }
 
-    // Sanity check that we receive the block of data that we requested
-    if (p.getPieceBegin() == ps->getNextBeginIndex())
+    if (pieceRepository.isCompleted(pieceIndex))
     {
-        ps->addBlock(p.getBlock());
+        // Another peer completed the piece while our requests were outstanding
+        spdlog::info("Protocol::onMessage(piece). Piece already completed {}", pieceIndex);
+        pieceRepository.countWastedBytes(block.size());
+        mPipeline.removePiece(pieceIndex);
+        return requestNextPiece(now);
+    }
 
-        if (ps->isComplete())
-        {
-            // Ensure integrity of data
-            if (pieceRepository.hashCheck(ps->getPieceIndex(), ps->getBuffer()))
-            {
-                // Update local state
-                diskQueue.push(disk::WriteData{infoHash, p.getPieceIndex(),
-                                               std::move(ps->extractData()), ps->getOffset()});
+    const bool added = ps->addBlock(begin, block);
+    if (!added)
+    {
+        spdlog::warn("Protocol::onMessage(Piece). Already received payload for {}", pieceIndex);
+        pieceRepository.countWastedBytes(block.size());
+    }
 
-                // Update in-memory state
-                pieceRepository.makeCompleted(p.getPieceIndex());
-                availablePieces.erase(p.getPieceIndex());
-            }
-            else
-            {
-                spdlog::error("Protocol::onMessage(Piece). HashCheckFail");
-                ps->clear();
-                return ProtocolState::HASH_CHECK_FAIL;
-            }
-        }
+    if (request && !ps->hasBlock(begin / PieceState::BLOCK_SIZE))
+    {
+        // Peer sent less than we asked for, the remainder is requested again
+        releaseRequest(*request);
     }
-    else
+
+    if (added && ps->isComplete())
     {
-        spdlog::warn("Protocol::onMessage(Piece). Already received payload for {}",
-                     p.getPieceIndex());
+        mPipeline.removePiece(pieceIndex);
+
+        // Ensure integrity of data
+        switch (pieceRepository.verify(infoHash, *ps))
+        {
+        case PieceStateManager::Verification::Valid:
+            // Update local state
+            diskQueue.push(
+                disk::WriteData{infoHash, pieceIndex, ps->extractData(), ps->getOffset()});
+
+            // Update in-memory state
+            pieceRepository.makeCompleted(pieceIndex);
+            break;
+        case PieceStateManager::Verification::Invalid:
+            // Blocks may have come from several peers, so none of them is blamed
+            spdlog::error("Protocol::onMessage(Piece). HashCheckFail piece={}", pieceIndex);
+            pieceRepository.discard(pieceIndex);
+            break;
+        case PieceStateManager::Verification::Pending:
+            // BitTorrentManager completes the piece once the hash service is done
+            break;
+        }
     }
 
     return requestNextPiece(now);
@@ -197,7 +222,9 @@ template <typename PeerServiceT>
 ProtocolState Protocol<PeerServiceT>::onMessage(const Cancel &hs, std::chrono::nanoseconds now)
 {
     spdlog::info("Protocol({}, {}). Received Cancel", peer.toString(), infoHash);
-    return ProtocolState::CLOSED;
+    // Peers cancel the duplicate requests of endgame. Nothing is uploaded, so there is nothing
+    // to take back.
+    return ProtocolState::OPEN;
 }
 
 template <typename PeerServiceT>
@@ -221,26 +248,45 @@ void Protocol<PeerServiceT>::sendInterested(std::chrono::nanoseconds now)
 template <typename PeerServiceT>
 ProtocolState Protocol<PeerServiceT>::requestNextPiece(std::chrono::nanoseconds now)
 {
-    const auto nextPiece = getNextAvailablePiece();
-    if (nextPiece != nullptr && pieceRepository.isActive())
+    if (!pieceRepository.isActive())
     {
-        uint32_t standardPacketSize = 1 << 14; // 16 KB
-        uint32_t remainingOfPiece = nextPiece->getRemainingSize();
-        uint32_t requestSize = std::min(standardPacketSize, remainingOfPiece);
+        return ProtocolState::CLOSED;
+    }
 
-        Request request{nextPiece->getPieceIndex(), nextPiece->getNextBeginIndex(), requestSize};
+    // Keep enough requests outstanding to cover the round trip to the peer
+    while (!mPeerChoking && mPipeline.canRequest())
+    {
+        auto block = nextBlock();
+        if (!block)
+        {
+            break;
+        }
 
-        if (!mPeerChoking)
+        spdlog::info("Protocol({}, {}). Send Request piece={} begin={} depth={}",
+                     peer.toString(), infoHash, block->piece, block->begin, mPipeline.getDepth());
+        block->sentAt = now;
+        peerService.write(this->peer, Request{block->piece, block->begin, block->length}, now);
+        mPipeline.add(*block);
+        if (!mWaitingSince)
         {
-            spdlog::info("Protocol({}, {}). Send Piece={}", peer.toString(), infoHash,
-                         nextPiece->getPieceIndex());
-            peerService.write(this->peer, request, now);
+            mWaitingSince = now;
         }
+    }
+
+    if (mPipeline.empty())
+    {
+        mWaitingSince.reset();
+    }
 
+    // Peer is asked for blocks again once the disk service released memory, or once a piece
+    // that is being verified turned out to be corrupt
+    if (!mPipeline.empty() || pieceRepository.hasAvailablePiece(availablePieces) ||
+        pieceRepository.isWaitingForMemory() || pieceRepository.isVerifying())
+    {
         return ProtocolState::OPEN;
     }
 
-    if (!pieceRepository.isAllComplete() || !pieceRepository.isActive())
+    if (!pieceRepository.isAllComplete())
     {
         return ProtocolState::CLOSED;
     }
@@ -250,6 +296,118 @@ ProtocolState Protocol<PeerServiceT>::requestNextPiece(std::chrono::nanoseconds
     }
 }
 
+template <typename PeerServiceT>
+std::optional<BlockRequest> Protocol<PeerServiceT>::nextBlock()
+{
+    // Blocks of a piece may be downloaded from several peers at once
+    if (const auto nextPiece = getNextAvailablePiece())
+    {
+        if (const auto range = nextPiece->reserveBlock(mOwner))
+        {
+            return BlockRequest{nextPiece->getPieceIndex(), range->begin, range->length};
+        }
+    }
+
+    // Endgame, the last blocks are also requested from us when other peers reserved them
+    if (!pieceRepository.isEndgame())
+    {
+        return std::nullopt;
+    }
+
+    const auto duplicate = pieceRepository.duplicateBlock(availablePieces, mOwner,
+                                                          [this](uint32_t piece, uint32_t begin)
+                                                          {
+                                                              return mPipeline.contains(piece,
+                                                                                        begin);
+                                                          });
+    if (!duplicate)
+    {
+        return std::nullopt;
+    }
+
+    const auto &[ps, range] = *duplicate;
+    BlockRequest request{ps->getPieceIndex(), range.begin, range.length};
+    request.duplicate = true;
+    return request;
+}
+
+template <typename PeerServiceT>
+void Protocol<PeerServiceT>::releaseRequest(const BlockRequest &request)
+{
+    if (auto *ps = pieceRepository.getPieceState(request.piece))
+    {
+        if (request.duplicate)
+        {
+            ps->releaseDuplicate(request.begin);
+        }
+        else
+        {
+            ps->releaseBlock(request.begin, mOwner);
+        }
+    }
+}
+
+template <typename PeerServiceT>
+void Protocol<PeerServiceT>::resumeRequests(std::chrono::nanoseconds now)
+{
+    if (mAmInterested && !mPeerChoking)
+    {
+        requestNextPiece(now);
+    }
+}
+
+template <typename PeerServiceT>
+size_t Protocol<PeerServiceT>::cancelReceived(std::chrono::nanoseconds now)
+{
+    const auto cancelled = mPipeline.takeIf(
+        [this](const BlockRequest &request)
+        {
+            if (pieceRepository.isCompleted(request.piece))
+            {
+                return true;
+            }
+
+            const auto *ps = pieceRepository.getPieceState(request.piece);
+            return ps == nullptr || ps->hasBlock(request.begin / PieceState::BLOCK_SIZE);
+        });
+
+    for (const auto &request : cancelled)
+    {
+        spdlog::info("Protocol({}, {}). Send Cancel piece={} begin={}", peer.toString(),
+                     infoHash, request.piece, request.begin);
+        peerService.write(this->peer, Cancel{request.piece, request.begin, request.length}, now);
+        pieceRepository.countCancel();
+    }
+
+    if (mPipeline.empty())
+    {
+        mWaitingSince.reset();
+    }
+
+    return cancelled.size();
+}
+
+template <typename PeerServiceT> void Protocol<PeerServiceT>::onDisconnect()
+{
+    releaseRequests();
+    availablePieces.forEach(
+        [this](uint32_t piece)
+        {
+            pieceRepository.removeAvailability(piece);
+        });
+    availablePieces.clear();
+}
+
+template <typename PeerServiceT> void Protocol<PeerServiceT>::releaseRequests()
+{
+    for (const auto &request : mPipeline.takeAll())
+    {
+        releaseRequest(request);
+    }
+
+    mWaitingSince.reset();
+}
+
 template <typename PeerServiceT> PieceState *Protocol<PeerServiceT>::getNextAvailablePiece()
 {
     return pieceRepository.nextAvailablePiece(availablePieces);
@@ -259,4 +417,37 @@ template <typename PeerServiceT> const common::InfoHash &Protocol<PeerServiceT>:
 {
     return infoHash;
 }
+
+template <typename PeerServiceT>
+std::optional<std::chrono::nanoseconds> Protocol<PeerServiceT>::getPendingRequestTime() const
+{
+    return mWaitingSince;
+}
+
+template <typename PeerServiceT>
+std::optional<std::chrono::nanoseconds> Protocol<PeerServiceT>::getNextDeadline() const
+{
+    return mPipeline.nextDeadline();
+}
+
+template <typename PeerServiceT>
+size_t Protocol<PeerServiceT>::expireRequests(std::chrono::nanoseconds now)
+{
+    const auto expired = mPipeline.expire(now);
+    for (const auto &request : expired)
+    {
+        spdlog::info("Protocol({}, {}). Request piece={} begin={} expired", peer.toString(),
+                     infoHash, request.piece, request.begin);
+        // Block goes to whichever peer asks for work first, a late answer is still accepted
+        releaseRequest(request);
+    }
+
+    return expired.size();
+}
+
+template <typename PeerServiceT>
+const RequestPipeline &Protocol<PeerServiceT>::getPipeline() const
+{
+    return mPipeline;
+}
 } // namespace fractals::network::p2p
\ No newline at end of file
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace fractals::network::p2p
+{
+class ReadRingBuffer;
+
+/**
+Slice of a complete peer message. Either leased from a ReadRingBuffer, in which case the
+ring space is handed back when the lease is destroyed, or owning its own bytes.
+Leases of a single ring must be released in the order they were handed out.
+*/
+class ReadLease
+{
+  public:
+    using value_type = char;
+    using const_iterator = const char *;
+    using iterator = const char *;
+
+    ReadLease() = default;
+    ReadLease(std::vector<char> &&owned);
+    ReadLease(std::shared_ptr<ReadRingBuffer> ring, const char *data, uint32_t size);
+
+    ReadLease(const ReadLease &) = delete;
+    ReadLease &operator=(const ReadLease &) = delete;
+    ReadLease(ReadLease &&other) noexcept;
+    ReadLease &operator=(ReadLease &&other) noexcept;
+    ~ReadLease();
+
+    const char *data() const;
+    const char *begin() const;
+    const char *end() const;
+    size_t size() const;
+    bool empty() const;
+
+    bool operator==(const ReadLease &other) const;
+
+  private:
+    void release();
+
+    std::shared_ptr<ReadRingBuffer> mRing;
+    std::vector<char> mOwned;
+    const char *mData{nullptr};
+    uint32_t mSize{0};
+};
+
+/**
+Fixed capacity receive buffer for a single peer. The backing memory is mapped twice
+back-to-back so that both the free region handed to read() and every message handed out
+as a lease are contiguous, even when they wrap around the end of the ring.
+*/
+class ReadRingBuffer : public std::enable_shared_from_this<ReadRingBuffer>
+{
+  public:
+    static constexpr uint32_t DEFAULT_CAPACITY = 1 << 18; // 256 KB
+
+    // Capacity is rounded up to a multiple of the page size. Returns nullptr on failure.
+    static std::shared_ptr<ReadRingBuffer> create(uint32_t capacity = DEFAULT_CAPACITY);
+
+    ReadRingBuffer(const ReadRingBuffer &) = delete;
+    ReadRingBuffer(ReadRingBuffer &&) = delete;
+    ~ReadRingBuffer();
+
+    // Free region starting at the write cursor. Empty if all space is leased out, or if the
+    // next message can never fit.
+    std::span<char> reserve();
+    void commit(uint32_t bytes);
+
+    // Hands out the next complete message, including its length prefix
+    std::optional<ReadLease> nextMessage();
+    bool hasMessage() const;
+
+    // Ring is full and waits for outstanding leases to be released
+    bool isStalled() const;
+    // Length prefix of the next message exceeds the capacity, it can never fit in the ring
+    bool isOversized() const;
+
+    uint32_t getCapacity() const;
+    uint64_t getUnparsedBytes() const;
+
+    // Invoked from the releasing thread once a stalled ring has space again
+    void setOnRelease(std::function<void()> onRelease);
+
+  private:
+    friend class ReadLease;
+
+    ReadRingBuffer(char *data, uint32_t capacity);
+
+    std::optional<uint64_t> peekMessageLength() const;
+    void release(uint32_t bytes);
+
+    char *mData;
+    uint32_t mCapacity;
+    bool mHandShakeReceived{false};
+    uint64_t mWrite{0};
+    uint64_t mParsed{0};
+    std::atomic<uint64_t> mReleased{0};
+    std::atomic<bool> mStalled{false};
+    std::function<void()> mOnRelease;
+};
+} // namespace fractals::network::p2p
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <fractals/network/p2p/BandwidthShaper.h>
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <vector>
+
+namespace fractals::network::p2p
+{
+
+struct BlockRequest
+{
+    uint32_t piece{0};
+    uint32_t begin{0};
+    uint32_t length{0};
+    std::chrono::nanoseconds sentAt{0};
+    // Request is given up on and its block handed to other peers after this time
+    std::chrono::nanoseconds deadline{0};
+    // Endgame request for a block that another peer reserved
+    bool duplicate{false};
+};
+
+/**
+Block requests that were sent to a peer and not answered yet. The number of requests to keep
+outstanding follows the bandwidth-delay product of the peer: the measured download rate times
+the lowest round trip time seen recently, with some headroom so the depth can grow until the
+peer or the link is saturated.
+
+Until a rate is measured the depth grows by one for every answered request.
+
+Every request gets a deadline from a retransmission timeout in the style of TCP: the smoothed
+round trip time plus four times its variance. Expired requests halve the depth, so a peer that
+slows down holds on to fewer blocks.
+*/
+class RequestPipeline
+{
+  public:
+    static constexpr uint32_t BLOCK_SIZE = 1 << 14; // 16 KB
+    static constexpr uint32_t INITIAL_DEPTH = 4;
+    static constexpr uint32_t MIN_DEPTH = 2;
+    static constexpr uint32_t MAX_DEPTH = 128;
+    // Lowest round trip times older than this are forgotten
+    static constexpr std::chrono::seconds RTT_WINDOW{10};
+    // Request timeout until the round trip time is measured, and its bounds after
+    static constexpr std::chrono::seconds INITIAL_TIMEOUT{3};
+    static constexpr std::chrono::seconds MIN_TIMEOUT{1};
+    static constexpr std::chrono::seconds MAX_TIMEOUT{20};
+
+    bool canRequest() const;
+    bool empty() const;
+    size_t size() const;
+    uint32_t getDepth() const;
+
+    // Sets the deadline of the request and adds it
+    void add(BlockRequest request);
+    // Removes the request answered by a block. Returns nothing if the block was not requested.
+    std::optional<BlockRequest> complete(uint32_t piece, uint32_t begin, uint32_t length,
+                                         std::chrono::nanoseconds now);
+    // Drops the requests for a piece, e.g. after its hash check failed
+    void removePiece(uint32_t piece);
+    // Takes all outstanding requests, e.g. after the peer choked us and discarded them
+    std::deque<BlockRequest> takeAll();
+    // Takes the requests of which the deadline passed
+    std::vector<BlockRequest> expire(std::chrono::nanoseconds now);
+    // Takes the requests for which pred(request) holds
+    template <typename Pred> std::vector<BlockRequest> takeIf(Pred &&pred)
+    {
+        std::vector<BlockRequest> taken;
+        std::erase_if(outstanding,
+                      [&](const BlockRequest &req)
+                      {
+                          if (!pred(req))
+                          {
+                              return false;
+                          }
+
+                          taken.push_back(req);
+                          return true;
+                      });
+
+        return taken;
+    }
+    // True if a request for the block that contains the offset is outstanding
+    bool contains(uint32_t piece, uint32_t begin) const;
+
+    // Time at which the oldest outstanding request was sent
+    std::optional<std::chrono::nanoseconds> oldestSentAt() const;
+    std::optional<std::chrono::nanoseconds> nextDeadline() const;
+    std::optional<std::chrono::nanoseconds> getMinRtt() const;
+    std::chrono::nanoseconds getTimeout() const;
+    uint64_t getRate(std::chrono::nanoseconds now);
+
+  private:
+    void sampleRtt(std::chrono::nanoseconds rtt, std::chrono::nanoseconds now);
+    void updateDepth(std::chrono::nanoseconds now);
+
+    std::deque<BlockRequest> outstanding;
+    uint32_t depth{INITIAL_DEPTH};
+
+    RateMeter meter;
+    std::optional<std::chrono::nanoseconds> minRtt;
+    // Lowest round trip time of the current window, replaces minRtt once the window ends
+    std::optional<std::chrono::nanoseconds> windowMinRtt;
+    std::chrono::nanoseconds windowStart{0};
+
+    std::optional<std::chrono::nanoseconds> smoothedRtt;
+    std::chrono::nanoseconds rttVariance{0};
+};
+
+} // namespace fractals::network::p2p
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <fractals/network/p2p/BufferedQueueManager.h>
+#include <fractals/network/p2p/EpollMsgQueue.h>
+#include <fractals/network/p2p/PeerFd.h>
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <liburing.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace fractals::network::p2p
+{
+
+/**
+io_uring based alternative to EpollService. Consumes the same EpollServiceRequest events and
+produces the same EpollServiceResponse events, so that it can be used as the EpollService of a
+PeerService.
+
+Peers receive through a multishot recv that picks buffers from a provided buffer ring.
+Queued outbound messages are gathered into a single sendmsg, and completions are reaped in
+batches.
+*/
+template <typename Peer, typename BufferedQueueManagerT, typename EpollMsgQueue>
+class UringServiceImpl
+{
+  public:
+    enum class State
+    {
+        Active,
+        Inactive,
+        Deactivating
+    };
+
+    static constexpr uint32_t DEFAULT_QUEUE_DEPTH = 1024;
+    static constexpr uint32_t NUM_BUFFERS = 1024; // must be a power of 2
+    static constexpr uint32_t BUFFER_SIZE = 16384;
+    static constexpr size_t MAX_SEND_IOVECS = 64;
+    static constexpr size_t CQE_BATCH = 256;
+    static constexpr uint16_t BUFFER_GROUP = 0;
+
+    UringServiceImpl(BufferedQueueManagerT &bufMan, typename EpollMsgQueue::RightEndPoint queue,
+                     uint32_t queueDepth = DEFAULT_QUEUE_DEPTH);
+    UringServiceImpl(const UringServiceImpl &) = delete;
+    UringServiceImpl(UringServiceImpl &&) = delete;
+    ~UringServiceImpl();
+
+    void notify();
+
+    bool isSubscribed(const Peer &peer);
+
+    void run();
+
+    State getState() const;
+    bool isActive() const;
+
+  private:
+    enum class Op : uint8_t
+    {
+        Notify,
+        Connect,
+        Recv,
+        Send,
+        Cancel,
+        Accept
+    };
+
+    // Received data that did not fit in the peer's read buffer yet
+    struct PendingRead
+    {
+        uint16_t bufferId;
+        uint32_t offset;
+        uint32_t size;
+    };
+
+    struct Connection
+    {
+        Peer peer;
+        bool connected{false};
+        bool closing{false};
+        bool recvArmed{false};
+        uint32_t sendsInFlight{0};
+        size_t queuedBeforeSend{0};
+        // Referenced by the in flight sendmsg
+        std::array<iovec, MAX_SEND_IOVECS> sendIovs;
+        msghdr sendMsg{};
+        std::deque<PendingRead> pendingReads;
+        // Keeps the data of in flight sends alive after the peer unsubscribed
+        WriteQueue retiredWrites;
+    };
+
+    static uint64_t encode(uint32_t connId, Op op);
+    static uint32_t connIdOf(uint64_t userData);
+    static Op opOf(uint64_t userData);
+
+    io_uring_sqe *getSqe();
+    char *bufferAt(uint16_t bufferId);
+    void recycleBuffer(uint16_t bufferId);
+
+    void subscribe(const Peer &peer);
+    void unsubscribe(const Peer &peer);
+    void listen(const Peer &listener);
+    void closeListeners();
+    State stop();
+
+    void armNotify();
+    void armAccept(uint32_t listenerId);
+    void armConnect(uint32_t connId, Connection &conn);
+    void armRecv(uint32_t connId, Connection &conn);
+    void submitSends(uint32_t connId, Connection &conn);
+
+    void handleCompletion(const io_uring_cqe &cqe);
+    void onAccept(uint32_t listenerId, const io_uring_cqe &cqe);
+    void onConnect(uint32_t connId, Connection &conn, int32_t res);
+    void onRecv(uint32_t connId, Connection &conn, const io_uring_cqe &cqe);
+    void onSend(uint32_t connId, Connection &conn, int32_t res);
+
+    // Move received data into the read buffer. Returns false if it can never be delivered.
+    bool deliverPending(Connection &conn);
+    void resumeStalledReads();
+
+    io_uring ring;
+    io_uring_buf_ring *bufRing{nullptr};
+    std::vector<char> bufferMemory;
+    bool buffersRecycled{false};
+    bool initialized{false};
+
+    int notifyFd;
+    uint64_t notifyValue{0};
+
+    State state{State::Inactive};
+    uint32_t nextConnId{0};
+    std::unordered_map<uint32_t, Connection> connections;
+    std::unordered_map<PeerFd, uint32_t> connIds;
+    std::vector<Peer> listeners;
+    // Connections waiting for the consumer to release read buffer space
+    std::unordered_set<uint32_t> stalledReads;
+    // Connections whose multishot recv ended because no provided buffers were left
+    std::unordered_set<uint32_t> starvedRecvs;
+
+    BufferedQueueManagerT &buffMan;
+    typename EpollMsgQueue::RightEndPoint queue;
+};
+
+using UringService = UringServiceImpl<PeerFd, BufferedQueueManager, EpollMsgQueue>;
+
+} // namespace fractals::network::p2p
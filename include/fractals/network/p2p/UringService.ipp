@@ -0,0 +1,749 @@
+#include <fractals/common/utils.h>
+#include <fractals/network/p2p/BufferedQueueManager.h>
+#include <fractals/network/p2p/EpollMsgQueue.h>
+#include <fractals/network/p2p/EpollServiceEvent.h>
+#include <fractals/network/p2p/PeerFd.h>
+#include <fractals/network/p2p/UringService.h>
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <array>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <liburing.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <spdlog/spdlog.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace fractals::network::p2p
+{
+
+#define TEMPLATE template <typename Peer, typename BufferedQueueManagerT, typename EpollMsgQueue>
+#define PREFIX UringServiceImpl<Peer, BufferedQueueManagerT, EpollMsgQueue>
+
+TEMPLATE
+PREFIX::UringServiceImpl(BufferedQueueManagerT &bufMan,
+                         typename EpollMsgQueue::RightEndPoint queue, uint32_t queueDepth)
+    : bufferMemory(NUM_BUFFERS * BUFFER_SIZE), notifyFd(eventfd(0, EFD_CLOEXEC)), buffMan(bufMan),
+      queue(queue)
+{
+    if (notifyFd < 0)
+    {
+        spdlog::error("UringService. Could not create eventfd: {}", strerror(errno));
+        return;
+    }
+
+    if (const int ret = io_uring_queue_init(queueDepth, &ring, 0); ret < 0)
+    {
+        spdlog::error("UringService. Could not set up io_uring: {}", strerror(-ret));
+        return;
+    }
+
+    int ret{0};
+    bufRing = io_uring_setup_buf_ring(&ring, NUM_BUFFERS, BUFFER_GROUP, 0, &ret);
+    if (!bufRing)
+    {
+        spdlog::error("UringService. Could not register provided buffers: {}", strerror(-ret));
+        io_uring_queue_exit(&ring);
+        return;
+    }
+
+    const int mask = io_uring_buf_ring_mask(NUM_BUFFERS);
+    for (uint16_t bufferId = 0; bufferId < NUM_BUFFERS; ++bufferId)
+    {
+        io_uring_buf_ring_add(bufRing, bufferAt(bufferId), BUFFER_SIZE, bufferId, mask, bufferId);
+    }
+    io_uring_buf_ring_advance(bufRing, NUM_BUFFERS);
+
+    // Consumer released a lease of a stalled read buffer
+    buffMan.onReadSpaceAvailable(
+        [this]()
+        {
+            notify();
+        });
+
+    initialized = true;
+}
+
+TEMPLATE
+PREFIX::~UringServiceImpl()
+{
+    if (initialized)
+    {
+        io_uring_free_buf_ring(&ring, bufRing, NUM_BUFFERS, BUFFER_GROUP);
+        io_uring_queue_exit(&ring);
+    }
+
+    if (notifyFd >= 0)
+    {
+        close(notifyFd);
+    }
+}
+
+TEMPLATE
+uint64_t PREFIX::encode(uint32_t connId, Op op)
+{
+    return (static_cast<uint64_t>(connId) << 8) | static_cast<uint64_t>(op);
+}
+
+TEMPLATE
+uint32_t PREFIX::connIdOf(uint64_t userData)
+{
+    return userData >> 8;
+}
+
+TEMPLATE
+typename PREFIX::Op PREFIX::opOf(uint64_t userData)
+{
+    return static_cast<Op>(userData & 0xff);
+}
+
+TEMPLATE
+io_uring_sqe *PREFIX::getSqe()
+{
+    auto *sqe = io_uring_get_sqe(&ring);
+    if (!sqe)
+    {
+        // Submission queue is full, make room
+        io_uring_submit(&ring);
+        sqe = io_uring_get_sqe(&ring);
+    }
+
+    assert(sqe);
+    return sqe;
+}
+
+TEMPLATE
+char *PREFIX::bufferAt(uint16_t bufferId)
+{
+    return bufferMemory.data() + static_cast<size_t>(bufferId) * BUFFER_SIZE;
+}
+
+TEMPLATE
+void PREFIX::recycleBuffer(uint16_t bufferId)
+{
+    io_uring_buf_ring_add(bufRing, bufferAt(bufferId), BUFFER_SIZE, bufferId,
+                          io_uring_buf_ring_mask(NUM_BUFFERS), 0);
+    io_uring_buf_ring_advance(bufRing, 1);
+    buffersRecycled = true;
+}
+
+TEMPLATE
+void PREFIX::notify()
+{
+    uint64_t one{1};
+    write(notifyFd, &one, sizeof(one));
+}
+
+TEMPLATE
+bool PREFIX::isSubscribed(const Peer &peer)
+{
+    return connIds.contains(peer);
+}
+
+TEMPLATE
+void PREFIX::subscribe(const Peer &peer)
+{
+    if (connIds.contains(peer))
+    {
+        queue.push(CtlResponse{peer, "Peer is already subscribed"});
+        return;
+    }
+
+    const auto connId = nextConnId++;
+    auto &conn = connections.emplace(connId, Connection{peer}).first->second;
+    connIds.emplace(peer, connId);
+
+    queue.push(CtlResponse{peer, ""});
+    armConnect(connId, conn);
+}
+
+TEMPLATE
+void PREFIX::unsubscribe(const Peer &peer)
+{
+    const auto it = connIds.find(peer);
+    if (it != connIds.end())
+    {
+        const auto connId = it->second;
+        auto &conn = connections.at(connId);
+
+        for (const auto &pending : conn.pendingReads)
+        {
+            recycleBuffer(pending.bufferId);
+        }
+        conn.pendingReads.clear();
+
+        if (auto *writeQueue = buffMan.getWriteBuffer(peer))
+        {
+            conn.retiredWrites = std::move(*writeQueue);
+        }
+
+        auto *sqe = getSqe();
+        io_uring_prep_cancel_fd(sqe, peer.getFileDescriptor(), IORING_ASYNC_CANCEL_ALL);
+        io_uring_sqe_set_data64(sqe, encode(connId, Op::Cancel));
+        io_uring_submit(&ring);
+
+        conn.closing = true;
+        if (!conn.recvArmed && conn.sendsInFlight == 0)
+        {
+            connections.erase(connId);
+        }
+
+        connIds.erase(it);
+        stalledReads.erase(connId);
+        starvedRecvs.erase(connId);
+    }
+
+    buffMan.removeFromReadBuffer(peer);
+    buffMan.removeFromWriteBuffer(peer);
+    close(peer.getFileDescriptor());
+    queue.push(CtlResponse{peer, ""});
+}
+
+TEMPLATE
+void PREFIX::listen(const Peer &listener)
+{
+    listeners.push_back(listener);
+    armAccept(listeners.size() - 1);
+    queue.push(CtlResponse{listener, ""});
+}
+
+TEMPLATE
+void PREFIX::closeListeners()
+{
+    for (const auto &listener : listeners)
+    {
+        close(listener.getFileDescriptor());
+    }
+
+    listeners.clear();
+}
+
+TEMPLATE
+void PREFIX::armNotify()
+{
+    auto *sqe = getSqe();
+    io_uring_prep_read(sqe, notifyFd, &notifyValue, sizeof(notifyValue), 0);
+    io_uring_sqe_set_data64(sqe, encode(0, Op::Notify));
+}
+
+TEMPLATE
+void PREFIX::armAccept(uint32_t listenerId)
+{
+    auto *sqe = getSqe();
+    io_uring_prep_multishot_accept(sqe, listeners[listenerId].getFileDescriptor(), nullptr,
+                                   nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    io_uring_sqe_set_data64(sqe, encode(listenerId, Op::Accept));
+}
+
+TEMPLATE
+void PREFIX::armConnect(uint32_t connId, Connection &conn)
+{
+    // Socket was connected non-blocking, it becomes writable once the connection is established
+    auto *sqe = getSqe();
+    io_uring_prep_poll_add(sqe, conn.peer.getFileDescriptor(), POLLOUT);
+    io_uring_sqe_set_data64(sqe, encode(connId, Op::Connect));
+}
+
+TEMPLATE
+void PREFIX::armRecv(uint32_t connId, Connection &conn)
+{
+    auto *sqe = getSqe();
+    io_uring_prep_recv_multishot(sqe, conn.peer.getFileDescriptor(), nullptr, 0, 0);
+    io_uring_sqe_set_flags(sqe, IOSQE_BUFFER_SELECT);
+    sqe->buf_group = BUFFER_GROUP;
+    io_uring_sqe_set_data64(sqe, encode(connId, Op::Recv));
+
+    conn.recvArmed = true;
+}
+
+TEMPLATE
+void PREFIX::submitSends(uint32_t connId, Connection &conn)
+{
+    // Only one send per peer may be in flight, otherwise data can be reordered
+    if (!conn.connected || conn.sendsInFlight > 0)
+    {
+        return;
+    }
+
+    auto *writeQueue = buffMan.getWriteBuffer(conn.peer);
+    if (!writeQueue || writeQueue->isComplete())
+    {
+        return;
+    }
+
+    const auto count = writeQueue->gather(conn.sendIovs, std::numeric_limits<size_t>::max());
+
+    conn.sendMsg = msghdr{};
+    conn.sendMsg.msg_iov = conn.sendIovs.data();
+    conn.sendMsg.msg_iovlen = count;
+
+    auto *sqe = getSqe();
+    io_uring_prep_sendmsg(sqe, conn.peer.getFileDescriptor(), &conn.sendMsg, MSG_NOSIGNAL);
+    io_uring_sqe_set_data64(sqe, encode(connId, Op::Send));
+
+    conn.queuedBeforeSend = writeQueue->size();
+    conn.sendsInFlight = 1;
+}
+
+TEMPLATE
+void PREFIX::handleCompletion(const io_uring_cqe &cqe)
+{
+    const auto userData = io_uring_cqe_get_data64(&cqe);
+    const auto op = opOf(userData);
+
+    if (op == Op::Notify)
+    {
+        armNotify();
+        return;
+    }
+
+    if (op == Op::Cancel)
+    {
+        return;
+    }
+
+    if (op == Op::Accept)
+    {
+        onAccept(connIdOf(userData), cqe);
+        return;
+    }
+
+    const bool hasBuffer = cqe.flags & IORING_CQE_F_BUFFER;
+    const uint16_t bufferId = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+
+    const auto it = connections.find(connIdOf(userData));
+    if (it == connections.end())
+    {
+        if (hasBuffer)
+        {
+            recycleBuffer(bufferId);
+        }
+        return;
+    }
+
+    const auto connId = it->first;
+    auto &conn = it->second;
+
+    // Wait for outstanding operations to finish before the connection is dropped
+    if (conn.closing)
+    {
+        if (hasBuffer)
+        {
+            recycleBuffer(bufferId);
+        }
+
+        if (op == Op::Recv && !(cqe.flags & IORING_CQE_F_MORE))
+        {
+            conn.recvArmed = false;
+        }
+        else if (op == Op::Send)
+        {
+            --conn.sendsInFlight;
+        }
+
+        if (!conn.recvArmed && conn.sendsInFlight == 0)
+        {
+            connections.erase(it);
+        }
+        return;
+    }
+
+    switch (op)
+    {
+    case Op::Connect:
+        onConnect(connId, conn, cqe.res);
+        break;
+    case Op::Recv:
+        onRecv(connId, conn, cqe);
+        break;
+    case Op::Send:
+        onSend(connId, conn, cqe.res);
+        break;
+    case Op::Notify:
+    case Op::Cancel:
+    case Op::Accept:
+        break;
+    }
+}
+
+TEMPLATE
+void PREFIX::onAccept(uint32_t listenerId, const io_uring_cqe &cqe)
+{
+    if (!(cqe.flags & IORING_CQE_F_MORE) && cqe.res != -ECANCELED && listenerId < listeners.size())
+    {
+        armAccept(listenerId);
+    }
+
+    if (cqe.res < 0)
+    {
+        if (cqe.res != -ECANCELED)
+        {
+            spdlog::error("UringService::onAccept. Failed to accept connection: {}",
+                          strerror(-cqe.res));
+        }
+        return;
+    }
+
+    const int fd = cqe.res;
+    sockaddr_in addr{};
+    socklen_t addrLen = sizeof(addr);
+    if (getpeername(fd, reinterpret_cast<sockaddr *>(&addr), &addrLen) < 0)
+    {
+        spdlog::error("UringService::onAccept. Could not get peer address: {}", strerror(errno));
+        close(fd);
+        return;
+    }
+
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+    const Peer peer{http::PeerId{ip, ntohs(addr.sin_port)}, fd};
+    if (connIds.contains(peer))
+    {
+        close(fd);
+        return;
+    }
+
+    const auto connId = nextConnId++;
+    auto &conn = connections.emplace(connId, Connection{peer}).first->second;
+    connIds.emplace(peer, connId);
+    conn.connected = true;
+
+    queue.push(PeerAccepted{peer});
+    armRecv(connId, conn);
+}
+
+TEMPLATE
+void PREFIX::onConnect(uint32_t connId, Connection &conn, int32_t res)
+{
+    if (res < 0 || (res & (POLLERR | POLLHUP)))
+    {
+        spdlog::error("UringService::onConnect. Could not connect to peer={}",
+                      conn.peer.getId().toString());
+        const auto peer = conn.peer;
+        queue.push(ConnectionCloseEvent{peer.getId()});
+        unsubscribe(peer);
+        return;
+    }
+
+    conn.connected = true;
+    queue.push(ConnectionAccepted{conn.peer});
+
+    armRecv(connId, conn);
+    submitSends(connId, conn);
+}
+
+TEMPLATE
+void PREFIX::onRecv(uint32_t connId, Connection &conn, const io_uring_cqe &cqe)
+{
+    if (!(cqe.flags & IORING_CQE_F_MORE))
+    {
+        conn.recvArmed = false;
+    }
+
+    if (cqe.res == -ENOBUFS)
+    {
+        starvedRecvs.emplace(connId);
+        return;
+    }
+
+    if (cqe.res == -ECANCELED)
+    {
+        return;
+    }
+
+    if (cqe.res <= 0)
+    {
+        if (cqe.res < 0)
+        {
+            spdlog::error("UringService::onRecv. Failed to receive from peer={} error={}",
+                          conn.peer.getId().toString(), strerror(-cqe.res));
+        }
+
+        const auto peer = conn.peer;
+        queue.push(ConnectionCloseEvent{peer.getId()});
+        unsubscribe(peer);
+        return;
+    }
+
+    const uint16_t bufferId = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    conn.pendingReads.push_back(PendingRead{bufferId, 0, static_cast<uint32_t>(cqe.res)});
+
+    if (!deliverPending(conn))
+    {
+        const auto peer = conn.peer;
+        queue.push(ConnectionCloseEvent{peer.getId()});
+        unsubscribe(peer);
+        return;
+    }
+
+    if (!conn.pendingReads.empty())
+    {
+        stalledReads.emplace(connId);
+    }
+    else if (!conn.recvArmed && !starvedRecvs.contains(connId))
+    {
+        armRecv(connId, conn);
+    }
+}
+
+TEMPLATE
+void PREFIX::onSend(uint32_t connId, Connection &conn, int32_t res)
+{
+    --conn.sendsInFlight;
+
+    if (res < 0 && res != -ECANCELED)
+    {
+        spdlog::error("UringService::onSend. Failed to send to peer={} error={}",
+                      conn.peer.getId().toString(), strerror(-res));
+        queue.push(WriteEventResponse{conn.peer, "Could not write any data to peer"});
+        return;
+    }
+
+    auto *writeQueue = buffMan.getWriteBuffer(conn.peer);
+    if (!writeQueue)
+    {
+        return;
+    }
+
+    if (res > 0)
+    {
+        writeQueue->flush(res);
+    }
+
+    if (writeQueue->size() < conn.queuedBeforeSend)
+    {
+        queue.push(WriteEventResponse{conn.peer, ""});
+    }
+
+    // A short send is resumed from where it ended
+    submitSends(connId, conn);
+}
+
+TEMPLATE
+bool PREFIX::deliverPending(Connection &conn)
+{
+    bool hasMessage{false};
+    while (!conn.pendingReads.empty())
+    {
+        auto &pending = conn.pendingReads.front();
+        const auto space = buffMan.reserveRead(conn.peer);
+        if (space.empty())
+        {
+            if (!buffMan.isReadStalled(conn.peer))
+            {
+                spdlog::error("UringService::deliverPending. No space to receive message from "
+                              "peer={}",
+                              conn.peer.getId().toString());
+                return false;
+            }
+            break;
+        }
+
+        const auto n = std::min<size_t>(space.size(), pending.size);
+        std::memcpy(space.data(), bufferAt(pending.bufferId) + pending.offset, n);
+        hasMessage = buffMan.commitRead(conn.peer, n) || hasMessage;
+
+        pending.offset += n;
+        pending.size -= n;
+        if (pending.size == 0)
+        {
+            recycleBuffer(pending.bufferId);
+            conn.pendingReads.pop_front();
+        }
+    }
+
+    if (hasMessage)
+    {
+        while (auto msg = buffMan.popMessage(conn.peer))
+        {
+            queue.push(ReadEvent{conn.peer, std::move(*msg)});
+        }
+    }
+
+    if (buffMan.isReadOversized(conn.peer))
+    {
+        spdlog::error("UringService::deliverPending. Message of peer={} exceeds the receive buffer",
+                      conn.peer.getId().toString());
+        return false;
+    }
+
+    return true;
+}
+
+TEMPLATE
+void PREFIX::resumeStalledReads()
+{
+    for (auto it = stalledReads.begin(); it != stalledReads.end();)
+    {
+        const auto connId = *it;
+        auto &conn = connections.at(connId);
+        if (buffMan.isReadStalled(conn.peer))
+        {
+            ++it;
+            continue;
+        }
+
+        if (!deliverPending(conn))
+        {
+            it = stalledReads.erase(it);
+            const auto peer = conn.peer;
+            queue.push(ConnectionCloseEvent{peer.getId()});
+            unsubscribe(peer);
+            continue;
+        }
+
+        if (!conn.pendingReads.empty())
+        {
+            ++it;
+            continue;
+        }
+
+        it = stalledReads.erase(it);
+        starvedRecvs.erase(connId);
+        if (!conn.recvArmed)
+        {
+            armRecv(connId, conn);
+        }
+    }
+
+    // Provided buffers were handed back, retry receives that ran out of them
+    if (buffersRecycled)
+    {
+        buffersRecycled = false;
+        for (auto it = starvedRecvs.begin(); it != starvedRecvs.end();)
+        {
+            auto &conn = connections.at(*it);
+            if (!conn.pendingReads.empty())
+            {
+                ++it;
+                continue;
+            }
+
+            if (!conn.recvArmed)
+            {
+                armRecv(*it, conn);
+            }
+            it = starvedRecvs.erase(it);
+        }
+    }
+}
+
+TEMPLATE
+void PREFIX::run()
+{
+    if (!initialized)
+    {
+        spdlog::error("UringService::run. Not initialized");
+        queue.push(EpollError{});
+        return;
+    }
+
+    state = State::Active;
+    armNotify();
+
+    std::array<io_uring_cqe *, CQE_BATCH> cqes;
+    while (state == State::Active)
+    {
+        const int ret = io_uring_submit_and_wait(&ring, 1);
+        if (ret < 0 && ret != -EINTR)
+        {
+            state = State::Inactive;
+            spdlog::error("UringService::run error={}", strerror(-ret));
+            queue.push(EpollError{});
+            closeListeners();
+            return;
+        }
+
+        // Reap all available completions before going back to the kernel
+        unsigned count{0};
+        while ((count = io_uring_peek_batch_cqe(&ring, cqes.data(), cqes.size())) > 0)
+        {
+            for (unsigned i = 0; i < count; ++i)
+            {
+                handleCompletion(*cqes[i]);
+            }
+            io_uring_cq_advance(&ring, count);
+        }
+
+        while (queue.canPop())
+        {
+            const auto req = queue.pop();
+
+            std::visit(common::overloaded{[&](Subscribe sub)
+                                          {
+                                              subscribe(sub.peer);
+                                          },
+                                          [&](UnSubscribe unsub)
+                                          {
+                                              unsubscribe(unsub.peer);
+                                              queue.push(ConnectionCloseEvent{unsub.peer.getId()});
+                                          },
+                                          [&](Listen req)
+                                          {
+                                              listen(req.listener);
+                                          },
+                                          [&](Deactivate stop)
+                                          {
+                                              state = State::Inactive;
+                                          },
+                                          [&](WriteEvent data)
+                                          {
+                                              const auto it = connIds.find(data.peer);
+                                              if (it == connIds.end())
+                                              {
+                                                  return;
+                                              }
+
+                                              buffMan.addToWriteBuffer(data.peer,
+                                                                       std::move(data.message));
+                                              submitSends(it->second,
+                                                          connections.at(it->second));
+                                          }},
+                       req);
+        }
+
+        resumeStalledReads();
+    }
+
+    closeListeners();
+    spdlog::info("UringService::run. Shutdown");
+}
+
+TEMPLATE
+typename PREFIX::State PREFIX::stop()
+{
+    spdlog::info("UringService::stop");
+    if (state == State::Active)
+    {
+        const auto newState = State::Deactivating;
+        state = newState;
+
+        notify();
+        return newState;
+    }
+
+    return state;
+}
+
+TEMPLATE
+typename PREFIX::State PREFIX::getState() const
+{
+    return state;
+}
+
+TEMPLATE
+bool PREFIX::isActive() const
+{
+    return state == PREFIX::State::Active;
+}
+
+#undef TEMPLATE
+#undef PREFIX
+
+} // namespace fractals::network::p2p
@@ -33,6 +33,10 @@ class PersistServiceImpl
     AppPersistQueue::RightEndPoint appQueue;
     sync::QueueCoordinator& coordinator;
     PersistClientT& client;
+
+    // Ready bits of the queues on the coordinator
+    sync::Notifier::ReadyBits btReady{0};
+    sync::Notifier::ReadyBits appReady{0};
 };
 
 using PersistService = PersistServiceImpl<PersistClient>;
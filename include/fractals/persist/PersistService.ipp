@@ -18,8 +18,8 @@ PersistServiceImpl<PersistClientT>::PersistServiceImpl(sync::QueueCoordinator &c
                                                        PersistClientT &client)
     : coordinator(coordinator), btQueue(btQueue), appQueue(appQueue), client(client)
 {
-    coordinator.addAsPublisherForPersistService<PersistEventQueue>(btQueue);
-    coordinator.addAsPublisherForPersistService<AppPersistQueue>(appQueue);
+    btReady = coordinator.addPublisher(sync::QueueCoordinator::Consumer::PersistService, btQueue);
+    appReady = coordinator.addPublisher(sync::QueueCoordinator::Consumer::PersistService, appQueue);
     client.openConnection("torrents.db");
 }
 
@@ -38,14 +38,14 @@ template <typename PersistClientT> void PersistServiceImpl<PersistClientT>::run(
     isActive = true;
     while (isActive)
     {
-        coordinator.waitOnPersistServiceUpdate();
+        const auto ready = coordinator.wait(sync::QueueCoordinator::Consumer::PersistService);
 
-        while (btQueue.canPop())
+        while ((ready & btReady) && btQueue.canPop())
         {
             processBtEvent();
         }
 
-        while (appQueue.canPop())
+        while ((ready & appReady) && appQueue.canPop())
         {
             processAppEvent();
         }
@@ -56,7 +56,7 @@ template <typename PersistClientT> void PersistServiceImpl<PersistClientT>::run(
 
 template <typename PersistClientT> void PersistServiceImpl<PersistClientT>::processBtEvent()
 {
-    auto &&req = std::move(btQueue.pop());
+    auto req = btQueue.pop();
 
     std::visit(
         common::overloaded{
@@ -113,7 +113,7 @@ template <typename PersistClientT> void PersistServiceImpl<PersistClientT>::proc
 
 template <typename PersistClientT> void PersistServiceImpl<PersistClientT>::processAppEvent()
 {
-    auto &&req = std::move(appQueue.pop());
+    auto req = appQueue.pop();
     std::visit(
         common::overloaded{
             [&](const RequestStats &req)
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace fractals::sync
+{
+
+/**
+Wakes up a consumer thread. Every queue of the consumer has a ready bit. Producers set the bit of
+the queue they pushed to and only signal the eventfd when no other bit was set yet. The consumer
+takes all bits at once and learns exactly which of its queues have events.
+
+The eventfd can be added to an epoll instance, call take once it is readable.
+*/
+class Notifier
+{
+  public:
+    using ReadyBits = uint64_t;
+
+    static constexpr uint32_t MAX_SOURCES = 64;
+
+    Notifier();
+    Notifier(const Notifier &) = delete;
+    Notifier(Notifier &&) = delete;
+    ~Notifier();
+
+    bool isValid() const;
+    int getFileDescriptor() const;
+
+    // Mark the source as ready. Sources beyond MAX_SOURCES share bits.
+    void notify(uint32_t source);
+
+    // Take the ready sources without blocking
+    ReadyBits take();
+
+    // Wait until a source is ready and take them. Zero waits without timeout, returns 0 once
+    // the timeout expired.
+    ReadyBits wait(std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+
+  private:
+    void drainFd();
+
+    int fd{-1};
+    std::atomic<ReadyBits> ready{0};
+};
+
+} // namespace fractals::sync
@@ -1,166 +1,66 @@
 #pragma once
 
-#include <algorithm>
+#include <fractals/sync/Notifier.h>
+
+#include <array>
 #include <chrono>
-#include <condition_variable>
-#include <functional>
-#include <mutex>
-#include <spdlog/spdlog.h>
+#include <cstdint>
+
 namespace fractals::sync
 {
+
+/**
+Wakes up the services when one of the queues they consume from has events. Every service has
+its own Notifier, every queue of a service its own ready bit.
+*/
 class QueueCoordinator
 {
-  private:
-    using Predicate = std::function<bool(void)>;
-
-    template <typename Q> using Left = typename Q::LeftEndPoint;
-    template <typename Q> using Right = typename Q::RightEndPoint;
-
   public:
-    template <typename Queue> void addAsPublisherForBitTorrentManager(Left<Queue> left)
+    enum class Consumer : uint8_t
     {
-        left.attachNotifier(btManMutex, btManCv);
-        btManPreds.emplace_back(
-            [left]()
-            {
-                return left.canPop();
-            });
-    }
+        BitTorrentManager,
+        AnnounceService,
+        PersistService,
+        DiskService
+    };
 
-    void waitOnBtManUpdate(std::chrono::milliseconds timeout)
-    {
-        waitOnNotify(btManMutex, btManCv, btManPreds, btManForceNotified, timeout);
-    }
+    static constexpr size_t NUM_CONSUMERS = 4;
 
-    void forceNotifyBtMan()
-    {
-        forceNotify(btManMutex, btManCv, btManForceNotified);
-    }
+    // Set when the consumer is woken up without an event, e.g. to shut down
+    static constexpr uint32_t FORCE_SOURCE = Notifier::MAX_SOURCES - 1;
 
-    template <typename Queue> void addAsPublisherForAnnounceService(Right<Queue> right)
+    // Wake up the consumer whenever the end point receives an event. Returns the ready bit of
+    // the end point.
+    template <typename EndPoint>
+    Notifier::ReadyBits addPublisher(Consumer consumer, EndPoint endPoint)
     {
-        right.attachNotifier(annServiceMutex, annServiceCv);
-        annServicePreds.emplace_back(
-            [right]()
-            {
-                return right.canPop();
-            });
-    }
-
-    void
-    waitOnAnnounceServiceUpdate(std::chrono::milliseconds timeout = std::chrono::milliseconds(0))
-    {
-        waitOnNotify(annServiceMutex, annServiceCv, annServicePreds, annServiceForceNotified,
-                     timeout);
-    }
+        const auto index = static_cast<size_t>(consumer);
+        const auto source = numSources[index]++ % FORCE_SOURCE;
+        endPoint.attachNotifier(notifiers[index], source);
 
-    void forceNotifyAnnounceService()
-    {
-        forceNotify(annServiceMutex, annServiceCv, annServiceForceNotified);
-    }
-
-    template <typename Queue> void addAsPublisherForPersistService(Right<Queue> right)
-    {
-        right.attachNotifier(persistServiceMutex, persistServiceCv);
-        persistServicePreds.emplace_back(
-            [right]()
-            {
-                return right.canPop();
-            });
+        return Notifier::ReadyBits{1} << source;
     }
 
-    void waitOnPersistServiceUpdate()
+    // Returns the ready bits. Zero waits until an event arrives.
+    Notifier::ReadyBits wait(Consumer consumer,
+                             std::chrono::milliseconds timeout = std::chrono::milliseconds(0))
     {
-        waitOnNotify(persistServiceMutex, persistServiceCv, persistServicePreds,
-                     persistServiceForceNotified);
+        return getNotifier(consumer).wait(timeout);
     }
 
-    void forceNotifyPersistService()
+    void forceNotify(Consumer consumer)
     {
-        forceNotify(persistServiceMutex, persistServiceCv, persistServiceForceNotified);
+        getNotifier(consumer).notify(FORCE_SOURCE);
     }
 
-    template <typename Queue> void addAsPublisherForDiskService(Right<Queue> right)
+    Notifier &getNotifier(Consumer consumer)
     {
-        right.attachNotifier(diskServiceMutex, diskServiceCv);
-        diskServicePreds.emplace_back(
-            [right]()
-            {
-                return right.canPop();
-            });
-    }
-
-    void waitOnDiskServiceUpdate()
-    {
-        waitOnNotify(diskServiceMutex, diskServiceCv, diskServicePreds, diskServiceForceNotified);
-    }
-
-    void forceNotifyDiskService()
-    {
-        forceNotify(diskServiceMutex, diskServiceCv, diskServiceForceNotified);
+        return notifiers[static_cast<size_t>(consumer)];
     }
 
   private:
-    void waitOnNotify(std::mutex &mutex, std::condition_variable &cv,
-                      const std::vector<Predicate> &preds, bool &forceNotified,
-                      std::chrono::milliseconds timeout = std::chrono::milliseconds(0))
-    {
-        std::unique_lock<std::mutex> _lock(mutex);
-        if (timeout == std::chrono::milliseconds(0))
-        {
-            while (std::none_of(preds.begin(), preds.end(),
-                                [](auto p)
-                                {
-                                    return p();
-                                }) ||
-                   forceNotified)
-            {
-                cv.wait(_lock);
-            }
-        }
-        else
-        {
-
-            cv.wait_for(_lock, timeout,
-                        [&]()
-                        {
-                            return std::any_of(preds.begin(), preds.end(),
-                                                [](auto p)
-                                                {
-                                                    return p();
-                                                }) ||
-                                   forceNotified;
-                        });
-        }
-
-        forceNotified = false;
-    }
-
-    void forceNotify(std::mutex &mutex, std::condition_variable &cv, bool &forceNotified)
-    {
-        std::unique_lock<std::mutex> _lock(mutex);
-        forceNotified = true;
-        cv.notify_all();
-    }
-
-    std::mutex btManMutex;
-    std::condition_variable btManCv;
-    std::vector<Predicate> btManPreds;
-    bool btManForceNotified{false};
-
-    std::mutex annServiceMutex;
-    std::condition_variable annServiceCv;
-    std::vector<Predicate> annServicePreds;
-    bool annServiceForceNotified{false};
-
-    std::mutex persistServiceMutex;
-    std::condition_variable persistServiceCv;
-    std::vector<Predicate> persistServicePreds;
-    bool persistServiceForceNotified{false};
-
-    std::mutex diskServiceMutex;
-    std::condition_variable diskServiceCv;
-    std::vector<Predicate> diskServicePreds;
-    bool diskServiceForceNotified{false};
+    std::array<Notifier, NUM_CONSUMERS> notifiers;
+    std::array<uint32_t, NUM_CONSUMERS> numSources{};
 };
-} // namespace fractals::sync
\ No newline at end of file
+
+} // namespace fractals::sync
@@ -241,6 +241,24 @@ void TorrentController::resumeTorrent(uint64_t torrentId)
     }
 }
 
+void TorrentController::limitRate(app::SetRateLimit::Scope scope, uint64_t torrentId,
+                                  uint64_t downloadRate, uint64_t uploadRate)
+{
+    if (scope != app::SetRateLimit::Scope::Torrent)
+    {
+        btQueue.push(app::SetRateLimit{scope, {}, downloadRate, uploadRate});
+        return;
+    }
+
+    const auto it = idTorrentMap.find(torrentId);
+
+    if (it != idTorrentMap.end())
+    {
+        btQueue.push(
+            app::SetRateLimit{scope, it->second.getInfoHash(), downloadRate, uploadRate});
+    }
+}
+
 void TorrentController::runUI()
 {
     using namespace ftxui;
@@ -253,6 +271,8 @@ void TorrentController::runUI()
     tdb->onRemove = std::bind(&TorrentController::removeTorrent, this, std::placeholders::_1);
     tdb->onStop = std::bind(&TorrentController::stopTorrent, this, std::placeholders::_1);
     tdb->onResume = std::bind(&TorrentController::resumeTorrent, this, std::placeholders::_1);
+    tdb->onLimit = std::bind(&TorrentController::limitRate, this, std::placeholders::_1,
+                             std::placeholders::_2, std::placeholders::_3, std::placeholders::_4);
 
     auto doExit = screen.ExitLoopClosure(); // had to move this outside of the on_enter definition
     // as it would otherwise not trigger. Not sure why though..
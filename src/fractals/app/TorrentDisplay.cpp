@@ -70,12 +70,13 @@ bool TorrentDisplayBase::parseCommand(StringRef ws)
     if (com == "help")
     {
         feedback.msg = "Available commands: exit, add <filepath>, stop <torrent name or id>, "
-                           "resume <torrent name or id>, remove <torrent name or id>";
+                           "resume <torrent name or id>, remove <torrent name or id>, "
+                           "limit <all, peer or torrent id> <download rate> <upload rate>";
         feedback.msgType = FeedbackType::Info;
         return false;
     }
 
-    if (!common::elem(com, "add", "stop", "resume", "remove"))
+    if (!common::elem(com, "add", "stop", "resume", "remove", "limit"))
     {
         feedback.msg = "unknown command: " + com;
         feedback.msgType = FeedbackType::Error;
@@ -135,6 +136,47 @@ bool TorrentDisplayBase::parseCommand(StringRef ws)
         return false;
     }
 
+    if (com == "limit")
+    {
+        // rates such as 500K or 2M, 0 is unlimited
+        std::string target, down, up;
+        ss >> target >> down >> up;
+        const auto downRate = common::parseBytes(down);
+        const auto upRate = common::parseBytes(up);
+        if (!downRate || !upRate)
+        {
+            feedback.msg = "Expected format is limit <all, peer or #<torrent id>> <download rate> "
+                           "<upload rate>. Rates are in bytes per second, 0 is unlimited.";
+            feedback.msgType = FeedbackType::Error;
+            return false;
+        }
+
+        if (target == "all")
+        {
+            onLimit(SetRateLimit::Scope::Global, 0, *downRate, *upRate);
+        }
+        else if (target == "peer")
+        {
+            onLimit(SetRateLimit::Scope::Peer, 0, *downRate, *upRate);
+        }
+        else
+        {
+            auto argIdent = parseIdent(target);
+            if (argIdent.isLeft)
+            {
+                feedback.msg = argIdent.leftValue;
+                feedback.msgType = FeedbackType::Error;
+            }
+            else
+            {
+                // send limit message to TorrentController
+                onLimit(SetRateLimit::Scope::Torrent, argIdent.rightValue, *downRate, *upRate);
+            }
+        }
+
+        return false;
+    }
+
     if (com == "stop")
     {
         // parse and validate the second argument
@@ -248,8 +290,14 @@ Element TorrentDisplayBase::Render()
             nameElems.emplace_back(cell(tv.getName()));
             sizeElems.emplace_back(cell(common::ppBytes(tv.getSize())));
             progressElems.emplace_back(cell(common::ppBytes(tv.getDownloaded())));
-            downElems.emplace_back(cell(common::ppBytesPerSecond(tv.getDownloadSpeed())));
-            upElems.emplace_back(cell(common::ppBytesPerSecond(tv.getUploadSpeed())));
+            // transfer rate with the limit between brackets if any
+            auto rate = [](auto current, auto limit)
+            {
+                auto s = common::ppBytesPerSecond(current);
+                return limit ? s + " (" + common::ppBytesPerSecond(limit) + ")" : s;
+            };
+            downElems.emplace_back(cell(rate(tv.getDownloadRate(), tv.getDownloadLimit())));
+            upElems.emplace_back(cell(rate(tv.getUploadRate(), tv.getUploadLimit())));
             auto connects = [](auto act, auto tot)
             {
                 return std::to_string(act) + "(" + std::to_string(tot) + ")";
@@ -272,9 +320,9 @@ Element TorrentDisplayBase::Render()
     sizeElems.emplace_back(separator() | color(Color::GreenLight));
     progressElems.emplace_back(colOfSize("Progress", 16));
     progressElems.emplace_back(separator() | color(Color::GreenLight));
-    downElems.emplace_back(colOfSize("Down", 12));
+    downElems.emplace_back(colOfSize("Down", 24));
     downElems.emplace_back(separator() | color(Color::GreenLight));
-    upElems.emplace_back(colOfSize("Up", 12));
+    upElems.emplace_back(colOfSize("Up", 24));
     upElems.emplace_back(separator() | color(Color::GreenLight));
     seederElems.emplace_back(colOfSize("Seeders", 12));
     seederElems.emplace_back(separator() | color(Color::GreenLight));
@@ -43,6 +43,11 @@ void TorrentDisplayEntry::update(const app::PeerStats& stats)
     totalSeeders = stats.knownPeerCount;
     connectedLeechers = 0;
     totalLeechers = 0;
+    downloadRate = stats.downloadRate;
+    uploadRate = stats.uploadRate;
+    downloadLimit = stats.downloadLimit;
+    uploadLimit = stats.uploadLimit;
+    wastedBytes = stats.wastedBytes;
 }
 
 uint64_t TorrentDisplayEntry::getId() const
@@ -110,6 +115,31 @@ uint64_t TorrentDisplayEntry::getUploadSpeed() const
     return uploadSpeed;
 }
 
+uint64_t TorrentDisplayEntry::getDownloadRate() const
+{
+    return downloadRate;
+}
+
+uint64_t TorrentDisplayEntry::getUploadRate() const
+{
+    return uploadRate;
+}
+
+uint64_t TorrentDisplayEntry::getDownloadLimit() const
+{
+    return downloadLimit;
+}
+
+uint64_t TorrentDisplayEntry::getUploadLimit() const
+{
+    return uploadLimit;
+}
+
+uint64_t TorrentDisplayEntry::getWastedBytes() const
+{
+    return wastedBytes;
+}
+
 uint64_t TorrentDisplayEntry::getTotalSeeders() const
 {
     return totalSeeders;
@@ -0,0 +1,263 @@
+#include <fractals/common/BufferPool.h>
+
+#include <algorithm>
+#include <bit>
+#include <new>
+#include <sys/mman.h>
+#include <utility>
+
+namespace fractals::common
+{
+
+struct PieceBuffer::Arena
+{
+    explicit Arena(BufferPoolConfig config) : config(config)
+    {
+    }
+
+    ~Arena()
+    {
+        freeCached(0);
+    }
+
+    bool isMapped(uint64_t capacity) const
+    {
+        return config.hugePages && capacity >= BufferPool::HUGE_PAGE_SIZE;
+    }
+
+    char *allocate(uint64_t capacity)
+    {
+        if (!isMapped(capacity))
+        {
+            return static_cast<char *>(::operator new(capacity, std::nothrow));
+        }
+
+        void *ptr =
+            mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED)
+        {
+            return nullptr;
+        }
+
+        madvise(ptr, capacity, MADV_HUGEPAGE);
+        return static_cast<char *>(ptr);
+    }
+
+    void deallocate(char *data, uint64_t capacity)
+    {
+        if (isMapped(capacity))
+        {
+            munmap(data, capacity);
+        }
+        else
+        {
+            ::operator delete(data);
+        }
+    }
+
+    // Frees cached buffers, largest first, until no more than target bytes are cached
+    void freeCached(uint64_t target)
+    {
+        for (auto it = freeLists.rbegin(); it != freeLists.rend() && stats.cached > target; ++it)
+        {
+            auto &[capacity, buffers] = *it;
+            while (!buffers.empty() && stats.cached > target)
+            {
+                deallocate(buffers.back(), capacity);
+                buffers.pop_back();
+                stats.cached -= capacity;
+            }
+        }
+    }
+
+    void release(char *data, uint64_t capacity)
+    {
+        std::lock_guard<std::mutex> _lock(mutex);
+        stats.inUse -= capacity;
+        if (stats.cached + capacity <= config.cacheLimit &&
+            stats.inUse + stats.cached + capacity <= config.memoryLimit)
+        {
+            freeLists[capacity].push_back(data);
+            stats.cached += capacity;
+        }
+        else
+        {
+            deallocate(data, capacity);
+        }
+    }
+
+    BufferPoolConfig config;
+    mutable std::mutex mutex;
+    std::map<uint64_t, std::vector<char *>> freeLists;
+    BufferPoolStats stats;
+};
+
+PieceBuffer::PieceBuffer(uint64_t size)
+    : mData(size ? new char[size] : nullptr), mSize(size), mCapacity(size)
+{
+}
+
+PieceBuffer::PieceBuffer(std::shared_ptr<Arena> arena, char *data, uint64_t size,
+                         uint64_t capacity)
+    : mArena(std::move(arena)), mData(data), mSize(size), mCapacity(capacity)
+{
+}
+
+PieceBuffer::PieceBuffer(PieceBuffer &&other) noexcept
+    : mArena(std::move(other.mArena)), mData(std::exchange(other.mData, nullptr)),
+      mSize(std::exchange(other.mSize, 0)), mCapacity(std::exchange(other.mCapacity, 0))
+{
+}
+
+PieceBuffer &PieceBuffer::operator=(PieceBuffer &&other) noexcept
+{
+    if (this != &other)
+    {
+        release();
+        mArena = std::move(other.mArena);
+        mData = std::exchange(other.mData, nullptr);
+        mSize = std::exchange(other.mSize, 0);
+        mCapacity = std::exchange(other.mCapacity, 0);
+    }
+
+    return *this;
+}
+
+PieceBuffer::~PieceBuffer()
+{
+    release();
+}
+
+PieceBuffer::operator bool() const
+{
+    return mData != nullptr;
+}
+
+char *PieceBuffer::data()
+{
+    return mData;
+}
+
+const char *PieceBuffer::data() const
+{
+    return mData;
+}
+
+uint64_t PieceBuffer::size() const
+{
+    return mSize;
+}
+
+uint64_t PieceBuffer::capacity() const
+{
+    return mCapacity;
+}
+
+std::string_view PieceBuffer::view() const
+{
+    return std::string_view{mData, mSize};
+}
+
+const char *PieceBuffer::begin() const
+{
+    return mData;
+}
+
+const char *PieceBuffer::end() const
+{
+    return mData + mSize;
+}
+
+void PieceBuffer::release()
+{
+    if (mArena)
+    {
+        mArena->release(mData, mCapacity);
+        mArena.reset();
+    }
+    else
+    {
+        delete[] mData;
+    }
+
+    mData = nullptr;
+    mSize = 0;
+    mCapacity = 0;
+}
+
+BufferPool::BufferPool(BufferPoolConfig config)
+    : mArena(std::make_shared<PieceBuffer::Arena>(config))
+{
+}
+
+PieceBuffer BufferPool::acquire(uint64_t size)
+{
+    const auto capacity = sizeClass(size);
+    std::lock_guard<std::mutex> _lock(mArena->mutex);
+    auto &stats = mArena->stats;
+    const auto limit = mArena->config.memoryLimit;
+
+    auto &buffers = mArena->freeLists[capacity];
+    if (!buffers.empty())
+    {
+        auto *data = buffers.back();
+        buffers.pop_back();
+        stats.cached -= capacity;
+        stats.inUse += capacity;
+        ++stats.acquired;
+        ++stats.reused;
+        return PieceBuffer{mArena, data, size, capacity};
+    }
+
+    if (stats.inUse + capacity > limit)
+    {
+        ++stats.refused;
+        return PieceBuffer{};
+    }
+
+    // Cached buffers of other size classes make room for the new one
+    if (stats.inUse + stats.cached + capacity > limit)
+    {
+        mArena->freeCached(limit - stats.inUse - capacity);
+    }
+
+    auto *data = mArena->allocate(capacity);
+    if (data == nullptr)
+    {
+        ++stats.refused;
+        return PieceBuffer{};
+    }
+
+    stats.inUse += capacity;
+    ++stats.acquired;
+    return PieceBuffer{mArena, data, size, capacity};
+}
+
+void BufferPool::setMemoryLimit(uint64_t limit)
+{
+    std::lock_guard<std::mutex> _lock(mArena->mutex);
+    mArena->config.memoryLimit = limit;
+    if (mArena->stats.inUse + mArena->stats.cached > limit)
+    {
+        mArena->freeCached(limit > mArena->stats.inUse ? limit - mArena->stats.inUse : 0);
+    }
+}
+
+void BufferPool::trim()
+{
+    std::lock_guard<std::mutex> _lock(mArena->mutex);
+    mArena->freeCached(0);
+}
+
+BufferPoolStats BufferPool::getStats() const
+{
+    std::lock_guard<std::mutex> _lock(mArena->mutex);
+    return mArena->stats;
+}
+
+uint64_t BufferPool::sizeClass(uint64_t size)
+{
+    return std::bit_ceil(std::max(size, MIN_SIZE_CLASS));
+}
+
+} // namespace fractals::common
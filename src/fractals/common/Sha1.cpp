@@ -0,0 +1,508 @@
+#include <fractals/common/Sha1.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define FRACTALS_SHA1_X86 1
+#endif
+
+namespace fractals::common
+{
+
+namespace
+{
+constexpr size_t BLOCK_SIZE = 64;
+constexpr uint32_t INITIAL_STATE[5]{0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+// Last bytes of the input that do not fill a block, followed by the padding and the length in
+// bits. Returns the number of blocks, one or two.
+size_t padTail(std::string_view data, unsigned char (&tail)[2 * BLOCK_SIZE])
+{
+    const auto remaining = data.size() % BLOCK_SIZE;
+    std::memset(tail, 0, sizeof(tail));
+    std::memcpy(tail, data.data() + data.size() - remaining, remaining);
+    tail[remaining] = 0x80;
+
+    const size_t numBlocks = remaining + 9 <= BLOCK_SIZE ? 1 : 2;
+    const uint64_t bits = uint64_t{data.size()} * 8;
+    for (size_t i = 0; i < 8; ++i)
+    {
+        tail[numBlocks * BLOCK_SIZE - 1 - i] = static_cast<unsigned char>(bits >> (8 * i));
+    }
+
+    return numBlocks;
+}
+
+Sha1::Digest toDigest(const uint32_t (&state)[5])
+{
+    Sha1::Digest res;
+    for (size_t i = 0; i < 5; ++i)
+    {
+        for (size_t j = 0; j < 4; ++j)
+        {
+            res[i * 4 + j] = static_cast<char>(state[i] >> (24 - 8 * j));
+        }
+    }
+
+    return res;
+}
+
+void digestOpenSsl(std::span<const std::string_view> inputs, std::span<Sha1::Digest> digests)
+{
+    for (size_t i = 0; i < inputs.size(); ++i)
+    {
+        SHA1(reinterpret_cast<const unsigned char *>(inputs[i].data()), inputs[i].size(),
+             reinterpret_cast<unsigned char *>(digests[i].data()));
+    }
+}
+
+#ifdef FRACTALS_SHA1_X86
+
+bool cpuHasShaNi()
+{
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    {
+        return false;
+    }
+
+    // SSSE3 and SSE4.1 for the byte shuffles and the lane extract
+    const bool sse = (ecx & bit_SSSE3) && (ecx & bit_SSE4_1);
+    return sse && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA);
+}
+
+bool cpuHasAvx2()
+{
+    // Also checks that the OS saves the AVX registers
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+// Rounds 4 * I to 4 * I + 3. The message words of four rounds are computed a few groups ahead,
+// msg[I % 4] holds the words of this group.
+template <int I>
+__attribute__((target("sha,sse4.1"))) inline void
+shaNiRounds(__m128i &abcd, __m128i (&e)[2], __m128i (&msg)[4])
+{
+    auto &eIn = e[I % 2];
+    auto &eOut = e[(I + 1) % 2];
+    if constexpr (I == 0)
+    {
+        eIn = _mm_add_epi32(eIn, msg[0]);
+    }
+    else
+    {
+        eIn = _mm_sha1nexte_epu32(eIn, msg[I % 4]);
+    }
+    eOut = abcd;
+
+    if constexpr (I >= 3 && I <= 18)
+    {
+        msg[(I + 1) % 4] = _mm_sha1msg2_epu32(msg[(I + 1) % 4], msg[I % 4]);
+    }
+    abcd = _mm_sha1rnds4_epu32(abcd, eIn, I / 5);
+    if constexpr (I >= 1 && I <= 16)
+    {
+        msg[(I + 3) % 4] = _mm_sha1msg1_epu32(msg[(I + 3) % 4], msg[I % 4]);
+    }
+    if constexpr (I >= 2 && I <= 17)
+    {
+        msg[(I + 2) % 4] = _mm_xor_si128(msg[(I + 2) % 4], msg[I % 4]);
+    }
+}
+
+template <int... I>
+__attribute__((target("sha,sse4.1"))) inline void
+shaNiAllRounds(__m128i &abcd, __m128i (&e)[2], __m128i (&msg)[4], std::integer_sequence<int, I...>)
+{
+    (shaNiRounds<I>(abcd, e, msg), ...);
+}
+
+__attribute__((target("sha,sse4.1"))) void shaNiBlocks(uint32_t (&state)[5],
+                                                       const unsigned char *data,
+                                                       size_t numBlocks)
+{
+    // Words are big endian and the rounds take them in reverse order
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state)),
+                                     0x1B);
+    __m128i e[2]{_mm_set_epi32(state[4], 0, 0, 0), _mm_setzero_si128()};
+
+    for (size_t block = 0; block < numBlocks; ++block, data += BLOCK_SIZE)
+    {
+        const auto abcdSave = abcd;
+        const auto eSave = e[0];
+
+        __m128i msg[4];
+        for (size_t i = 0; i < 4; ++i)
+        {
+            msg[i] = _mm_shuffle_epi8(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16 * i)), mask);
+        }
+
+        shaNiAllRounds(abcd, e, msg, std::make_integer_sequence<int, 20>{});
+
+        // Last group leaves e in e[0]
+        e[0] = _mm_sha1nexte_epu32(e[0], eSave);
+        abcd = _mm_add_epi32(abcd, abcdSave);
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state), _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = _mm_extract_epi32(e[0], 3);
+}
+
+void digestShaNi(std::span<const std::string_view> inputs, std::span<Sha1::Digest> digests)
+{
+    unsigned char tail[2 * BLOCK_SIZE];
+    for (size_t i = 0; i < inputs.size(); ++i)
+    {
+        uint32_t state[5];
+        std::copy(std::begin(INITIAL_STATE), std::end(INITIAL_STATE), state);
+
+        const auto &input = inputs[i];
+        shaNiBlocks(state, reinterpret_cast<const unsigned char *>(input.data()),
+                    input.size() / BLOCK_SIZE);
+        shaNiBlocks(state, tail, padTail(input, tail));
+        digests[i] = toDigest(state);
+    }
+}
+
+constexpr size_t AVX2_LANES = 8;
+
+template <int N> __attribute__((target("avx2"))) inline __m256i rotl(__m256i x)
+{
+    return _mm256_or_si256(_mm256_slli_epi32(x, N), _mm256_srli_epi32(x, 32 - N));
+}
+
+// Loads eight words of every lane, so that register i holds word i of all lanes
+__attribute__((target("avx2"))) inline void loadTransposed(const unsigned char *(&blocks)[8],
+                                                           size_t offset, __m256i *words)
+{
+    const __m256i swap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+                                         12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    __m256i r[8];
+    for (size_t lane = 0; lane < AVX2_LANES; ++lane)
+    {
+        r[lane] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(blocks[lane] + offset));
+    }
+
+    __m256i t[8];
+    for (size_t i = 0; i < 8; i += 2)
+    {
+        t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+        t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+    }
+
+    __m256i u[8];
+    for (size_t i = 0; i < 8; i += 4)
+    {
+        u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+        u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+        u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+        u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+
+    for (size_t i = 0; i < 4; ++i)
+    {
+        words[i] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[i], u[i + 4], 0x20), swap);
+        words[i + 4] =
+            _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[i], u[i + 4], 0x31), swap);
+    }
+}
+
+struct Avx2Round
+{
+    __m256i a, b, c, d, e;
+    __m256i (&w)[16];
+
+    __attribute__((target("avx2"))) void operator()(size_t t, __m256i f, __m256i k)
+    {
+        if (t >= 16)
+        {
+            w[t & 15] = rotl<1>(
+                _mm256_xor_si256(_mm256_xor_si256(w[(t - 3) & 15], w[(t - 8) & 15]),
+                                 _mm256_xor_si256(w[(t - 14) & 15], w[t & 15])));
+        }
+
+        const auto tmp = _mm256_add_epi32(_mm256_add_epi32(rotl<5>(a), f),
+                                          _mm256_add_epi32(_mm256_add_epi32(e, k), w[t & 15]));
+        e = d;
+        d = c;
+        c = rotl<30>(b);
+        b = a;
+        a = tmp;
+    }
+};
+
+// Blocks of lanes whose message is done point at a zero block, their state is kept by the mask
+__attribute__((target("avx2"))) void avx2Block(__m256i (&state)[5],
+                                               const unsigned char *(&blocks)[8], __m256i active)
+{
+    __m256i w[16];
+    loadTransposed(blocks, 0, w);
+    loadTransposed(blocks, 32, w + 8);
+
+    Avx2Round round{state[0], state[1], state[2], state[3], state[4], w};
+    auto &[a, b, c, d, e, _] = round;
+
+    const auto k0 = _mm256_set1_epi32(0x5A827999);
+    for (size_t t = 0; t < 20; ++t)
+    {
+        round(t, _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d))), k0);
+    }
+    const auto k1 = _mm256_set1_epi32(0x6ED9EBA1);
+    for (size_t t = 20; t < 40; ++t)
+    {
+        round(t, _mm256_xor_si256(_mm256_xor_si256(b, c), d), k1);
+    }
+    const auto k2 = _mm256_set1_epi32(static_cast<int>(0x8F1BBCDC));
+    for (size_t t = 40; t < 60; ++t)
+    {
+        round(t,
+              _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c))),
+              k2);
+    }
+    const auto k3 = _mm256_set1_epi32(static_cast<int>(0xCA62C1D6));
+    for (size_t t = 60; t < 80; ++t)
+    {
+        round(t, _mm256_xor_si256(_mm256_xor_si256(b, c), d), k3);
+    }
+
+    const __m256i result[5]{round.a, round.b, round.c, round.d, round.e};
+    for (size_t i = 0; i < 5; ++i)
+    {
+        state[i] =
+            _mm256_blendv_epi8(state[i], _mm256_add_epi32(state[i], result[i]), active);
+    }
+}
+
+// Up to eight inputs, lanes past the inputs stay idle
+__attribute__((target("avx2"))) void avx2Lanes(std::span<const std::string_view> inputs,
+                                               std::span<Sha1::Digest> digests)
+{
+    alignas(32) static constexpr unsigned char ZERO_BLOCK[BLOCK_SIZE]{};
+    unsigned char tails[AVX2_LANES][2 * BLOCK_SIZE];
+    size_t fullBlocks[AVX2_LANES]{};
+    alignas(32) int32_t numBlocks[AVX2_LANES]{};
+    size_t maxBlocks{0};
+    for (size_t lane = 0; lane < inputs.size(); ++lane)
+    {
+        fullBlocks[lane] = inputs[lane].size() / BLOCK_SIZE;
+        numBlocks[lane] = fullBlocks[lane] + padTail(inputs[lane], tails[lane]);
+        maxBlocks = std::max<size_t>(maxBlocks, numBlocks[lane]);
+    }
+
+    __m256i state[5];
+    for (size_t i = 0; i < 5; ++i)
+    {
+        state[i] = _mm256_set1_epi32(static_cast<int>(INITIAL_STATE[i]));
+    }
+
+    const auto lanes = _mm256_load_si256(reinterpret_cast<const __m256i *>(numBlocks));
+    for (size_t block = 0; block < maxBlocks; ++block)
+    {
+        const unsigned char *blocks[AVX2_LANES];
+        for (size_t lane = 0; lane < AVX2_LANES; ++lane)
+        {
+            if (block < fullBlocks[lane])
+            {
+                blocks[lane] = reinterpret_cast<const unsigned char *>(inputs[lane].data()) +
+                               block * BLOCK_SIZE;
+            }
+            else if (block < static_cast<size_t>(numBlocks[lane]))
+            {
+                blocks[lane] = tails[lane] + (block - fullBlocks[lane]) * BLOCK_SIZE;
+            }
+            else
+            {
+                blocks[lane] = ZERO_BLOCK;
+            }
+        }
+
+        avx2Block(state, blocks, _mm256_cmpgt_epi32(lanes, _mm256_set1_epi32(block)));
+    }
+
+    alignas(32) uint32_t words[5][AVX2_LANES];
+    for (size_t i = 0; i < 5; ++i)
+    {
+        _mm256_store_si256(reinterpret_cast<__m256i *>(words[i]), state[i]);
+    }
+
+    for (size_t lane = 0; lane < inputs.size(); ++lane)
+    {
+        const uint32_t laneState[5]{words[0][lane], words[1][lane], words[2][lane],
+                                    words[3][lane], words[4][lane]};
+        digests[lane] = toDigest(laneState);
+    }
+}
+
+void digestAvx2(std::span<const std::string_view> inputs, std::span<Sha1::Digest> digests)
+{
+    // Lanes of a batch run until the longest input is done, so inputs of similar size go
+    // together
+    std::vector<size_t> order(inputs.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(),
+              [&](size_t lhs, size_t rhs)
+              {
+                  return inputs[lhs].size() > inputs[rhs].size();
+              });
+
+    std::string_view batch[AVX2_LANES];
+    Sha1::Digest batchDigests[AVX2_LANES];
+    for (size_t begin = 0; begin < order.size(); begin += AVX2_LANES)
+    {
+        const auto size = std::min(AVX2_LANES, order.size() - begin);
+        for (size_t lane = 0; lane < size; ++lane)
+        {
+            batch[lane] = inputs[order[begin + lane]];
+        }
+
+        avx2Lanes({batch, size}, {batchDigests, size});
+        for (size_t lane = 0; lane < size; ++lane)
+        {
+            digests[order[begin + lane]] = batchDigests[lane];
+        }
+    }
+}
+
+#endif
+} // namespace
+
+Sha1::Sha1()
+{
+    reset();
+}
+
+Sha1::Sha1(const Sha1 &other) : mCtx(EVP_MD_CTX_new())
+{
+    EVP_MD_CTX_copy_ex(mCtx, other.mCtx);
+}
+
+Sha1::Sha1(Sha1 &&other) noexcept : mCtx(std::exchange(other.mCtx, nullptr))
+{
+}
+
+Sha1 &Sha1::operator=(const Sha1 &other)
+{
+    if (this != &other)
+    {
+        if (!mCtx)
+        {
+            mCtx = EVP_MD_CTX_new();
+        }
+        EVP_MD_CTX_copy_ex(mCtx, other.mCtx);
+    }
+
+    return *this;
+}
+
+Sha1 &Sha1::operator=(Sha1 &&other) noexcept
+{
+    std::swap(mCtx, other.mCtx);
+    return *this;
+}
+
+Sha1::~Sha1()
+{
+    EVP_MD_CTX_free(mCtx);
+}
+
+void Sha1::update(std::string_view data)
+{
+    EVP_DigestUpdate(mCtx, data.data(), data.size());
+}
+
+Sha1::Digest Sha1::finalize()
+{
+    Digest res;
+    EVP_DigestFinal_ex(mCtx, reinterpret_cast<unsigned char *>(res.data()), nullptr);
+    reset();
+
+    return res;
+}
+
+void Sha1::reset()
+{
+    if (!mCtx)
+    {
+        mCtx = EVP_MD_CTX_new();
+    }
+    EVP_DigestInit_ex(mCtx, EVP_sha1(), nullptr);
+}
+
+Sha1::Digest Sha1::digest(std::string_view data)
+{
+    Sha1 sha1;
+    sha1.update(data);
+    return sha1.finalize();
+}
+
+void Sha1::digestMany(std::span<const std::string_view> inputs, std::span<Digest> digests)
+{
+    digestMany(inputs, digests, getKernel());
+}
+
+void Sha1::digestMany(std::span<const std::string_view> inputs, std::span<Digest> digests,
+                      Sha1Kernel kernel)
+{
+    assert(inputs.size() == digests.size());
+    if (!isSupported(kernel))
+    {
+        kernel = Sha1Kernel::OpenSsl;
+    }
+
+    switch (kernel)
+    {
+#ifdef FRACTALS_SHA1_X86
+    case Sha1Kernel::ShaNi:
+        digestShaNi(inputs, digests);
+        return;
+    case Sha1Kernel::Avx2:
+        digestAvx2(inputs, digests);
+        return;
+#endif
+    default:
+        digestOpenSsl(inputs, digests);
+        return;
+    }
+}
+
+bool Sha1::isSupported(Sha1Kernel kernel)
+{
+#ifdef FRACTALS_SHA1_X86
+    static const bool shaNi = cpuHasShaNi();
+    static const bool avx2 = cpuHasAvx2();
+#else
+    constexpr bool shaNi = false;
+    constexpr bool avx2 = false;
+#endif
+
+    switch (kernel)
+    {
+    case Sha1Kernel::ShaNi:
+        return shaNi;
+    case Sha1Kernel::Avx2:
+        return avx2;
+    default:
+        return true;
+    }
+}
+
+Sha1Kernel Sha1::getKernel()
+{
+    // benchSha1 puts all three kernels at about 1 GB/s on full batches, OpenSSL already uses the
+    // SHA extensions. AVX2 falls far behind on batches of less than eight pieces, which is what
+    // HashService mostly sees.
+    return Sha1Kernel::OpenSsl;
+}
+
+} // namespace fractals::common
@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <cctype>
 #include <cmath> // for floor
 #include <cstdlib>
 #include <filesystem>
@@ -291,6 +292,55 @@ std::string ppBytesPerSecond(int64_t bytes)
     return ppBytes(bytes) + "/s";
 }
 
+std::optional<uint64_t> parseBytes(std::string_view s)
+{
+    size_t end = 0;
+    while (end < s.size() && (std::isdigit(s[end]) || s[end] == '.'))
+    {
+        ++end;
+    }
+
+    long double value;
+    try
+    {
+        size_t parsed = 0;
+        value = std::stold(std::string(s.substr(0, end)), &parsed);
+        if (parsed != end)
+        {
+            return std::nullopt;
+        }
+    }
+    catch (const std::exception &)
+    {
+        return std::nullopt;
+    }
+
+    auto unit = s.substr(end);
+    if (!unit.empty() && std::toupper(unit.back()) == 'B')
+    {
+        unit.remove_suffix(1);
+    }
+
+    if (unit.size() > 1)
+    {
+        return std::nullopt;
+    }
+
+    if (!unit.empty())
+    {
+        const std::string units = "KMGTP";
+        const auto pos = units.find(std::toupper(unit.front()));
+        if (pos == std::string::npos)
+        {
+            return std::nullopt;
+        }
+
+        value *= std::pow(1000.0L, pos + 1);
+    }
+
+    return static_cast<uint64_t>(value);
+}
+
 std::string ppTime(int64_t seconds)
 {
     // >= 3 years
@@ -1,8 +1,15 @@
 #include <fractals/disk/IOLayer.h>
 #include <fractals/common/utils.h>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
 #include <filesystem>
 #include <spdlog/spdlog.h>
+#include <sys/uio.h>
 #include <system_error>
+#include <unistd.h>
 
 namespace fractals::disk
 {
@@ -10,6 +17,7 @@ namespace fractals::disk
 IOLayer::~IOLayer()
 {
     stream.close();
+    closeFiles();
 }
 
 bool IOLayer::createDirectories(const std::filesystem::path &path)
@@ -134,4 +142,131 @@ std::istream &IOLayer::getStream()
     return stream;
 }
 
+bool IOLayer::writeAt(const std::filesystem::path &filePath, uint64_t offset,
+                      std::span<const std::string_view> buffers)
+{
+    const int fd = getFd(filePath);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    std::vector<iovec> iov;
+    iov.reserve(buffers.size());
+    for (const auto buffer : buffers)
+    {
+        if (!buffer.empty())
+        {
+            iov.push_back(iovec{const_cast<char *>(buffer.data()), buffer.size()});
+        }
+    }
+
+    size_t first{0};
+    while (first < iov.size())
+    {
+        const int count = std::min<size_t>(iov.size() - first, IOV_MAX);
+        const ssize_t written = ::pwritev(fd, &iov[first], count, offset);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (written <= 0)
+        {
+            spdlog::error("IOLayer::writeAt. Error '{}' occurred when writing to: {}",
+                          std::strerror(errno), filePath.c_str());
+            closeFile(filePath);
+            return false;
+        }
+
+        // Short writes continue in the middle of a buffer
+        offset += written;
+        size_t remaining = written;
+        while (first < iov.size() && remaining >= iov[first].iov_len)
+        {
+            remaining -= iov[first].iov_len;
+            ++first;
+        }
+
+        if (remaining > 0)
+        {
+            iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + remaining;
+            iov[first].iov_len -= remaining;
+        }
+    }
+
+    return true;
+}
+
+bool IOLayer::writeAt(const std::filesystem::path &filePath, uint64_t offset,
+                      std::string_view bytes)
+{
+    return writeAt(filePath, offset, std::span<const std::string_view>{&bytes, 1});
+}
+
+void IOLayer::setMaxOpenFiles(size_t maxOpen)
+{
+    maxOpenFiles = std::max<size_t>(maxOpen, 1);
+    while (lru.size() > maxOpenFiles)
+    {
+        closeFile(lru.back().path);
+    }
+}
+
+size_t IOLayer::getNumOpenFiles() const
+{
+    return lru.size();
+}
+
+void IOLayer::closeFile(const std::filesystem::path &filePath)
+{
+    const auto it = openFiles.find(filePath.native());
+    if (it == openFiles.end())
+    {
+        return;
+    }
+
+    ::close(it->second->fd);
+    lru.erase(it->second);
+    openFiles.erase(it);
+}
+
+void IOLayer::closeFiles()
+{
+    for (const auto &file : lru)
+    {
+        ::close(file.fd);
+    }
+
+    lru.clear();
+    openFiles.clear();
+}
+
+int IOLayer::getFd(const std::filesystem::path &filePath)
+{
+    const auto it = openFiles.find(filePath.native());
+    if (it != openFiles.end())
+    {
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->fd;
+    }
+
+    const int fd = ::open(filePath.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+    {
+        spdlog::error("IOLayer::getFd. Error '{}' occurred when opening: {}", std::strerror(errno),
+                      filePath.c_str());
+        return -1;
+    }
+
+    if (lru.size() >= maxOpenFiles)
+    {
+        closeFile(lru.back().path);
+    }
+
+    lru.push_front(OpenFile{filePath.native(), fd});
+    openFiles.emplace(filePath.native(), lru.begin());
+    return fd;
+}
+
 } // namespace fractals::disk
\ No newline at end of file
@@ -0,0 +1,181 @@
+#include <fractals/disk/WriteCache.h>
+
+#include <algorithm>
+#include <utility>
+
+namespace fractals::disk
+{
+
+WriteCache::WriteCache(WriteCacheConfig config) : mConfig(config)
+{
+}
+
+void WriteCache::add(CachedPiece &&piece, Clock::time_point now)
+{
+    auto &entries = mTorrents[piece.infoHash];
+    const auto offset = piece.offset;
+    const auto bytes = piece.data.capacity();
+    if (const auto it = entries.find(offset); it != entries.end())
+    {
+        mBytes -= it->second.piece.data.capacity();
+        --mNumPieces;
+    }
+
+    entries.insert_or_assign(offset, Entry{std::move(piece), now});
+    mBytes += bytes;
+    ++mNumPieces;
+}
+
+bool WriteCache::isOverLimit() const
+{
+    return mBytes > mConfig.memoryLimit;
+}
+
+std::vector<WriteRun> WriteCache::takeExpired(Clock::time_point now)
+{
+    std::vector<WriteRun> runs;
+    if (mNumPieces == 0)
+    {
+        return runs;
+    }
+
+    // A run is written as a whole once any of its pieces expired
+    for (const auto &span : getSpans())
+    {
+        if (now - span.oldest >= mConfig.flushDeadline)
+        {
+            runs.push_back(take(span));
+        }
+    }
+
+    return runs;
+}
+
+std::vector<WriteRun> WriteCache::takeOldest(uint64_t target)
+{
+    std::vector<WriteRun> runs;
+    if (mBytes <= target)
+    {
+        return runs;
+    }
+
+    auto spans = getSpans();
+    std::sort(spans.begin(), spans.end(),
+              [](const Span &lhs, const Span &rhs)
+              {
+                  return lhs.oldest < rhs.oldest;
+              });
+
+    for (const auto &span : spans)
+    {
+        if (mBytes <= target)
+        {
+            break;
+        }
+
+        runs.push_back(take(span));
+    }
+
+    return runs;
+}
+
+std::vector<WriteRun> WriteCache::takeAll()
+{
+    return takeOldest(0);
+}
+
+std::optional<WriteCache::Clock::duration> WriteCache::untilExpired(Clock::time_point now) const
+{
+    std::optional<Clock::time_point> oldest;
+    for (const auto &[_, entries] : mTorrents)
+    {
+        for (const auto &[_, entry] : entries)
+        {
+            oldest = oldest ? std::min(*oldest, entry.addedAt) : entry.addedAt;
+        }
+    }
+
+    if (!oldest)
+    {
+        return std::nullopt;
+    }
+
+    return std::max(*oldest + mConfig.flushDeadline - now, Clock::duration::zero());
+}
+
+uint64_t WriteCache::getBytes() const
+{
+    return mBytes;
+}
+
+size_t WriteCache::getNumPieces() const
+{
+    return mNumPieces;
+}
+
+const WriteCacheConfig &WriteCache::getConfig() const
+{
+    return mConfig;
+}
+
+std::vector<WriteCache::Span> WriteCache::getSpans() const
+{
+    std::vector<Span> spans;
+    for (const auto &[infoHash, entries] : mTorrents)
+    {
+        std::optional<Span> span;
+        uint64_t end{0};
+        for (const auto &[offset, entry] : entries)
+        {
+            if (span && offset == end)
+            {
+                span->last = offset;
+                span->oldest = std::min(span->oldest, entry.addedAt);
+            }
+            else
+            {
+                if (span)
+                {
+                    spans.push_back(*span);
+                }
+
+                span = Span{infoHash, offset, offset, entry.addedAt};
+            }
+
+            end = offset + entry.piece.data.size();
+        }
+
+        if (span)
+        {
+            spans.push_back(*span);
+        }
+    }
+
+    return spans;
+}
+
+WriteRun WriteCache::take(const Span &span)
+{
+    WriteRun run{span.infoHash, span.first, 0, {}};
+    auto torrentIt = mTorrents.find(span.infoHash);
+    auto &entries = torrentIt->second;
+
+    auto it = entries.find(span.first);
+    while (it != entries.end() && it->first <= span.last)
+    {
+        run.size += it->second.piece.data.size();
+        mBytes -= it->second.piece.data.capacity();
+        --mNumPieces;
+        run.pieces.push_back(std::move(it->second.piece));
+        it = entries.erase(it);
+    }
+
+    if (entries.empty())
+    {
+        mTorrents.erase(torrentIt);
+    }
+
+    return run;
+}
+
+} // namespace fractals::disk
@@ -0,0 +1,7 @@
+#include <fractals/disk/IOLayer.h>
+#include <fractals/disk/WriteEngine.ipp>
+
+namespace fractals::disk
+{
+template class WriteEngineImpl<IOLayer>;
+}
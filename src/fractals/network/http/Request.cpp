@@ -4,6 +4,7 @@
 
 #include <arpa/inet.h>
 #include <bencode/encode.h>
+#include <fractals/AppId.h>
 #include <fractals/app/Client.h>
 #include <fractals/common/encode.h>
 #include <fractals/common/maybe.h>
@@ -84,7 +85,7 @@ TrackerRequest::TrackerRequest(const std::string &announce, const torrent::MetaI
     : announce(announce),
       infoHash(common::sha1_encode<20>(bencode::encode(torrent::toBdict(mi.info)))),
       urlInfoHash(common::urlEncode<20>(infoHash.underlying)), appId(appId),
-      urlAppId(common::urlEncode<20>(appId.underlying)), port(6882), uploaded(0), downloaded(0),
+      urlAppId(common::urlEncode<20>(appId.underlying)), port(Fractals::LISTEN_PORT), uploaded(0), downloaded(0),
       left(0), compact(0)
 {
 }
@@ -93,7 +94,7 @@ TrackerRequest::TrackerRequest(const std::string &announce, const persist::Torre
                                const common::AppId &appId)
     : announce(announce), infoHash(model.infoHash),
       urlInfoHash(common::urlEncode<20>(infoHash.underlying)), appId(appId),
-      urlAppId(common::urlEncode<20>(appId.underlying)), port(6882), uploaded(0), downloaded(0),
+      urlAppId(common::urlEncode<20>(appId.underlying)), port(Fractals::LISTEN_PORT), uploaded(0), downloaded(0),
       left(0), compact(0)
 {
 }
@@ -0,0 +1,396 @@
+#include <fractals/network/p2p/BandwidthShaper.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace fractals::network::p2p
+{
+
+using namespace std::chrono_literals;
+
+namespace
+{
+constexpr std::chrono::nanoseconds METER_WINDOW{1s};
+}
+
+void TokenBucket::reconfigure(RateLimit newLimit, std::chrono::nanoseconds now)
+{
+    if (newLimit.rate && !newLimit.burst)
+    {
+        newLimit.burst = std::max(newLimit.rate, MIN_BURST);
+    }
+
+    if (!isLimited())
+    {
+        // Start out with a full bucket
+        tokens = newLimit.burst;
+    }
+    else
+    {
+        refill(now);
+        tokens = std::min<double>(tokens, newLimit.burst);
+    }
+
+    limit = newLimit;
+    lastRefill = now;
+}
+
+bool TokenBucket::isLimited() const
+{
+    return limit.rate > 0;
+}
+
+const RateLimit &TokenBucket::getLimit() const
+{
+    return limit;
+}
+
+uint64_t TokenBucket::available(std::chrono::nanoseconds now)
+{
+    if (!isLimited())
+    {
+        return std::numeric_limits<uint64_t>::max();
+    }
+
+    refill(now);
+    return tokens > 0 ? static_cast<uint64_t>(tokens) : 0;
+}
+
+void TokenBucket::consume(uint64_t bytes)
+{
+    if (isLimited())
+    {
+        tokens -= bytes;
+    }
+}
+
+void TokenBucket::refund(uint64_t bytes)
+{
+    if (isLimited())
+    {
+        tokens = std::min<double>(tokens + bytes, limit.burst);
+    }
+}
+
+std::chrono::nanoseconds TokenBucket::timeUntil(uint64_t bytes) const
+{
+    const double wanted = std::min(bytes, limit.burst);
+    if (!isLimited() || tokens >= wanted)
+    {
+        return 0ns;
+    }
+
+    const auto seconds = (wanted - tokens) / limit.rate;
+    return std::chrono::nanoseconds{static_cast<int64_t>(std::ceil(seconds * 1e9))};
+}
+
+void TokenBucket::refill(std::chrono::nanoseconds now)
+{
+    if (now <= lastRefill)
+    {
+        return;
+    }
+
+    const auto elapsed = std::chrono::duration<double>(now - lastRefill).count();
+    tokens = std::min<double>(tokens + elapsed * limit.rate, limit.burst);
+    lastRefill = now;
+}
+
+void RateMeter::add(uint64_t bytes, std::chrono::nanoseconds now)
+{
+    roll(now);
+    windowBytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+uint64_t RateMeter::rate(std::chrono::nanoseconds now)
+{
+    roll(now);
+    return lastRate.load(std::memory_order_relaxed);
+}
+
+void RateMeter::roll(std::chrono::nanoseconds now)
+{
+    auto start = windowStart.load(std::memory_order_relaxed);
+    if (start == 0)
+    {
+        windowStart.compare_exchange_strong(start, now.count(), std::memory_order_relaxed);
+        return;
+    }
+
+    // Only the shard that moves the window start closes the window
+    const auto elapsed = now.count() - start;
+    if (elapsed >= METER_WINDOW.count() &&
+        windowStart.compare_exchange_strong(start, now.count(), std::memory_order_relaxed))
+    {
+        const auto bytes = windowBytes.exchange(0, std::memory_order_relaxed);
+        lastRate.store(bytes * std::nano::den / elapsed, std::memory_order_relaxed);
+    }
+}
+
+BandwidthShaper::BandwidthShaper()
+    : BandwidthShaper(
+          []()
+          {
+              return std::chrono::steady_clock::now().time_since_epoch();
+          })
+{
+}
+
+BandwidthShaper::BandwidthShaper(Clock clock) : clock(std::move(clock))
+{
+}
+
+void BandwidthShaper::setGlobalLimit(Direction dir, RateLimit limit)
+{
+    std::lock_guard<std::shared_mutex> _lock(mutex);
+    global.buckets[index(dir)].reconfigure(limit, clock());
+    updateLimited();
+}
+
+void BandwidthShaper::setTorrentLimit(const common::InfoHash &torrent, Direction dir,
+                                      RateLimit limit)
+{
+    std::lock_guard<std::shared_mutex> _lock(mutex);
+    torrents[torrent].buckets[index(dir)].reconfigure(limit, clock());
+    updateLimited();
+}
+
+void BandwidthShaper::setPeerLimit(Direction dir, RateLimit limit)
+{
+    std::lock_guard<std::shared_mutex> _lock(mutex);
+    const auto now = clock();
+    peerLimits[index(dir)] = limit;
+    for (auto &[_, peer] : peers)
+    {
+        peer.buckets[index(dir)].reconfigure(limit, now);
+    }
+    updateLimited();
+}
+
+void BandwidthShaper::assignPeer(const http::PeerId &peer, const common::InfoHash &torrent)
+{
+    std::lock_guard<std::shared_mutex> _lock(mutex);
+    peerNode(peer, clock()).torrent = torrent;
+    torrents.try_emplace(torrent);
+}
+
+void BandwidthShaper::removePeer(const http::PeerId &peer)
+{
+    std::lock_guard<std::shared_mutex> _lock(mutex);
+    peers.erase(peer);
+}
+
+void BandwidthShaper::removeTorrent(const common::InfoHash &torrent)
+{
+    std::lock_guard<std::shared_mutex> _lock(mutex);
+    torrents.erase(torrent);
+    updateLimited();
+}
+
+uint64_t BandwidthShaper::acquire(const http::PeerId &peer, Direction dir, uint64_t wanted)
+{
+    if (!limited.load(std::memory_order_relaxed))
+    {
+        return wanted;
+    }
+
+    std::lock_guard<std::shared_mutex> _lock(mutex);
+    const auto now = clock();
+    const auto i = index(dir);
+
+    // Peer that was removed already is only held to the global limit
+    auto *node = findPeer(peer);
+    auto *torrent = node ? torrentNode(*node) : nullptr;
+
+    auto granted = std::min(wanted, global.buckets[i].available(now));
+    if (node)
+    {
+        granted = std::min(granted, node->buckets[i].available(now));
+    }
+    if (torrent)
+    {
+        granted = std::min(granted, torrent->buckets[i].available(now));
+    }
+
+    if (granted == 0)
+    {
+        return 0;
+    }
+
+    global.buckets[i].consume(granted);
+    if (node)
+    {
+        node->buckets[i].consume(granted);
+    }
+    if (torrent)
+    {
+        torrent->buckets[i].consume(granted);
+    }
+
+    return granted;
+}
+
+void BandwidthShaper::release(const http::PeerId &peer, Direction dir, uint64_t granted,
+                              uint64_t used)
+{
+    const auto now = clock();
+    const auto i = index(dir);
+    if (!limited.load(std::memory_order_relaxed))
+    {
+        // Nothing to refund, the meters are updated under the reader lock
+        std::shared_lock<std::shared_mutex> _lock(mutex);
+        addTransfer(peer, i, used, now);
+        return;
+    }
+
+    std::lock_guard<std::shared_mutex> _lock(mutex);
+    const auto unused = granted - std::min(granted, used);
+
+    global.buckets[i].refund(unused);
+    if (auto *node = findPeer(peer))
+    {
+        node->buckets[i].refund(unused);
+        if (auto *torrent = torrentNode(*node))
+        {
+            torrent->buckets[i].refund(unused);
+        }
+    }
+
+    addTransfer(peer, i, used, now);
+}
+
+std::chrono::nanoseconds BandwidthShaper::retryAfter(const http::PeerId &peer, Direction dir)
+{
+    if (!limited.load(std::memory_order_relaxed))
+    {
+        return 0ns;
+    }
+
+    std::lock_guard<std::shared_mutex> _lock(mutex);
+    const auto now = clock();
+    const auto i = index(dir);
+
+    auto wait = [&](TokenBucket &bucket)
+    {
+        bucket.available(now);
+        return bucket.timeUntil(MIN_GRANT);
+    };
+
+    auto result = wait(global.buckets[i]);
+    if (auto *node = findPeer(peer))
+    {
+        result = std::max(result, wait(node->buckets[i]));
+        if (auto *torrent = torrentNode(*node))
+        {
+            result = std::max(result, wait(torrent->buckets[i]));
+        }
+    }
+
+    return result;
+}
+
+TransferRates BandwidthShaper::getRates()
+{
+    std::shared_lock<std::shared_mutex> _lock(mutex);
+    return ratesOf(global, clock());
+}
+
+TransferRates BandwidthShaper::getRates(const common::InfoHash &torrent)
+{
+    std::shared_lock<std::shared_mutex> _lock(mutex);
+    auto it = torrents.find(torrent);
+    if (it == torrents.end())
+    {
+        return {};
+    }
+
+    return ratesOf(it->second, clock());
+}
+
+size_t BandwidthShaper::index(Direction dir)
+{
+    return static_cast<size_t>(dir);
+}
+
+TransferRates BandwidthShaper::ratesOf(Node &node, std::chrono::nanoseconds now)
+{
+    return TransferRates{node.meters[index(Direction::Down)].rate(now),
+                         node.meters[index(Direction::Up)].rate(now),
+                         node.buckets[index(Direction::Down)].getLimit(),
+                         node.buckets[index(Direction::Up)].getLimit()};
+}
+
+void BandwidthShaper::updateLimited()
+{
+    auto isLimited = [](const Node &node)
+    {
+        return std::any_of(node.buckets.begin(), node.buckets.end(),
+                           [](const TokenBucket &bucket)
+                           {
+                               return bucket.isLimited();
+                           });
+    };
+
+    bool result = isLimited(global) || std::any_of(peerLimits.begin(), peerLimits.end(),
+                                                   [](const RateLimit &limit)
+                                                   {
+                                                       return limit.rate > 0;
+                                                   });
+    for (const auto &[_, torrent] : torrents)
+    {
+        result = result || isLimited(torrent);
+    }
+
+    limited.store(result, std::memory_order_relaxed);
+}
+
+void BandwidthShaper::addTransfer(const http::PeerId &peer, size_t i, uint64_t used,
+                                  std::chrono::nanoseconds now)
+{
+    global.meters[i].add(used, now);
+    if (auto *node = findPeer(peer))
+    {
+        if (auto *torrent = torrentNode(*node))
+        {
+            torrent->meters[i].add(used, now);
+        }
+    }
+}
+
+BandwidthShaper::PeerNode &BandwidthShaper::peerNode(const http::PeerId &peer,
+                                                     std::chrono::nanoseconds now)
+{
+    auto [it, inserted] = peers.try_emplace(peer);
+    if (inserted)
+    {
+        for (auto dir : {Direction::Down, Direction::Up})
+        {
+            if (peerLimits[index(dir)].rate)
+            {
+                it->second.buckets[index(dir)].reconfigure(peerLimits[index(dir)], now);
+            }
+        }
+    }
+
+    return it->second;
+}
+
+BandwidthShaper::PeerNode *BandwidthShaper::findPeer(const http::PeerId &peer)
+{
+    auto it = peers.find(peer);
+    return it != peers.end() ? &it->second : nullptr;
+}
+
+BandwidthShaper::Node *BandwidthShaper::torrentNode(const PeerNode &peer)
+{
+    if (!peer.torrent)
+    {
+        return nullptr;
+    }
+
+    auto it = torrents.find(*peer.torrent);
+    return it != torrents.end() ? &it->second : nullptr;
+}
+
+} // namespace fractals::network::p2p
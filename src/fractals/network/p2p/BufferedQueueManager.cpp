@@ -2,71 +2,205 @@
 #include <fractals/common/utils.h>
 #include <fractals/network/http/Peer.h>
 
+#include <algorithm>
+#include <spdlog/spdlog.h>
 #include <string_view>
 
 namespace fractals::network::p2p
 {
-    bool ReadMsgState::isComplete() const
+    WriteMsgState::WriteMsgState(std::vector<char>&& data) 
+        : buffer(std::move(data))
     {
-        // BufferedQueueManager includes length bytes which is not accounted for in mLength
-        return mLength <= buffer.size();
+        mBufferedQueueManagerView = std::string_view(buffer.begin(), buffer.end());
     }
 
-    bool ReadMsgState::isInitialized() const
+    bool WriteMsgState::isComplete() const
     {
-        return mLength >= 0;
+        return mBufferedQueueManagerView.empty();
     }
 
-    void ReadMsgState::initialize(uint32_t length)
+    std::string_view& WriteMsgState::getBuffer()
     {
-        mLength = length;
-        buffer.reserve(mLength);
+        return mBufferedQueueManagerView;
     }
 
-    std::vector<char>&& ReadMsgState::flush()
+    uint32_t WriteMsgState::remaining() const
     {
-        reset();
-        return std::move(buffer);
+        return mBufferedQueueManagerView.size();
     }
 
-    void ReadMsgState::reset()
+    void WriteMsgState::flush(uint32_t shift)
     {
-        mLength = -1;
+        mBufferedQueueManagerView.remove_prefix(shift);
     }
 
-    std::string_view ReadMsgState::getBuffer() const
+    void WriteQueue::push(std::vector<char>&& data)
     {
-        return std::string_view(buffer.cbegin(),buffer.cend());
+        if (data.empty())
+        {
+            return;
+        }
+
+        mRemaining += data.size();
+        mMessages.emplace_back(std::move(data));
     }
 
-    int32_t ReadMsgState::getRemaining() const
+    bool WriteQueue::isComplete() const
     {
-        return mLength - buffer.size();
+        return mMessages.empty();
     }
 
-    WriteMsgState::WriteMsgState(std::vector<char>&& data) 
-        : buffer(std::move(data))
+    size_t WriteQueue::size() const
     {
-        mBufferedQueueManagerView = std::string_view(buffer.begin(), buffer.end());
+        return mMessages.size();
     }
 
-    bool WriteMsgState::isComplete() const
+    size_t WriteQueue::remaining() const
     {
-        return mBufferedQueueManagerView.empty();
+        return mRemaining;
     }
 
-    std::string_view& WriteMsgState::getBuffer()
+    std::string_view& WriteQueue::getBuffer()
     {
-        return mBufferedQueueManagerView;
+        if (mMessages.empty())
+        {
+            return mEmptyView;
+        }
+
+        return mMessages.front().getBuffer();
     }
 
-    uint32_t WriteMsgState::remaining() const
+    size_t WriteQueue::gather(std::span<iovec> iovs, size_t maxBytes)
     {
-        return mBufferedQueueManagerView.size();
+        size_t count{0};
+        for (auto it = mMessages.begin(); it != mMessages.end() && count < iovs.size() && maxBytes > 0; ++it)
+        {
+            const auto& view = it->getBuffer();
+            const auto len = std::min(view.size(), maxBytes);
+            iovs[count++] = iovec{const_cast<char*>(view.data()), len};
+            maxBytes -= len;
+        }
+
+        return count;
     }
 
-    void WriteMsgState::flush(uint32_t shift)
+    uint32_t WriteQueue::flush(size_t shift)
     {
-        mBufferedQueueManagerView.remove_prefix(shift);
+        uint32_t completed{0};
+        while (shift > 0 && !mMessages.empty())
+        {
+            auto& front = mMessages.front();
+            const size_t n = std::min<size_t>(shift, front.remaining());
+            front.flush(n);
+            shift -= n;
+            mRemaining -= n;
+
+            if (front.isComplete())
+            {
+                mMessages.pop_front();
+                ++completed;
+            }
+        }
+
+        return completed;
+    }
+
+    BufferedQueueManager::BufferedQueueManager(uint32_t readBufferCapacity)
+        : mReadBufferCapacity(readBufferCapacity)
+    {
+    }
+
+    std::span<char> BufferedQueueManager::reserveRead(const PeerFd& p)
+    {
+        auto it = mReadBuffers.find(p);
+        if (it == mReadBuffers.end())
+        {
+            auto ring = ReadRingBuffer::create(mReadBufferCapacity);
+            if (!ring)
+            {
+                spdlog::error("BufferedQueueManager::reserveRead. Could not allocate read buffer for peer={}",
+                              p.getId().toString());
+                return {};
+            }
+
+            ring->setOnRelease(mOnReadSpaceAvailable);
+            it = mReadBuffers.emplace(p, std::move(ring)).first;
+        }
+
+        return it->second->reserve();
+    }
+
+    bool BufferedQueueManager::commitRead(const PeerFd& p, uint32_t bytes)
+    {
+        auto* ring = getReadBuffer(p);
+        if (!ring)
+        {
+            return false;
+        }
+
+        ring->commit(bytes);
+        return ring->hasMessage();
+    }
+
+    std::optional<ReadLease> BufferedQueueManager::popMessage(const PeerFd& p)
+    {
+        auto* ring = getReadBuffer(p);
+        if (!ring)
+        {
+            return std::nullopt;
+        }
+
+        return ring->nextMessage();
+    }
+
+    bool BufferedQueueManager::isReadStalled(const PeerFd& p) const
+    {
+        const auto* ring = getReadBuffer(p);
+        return ring && ring->isStalled();
+    }
+
+    bool BufferedQueueManager::isReadOversized(const PeerFd& p) const
+    {
+        const auto* ring = getReadBuffer(p);
+        return ring && ring->isOversized();
+    }
+
+    void BufferedQueueManager::removeFromReadBuffer(const PeerFd& p)
+    {
+        // Outstanding leases keep the ring alive until they are released
+        mReadBuffers.erase(p);
+    }
+
+    void BufferedQueueManager::onReadSpaceAvailable(std::function<void()> callback)
+    {
+        mOnReadSpaceAvailable = std::move(callback);
+        for (auto& [_, ring] : mReadBuffers)
+        {
+            ring->setOnRelease(mOnReadSpaceAvailable);
+        }
+    }
+
+    ReadRingBuffer* BufferedQueueManager::getReadBuffer(const PeerFd& p)
+    {
+        auto it = mReadBuffers.find(p);
+
+        if (it != mReadBuffers.end())
+        {
+            return it->second.get();
+        }
+
+        return nullptr;
+    }
+
+    const ReadRingBuffer* BufferedQueueManager::getReadBuffer(const PeerFd& p) const
+    {
+        auto it = mReadBuffers.find(p);
+
+        if (it != mReadBuffers.end())
+        {
+            return it->second.get();
+        }
+
+        return nullptr;
     }
 }
\ No newline at end of file
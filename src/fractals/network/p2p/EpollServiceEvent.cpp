@@ -43,6 +43,18 @@ std::ostream &operator<<(std::ostream &os, const UnSubscribe &e)
               << "peer=" << e.peer.getId().toString();
 };
 
+std::ostream &operator<<(std::ostream &os, const Listen &e)
+{
+    return os << "Listen: "
+              << "listener=" << e.listener.getId().toString();
+};
+
+std::ostream &operator<<(std::ostream &os, const PeerAccepted &e)
+{
+    return os << "PeerAccepted: "
+              << "peer=" << e.peer.getId().toString();
+};
+
 std::ostream &operator<<(std::ostream &os, const CtlResponse &e)
 {
     return os << "CtlResponse: "
@@ -0,0 +1,165 @@
+#include <fractals/network/p2p/HashService.h>
+
+#include <algorithm>
+#include <spdlog/spdlog.h>
+#include <utility>
+
+namespace fractals::network::p2p
+{
+
+HashService::HashService(uint32_t numWorkers)
+{
+    // Results must never be lost, the buffer of the piece travels with them
+    mResults.setOverflowPolicy(common::OverflowPolicy::Overflow);
+
+    for (uint32_t i = 0; i < numWorkers; ++i)
+    {
+        mWorkers.emplace_back(&HashService::work, this);
+    }
+}
+
+HashService::~HashService()
+{
+    stop();
+}
+
+void HashService::push(HashRequest &&request)
+{
+    if (mWorkers.empty())
+    {
+        mResults.push(verify(std::move(request)));
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> _lock(mMutex);
+        if (mStopped)
+        {
+            spdlog::warn("HashService::push. Stopped, dropping piece={}", request.pieceIndex);
+            return;
+        }
+        mJobs.push_back(std::move(request));
+    }
+
+    mCv.notify_one();
+}
+
+void HashService::stop()
+{
+    {
+        std::lock_guard<std::mutex> _lock(mMutex);
+        mStopped = true;
+        mJobs.clear();
+    }
+
+    mCv.notify_all();
+    for (auto &worker : mWorkers)
+    {
+        if (worker.joinable())
+        {
+            worker.join();
+        }
+    }
+}
+
+HashService::ResultEndPoint HashService::getResultEndPoint()
+{
+    return ResultEndPoint{mResults};
+}
+
+size_t HashService::getPending() const
+{
+    std::lock_guard<std::mutex> _lock(mMutex);
+    return mJobs.size();
+}
+
+uint32_t HashService::defaultWorkers()
+{
+    return std::clamp(std::thread::hardware_concurrency() / 2, 1u, 4u);
+}
+
+HashResult HashService::verify(HashRequest &&request)
+{
+    const auto data = request.data.view();
+    if (request.hashedBytes < data.size())
+    {
+        request.hasher.update(data.substr(request.hashedBytes));
+    }
+
+    const bool valid = request.hasher.finalize() == request.expected.underlying;
+    return HashResult{request.infoHash, request.pieceIndex, std::move(request.data), valid};
+}
+
+void HashService::verifyBatch(std::vector<HashRequest> &batch, std::vector<HashResult> &results)
+{
+    std::vector<std::string_view> inputs;
+    for (auto &request : batch)
+    {
+        if (request.hashedBytes == 0)
+        {
+            inputs.push_back(request.data.view());
+        }
+        else
+        {
+            results.push_back(verify(std::move(request)));
+        }
+    }
+
+    std::vector<common::Sha1::Digest> digests(inputs.size());
+    common::Sha1::digestMany(inputs, digests);
+
+    size_t next{0};
+    for (auto &request : batch)
+    {
+        if (request.hashedBytes == 0)
+        {
+            const bool valid = digests[next++] == request.expected.underlying;
+            results.push_back(
+                HashResult{request.infoHash, request.pieceIndex, std::move(request.data), valid});
+        }
+    }
+}
+
+void HashService::work()
+{
+    std::vector<HashRequest> batch;
+    std::vector<HashResult> results;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCv.wait(lock,
+                     [this]()
+                     {
+                         return mStopped || !mJobs.empty();
+                     });
+            if (mStopped)
+            {
+                return;
+            }
+
+            takeBatch(batch);
+        }
+
+        verifyBatch(batch, results);
+        for (auto &result : results)
+        {
+            mResults.push(std::move(result));
+        }
+
+        batch.clear();
+        results.clear();
+    }
+}
+
+void HashService::takeBatch(std::vector<HashRequest> &batch)
+{
+    do
+    {
+        batch.push_back(std::move(mJobs.front()));
+        mJobs.pop_front();
+    } while (batch.front().hashedBytes == 0 && batch.size() < MAX_BATCH && !mJobs.empty() &&
+             mJobs.front().hashedBytes == 0);
+}
+
+} // namespace fractals::network::p2p
@@ -7,6 +7,11 @@ namespace fractals::network::p2p
         return os << "Connect[peer=]" << e.peer.toString() << "]";
     }
 
+    std::ostream &operator<<(std::ostream &os, const IncomingConnection &e)
+    {
+        return os << "Incoming[peer=" << e.peer.toString() << "]";
+    }
+
     std::ostream &operator<<(std::ostream &os, const Message &m)
     {
         return os << "Message[peer=" << m.peer.toString() << ", content=" << m.message << "]";
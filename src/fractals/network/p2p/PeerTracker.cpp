@@ -1,6 +1,7 @@
 #include <fractals/common/Tagged.h>
 #include <fractals/network/http/Peer.h>
 #include <fractals/network/p2p/PeerTracker.h>
+#include <algorithm>
 #include <spdlog/spdlog.h>
 #include <unordered_set>
 
@@ -29,6 +30,7 @@ const std::unordered_set<http::PeerId> &PeersInfo::getActivePeers() const
 
 void PeersInfo::addActivePeer(http::PeerId peer)
 {
+    inactivePeers.erase(peer);
     activePeers.emplace(peer);
 }
 
@@ -81,15 +83,48 @@ std::vector<PeerCommand> PeerTracker::onPeerDisconnect(const http::PeerId &peer)
         return {};
     }
 
-    peersInfoMap[it->second.torrent].makeInactive(peer);
-    peerMap.erase(peer);
+    const auto torrent = it->second.torrent;
+    peersInfoMap[torrent].makeInactive(peer);
     currConnectedPeers--;
 
     spdlog::info(
         "PeerTracker::onPeerDisconnect. currConnectedPeers={} torrent={} connectedToTorr={}",
-        currConnectedPeers, it->second.torrent,
-        peersInfoMap[it->second.torrent].getConnectedPeerCount());
+        currConnectedPeers, torrent, peersInfoMap[torrent].getConnectedPeerCount());
 
+    std::vector<PeerCommand> cmds;
+
+    // Inbound peers connect from an ephemeral port, they can not be dialed back
+    auto &p = it->second;
+    if (p.inbound || ++p.failures > maxReconnects)
+    {
+        peerMap.erase(it);
+    }
+    else
+    {
+        p.connected = PeerConnection::NOT_CONNECTED;
+        p.backingOff = true;
+        cmds.emplace_back(
+            PeerCommand{PeerCommandFlag::RECONNECT_LATER, peer, torrent, reconnectDelay(p.failures)});
+    }
+
+    if (activeTorrents.contains(torrent))
+    {
+        const auto torrCmds = makeCommand();
+        cmds.insert(cmds.end(), torrCmds.begin(), torrCmds.end());
+    }
+
+    return cmds;
+}
+
+std::vector<PeerCommand> PeerTracker::onReconnectDue(const http::PeerId &peer)
+{
+    auto it = peerMap.find(peer);
+    if (it == peerMap.end() || !it->second.backingOff)
+    {
+        return {};
+    }
+
+    it->second.backingOff = false;
     if (activeTorrents.contains(it->second.torrent))
     {
         return makeCommand();
@@ -98,11 +133,20 @@ std::vector<PeerCommand> PeerTracker::onPeerDisconnect(const http::PeerId &peer)
     return {};
 }
 
+std::chrono::milliseconds PeerTracker::reconnectDelay(uint8_t failures) const
+{
+    // Doubles with every failure
+    const auto delay = minReconnectDelay * (1 << std::min<uint8_t>(failures - 1, 16));
+    return std::min(delay, maxReconnectDelay);
+}
+
 std::vector<PeerCommand> PeerTracker::onPeerConnect(const http::PeerId &peer)
 {
     const auto &torr = peerMap[peer].torrent;
     peerMap[peer].connected = PeerConnection::CONNECTED;
     peerMap[peer].hasConnectedBefore = true;
+    // Only consecutive failures count towards the backoff and the reconnect limit
+    peerMap[peer].failures = 0;
     peersInfoMap[torr].incrConnected();
 
     spdlog::info("PeerTracker::onPeerConnect. currConnectedPeers={} torrent={} connectedToTorr={}",
@@ -116,6 +160,32 @@ std::vector<PeerCommand> PeerTracker::onPeerConnect(const http::PeerId &peer)
     return {};
 }
 
+bool PeerTracker::onInboundPeer(const http::PeerId &peer, const common::InfoHash &torrent)
+{
+    if (peerMap.contains(peer) && peerMap[peer].connected != PeerConnection::NOT_CONNECTED)
+    {
+        spdlog::warn("PeerTracker::onInboundPeer. Peer {} already connected", peer.toString());
+        return false;
+    }
+
+    auto &info = peersInfoMap[torrent];
+    if (info.getActivePeerCount() >= maxPeersPerTorrent || currConnectedPeers >= maxConnectedPeers)
+    {
+        spdlog::info("PeerTracker::onInboundPeer. Peer limit reached for torrent={}", torrent);
+        return false;
+    }
+
+    peerMap[peer] = Peer{PeerConnection::CONNECTED, peer, torrent, true, true};
+    currConnectedPeers++;
+    info.addActivePeer(peer);
+    info.incrConnected();
+
+    spdlog::info("PeerTracker::onInboundPeer. currConnectedPeers={} torrent={} connectedToTorr={}",
+                 currConnectedPeers, torrent, info.getConnectedPeerCount());
+
+    return true;
+}
+
 std::vector<PeerCommand> PeerTracker::onAnnounce(const http::Announce &announce)
 {
     for (const auto &peerId : announce.peers)
@@ -204,7 +274,7 @@ PeerTracker::Peer *PeerTracker::findNotConnectedPeer(const common::InfoHash &tor
                            [](const auto &kvp)
                            {
                                return kvp.second.connected == PeerConnection::NOT_CONNECTED &&
-                                      !kvp.second.hasConnectedBefore;
+                                      !kvp.second.backingOff;
                            });
 
     if (it == peerMap.end())
@@ -0,0 +1,375 @@
+#include <fractals/network/p2p/PieceBitset.h>
+
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace fractals::network::p2p
+{
+
+namespace
+{
+constexpr uint32_t WORD_BITS = 64;
+
+size_t numWords(uint32_t numPieces)
+{
+    return (numPieces + WORD_BITS - 1) / WORD_BITS;
+}
+
+// Wire order is most significant bit first, words are least significant bit first
+uint8_t reverseBits(uint8_t byte)
+{
+    byte = (byte & 0xf0) >> 4 | (byte & 0x0f) << 4;
+    byte = (byte & 0xcc) >> 2 | (byte & 0x33) << 2;
+    return (byte & 0xaa) >> 1 | (byte & 0x55) << 1;
+}
+
+#if defined(__AVX2__)
+constexpr size_t LANES = 4;
+
+__m256i load(const uint64_t *words)
+{
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(words));
+}
+
+void store(uint64_t *words, __m256i v)
+{
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(words), v);
+}
+
+// Popcount of every byte with a nibble lookup, summed into the four 64 bit lanes
+__m256i popcount(__m256i v)
+{
+    const auto lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1,
+                                         1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const auto nibble = _mm256_set1_epi8(0x0f);
+    const auto lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, nibble));
+    const auto hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+    return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+uint64_t sum(__m256i v)
+{
+    return _mm256_extract_epi64(v, 0) + _mm256_extract_epi64(v, 1) +
+           _mm256_extract_epi64(v, 2) + _mm256_extract_epi64(v, 3);
+}
+#elif defined(__ARM_NEON)
+constexpr size_t LANES = 2;
+
+uint64_t popcount(uint64x2_t v)
+{
+    return vaddlvq_u8(vcntq_u8(vreinterpretq_u8_u64(v)));
+}
+
+bool isZero(uint64x2_t v)
+{
+    return (vgetq_lane_u64(v, 0) | vgetq_lane_u64(v, 1)) == 0;
+}
+#else
+constexpr size_t LANES = 1;
+#endif
+
+uint32_t countWords(const uint64_t *lhs, const uint64_t *rhs, size_t n)
+{
+    size_t w = 0;
+    uint64_t total = 0;
+#if defined(__AVX2__)
+    auto acc = _mm256_setzero_si256();
+    for (; w + LANES <= n; w += LANES)
+    {
+        const auto v = rhs ? _mm256_and_si256(load(lhs + w), load(rhs + w)) : load(lhs + w);
+        acc = _mm256_add_epi64(acc, popcount(v));
+    }
+    total = sum(acc);
+#elif defined(__ARM_NEON)
+    for (; w + LANES <= n; w += LANES)
+    {
+        const auto l = vld1q_u64(lhs + w);
+        const auto v = rhs ? vandq_u64(l, vld1q_u64(rhs + w)) : l;
+        total += popcount(v);
+    }
+#endif
+    for (; w < n; ++w)
+    {
+        total += std::popcount(rhs ? lhs[w] & rhs[w] : lhs[w]);
+    }
+
+    return static_cast<uint32_t>(total);
+}
+
+// Index of the first word in [from, n) with a bit set in both, or in lhs if rhs is null
+size_t firstNonZero(const uint64_t *lhs, const uint64_t *rhs, size_t from, size_t n)
+{
+    size_t w = from;
+#if defined(__AVX2__)
+    for (; w + LANES <= n; w += LANES)
+    {
+        const auto v = rhs ? _mm256_and_si256(load(lhs + w), load(rhs + w)) : load(lhs + w);
+        if (!_mm256_testz_si256(v, v))
+        {
+            break;
+        }
+    }
+#elif defined(__ARM_NEON)
+    for (; w + LANES <= n; w += LANES)
+    {
+        const auto l = vld1q_u64(lhs + w);
+        const auto v = rhs ? vandq_u64(l, vld1q_u64(rhs + w)) : l;
+        if (!isZero(v))
+        {
+            break;
+        }
+    }
+#endif
+    for (; w < n; ++w)
+    {
+        if (rhs ? lhs[w] & rhs[w] : lhs[w])
+        {
+            return w;
+        }
+    }
+
+    return n;
+}
+
+enum class Op
+{
+    And,
+    Or,
+    AndNot
+};
+
+template <Op op> uint64_t apply(uint64_t lhs, uint64_t rhs)
+{
+    if constexpr (op == Op::And)
+    {
+        return lhs & rhs;
+    }
+    else if constexpr (op == Op::Or)
+    {
+        return lhs | rhs;
+    }
+    else
+    {
+        return lhs & ~rhs;
+    }
+}
+
+template <Op op> void applyWords(uint64_t *lhs, const uint64_t *rhs, size_t n)
+{
+    size_t w = 0;
+#if defined(__AVX2__)
+    for (; w + LANES <= n; w += LANES)
+    {
+        const auto l = load(lhs + w);
+        const auto r = load(rhs + w);
+        if constexpr (op == Op::And)
+        {
+            store(lhs + w, _mm256_and_si256(l, r));
+        }
+        else if constexpr (op == Op::Or)
+        {
+            store(lhs + w, _mm256_or_si256(l, r));
+        }
+        else
+        {
+            store(lhs + w, _mm256_andnot_si256(r, l));
+        }
+    }
+#elif defined(__ARM_NEON)
+    for (; w + LANES <= n; w += LANES)
+    {
+        const auto l = vld1q_u64(lhs + w);
+        const auto r = vld1q_u64(rhs + w);
+        if constexpr (op == Op::And)
+        {
+            vst1q_u64(lhs + w, vandq_u64(l, r));
+        }
+        else if constexpr (op == Op::Or)
+        {
+            vst1q_u64(lhs + w, vorrq_u64(l, r));
+        }
+        else
+        {
+            vst1q_u64(lhs + w, vbicq_u64(l, r));
+        }
+    }
+#endif
+    for (; w < n; ++w)
+    {
+        lhs[w] = apply<op>(lhs[w], rhs[w]);
+    }
+}
+} // namespace
+
+PieceBitset::PieceBitset(uint32_t numPieces) : mWords(numWords(numPieces)), mSize(numPieces)
+{
+}
+
+PieceBitset::PieceBitset(uint32_t numPieces, std::initializer_list<uint32_t> pieces)
+    : PieceBitset(numPieces)
+{
+    for (auto piece : pieces)
+    {
+        set(piece);
+    }
+}
+
+PieceBitset PieceBitset::fromBitfield(uint32_t numPieces, std::string_view bytes)
+{
+    PieceBitset bits(numPieces);
+    const auto numBytes = std::min<size_t>(bytes.size(), (numPieces + 7) / 8);
+    for (size_t i = 0; i < numBytes; ++i)
+    {
+        const uint64_t byte = reverseBits(static_cast<uint8_t>(bytes[i]));
+        bits.mWords[i / 8] |= byte << (i % 8 * 8);
+    }
+
+    bits.trimTail();
+    return bits;
+}
+
+std::string PieceBitset::toBitfield() const
+{
+    std::string bytes((mSize + 7) / 8, '\0');
+    for (size_t i = 0; i < bytes.size(); ++i)
+    {
+        const auto byte = static_cast<uint8_t>(mWords[i / 8] >> (i % 8 * 8));
+        bytes[i] = static_cast<char>(reverseBits(byte));
+    }
+
+    return bytes;
+}
+
+uint32_t PieceBitset::size() const
+{
+    return mSize;
+}
+
+void PieceBitset::resize(uint32_t numPieces)
+{
+    mWords.resize(numWords(numPieces));
+    mSize = numPieces;
+    trimTail();
+}
+
+bool PieceBitset::test(uint32_t piece) const
+{
+    return piece < mSize && (mWords[piece / WORD_BITS] >> (piece % WORD_BITS) & 1);
+}
+
+bool PieceBitset::set(uint32_t piece)
+{
+    if (piece >= mSize || test(piece))
+    {
+        return false;
+    }
+
+    mWords[piece / WORD_BITS] |= uint64_t{1} << (piece % WORD_BITS);
+    return true;
+}
+
+bool PieceBitset::reset(uint32_t piece)
+{
+    if (!test(piece))
+    {
+        return false;
+    }
+
+    mWords[piece / WORD_BITS] &= ~(uint64_t{1} << (piece % WORD_BITS));
+    return true;
+}
+
+void PieceBitset::clear()
+{
+    std::fill(mWords.begin(), mWords.end(), 0);
+}
+
+uint32_t PieceBitset::count() const
+{
+    return countWords(mWords.data(), nullptr, mWords.size());
+}
+
+bool PieceBitset::none() const
+{
+    return firstNonZero(mWords.data(), nullptr, 0, mWords.size()) == mWords.size();
+}
+
+uint32_t PieceBitset::countAnd(const PieceBitset &other) const
+{
+    return countWords(mWords.data(), other.mWords.data(),
+                      std::min(mWords.size(), other.mWords.size()));
+}
+
+bool PieceBitset::intersects(const PieceBitset &other) const
+{
+    const auto n = std::min(mWords.size(), other.mWords.size());
+    return firstNonZero(mWords.data(), other.mWords.data(), 0, n) != n;
+}
+
+PieceBitset &PieceBitset::operator&=(const PieceBitset &other)
+{
+    const auto n = std::min(mWords.size(), other.mWords.size());
+    applyWords<Op::And>(mWords.data(), other.mWords.data(), n);
+    std::fill(mWords.begin() + n, mWords.end(), 0);
+    return *this;
+}
+
+PieceBitset &PieceBitset::operator|=(const PieceBitset &other)
+{
+    applyWords<Op::Or>(mWords.data(), other.mWords.data(),
+                       std::min(mWords.size(), other.mWords.size()));
+    trimTail();
+    return *this;
+}
+
+PieceBitset &PieceBitset::andNot(const PieceBitset &other)
+{
+    applyWords<Op::AndNot>(mWords.data(), other.mWords.data(),
+                           std::min(mWords.size(), other.mWords.size()));
+    return *this;
+}
+
+uint32_t PieceBitset::findFirst(uint32_t from) const
+{
+    return findFirstAnd(*this, from);
+}
+
+uint32_t PieceBitset::findFirstAnd(const PieceBitset &other, uint32_t from) const
+{
+    const auto n = std::min(mWords.size(), other.mWords.size());
+    auto w = size_t{from / WORD_BITS};
+    if (from >= mSize || w >= n)
+    {
+        return NPOS;
+    }
+
+    // Bits of the first word below from do not count
+    const auto first = mWords[w] & other.mWords[w] & (~uint64_t{0} << (from % WORD_BITS));
+    if (!first)
+    {
+        w = firstNonZero(mWords.data(), other.mWords.data(), w + 1, n);
+        if (w == n)
+        {
+            return NPOS;
+        }
+    }
+
+    const auto word = first ? first : mWords[w] & other.mWords[w];
+    return static_cast<uint32_t>(w * WORD_BITS + std::countr_zero(word));
+}
+
+void PieceBitset::trimTail()
+{
+    // Bits past the size are kept zero, so that whole words can be counted and compared
+    if (mSize % WORD_BITS && !mWords.empty())
+    {
+        mWords.back() &= (uint64_t{1} << (mSize % WORD_BITS)) - 1;
+    }
+}
+
+} // namespace fractals::network::p2p
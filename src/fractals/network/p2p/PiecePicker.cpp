@@ -0,0 +1,85 @@
+#include <fractals/network/p2p/PiecePicker.h>
+
+namespace fractals::network::p2p
+{
+
+void PiecePicker::resize(uint32_t numPieces)
+{
+    mAvailability.assign(numPieces, 0);
+    mWanted = PieceBitset(numPieces);
+    for (uint32_t piece = 0; piece < numPieces; ++piece)
+    {
+        mWanted.set(piece);
+    }
+
+    mBuckets.assign(1, mWanted);
+    mBucketSize.assign(1, numPieces);
+}
+
+void PiecePicker::addAvailability(uint32_t piece)
+{
+    if (piece >= mAvailability.size())
+    {
+        return;
+    }
+
+    const auto availability = mAvailability[piece]++;
+    if (!isWanted(piece))
+    {
+        return;
+    }
+
+    if (availability + 1 >= mBuckets.size())
+    {
+        mBuckets.emplace_back(mWanted.size());
+        mBucketSize.push_back(0);
+    }
+
+    move(piece, availability, availability + 1);
+}
+
+void PiecePicker::removeAvailability(uint32_t piece)
+{
+    if (piece >= mAvailability.size() || mAvailability[piece] == 0)
+    {
+        return;
+    }
+
+    const auto availability = mAvailability[piece]--;
+    if (isWanted(piece))
+    {
+        move(piece, availability, availability - 1);
+    }
+}
+
+uint32_t PiecePicker::getAvailability(uint32_t piece) const
+{
+    return piece < mAvailability.size() ? mAvailability[piece] : 0;
+}
+
+bool PiecePicker::isWanted(uint32_t piece) const
+{
+    return mWanted.test(piece);
+}
+
+void PiecePicker::remove(uint32_t piece)
+{
+    if (!mWanted.reset(piece))
+    {
+        return;
+    }
+
+    const auto availability = mAvailability[piece];
+    mBuckets[availability].reset(piece);
+    --mBucketSize[availability];
+}
+
+void PiecePicker::move(uint32_t piece, uint32_t from, uint32_t to)
+{
+    mBuckets[from].reset(piece);
+    --mBucketSize[from];
+    mBuckets[to].set(piece);
+    ++mBucketSize[to];
+}
+
+} // namespace fractals::network::p2p
@@ -8,7 +8,6 @@
 #include <cstdint>
 #include <numeric>
 #include <stdexcept>
-#include <unordered_set>
 
 namespace fractals::network::p2p
 {
@@ -17,19 +16,47 @@ PieceState::PieceState(uint32_t pieceIndex, uint64_t maxSize, uint64_t offset)
 {
 }
 
-void PieceState::initialize()
+bool PieceState::initialize(common::BufferPool *pool)
 {
-    mPieceData.reserve(mMaxSize);
+    if (isInitialized())
+    {
+        return true;
+    }
+
+    mPieceData = pool ? pool->acquire(mMaxSize) : common::PieceBuffer{mMaxSize};
+    if (!mPieceData)
+    {
+        return false;
+    }
+
+    mReceived.resize(getNumBlocks());
+    mOwners.resize(getNumBlocks(), NO_OWNER);
+    mDuplicates.resize(getNumBlocks());
+    return true;
+}
+
+bool PieceState::isInitialized() const
+{
+    return !mReceived.empty();
 }
 
 void PieceState::clear()
 {
-    mPieceData.clear();
+    mPieceData = common::PieceBuffer{};
+    mReceived.clear();
+    mOwners.clear();
+    mDuplicates.clear();
+    mPartial.clear();
+    mHasher.reset();
+    mHashedBytes = 0;
+    mReceivedBytes = 0;
+    mNumReceived = 0;
+    mNumReserved = 0;
 }
 
 uint64_t PieceState::getRemainingSize() const
 {
-    return mMaxSize - mPieceData.size();
+    return mMaxSize - mReceivedBytes;
 }
 
 uint64_t PieceState::getMaxSize() const
@@ -39,7 +66,15 @@ uint64_t PieceState::getMaxSize() const
 
 uint32_t PieceState::getNextBeginIndex() const
 {
-    return mPieceData.size();
+    const auto it = std::find(mReceived.begin(), mReceived.end(), false);
+    if (it == mReceived.end())
+    {
+        return mReceived.empty() ? 0 : mMaxSize;
+    }
+
+    const uint32_t block = std::distance(mReceived.begin(), it);
+    const auto partial = mPartial.find(block);
+    return block * BLOCK_SIZE + (partial != mPartial.end() ? partial->second : 0);
 }
 
 uint32_t PieceState::getPieceIndex() const
@@ -57,44 +92,189 @@ bool PieceState::isComplete() const
     return getRemainingSize() == 0;
 }
 
-void PieceState::addBlock(const std::string_view block)
+uint32_t PieceState::getNumBlocks() const
+{
+    return (mMaxSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+bool PieceState::hasBlock(uint32_t block) const
+{
+    return block < mReceived.size() && mReceived[block];
+}
+
+bool PieceState::isReserved(uint32_t block) const
+{
+    return getOwner(block) != NO_OWNER;
+}
+
+uint32_t PieceState::getOwner(uint32_t block) const
+{
+    return block < mOwners.size() ? mOwners[block] : NO_OWNER;
+}
+
+bool PieceState::hasFreeBlocks() const
+{
+    return mNumReceived + mNumReserved < getNumBlocks();
+}
+
+std::optional<BlockRange> PieceState::reserveBlock(uint32_t owner)
+{
+    for (uint32_t block = 0; block < mReceived.size(); ++block)
+    {
+        if (!mReceived[block] && mOwners[block] == NO_OWNER)
+        {
+            mOwners[block] = owner;
+            ++mNumReserved;
+            return missingRange(block);
+        }
+    }
+
+    return std::nullopt;
+}
+
+void PieceState::releaseBlock(uint32_t begin, uint32_t owner)
+{
+    const auto block = begin / BLOCK_SIZE;
+    if (block < mOwners.size() && mOwners[block] != NO_OWNER && mOwners[block] == owner)
+    {
+        mOwners[block] = NO_OWNER;
+        --mNumReserved;
+    }
+}
+
+void PieceState::releaseDuplicate(uint32_t begin)
+{
+    const auto block = begin / BLOCK_SIZE;
+    if (block < mDuplicates.size() && mDuplicates[block] > 0)
+    {
+        --mDuplicates[block];
+    }
+}
+
+uint32_t PieceState::getMissingBlocks() const
+{
+    return getNumBlocks() - mNumReceived;
+}
+
+bool PieceState::addBlock(uint32_t begin, const std::string_view data)
+{
+    if (!isInitialized() || data.empty() || begin + data.size() > mMaxSize)
+    {
+        return false;
+    }
+
+    const auto block = begin / BLOCK_SIZE;
+    const auto blockBegin = block * BLOCK_SIZE;
+    // Blocks are requested one at a time, so data never spans multiple blocks
+    if (mReceived[block] || begin + data.size() > blockBegin + blockLength(block))
+    {
+        return false;
+    }
+
+    const auto partial = mPartial.find(block);
+    const uint32_t received = partial != mPartial.end() ? partial->second : 0;
+    if (begin != blockBegin + received)
+    {
+        return false;
+    }
+
+    std::copy(data.begin(), data.end(), mPieceData.data() + begin);
+    mReceivedBytes += data.size();
+
+    if (received + data.size() == blockLength(block))
+    {
+        // Block is done, whoever reserved it
+        releaseBlock(begin, mOwners[block]);
+        mReceived[block] = true;
+        ++mNumReceived;
+        mDuplicates[block] = 0;
+        mPartial.erase(block);
+    }
+    else
+    {
+        mPartial[block] = received + data.size();
+    }
+
+    // Data that continues the hashed prefix is hashed while it is still in cache. Blocks that
+    // arrived ahead of a gap are left to the verification, so filling the gap stays cheap.
+    if (begin == mHashedBytes)
+    {
+        mHasher.update(data);
+        mHashedBytes += data.size();
+    }
+
+    return true;
+}
+
+uint64_t PieceState::getHashedBytes() const
 {
-    common::append(mPieceData, block);
+    return mHashedBytes;
 }
 
-std::vector<char> &&PieceState::extractData()
+const common::Sha1 &PieceState::getHasher() const
+{
+    return mHasher;
+}
+
+common::PieceBuffer PieceState::extractData()
 {
     return std::move(mPieceData);
 }
 
 std::string_view PieceState::getBuffer()
 {
-    return std::string_view{mPieceData.begin(), mPieceData.end()};
+    return mPieceData.view();
+}
+
+uint32_t PieceState::blockLength(uint32_t block) const
+{
+    return std::min<uint64_t>(BLOCK_SIZE, mMaxSize - uint64_t{block} * BLOCK_SIZE);
+}
+
+BlockRange PieceState::missingRange(uint32_t block) const
+{
+    const auto partial = mPartial.find(block);
+    const uint32_t received = partial != mPartial.end() ? partial->second : 0;
+    return BlockRange{block * BLOCK_SIZE + received, blockLength(block) - received};
 }
 
 void PieceStateManager::populate(const std::vector<persist::PieceModel> &pieceModels)
 {
-    std::vector<uint32_t> completedPieces;
-    completedPieces.reserve(pieceModels.size());
-    for (const auto pm : pieceModels)
+    uint32_t numPieces{0};
+    for (const auto &pm : pieceModels)
+    {
+        numPieces = std::max(numPieces, pm.piece + 1);
+    }
+
+    mAvailable.resize(numPieces);
+    mInProgress.resize(numPieces);
+    mCompletedPieces.resize(numPieces);
+    mVerifying.resize(numPieces);
+    mPicker.resize(numPieces);
+
+    uint64_t offset{0};
+    for (const auto &pm : pieceModels)
     {
         if (pm.complete)
         {
-            completedPieces.emplace_back(pm.piece);
+            mCompletedPieces.set(pm.piece);
         }
         else
         {
-            mAvailable.emplace(pm.piece);
+            mAvailable.set(pm.piece);
         }
 
         mHashes.emplace(pm.piece, common::PieceHash{pm.hash});
+        mAllPieces.emplace(pm.piece, PieceState(pm.piece, pm.size, offset));
+        offset += pm.size;
     }
 
-    uint64_t offset{0};
-    for (const auto &pm : pieceModels)
+    for (uint32_t piece = 0; piece < numPieces; ++piece)
     {
-        mAllPieces.emplace(pm.piece, PieceState(pm.piece, pm.size, offset));
-        offset += pm.size;
+        if (!mAvailable.test(piece))
+        {
+            mPicker.remove(piece);
+        }
     }
 }
 
@@ -110,35 +290,175 @@ PieceState *PieceStateManager::getPieceState(uint32_t pieceIndex)
     return nullptr;
 }
 
-PieceState *PieceStateManager::nextAvailablePiece(const std::unordered_set<uint32_t> &peerPieces)
+PieceState *PieceStateManager::nextAvailablePiece(const PieceBitset &peerPieces)
 {
-    std::unordered_set<uint32_t> pieces;
+    // Only called for pieces of the peer
+    const auto usable = [&](uint32_t piece)
+    {
+        const auto it = mAllPieces.find(piece);
+        return it != mAllPieces.end() && it->second.hasFreeBlocks();
+    };
+
+    std::optional<uint32_t> next;
+    mInProgress.forEachAnd(peerPieces,
+                           [&](uint32_t piece)
+                           {
+                               if (usable(piece) && (!next || mPicker.getAvailability(piece) <
+                                                                  mPicker.getAvailability(*next)))
+                               {
+                                   next = piece;
+                               }
+                           });
+
+    if (!next && mCompletedPieces.count() < mRandomFirstPieces)
+    {
+        next = mPicker.pickRandom(peerPieces, usable, mRng);
+    }
+
+    if (!next)
+    {
+        next = mPicker.pickRarest(
+            peerPieces,
+            [&](uint32_t piece)
+            {
+                return !mInProgress.test(piece) && usable(piece);
+            });
+    }
 
-    for (auto piece : peerPieces)
+    if (!next)
     {
-        if (mAvailable.count(piece))
+        return nullptr;
+    }
+
+    // No new pieces are started until the disk service returned buffers to the pool
+    auto &ps = mAllPieces.at(*next);
+    mWaitingForMemory = !ps.initialize(mBufferPool);
+    if (mWaitingForMemory)
+    {
+        spdlog::debug("PSM::nextAvailablePiece. No memory for piece={}", *next);
+        return nullptr;
+    }
+
+    mInProgress.set(*next);
+    return &ps;
+}
+
+bool PieceStateManager::hasAvailablePiece(const PieceBitset &peerPieces) const
+{
+    for (auto piece = mAvailable.findFirstAnd(peerPieces); piece != PieceBitset::NPOS;
+         piece = mAvailable.findFirstAnd(peerPieces, piece + 1))
+    {
+        const auto it = mAllPieces.find(piece);
+        if (it != mAllPieces.end() && it->second.hasFreeBlocks())
         {
-            auto it = mAllPieces.find(piece);
+            return true;
+        }
+    }
+
+    return false;
+}
 
+void PieceStateManager::addAvailability(uint32_t pieceIndex)
+{
+    mPicker.addAvailability(pieceIndex);
+}
+
+void PieceStateManager::removeAvailability(uint32_t pieceIndex)
+{
+    mPicker.removeAvailability(pieceIndex);
+}
+
+uint32_t PieceStateManager::getAvailability(uint32_t pieceIndex) const
+{
+    return mPicker.getAvailability(pieceIndex);
+}
+
+void PieceStateManager::setBufferPool(common::BufferPool *pool)
+{
+    mBufferPool = pool;
+}
+
+bool PieceStateManager::isWaitingForMemory() const
+{
+    return mWaitingForMemory;
+}
+
+void PieceStateManager::setRandomFirstPieces(uint32_t numPieces)
+{
+    mRandomFirstPieces = numPieces;
+}
+
+uint32_t PieceStateManager::registerOwner()
+{
+    return ++mLastOwner;
+}
+
+void PieceStateManager::setEndgameConfig(const EndgameConfig &config)
+{
+    mEndgameConfig = config;
+}
+
+const EndgameConfig &PieceStateManager::getEndgameConfig() const
+{
+    return mEndgameConfig;
+}
+
+bool PieceStateManager::isEndgame() const
+{
+    // Every missing piece misses at least one block
+    const auto threshold = mEndgameConfig.blockThreshold;
+    if (threshold == 0 || mAvailable.count() > threshold)
+    {
+        return false;
+    }
+
+    uint64_t missing{0};
+    mAvailable.forEach(
+        [&](uint32_t piece)
+        {
+            const auto it = mAllPieces.find(piece);
             if (it != mAllPieces.end())
             {
-                it->second.initialize();
-                return &it->second;
+                missing += it->second.getMissingBlocks();
             }
-        }
-    }
+        });
 
-    return nullptr;
+    return missing <= threshold;
+}
+
+void PieceStateManager::countCancel()
+{
+    ++mEndgameStats.cancels;
+}
+
+void PieceStateManager::countWastedBytes(uint64_t bytes)
+{
+    mEndgameStats.wastedBytes += bytes;
+}
+
+const EndgameStats &PieceStateManager::getEndgameStats() const
+{
+    return mEndgameStats;
 }
 
 bool PieceStateManager::isCompleted(uint32_t pieceIndex)
 {
-    return mCompletedPieces.count(pieceIndex);
+    return mCompletedPieces.test(pieceIndex);
 }
 
 bool PieceStateManager::isAllComplete() const
 {
-    return mAvailable.empty();
+    return mAvailable.none();
+}
+
+bool PieceStateManager::isInteresting(const PieceBitset &peerPieces) const
+{
+    return peerPieces.intersects(mAvailable);
+}
+
+uint32_t PieceStateManager::getNumPieces() const
+{
+    return mAvailable.size();
 }
 
 bool PieceStateManager::isActive() const
@@ -156,12 +476,90 @@ void PieceStateManager::makeCompleted(uint32_t pieceIndex)
     auto it = mAllPieces.find(pieceIndex);
     if (it != mAllPieces.end())
     {
-        mAvailable.erase(pieceIndex);
-        mCompletedPieces.emplace(pieceIndex);
+        mAvailable.reset(pieceIndex);
+        mInProgress.reset(pieceIndex);
+        mCompletedPieces.set(pieceIndex);
+        mPicker.remove(pieceIndex);
         it->second.clear();
     }
 }
 
+void PieceStateManager::discard(uint32_t pieceIndex)
+{
+    auto it = mAllPieces.find(pieceIndex);
+    if (it != mAllPieces.end())
+    {
+        mInProgress.reset(pieceIndex);
+        it->second.clear();
+    }
+}
+
+void PieceStateManager::setHashService(HashService *service)
+{
+    mHashService = service;
+}
+
+PieceStateManager::Verification PieceStateManager::verify(const common::InfoHash &infoHash,
+                                                          PieceState &ps)
+{
+    const auto pieceIndex = ps.getPieceIndex();
+    if (mVerifying.test(pieceIndex))
+    {
+        return Verification::Pending;
+    }
+
+    const auto it = mHashes.find(pieceIndex);
+    if (it == mHashes.end())
+    {
+        spdlog::error("PSM::verify. Could not find hash for piece={}", pieceIndex);
+        return Verification::Invalid;
+    }
+
+    // Blocks that arrived in order were hashed already, only the digest is left
+    if (ps.getHashedBytes() == ps.getMaxSize() || mHashService == nullptr)
+    {
+        auto hasher = ps.getHasher();
+        hasher.update(ps.getBuffer().substr(ps.getHashedBytes()));
+        return hashCheck(pieceIndex, hasher.finalize()) ? Verification::Valid
+                                                        : Verification::Invalid;
+    }
+
+    mVerifying.set(pieceIndex);
+    mHashService->push(HashRequest{infoHash, pieceIndex, ps.extractData(), ps.getHasher(),
+                                   ps.getHashedBytes(), it->second});
+    return Verification::Pending;
+}
+
+void PieceStateManager::finishVerification(uint32_t pieceIndex)
+{
+    mVerifying.reset(pieceIndex);
+}
+
+bool PieceStateManager::isVerifying() const
+{
+    return !mVerifying.none();
+}
+
+bool PieceStateManager::hashCheck(uint32_t pieceIndex, const common::Sha1::Digest &digest) const
+{
+    const auto it = mHashes.find(pieceIndex);
+    if (it == mHashes.end())
+    {
+        spdlog::error("PSM::hashCheck. Could not find hash for piece={}", pieceIndex);
+        return false;
+    }
+
+    const bool valid = it->second.underlying == digest;
+    if (!valid)
+    {
+        spdlog::error("PSM::hashCheck. piece={} storedHash={} computedHash={}", pieceIndex,
+                      common::bytesToHex<20>(it->second.underlying),
+                      common::bytesToHex<20>(digest));
+    }
+
+    return valid;
+}
+
 std::unordered_map<uint32_t, PieceState>::iterator PieceStateManager::begin()
 {
     return mAllPieces.begin();
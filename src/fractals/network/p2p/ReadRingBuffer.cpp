@@ -0,0 +1,259 @@
+#include <fractals/common/utils.h>
+#include <fractals/network/p2p/ReadRingBuffer.h>
+
+#include <cerrno>
+#include <cstring>
+#include <spdlog/spdlog.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace fractals::network::p2p
+{
+ReadLease::ReadLease(std::vector<char> &&owned)
+    : mOwned(std::move(owned)), mData(mOwned.data()), mSize(mOwned.size())
+{
+}
+
+ReadLease::ReadLease(std::shared_ptr<ReadRingBuffer> ring, const char *data, uint32_t size)
+    : mRing(std::move(ring)), mData(data), mSize(size)
+{
+}
+
+ReadLease::ReadLease(ReadLease &&other) noexcept
+{
+    *this = std::move(other);
+}
+
+ReadLease &ReadLease::operator=(ReadLease &&other) noexcept
+{
+    if (this != &other)
+    {
+        release();
+        mRing = std::move(other.mRing);
+        mOwned = std::move(other.mOwned);
+        mData = mRing ? other.mData : mOwned.data();
+        mSize = other.mSize;
+
+        other.mData = nullptr;
+        other.mSize = 0;
+    }
+
+    return *this;
+}
+
+ReadLease::~ReadLease()
+{
+    release();
+}
+
+void ReadLease::release()
+{
+    if (mRing)
+    {
+        mRing->release(mSize);
+        mRing.reset();
+    }
+}
+
+const char *ReadLease::data() const
+{
+    return mData;
+}
+
+const char *ReadLease::begin() const
+{
+    return mData;
+}
+
+const char *ReadLease::end() const
+{
+    return mData + mSize;
+}
+
+size_t ReadLease::size() const
+{
+    return mSize;
+}
+
+bool ReadLease::empty() const
+{
+    return mSize == 0;
+}
+
+bool ReadLease::operator==(const ReadLease &other) const
+{
+    return std::string_view(begin(), end()) == std::string_view(other.begin(), other.end());
+}
+
+std::shared_ptr<ReadRingBuffer> ReadRingBuffer::create(uint32_t capacity)
+{
+    const uint32_t pageSize = sysconf(_SC_PAGESIZE);
+    capacity = ((capacity + pageSize - 1) / pageSize) * pageSize;
+
+    int fd = memfd_create("fractals-read-ring", MFD_CLOEXEC);
+    if (fd < 0)
+    {
+        spdlog::error("ReadRingBuffer::create. memfd_create failed: {}", strerror(errno));
+        return nullptr;
+    }
+
+    if (ftruncate(fd, capacity) < 0)
+    {
+        spdlog::error("ReadRingBuffer::create. ftruncate failed: {}", strerror(errno));
+        ::close(fd);
+        return nullptr;
+    }
+
+    // Reserve twice the capacity, then map the same file into both halves
+    char *base = static_cast<char *>(
+        mmap(nullptr, 2 * capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (base == MAP_FAILED)
+    {
+        spdlog::error("ReadRingBuffer::create. mmap reserve failed: {}", strerror(errno));
+        ::close(fd);
+        return nullptr;
+    }
+
+    for (char *half : {base, base + capacity})
+    {
+        if (mmap(half, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) ==
+            MAP_FAILED)
+        {
+            spdlog::error("ReadRingBuffer::create. mmap mirror failed: {}", strerror(errno));
+            munmap(base, 2 * capacity);
+            ::close(fd);
+            return nullptr;
+        }
+    }
+
+    ::close(fd);
+
+    return std::shared_ptr<ReadRingBuffer>(new ReadRingBuffer(base, capacity));
+}
+
+ReadRingBuffer::ReadRingBuffer(char *data, uint32_t capacity) : mData(data), mCapacity(capacity)
+{
+}
+
+ReadRingBuffer::~ReadRingBuffer()
+{
+    munmap(mData, 2 * mCapacity);
+}
+
+std::span<char> ReadRingBuffer::reserve()
+{
+    if (isOversized())
+    {
+        return {};
+    }
+
+    uint64_t used = mWrite - mReleased.load(std::memory_order_acquire);
+    if (used == mCapacity)
+    {
+        mStalled.store(true, std::memory_order_seq_cst);
+
+        // A lease may have been released before we flagged the stall
+        used = mWrite - mReleased.load(std::memory_order_seq_cst);
+        if (used == mCapacity)
+        {
+            return {};
+        }
+
+        mStalled.store(false, std::memory_order_relaxed);
+    }
+
+    return std::span<char>(mData + (mWrite % mCapacity), mCapacity - used);
+}
+
+void ReadRingBuffer::commit(uint32_t bytes)
+{
+    mWrite += bytes;
+}
+
+std::optional<uint64_t> ReadRingBuffer::peekMessageLength() const
+{
+    const uint64_t available = mWrite - mParsed;
+    const char *head = mData + (mParsed % mCapacity);
+
+    // Peer always opens with a HandShake, which is prefixed by a single length byte
+    if (!mHandShakeReceived)
+    {
+        if (available < 1)
+        {
+            return std::nullopt;
+        }
+
+        return 49 + static_cast<uint8_t>(head[0]);
+    }
+
+    if (available < 4)
+    {
+        return std::nullopt;
+    }
+
+    std::string_view lenView(head, 4);
+    return 4 + static_cast<uint64_t>(common::bytesToInt<uint32_t>(lenView));
+}
+
+bool ReadRingBuffer::hasMessage() const
+{
+    const auto length = peekMessageLength();
+    return length && *length <= mCapacity && mWrite - mParsed >= *length;
+}
+
+std::optional<ReadLease> ReadRingBuffer::nextMessage()
+{
+    const auto length = peekMessageLength();
+    if (!length)
+    {
+        return std::nullopt;
+    }
+
+    if (*length > mCapacity || mWrite - mParsed < *length)
+    {
+        return std::nullopt;
+    }
+
+    const char *head = mData + (mParsed % mCapacity);
+    mParsed += *length;
+    mHandShakeReceived = true;
+
+    return ReadLease{shared_from_this(), head, static_cast<uint32_t>(*length)};
+}
+
+bool ReadRingBuffer::isStalled() const
+{
+    return mStalled.load(std::memory_order_acquire);
+}
+
+bool ReadRingBuffer::isOversized() const
+{
+    const auto length = peekMessageLength();
+    return length && *length > mCapacity;
+}
+
+uint32_t ReadRingBuffer::getCapacity() const
+{
+    return mCapacity;
+}
+
+uint64_t ReadRingBuffer::getUnparsedBytes() const
+{
+    return mWrite - mParsed;
+}
+
+void ReadRingBuffer::setOnRelease(std::function<void()> onRelease)
+{
+    mOnRelease = std::move(onRelease);
+}
+
+void ReadRingBuffer::release(uint32_t bytes)
+{
+    mReleased.fetch_add(bytes, std::memory_order_seq_cst);
+
+    if (mStalled.exchange(false) && mOnRelease)
+    {
+        mOnRelease();
+    }
+}
+} // namespace fractals::network::p2p
@@ -0,0 +1,198 @@
+#include <fractals/network/p2p/RequestPipeline.h>
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+namespace fractals::network::p2p
+{
+
+bool RequestPipeline::canRequest() const
+{
+    return outstanding.size() < depth;
+}
+
+bool RequestPipeline::empty() const
+{
+    return outstanding.empty();
+}
+
+size_t RequestPipeline::size() const
+{
+    return outstanding.size();
+}
+
+uint32_t RequestPipeline::getDepth() const
+{
+    return depth;
+}
+
+void RequestPipeline::add(BlockRequest request)
+{
+    request.deadline = request.sentAt + getTimeout();
+    outstanding.push_back(request);
+}
+
+std::optional<BlockRequest> RequestPipeline::complete(uint32_t piece, uint32_t begin,
+                                                      uint32_t length,
+                                                      std::chrono::nanoseconds now)
+{
+    // Peers mostly answer in order, so the match is usually at the front
+    const auto it = std::find_if(outstanding.begin(), outstanding.end(),
+                                 [&](const BlockRequest &req)
+                                 {
+                                     return req.piece == piece && req.begin == begin;
+                                 });
+    if (it == outstanding.end())
+    {
+        return std::nullopt;
+    }
+
+    const auto request = *it;
+    outstanding.erase(it);
+
+    meter.add(length, now);
+    sampleRtt(now - request.sentAt, now);
+    updateDepth(now);
+
+    return request;
+}
+
+void RequestPipeline::removePiece(uint32_t piece)
+{
+    std::erase_if(outstanding,
+                  [piece](const BlockRequest &req)
+                  {
+                      return req.piece == piece;
+                  });
+}
+
+std::deque<BlockRequest> RequestPipeline::takeAll()
+{
+    return std::exchange(outstanding, {});
+}
+
+std::optional<std::chrono::nanoseconds> RequestPipeline::oldestSentAt() const
+{
+    if (outstanding.empty())
+    {
+        return std::nullopt;
+    }
+
+    return std::min_element(outstanding.begin(), outstanding.end(),
+                            [](const BlockRequest &lhs, const BlockRequest &rhs)
+                            {
+                                return lhs.sentAt < rhs.sentAt;
+                            })
+        ->sentAt;
+}
+
+std::vector<BlockRequest> RequestPipeline::expire(std::chrono::nanoseconds now)
+{
+    auto expired = takeIf(
+        [now](const BlockRequest &req)
+        {
+            return req.deadline <= now;
+        });
+
+    if (!expired.empty())
+    {
+        depth = std::max(depth / 2, MIN_DEPTH);
+    }
+
+    return expired;
+}
+
+bool RequestPipeline::contains(uint32_t piece, uint32_t begin) const
+{
+    return std::any_of(outstanding.begin(), outstanding.end(),
+                       [&](const BlockRequest &req)
+                       {
+                           return req.piece == piece &&
+                                  req.begin / BLOCK_SIZE == begin / BLOCK_SIZE;
+                       });
+}
+
+std::optional<std::chrono::nanoseconds> RequestPipeline::nextDeadline() const
+{
+    if (outstanding.empty())
+    {
+        return std::nullopt;
+    }
+
+    return std::min_element(outstanding.begin(), outstanding.end(),
+                            [](const BlockRequest &lhs, const BlockRequest &rhs)
+                            {
+                                return lhs.deadline < rhs.deadline;
+                            })
+        ->deadline;
+}
+
+std::chrono::nanoseconds RequestPipeline::getTimeout() const
+{
+    if (!smoothedRtt)
+    {
+        return INITIAL_TIMEOUT;
+    }
+
+    return std::clamp<std::chrono::nanoseconds>(*smoothedRtt + 4 * rttVariance, MIN_TIMEOUT,
+                                                MAX_TIMEOUT);
+}
+
+std::optional<std::chrono::nanoseconds> RequestPipeline::getMinRtt() const
+{
+    return minRtt;
+}
+
+uint64_t RequestPipeline::getRate(std::chrono::nanoseconds now)
+{
+    return meter.rate(now);
+}
+
+void RequestPipeline::sampleRtt(std::chrono::nanoseconds rtt, std::chrono::nanoseconds now)
+{
+    // Requests queue up at the peer, so only the lowest samples reflect the round trip
+    if (now - windowStart >= RTT_WINDOW)
+    {
+        if (windowMinRtt)
+        {
+            minRtt = windowMinRtt;
+        }
+        windowMinRtt.reset();
+        windowStart = now;
+    }
+
+    windowMinRtt = windowMinRtt ? std::min(*windowMinRtt, rtt) : rtt;
+    minRtt = minRtt ? std::min(*minRtt, rtt) : rtt;
+
+    // Smoothed round trip time and variance with the gains of RFC 6298
+    if (!smoothedRtt)
+    {
+        smoothedRtt = rtt;
+        rttVariance = rtt / 2;
+    }
+    else
+    {
+        const auto error = *smoothedRtt > rtt ? *smoothedRtt - rtt : rtt - *smoothedRtt;
+        rttVariance = (3 * rttVariance + error) / 4;
+        smoothedRtt = (7 * *smoothedRtt + rtt) / 8;
+    }
+}
+
+void RequestPipeline::updateDepth(std::chrono::nanoseconds now)
+{
+    const auto rate = meter.rate(now);
+    if (rate == 0 || !minRtt)
+    {
+        depth = std::min(depth + 1, MAX_DEPTH);
+        return;
+    }
+
+    // Half again the bandwidth-delay product, plus one to cover the request in flight
+    const auto rtt = std::chrono::duration<double>(*minRtt).count();
+    const auto bdp = rate * rtt / BLOCK_SIZE;
+    const auto wanted = static_cast<uint32_t>(std::ceil(bdp * 1.5)) + 1;
+    depth = std::clamp(wanted, MIN_DEPTH, MAX_DEPTH);
+}
+
+} // namespace fractals::network::p2p
@@ -0,0 +1,8 @@
+#include <fractals/network/p2p/UringService.ipp>
+#include <fractals/network/p2p/BufferedQueueManager.h>
+#include <fractals/network/p2p/EpollMsgQueue.h>
+
+namespace fractals::network::p2p
+{
+    template class UringServiceImpl<PeerFd, BufferedQueueManager, EpollMsgQueue>;
+}
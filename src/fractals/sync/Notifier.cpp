@@ -0,0 +1,103 @@
+#include <fractals/sync/Notifier.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <poll.h>
+#include <spdlog/spdlog.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace fractals::sync
+{
+
+Notifier::Notifier() : fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+{
+    if (fd < 0)
+    {
+        spdlog::error("Notifier. Could not create eventfd errno={}", errno);
+    }
+}
+
+Notifier::~Notifier()
+{
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+bool Notifier::isValid() const
+{
+    return fd >= 0;
+}
+
+int Notifier::getFileDescriptor() const
+{
+    return fd;
+}
+
+void Notifier::notify(uint32_t source)
+{
+    const ReadyBits bit = ReadyBits{1} << (source % MAX_SOURCES);
+
+    // Only the first producer after a take has to wake up the consumer
+    if (ready.fetch_or(bit, std::memory_order_acq_rel) == 0)
+    {
+        const uint64_t one = 1;
+        [[maybe_unused]] const auto res = write(fd, &one, sizeof(one));
+    }
+}
+
+Notifier::ReadyBits Notifier::take()
+{
+    drainFd();
+    return ready.exchange(0, std::memory_order_acq_rel);
+}
+
+Notifier::ReadyBits Notifier::wait(std::chrono::milliseconds timeout)
+{
+    // Bits set while the consumer was busy. The eventfd may still be signalled, which costs one
+    // extra wakeup later on.
+    if (const auto bits = ready.exchange(0, std::memory_order_acq_rel))
+    {
+        return bits;
+    }
+
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (true)
+    {
+        int pollTimeout = -1;
+        if (timeout.count() > 0)
+        {
+            const auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now());
+            pollTimeout = std::max<int64_t>(0, remaining.count());
+        }
+
+        pollfd pfd{fd, POLLIN, 0};
+        const auto res = poll(&pfd, 1, pollTimeout);
+        if (res < 0 && errno != EINTR)
+        {
+            spdlog::error("Notifier::wait. poll failed errno={}", errno);
+            return take();
+        }
+
+        if (const auto bits = take())
+        {
+            return bits;
+        }
+
+        if (res == 0)
+        {
+            return 0;
+        }
+    }
+}
+
+void Notifier::drainFd()
+{
+    uint64_t count;
+    [[maybe_unused]] const auto res = read(fd, &count, sizeof(count));
+}
+
+} // namespace fractals::sync
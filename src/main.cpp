@@ -14,6 +14,7 @@
 #include <fractals/network/p2p/BufferedQueueManager.h>
 #include <fractals/network/p2p/EpollMsgQueue.h>
 #include <fractals/network/p2p/EpollService.h>
+#include <fractals/network/p2p/EpollServicePool.h>
 #include <fractals/network/p2p/PeerFd.h>
 #include <fractals/network/p2p/PeerService.h>
 #include <fractals/persist/PersistClient.h>
@@ -38,19 +39,22 @@ int main()
     common::setupLogging();
 
     Fractals::initAppId();
+    Fractals::initListenPort();
 
     sync::QueueCoordinator coordinator;
 
-    network::p2p::EpollMsgQueue epollQueue;
-    auto epoll = epoll_wrapper::Epoll<network::p2p::PeerFd>::epollCreate();
-    if (!epoll)
+    network::p2p::EpollServicePool epollPool;
+    if (!epollPool.size())
     {
         throw "Could not create epoll instance";
     }
-    network::p2p::BufferedQueueManager bufMan;
-    network::p2p::EpollService epollSrvc{epoll.getEpoll(), bufMan, epollQueue.getRightEnd()};
     TcpService tcpSrvc;
-    network::p2p::PeerService peerSrvc{epollQueue.getLeftEnd(), epollSrvc, tcpSrvc};
+    network::p2p::PeerService peerSrvc{epollPool, tcpSrvc};
+    if (!peerSrvc.listen(Fractals::LISTEN_PORT))
+    {
+        spdlog::warn("Could not listen on port {}. Inbound peers are not accepted",
+                     Fractals::LISTEN_PORT);
+    }
 
     persist::PersistEventQueue btPersistQueue;
     persist::AppPersistQueue appPersistQueue;
@@ -77,6 +81,8 @@ int main()
     spdlog::info("Starting threads..");
 
     auto rQueue = appQueue.getRightEnd();
+    // The UI can afford to wait for BtMan to catch up
+    rQueue.setOverflowPolicy(common::OverflowPolicy::Block);
 
     app::TorrentController controller(rQueue, appPersistQueue.getLeftEnd());
 
@@ -100,11 +106,7 @@ int main()
         {
             persistSrvc.run();
         });
-    std::thread thrdEpollSrvc(
-        [&epollSrvc]()
-        {
-            epollSrvc.run();
-        });
+    epollPool.run();
 
     controller.run();
 
@@ -113,8 +115,14 @@ int main()
     thrdAnnSrvc.join();
     thrdDiskSrvc.join();
     thrdPersistSrvc.join();
-    thrdEpollSrvc.join();
+    epollPool.join();
     thrdBtMan.join();
 
+    btPersistQueue.logStats("Persist queue");
+    appPersistQueue.logStats("App persist queue");
+    diskQueue.logStats("Disk queue");
+    annQueue.logStats("Announce queue");
+    appQueue.logStats("App queue");
+
     return 0;
 }
@@ -0,0 +1,65 @@
+#include <fractals/common/Sha1.h>
+
+#include <benchmark/benchmark.h>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace fractals::common
+{
+
+namespace
+{
+// Batch of equally sized pieces, as in a recheck or a burst of completed pieces
+void hashPieces(benchmark::State &state, Sha1Kernel kernel)
+{
+    if (!Sha1::isSupported(kernel))
+    {
+        state.SkipWithError("Kernel is not supported by this CPU");
+        return;
+    }
+
+    const auto pieceSize = static_cast<size_t>(state.range(0));
+    const auto numPieces = static_cast<size_t>(state.range(1));
+    std::mt19937 rng{1};
+    std::vector<std::string> pieces(numPieces, std::string(pieceSize, 0));
+    for (auto &piece : pieces)
+    {
+        for (auto &c : piece)
+        {
+            c = static_cast<char>(rng());
+        }
+    }
+
+    const std::vector<std::string_view> inputs(pieces.begin(), pieces.end());
+    std::vector<Sha1::Digest> digests(numPieces);
+    for (auto _ : state)
+    {
+        Sha1::digestMany(inputs, digests, kernel);
+        benchmark::DoNotOptimize(digests.data());
+    }
+
+    state.SetBytesProcessed(state.iterations() * pieceSize * numPieces);
+}
+} // namespace
+
+// Partial batches are what HashService sees when few pieces complete at once
+BENCHMARK_CAPTURE(hashPieces, openssl, Sha1Kernel::OpenSsl)
+    ->Args({256 * 1024, 1})
+    ->Args({256 * 1024, 4})
+    ->Args({256 * 1024, 16})
+    ->Args({4 * 1024 * 1024, 8});
+BENCHMARK_CAPTURE(hashPieces, shaNi, Sha1Kernel::ShaNi)
+    ->Args({256 * 1024, 1})
+    ->Args({256 * 1024, 4})
+    ->Args({256 * 1024, 16})
+    ->Args({4 * 1024 * 1024, 8});
+BENCHMARK_CAPTURE(hashPieces, avx2, Sha1Kernel::Avx2)
+    ->Args({256 * 1024, 1})
+    ->Args({256 * 1024, 4})
+    ->Args({256 * 1024, 16})
+    ->Args({4 * 1024 * 1024, 8});
+
+} // namespace fractals::common
+
+BENCHMARK_MAIN();
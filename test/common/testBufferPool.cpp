@@ -0,0 +1,106 @@
+#include <fractals/common/BufferPool.h>
+
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+namespace fractals::common
+{
+
+constexpr uint64_t KiB = 1024;
+
+TEST(BUFFER_POOL, sizeClasses)
+{
+    ASSERT_EQ(BufferPool::sizeClass(1), BufferPool::MIN_SIZE_CLASS);
+    ASSERT_EQ(BufferPool::sizeClass(16 * KiB), 16 * KiB);
+    ASSERT_EQ(BufferPool::sizeClass(16 * KiB + 1), 32 * KiB);
+    ASSERT_EQ(BufferPool::sizeClass(1000 * KiB), 1024 * KiB);
+
+    BufferPool pool;
+    const auto buffer = pool.acquire(20 * KiB);
+    ASSERT_TRUE(buffer);
+    ASSERT_EQ(buffer.size(), 20 * KiB);
+    ASSERT_EQ(buffer.capacity(), 32 * KiB);
+    ASSERT_EQ(buffer.view().size(), 20 * KiB);
+    ASSERT_EQ(pool.getStats().inUse, 32 * KiB);
+}
+
+TEST(BUFFER_POOL, reusesReturnedBuffers)
+{
+    BufferPool pool;
+    const char *data{nullptr};
+    {
+        auto buffer = pool.acquire(64 * KiB);
+        data = buffer.data();
+        // Moved buffers are returned once
+        auto moved = std::move(buffer);
+        ASSERT_FALSE(buffer);
+    }
+
+    auto stats = pool.getStats();
+    ASSERT_EQ(stats.inUse, 0);
+    ASSERT_EQ(stats.cached, 64 * KiB);
+
+    // Same size class gets the cached buffer back
+    const auto again = pool.acquire(40 * KiB);
+    ASSERT_EQ(again.data(), data);
+    stats = pool.getStats();
+    ASSERT_EQ(stats.acquired, 2);
+    ASSERT_EQ(stats.reused, 1);
+    ASSERT_EQ(stats.cached, 0);
+}
+
+TEST(BUFFER_POOL, memoryLimit)
+{
+    BufferPool pool(BufferPoolConfig{128 * KiB, 128 * KiB});
+    auto first = pool.acquire(64 * KiB);
+    auto second = pool.acquire(64 * KiB);
+    ASSERT_TRUE(first);
+    ASSERT_TRUE(second);
+    ASSERT_FALSE(pool.acquire(16 * KiB));
+    ASSERT_EQ(pool.getStats().refused, 1);
+
+    // Cached buffers of another size class are freed to make room
+    first = PieceBuffer{};
+    ASSERT_EQ(pool.getStats().cached, 64 * KiB);
+    auto small = pool.acquire(16 * KiB);
+    ASSERT_TRUE(small);
+    ASSERT_EQ(pool.getStats().cached, 0);
+    ASSERT_EQ(pool.getStats().inUse, 80 * KiB);
+
+    // Lowering the limit keeps the buffers that are in use
+    pool.setMemoryLimit(32 * KiB);
+    ASSERT_EQ(pool.getStats().inUse, 80 * KiB);
+    ASSERT_FALSE(pool.acquire(16 * KiB));
+    second = PieceBuffer{};
+    ASSERT_EQ(pool.getStats().cached, 0);
+    ASSERT_TRUE(pool.acquire(16 * KiB));
+}
+
+TEST(BUFFER_POOL, releaseFromOtherThread)
+{
+    std::vector<PieceBuffer> buffers;
+    {
+        BufferPool pool(BufferPoolConfig{1024 * KiB, 1024 * KiB, true});
+        for (int i = 0; i < 4; ++i)
+        {
+            buffers.push_back(pool.acquire(256 * KiB));
+            buffers.back().data()[0] = 'a';
+        }
+        ASSERT_FALSE(pool.acquire(1));
+    }
+
+    // Buffers outlive the pool that handed them out
+    std::thread disk(
+        [&]()
+        {
+            buffers.clear();
+        });
+    disk.join();
+
+    PieceBuffer plain(10);
+    ASSERT_TRUE(plain);
+    ASSERT_EQ(plain.capacity(), 10);
+}
+
+} // namespace fractals::common
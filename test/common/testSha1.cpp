@@ -0,0 +1,90 @@
+#include <fractals/common/Sha1.h>
+#include <fractals/common/utils.h>
+
+#include <gtest/gtest.h>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace fractals::common
+{
+
+TEST(SHA1, digest)
+{
+    ASSERT_EQ(bytesToHex<20>(Sha1::digest("!teststringº")),
+              "1b74878ef7e38624fda0b55d9f33be10861bd7c4");
+    ASSERT_EQ(bytesToHex<20>(Sha1::digest("")), "da39a3ee5e6b4b0d3255bfef95601890afd80709");
+}
+
+TEST(SHA1, incremental)
+{
+    std::string data(100000, 0);
+    for (size_t i = 0; i < data.size(); ++i)
+    {
+        data[i] = static_cast<char>(i * 31);
+    }
+
+    // Parts that do not line up with the 64 byte SHA1 blocks
+    Sha1 sha1;
+    std::string_view view{data};
+    for (size_t part : {1, 63, 100, 16384, 1000})
+    {
+        sha1.update(view.substr(0, part));
+        view.remove_prefix(part);
+    }
+
+    // Copies continue independently of the original
+    auto copy = sha1;
+    sha1.update(view);
+    ASSERT_EQ(sha1.finalize(), Sha1::digest(data));
+
+    auto moved = std::move(copy);
+    moved.update(view);
+    ASSERT_EQ(moved.finalize(), Sha1::digest(data));
+
+    // Moved from context is usable again after a reset
+    copy.reset();
+    copy = moved;
+    copy.update("abc");
+    ASSERT_EQ(copy.finalize(), Sha1::digest("abc"));
+
+    // Context starts over after a finalize
+    sha1.update("abc");
+    ASSERT_EQ(sha1.finalize(), Sha1::digest("abc"));
+}
+
+TEST(SHA1, kernels)
+{
+    // Sizes around the padding boundaries and a few whole pieces, in one batch
+    std::mt19937 rng{7};
+    std::vector<std::string> data;
+    for (size_t size : {0, 1, 55, 56, 63, 64, 65, 119, 120, 1000, 16384, 100000, 262144})
+    {
+        std::string buffer(size, 0);
+        for (auto &c : buffer)
+        {
+            c = static_cast<char>(rng());
+        }
+        data.push_back(std::move(buffer));
+    }
+    const std::vector<std::string_view> inputs(data.begin(), data.end());
+
+    for (auto kernel : {Sha1Kernel::OpenSsl, Sha1Kernel::ShaNi, Sha1Kernel::Avx2})
+    {
+        // Unsupported kernels fall back to OpenSSL
+        std::vector<Sha1::Digest> digests(inputs.size());
+        Sha1::digestMany(inputs, digests, kernel);
+        for (size_t i = 0; i < inputs.size(); ++i)
+        {
+            ASSERT_EQ(digests[i], Sha1::digest(inputs[i]))
+                << "kernel=" << static_cast<int>(kernel) << " size=" << inputs[i].size();
+        }
+    }
+
+    std::vector<Sha1::Digest> digests(1);
+    Sha1::digestMany(std::vector<std::string_view>{"!teststringº"}, digests);
+    ASSERT_EQ(bytesToHex<20>(digests[0]), "1b74878ef7e38624fda0b55d9f33be10861bd7c4");
+    ASSERT_TRUE(Sha1::isSupported(Sha1::getKernel()));
+}
+
+} // namespace fractals::common
@@ -0,0 +1,121 @@
+#include <fractals/common/TimerWheel.h>
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace fractals::common
+{
+
+TEST(TIMERWHEEL, FireInOrder)
+{
+    TimerWheel<int> wheel(10ms, 0ns);
+    wheel.schedule(30ms, 3);
+    wheel.schedule(10ms, 1);
+    wheel.schedule(20ms, 2);
+    ASSERT_EQ(wheel.size(), 3);
+
+    std::vector<int> fired;
+    const auto onExpire = [&](int n)
+    {
+        fired.push_back(n);
+    };
+
+    wheel.advance(5ms, onExpire);
+    ASSERT_TRUE(fired.empty());
+
+    wheel.advance(20ms, onExpire);
+    ASSERT_THAT(fired, testing::ElementsAre(1, 2));
+
+    wheel.advance(100ms, onExpire);
+    ASSERT_THAT(fired, testing::ElementsAre(1, 2, 3));
+    ASSERT_TRUE(wheel.empty());
+}
+
+TEST(TIMERWHEEL, NeverFireEarly)
+{
+    TimerWheel<int> wheel(10ms, 0ns);
+    wheel.schedule(15ms, 1);
+
+    std::vector<int> fired;
+    const auto onExpire = [&](int n)
+    {
+        fired.push_back(n);
+    };
+
+    wheel.advance(10ms, onExpire);
+    ASSERT_TRUE(fired.empty());
+
+    wheel.advance(20ms, onExpire);
+    ASSERT_THAT(fired, testing::ElementsAre(1));
+}
+
+TEST(TIMERWHEEL, Cancel)
+{
+    TimerWheel<int> wheel(10ms, 0ns);
+    const auto id1 = wheel.schedule(10ms, 1);
+    wheel.schedule(10ms, 2);
+
+    ASSERT_TRUE(wheel.cancel(id1));
+    ASSERT_FALSE(wheel.cancel(id1));
+    ASSERT_EQ(wheel.size(), 1);
+
+    std::vector<int> fired;
+    wheel.advance(10ms,
+                  [&](int n)
+                  {
+                      fired.push_back(n);
+                  });
+    ASSERT_THAT(fired, testing::ElementsAre(2));
+
+    // Slot of a fired timer is reused, the old id must not cancel the new timer
+    const auto id3 = wheel.schedule(50ms, 3);
+    ASSERT_FALSE(wheel.cancel(id1));
+    ASSERT_TRUE(wheel.cancel(id3));
+}
+
+TEST(TIMERWHEEL, CascadeFromHigherLevels)
+{
+    TimerWheel<int> wheel(1ms, 0ns);
+    wheel.schedule(63ms, 1);
+    wheel.schedule(64ms, 2);
+    wheel.schedule(4100ms, 3);
+    wheel.schedule(300000ms, 4);
+
+    std::vector<std::pair<int, std::chrono::nanoseconds>> fired;
+    std::chrono::nanoseconds now{0};
+    while (!wheel.empty())
+    {
+        now = *wheel.nextExpiry();
+        wheel.advance(now,
+                      [&](int n)
+                      {
+                          fired.emplace_back(n, now);
+                      });
+    }
+
+    ASSERT_EQ(fired.size(), 4);
+    ASSERT_EQ(fired[0], std::make_pair(1, std::chrono::nanoseconds(63ms)));
+    ASSERT_EQ(fired[1], std::make_pair(2, std::chrono::nanoseconds(64ms)));
+    ASSERT_EQ(fired[2], std::make_pair(3, std::chrono::nanoseconds(4100ms)));
+    ASSERT_EQ(fired[3], std::make_pair(4, std::chrono::nanoseconds(300000ms)));
+}
+
+TEST(TIMERWHEEL, NextExpiry)
+{
+    TimerWheel<int> wheel(10ms, 1s);
+    ASSERT_FALSE(wheel.nextExpiry());
+
+    wheel.schedule(1s + 50ms, 1);
+    ASSERT_EQ(*wheel.nextExpiry(), 1s + 50ms);
+
+    // Deadline in the past fires on the next tick
+    wheel.schedule(0ns, 2);
+    ASSERT_EQ(*wheel.nextExpiry(), 1s + 10ms);
+}
+
+} // namespace fractals::common
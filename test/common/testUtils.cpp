@@ -224,4 +224,18 @@ TEST(UTILS, ppTime)
     ASSERT_EQ(res11, "inf");
 }
 
-} // namespace Fractals::common
\ No newline at end of file
+TEST(UTILS, parseBytes)
+{
+    ASSERT_EQ(parseBytes("0"), 0);
+    ASSERT_EQ(parseBytes("512"), 512);
+    ASSERT_EQ(parseBytes("20K"), 20000);
+    ASSERT_EQ(parseBytes("20kb"), 20000);
+    ASSERT_EQ(parseBytes("1.5M"), 1500000);
+    ASSERT_EQ(parseBytes("2G"), 2000000000);
+    ASSERT_EQ(parseBytes(""), std::nullopt);
+    ASSERT_EQ(parseBytes("M"), std::nullopt);
+    ASSERT_EQ(parseBytes("10X"), std::nullopt);
+    ASSERT_EQ(parseBytes("1.2.3K"), std::nullopt);
+}
+
+} // namespace Fractals::common
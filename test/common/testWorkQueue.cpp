@@ -1,8 +1,14 @@
+#include <fractals/common/FullDuplexQueue.h>
 #include <fractals/common/WorkQueue.h>
 
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
 namespace fractals::common
 {
 
@@ -143,4 +149,240 @@ TEST(WORKQUEUE, alternate)
     // alternateTest<10000>();
 }
 
-} // namespace fractals::common
\ No newline at end of file
+TEST(WORKQUEUE, moveOnlyEvents)
+{
+    SpscQueue<4, std::unique_ptr<int>> spsc;
+    MpscQueue<4, std::unique_ptr<int>> mpsc;
+
+    ASSERT_TRUE(spsc.push(std::make_unique<int>(1)));
+    ASSERT_TRUE(mpsc.push(std::make_unique<int>(2)));
+
+    auto i1 = spsc.pop();
+    auto i2 = mpsc.pop();
+    ASSERT_EQ(*i1, 1);
+    ASSERT_EQ(*i2, 2);
+    ASSERT_FALSE(spsc.tryPop());
+    ASSERT_FALSE(mpsc.tryPop());
+}
+
+TEST(WORKQUEUE, destroysEvents)
+{
+    auto item = std::make_shared<int>(0);
+    {
+        SpscQueue<4, std::shared_ptr<int>> spsc;
+        MpscQueue<4, std::shared_ptr<int>> mpsc;
+        spsc.push(std::shared_ptr<int>(item));
+        spsc.push(std::shared_ptr<int>(item));
+        mpsc.push(std::shared_ptr<int>(item));
+        ASSERT_EQ(item.use_count(), 4);
+
+        // Popping leaves nothing behind in the slot
+        spsc.pop();
+        ASSERT_EQ(item.use_count(), 3);
+    }
+    ASSERT_EQ(item.use_count(), 1);
+}
+
+TEST(WORKQUEUE, mpscFull)
+{
+    MpscQueue<5, Item> queue;
+
+    for (int i = 0; i < 7; ++i)
+    {
+        ASSERT_EQ(queue.push(Item{i}), i < 5);
+    }
+    ASSERT_EQ(queue.size(), 5);
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        ASSERT_EQ(queue.pop().n, i);
+        ASSERT_TRUE(queue.push(Item{i + 5}));
+        ASSERT_EQ(queue.size(), 5);
+    }
+}
+
+TEST(WORKQUEUE, spscThreads)
+{
+    static constexpr int32_t ITEMS = 200'000;
+    SpscQueue<64, Item> queue;
+
+    std::thread producer(
+        [&]()
+        {
+            for (int32_t i = 0; i < ITEMS; ++i)
+            {
+                while (!queue.push(Item{i}))
+                {
+                    std::this_thread::yield();
+                }
+            }
+        });
+
+    for (int32_t expected = 0; expected < ITEMS;)
+    {
+        if (auto item = queue.tryPop())
+        {
+            ASSERT_EQ(item->n, expected);
+            ++expected;
+        }
+    }
+
+    producer.join();
+    ASSERT_TRUE(queue.isEmpty());
+}
+
+TEST(WORKQUEUE, mpscThreads)
+{
+    static constexpr int32_t PRODUCERS = 4;
+    static constexpr int32_t ITEMS = 50'000;
+    MpscQueue<64, Item> queue;
+
+    std::vector<std::thread> producers;
+    for (int32_t p = 0; p < PRODUCERS; ++p)
+    {
+        producers.emplace_back(
+            [&, p]()
+            {
+                for (int32_t i = 0; i < ITEMS; ++i)
+                {
+                    while (!queue.push(Item{p * ITEMS + i}))
+                    {
+                        std::this_thread::yield();
+                    }
+                }
+            });
+    }
+
+    // Events of a single producer keep their order
+    std::vector<int32_t> next(PRODUCERS, 0);
+    for (int32_t received = 0; received < PRODUCERS * ITEMS;)
+    {
+        if (auto item = queue.tryPop())
+        {
+            const auto p = item->n / ITEMS;
+            ASSERT_EQ(item->n % ITEMS, next[p]);
+            ++next[p];
+            ++received;
+        }
+    }
+
+    for (auto &producer : producers)
+    {
+        producer.join();
+    }
+    ASSERT_TRUE(queue.isEmpty());
+}
+
+TEST(WORKQUEUE, rejectCounts)
+{
+    WorkQueueImpl<2, Item> queue;
+
+    ASSERT_TRUE(queue.push(Item{1}));
+    ASSERT_TRUE(queue.canPush());
+    ASSERT_TRUE(queue.push(Item{2}));
+    ASSERT_FALSE(queue.canPush());
+    ASSERT_FALSE(queue.push(Item{3}));
+
+    queue.pop();
+    const auto stats = queue.getStats();
+    ASSERT_EQ(stats.pushed, 2);
+    ASSERT_EQ(stats.rejected, 1);
+    ASSERT_EQ(stats.maxDepth, 2);
+}
+
+template <typename Queue> void overflowTest()
+{
+    Queue queue;
+    queue.setOverflowPolicy(OverflowPolicy::Overflow);
+
+    for (int i = 0; i < 10; ++i)
+    {
+        ASSERT_TRUE(queue.canPush());
+        ASSERT_TRUE(queue.push(Item{i}));
+    }
+    ASSERT_EQ(queue.size(), 10);
+
+    // Pushes keep queueing behind the overflow until it is drained
+    for (int i = 0; i < 8; ++i)
+    {
+        ASSERT_EQ(queue.pop().n, i);
+    }
+    ASSERT_TRUE(queue.push(Item{10}));
+    for (int i = 8; i < 11; ++i)
+    {
+        ASSERT_EQ(queue.pop().n, i);
+    }
+    ASSERT_TRUE(queue.isEmpty());
+
+    const auto stats = queue.getStats();
+    ASSERT_EQ(stats.pushed, 11);
+    ASSERT_EQ(stats.overflowed, 6);
+    ASSERT_EQ(stats.maxDepth, 10);
+}
+
+TEST(WORKQUEUE, overflow)
+{
+    overflowTest<SpscQueue<5, Item>>();
+    overflowTest<MpscQueue<5, Item>>();
+}
+
+TEST(WORKQUEUE, blockUntilPopped)
+{
+    SpscQueue<2, Item> queue;
+    queue.setOverflowPolicy(OverflowPolicy::Block, std::chrono::seconds(10));
+    queue.push(Item{0});
+    queue.push(Item{1});
+
+    std::thread consumer(
+        [&]()
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            ASSERT_EQ(queue.pop().n, 0);
+        });
+
+    ASSERT_TRUE(queue.push(Item{2}));
+    consumer.join();
+
+    ASSERT_EQ(queue.pop().n, 1);
+    ASSERT_EQ(queue.pop().n, 2);
+    ASSERT_EQ(queue.getStats().blocked, 1);
+    ASSERT_EQ(queue.getStats().timedOut, 0);
+}
+
+TEST(WORKQUEUE, blockTimesOut)
+{
+    MpscQueue<2, Item> queue;
+    queue.setOverflowPolicy(OverflowPolicy::Block, std::chrono::milliseconds(2));
+    queue.push(Item{0});
+    queue.push(Item{1});
+
+    ASSERT_FALSE(queue.push(Item{2}));
+    ASSERT_EQ(queue.size(), 2);
+    ASSERT_EQ(queue.getStats().timedOut, 1);
+}
+
+TEST(WORKQUEUE, fullDuplexCanPush)
+{
+    FullDuplexQueue<2, Item, Item> queue;
+    auto left = queue.getLeftEnd();
+    auto right = queue.getRightEnd();
+    right.setOverflowPolicy(OverflowPolicy::Reject);
+
+    ASSERT_TRUE(right.canPush());
+    right.push(Item{0});
+    right.push(Item{1});
+    ASSERT_FALSE(right.canPush());
+    ASSERT_FALSE(right.push(Item{2}));
+    ASSERT_EQ(left.numToRead(), 2);
+
+    // Overflows by default
+    for (int i = 0; i < 5; ++i)
+    {
+        ASSERT_TRUE(left.canPush());
+        ASSERT_TRUE(left.push(Item{i}));
+    }
+    ASSERT_EQ(right.numToRead(), 5);
+    ASSERT_EQ(left.getPushStats().overflowed, 3);
+}
+
+} // namespace fractals::common
@@ -1,39 +1,125 @@
+#include <fractals/common/BufferPool.h>
 #include <fractals/disk/DiskEventQueue.h>
 #include <fractals/disk/DiskIOService.h>
+#include <fractals/sync/Notifier.h>
 #include <fractals/sync/QueueCoordinator.h>
 
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <variant>
+#include <vector>
 
 using namespace ::testing;
+using namespace std::chrono_literals;
 
 namespace fractals::disk
 {
 
-class MockIOLayer
+class DiskIOServiceTestz : public ::testing::Test
 {
   public:
-    MOCK_METHOD(bool, createDirectory, (const std::string &));
-    MOCK_METHOD(bool, createDirectories, (const std::string &));
-    MOCK_METHOD(bool, pathExists, (const std::string &));
+    static constexpr uint64_t PIECE_SIZE = 16;
 
-    MOCK_METHOD(bool, open, (const std::string &));
-    MOCK_METHOD(void, write, (const std::vector<char> &));
-    MOCK_METHOD(bool, writeFrom, (int64_t, const std::vector<char> &));
+    void SetUp() override
+    {
+        dir = std::filesystem::temp_directory_path() /
+              ("fractals_diskio_" + std::to_string(::getpid()));
+        std::filesystem::create_directories(dir);
+    }
 
-    std::istream &getStream()
+    void TearDown() override
     {
-        return std::cin;
+        service.reset();
+        std::filesystem::remove_all(dir);
     }
-};
 
-class DiskIOServiceTestz : public ::testing::Test
-{
-  public:
-    ::testing::StrictMock<MockIOLayer> ioLayer;
+    void start(WriteCacheConfig cacheConfig, const std::vector<uint64_t> &fileLengths)
+    {
+        service.emplace(coordinator, queue.getRightEnd(), WriteEngineConfig{}, cacheConfig);
+
+        persist::TorrentModel tm{};
+        tm.infoHash = std::string(20, 'a');
+        tm.dirName = dir.string();
+        tm.pieceLength = PIECE_SIZE;
+
+        std::vector<persist::FileModel> files;
+        for (size_t i = 0; i < fileLengths.size(); ++i)
+        {
+            persist::FileModel fm{};
+            fm.fileName = std::to_string(i);
+            fm.length = fileLengths[i];
+            files.push_back(fm);
+        }
+
+        service->process(InitTorrent{tm, files});
+        ASSERT_TRUE(std::holds_alternative<TorrentInitialized>(requests.pop()));
+    }
+
+    void writePiece(uint32_t pieceIndex, uint64_t size, char c)
+    {
+        common::PieceBuffer data{size};
+        std::fill(data.data(), data.data() + size, c);
+        requests.push(WriteData{infoHash, pieceIndex, std::move(data), pieceIndex * PIECE_SIZE});
+    }
+
+    std::string readFile(const std::string &name)
+    {
+        std::ifstream file(dir / name, std::ios::binary);
+        std::stringstream ss;
+        ss << file.rdbuf();
+        return ss.str();
+    }
+
+    // Runs the service until the number of pieces were reported written
+    void runUntilWritten(size_t numPieces)
+    {
+        sync::Notifier notifier;
+        requests.attachNotifier(notifier, 0);
+        std::thread runner(
+            [this]()
+            {
+                service->run();
+            });
+
+        size_t numWritten{0};
+        while (numWritten < numPieces)
+        {
+            notifier.wait();
+            while (requests.canPop())
+            {
+                numWritten += std::holds_alternative<WriteSuccess>(requests.pop());
+            }
+        }
+
+        requests.push(Shutdown{});
+        runner.join();
+    }
+
+    std::vector<DiskResponse> responses()
+    {
+        std::vector<DiskResponse> result;
+        while (requests.canPop())
+        {
+            result.push_back(requests.pop());
+        }
+
+        return result;
+    }
+
+    const common::InfoHash infoHash{std::string(20, 'a')};
+    std::filesystem::path dir;
     DiskEventQueue queue;
+    DiskEventQueue::LeftEndPoint requests = queue.getLeftEnd();
     sync::QueueCoordinator coordinator;
-    DiskIOService<MockIOLayer> service{coordinator, queue.getRightEnd()};
+    std::optional<DiskIOService> service;
 };
 
 TEST_F(DiskIOServiceTestz, torrent)
@@ -42,10 +128,83 @@ TEST_F(DiskIOServiceTestz, torrent)
 
 TEST_F(DiskIOServiceTestz, piece)
 {
+    // Piece 0 ends in the second file, piece 1 lies in the second file only
+    start(WriteCacheConfig{0}, {10, 22});
+    writePiece(0, PIECE_SIZE, 'a');
+    writePiece(1, PIECE_SIZE, 'b');
+    requests.push(Shutdown{});
+    service->run();
+
+    std::vector<uint32_t> written;
+    for (const auto &response : responses())
+    {
+        ASSERT_TRUE(std::holds_alternative<WriteSuccess>(response));
+        written.push_back(std::get<WriteSuccess>(response).pieceIndex);
+    }
+    std::sort(written.begin(), written.end());
+    ASSERT_THAT(written, ElementsAre(0, 1));
+
+    ASSERT_EQ(readFile("0"), std::string(10, 'a'));
+    ASSERT_EQ(readFile("1"), std::string(6, 'a') + std::string(16, 'b'));
+    ASSERT_EQ(service->getWriteEngine().getInFlight(), 0);
+}
+
+TEST_F(DiskIOServiceTestz, pieceFailsIfAnyFileFails)
+{
+    start(WriteCacheConfig{0}, {20, 12});
+    std::filesystem::remove(dir / "1");
+
+    // Part of piece 1 that lies in the first file is written, the piece is still reported failed
+    writePiece(0, PIECE_SIZE, 'a');
+    writePiece(1, PIECE_SIZE, 'b');
+    requests.push(Shutdown{});
+    service->run();
+
+    const auto result = responses();
+    ASSERT_EQ(result.size(), 2);
+    for (const auto &response : result)
+    {
+        if (const auto *success = std::get_if<WriteSuccess>(&response))
+        {
+            ASSERT_EQ(success->pieceIndex, 0);
+        }
+        else
+        {
+            ASSERT_EQ(std::get<WriteError>(response).pieceIndex, 1);
+        }
+    }
+
+    ASSERT_EQ(readFile("0"), std::string(16, 'a') + std::string(4, 'b'));
+}
+
+TEST_F(DiskIOServiceTestz, flushWritesCachedPieces)
+{
+    // Pieces would be held for much longer than the test runs
+    start(WriteCacheConfig{1024, 1h}, {64});
+    writePiece(1, PIECE_SIZE, 'b');
+    writePiece(0, PIECE_SIZE, 'a');
+    requests.push(Flush{});
+
+    // Written before the service shuts down
+    runUntilWritten(2);
+    ASSERT_EQ(readFile("0").substr(0, 2 * PIECE_SIZE),
+              std::string(PIECE_SIZE, 'a') + std::string(PIECE_SIZE, 'b'));
+}
+
+TEST_F(DiskIOServiceTestz, fullCacheWritesOldestPieces)
+{
+    start(WriteCacheConfig{2 * PIECE_SIZE, 1h}, {64});
+    writePiece(0, PIECE_SIZE, 'a');
+    writePiece(2, PIECE_SIZE, 'c');
+    writePiece(3, PIECE_SIZE, 'd');
+
+    // Cache is drained to half of its limit before the service shuts down
+    runUntilWritten(2);
+    ASSERT_EQ(readFile("0").substr(0, PIECE_SIZE), std::string(PIECE_SIZE, 'a'));
 }
 
 TEST_F(DiskIOServiceTestz, announce)
 {
 }
 
-} // namespace fractals::disk
\ No newline at end of file
+} // namespace fractals::disk
@@ -0,0 +1,93 @@
+#include <fractals/disk/IOLayer.h>
+
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace fractals::disk
+{
+
+class IOLayerTest : public ::testing::Test
+{
+  public:
+    void SetUp() override
+    {
+        dir = std::filesystem::temp_directory_path() /
+              ("fractals_iolayer_" + std::to_string(::getpid()));
+        std::filesystem::create_directories(dir);
+    }
+
+    void TearDown() override
+    {
+        std::filesystem::remove_all(dir);
+    }
+
+    std::filesystem::path createFile(const std::string &name)
+    {
+        const auto path = dir / name;
+        EXPECT_TRUE(io.createFile(path));
+        return path;
+    }
+
+    std::string readFile(const std::filesystem::path &path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        std::stringstream ss;
+        ss << file.rdbuf();
+        return ss.str();
+    }
+
+    std::filesystem::path dir;
+    IOLayer io;
+};
+
+TEST_F(IOLayerTest, positionalWrites)
+{
+    const auto path = createFile("a");
+
+    // Writes land at their offset in any order, gaps stay zero
+    ASSERT_TRUE(io.writeAt(path, 4, "efgh"));
+    ASSERT_TRUE(io.writeAt(path, 0, "abcd"));
+    const std::vector<std::string_view> buffers{"ij", "", "klm"};
+    ASSERT_TRUE(io.writeAt(path, 10, buffers));
+    ASSERT_EQ(readFile(path), std::string("abcdefgh\0\0ijklm", 15));
+    ASSERT_EQ(io.getNumOpenFiles(), 1);
+
+    // Files are not created by writing
+    ASSERT_FALSE(io.writeAt(dir / "missing", 0, "abc"));
+    ASSERT_EQ(io.getNumOpenFiles(), 1);
+}
+
+TEST_F(IOLayerTest, closesLeastRecentlyWritten)
+{
+    io.setMaxOpenFiles(2);
+    const auto a = createFile("a");
+    const auto b = createFile("b");
+    const auto c = createFile("c");
+
+    ASSERT_TRUE(io.writeAt(a, 0, "a"));
+    ASSERT_TRUE(io.writeAt(b, 0, "b"));
+    ASSERT_TRUE(io.writeAt(a, 1, "a"));
+    ASSERT_EQ(io.getNumOpenFiles(), 2);
+
+    // b was written longest ago
+    ASSERT_TRUE(io.writeAt(c, 0, "c"));
+    ASSERT_EQ(io.getNumOpenFiles(), 2);
+    ASSERT_TRUE(io.writeAt(b, 1, "b"));
+    ASSERT_TRUE(io.writeAt(a, 2, "a"));
+
+    ASSERT_EQ(readFile(a), "aaa");
+    ASSERT_EQ(readFile(b), "bb");
+    ASSERT_EQ(readFile(c), "c");
+
+    io.setMaxOpenFiles(1);
+    ASSERT_EQ(io.getNumOpenFiles(), 1);
+    io.closeFiles();
+    ASSERT_EQ(io.getNumOpenFiles(), 0);
+}
+
+} // namespace fractals::disk
@@ -0,0 +1,116 @@
+#include <fractals/disk/WriteCache.h>
+
+#include <algorithm>
+#include <gtest/gtest.h>
+#include <string>
+
+namespace fractals::disk
+{
+
+using namespace std::chrono_literals;
+
+constexpr uint64_t PIECE_SIZE = 16 * 1024;
+
+const common::InfoHash infoHash{std::string(20, 'a')};
+const common::InfoHash otherHash{std::string(20, 'b')};
+
+CachedPiece makePiece(const common::InfoHash &ih, uint32_t index, uint64_t size = PIECE_SIZE)
+{
+    CachedPiece piece{ih, index, index * PIECE_SIZE, common::PieceBuffer{size}};
+    std::fill(piece.data.data(), piece.data.data() + size, static_cast<char>('a' + index));
+    return piece;
+}
+
+TEST(WRITE_CACHE, mergesAdjacentPieces)
+{
+    WriteCache cache;
+    const auto now = WriteCache::Clock::now();
+
+    // Pieces arrive out of order, the last piece of a torrent is shorter
+    for (const uint32_t index : {2, 0, 5, 1})
+    {
+        cache.add(makePiece(infoHash, index), now);
+    }
+    cache.add(makePiece(infoHash, 6, 100), now);
+    cache.add(makePiece(otherHash, 3), now);
+    ASSERT_EQ(cache.getNumPieces(), 6);
+    ASSERT_EQ(cache.getBytes(), 5 * PIECE_SIZE + 100);
+
+    auto runs = cache.takeAll();
+    ASSERT_EQ(runs.size(), 3);
+    ASSERT_EQ(cache.getNumPieces(), 0);
+    ASSERT_EQ(cache.getBytes(), 0);
+
+    std::sort(runs.begin(), runs.end(),
+              [](const WriteRun &lhs, const WriteRun &rhs)
+              {
+                  return lhs.pieces.size() > rhs.pieces.size();
+              });
+
+    ASSERT_EQ(runs[0].infoHash, infoHash);
+    ASSERT_EQ(runs[0].offset, 0);
+    ASSERT_EQ(runs[0].size, 3 * PIECE_SIZE);
+    for (uint32_t i = 0; i < runs[0].pieces.size(); ++i)
+    {
+        ASSERT_EQ(runs[0].pieces[i].pieceIndex, i);
+        ASSERT_EQ(runs[0].pieces[i].data.view()[0], 'a' + i);
+    }
+
+    ASSERT_EQ(runs[1].pieces.size(), 2);
+    ASSERT_EQ(runs[1].offset, 5 * PIECE_SIZE);
+    ASSERT_EQ(runs[1].size, PIECE_SIZE + 100);
+    ASSERT_EQ(runs[2].infoHash, otherHash);
+    ASSERT_EQ(runs[2].size, PIECE_SIZE);
+}
+
+TEST(WRITE_CACHE, flushDeadline)
+{
+    WriteCache cache(WriteCacheConfig{1024 * PIECE_SIZE, 100ms});
+    const auto start = WriteCache::Clock::now();
+    ASSERT_FALSE(cache.untilExpired(start));
+
+    cache.add(makePiece(infoHash, 0), start);
+    cache.add(makePiece(infoHash, 4), start + 50ms);
+    ASSERT_EQ(cache.untilExpired(start + 30ms), 70ms);
+    ASSERT_TRUE(cache.takeExpired(start + 99ms).empty());
+
+    // A piece that joins an old run is written along with it
+    cache.add(makePiece(infoHash, 1), start + 60ms);
+    auto runs = cache.takeExpired(start + 100ms);
+    ASSERT_EQ(runs.size(), 1);
+    ASSERT_EQ(runs[0].pieces.size(), 2);
+    ASSERT_EQ(cache.untilExpired(start + 100ms), 50ms);
+
+    runs = cache.takeExpired(start + 200ms);
+    ASSERT_EQ(runs.size(), 1);
+    ASSERT_EQ(runs[0].pieces[0].pieceIndex, 4);
+    ASSERT_FALSE(cache.untilExpired(start + 200ms));
+}
+
+TEST(WRITE_CACHE, memoryLimit)
+{
+    WriteCache cache(WriteCacheConfig{3 * PIECE_SIZE, 1000ms});
+    const auto start = WriteCache::Clock::now();
+    cache.add(makePiece(infoHash, 4), start);
+    cache.add(makePiece(infoHash, 0), start + 1ms);
+    cache.add(makePiece(infoHash, 1), start + 2ms);
+    ASSERT_FALSE(cache.isOverLimit());
+
+    // Replacing a piece does not count twice
+    cache.add(makePiece(infoHash, 1), start + 3ms);
+    ASSERT_EQ(cache.getBytes(), 3 * PIECE_SIZE);
+
+    cache.add(makePiece(infoHash, 8), start + 4ms);
+    ASSERT_TRUE(cache.isOverLimit());
+
+    // Oldest runs go first
+    const auto runs = cache.takeOldest(3 * PIECE_SIZE);
+    ASSERT_EQ(runs.size(), 1);
+    ASSERT_EQ(runs[0].pieces[0].pieceIndex, 4);
+    ASSERT_EQ(cache.getBytes(), 3 * PIECE_SIZE);
+    ASSERT_FALSE(cache.isOverLimit());
+    ASSERT_EQ(cache.takeOldest(2 * PIECE_SIZE).size(), 1);
+    ASSERT_EQ(cache.getNumPieces(), 1);
+}
+
+} // namespace fractals::disk
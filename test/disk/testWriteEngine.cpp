@@ -0,0 +1,128 @@
+#include <fractals/disk/WriteEngine.h>
+
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+namespace fractals::disk
+{
+
+class WriteEngineTest : public ::testing::Test
+{
+  public:
+    void SetUp() override
+    {
+        dir = std::filesystem::temp_directory_path() /
+              ("fractals_writeengine_" + std::to_string(::getpid()));
+        std::filesystem::create_directories(dir);
+    }
+
+    void TearDown() override
+    {
+        std::filesystem::remove_all(dir);
+    }
+
+    std::filesystem::path createFile(const std::string &name)
+    {
+        const auto path = dir / name;
+        std::ofstream{path};
+        return path;
+    }
+
+    std::string readFile(const std::filesystem::path &path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        std::stringstream ss;
+        ss << file.rdbuf();
+        return ss.str();
+    }
+
+    // Completions of the tickets, after all submitted jobs are written
+    std::unordered_map<uint64_t, bool> complete(WriteEngine &engine)
+    {
+        engine.stop();
+        std::unordered_map<uint64_t, bool> results;
+        auto completions = engine.getCompletionEndPoint();
+        while (completions.canPop())
+        {
+            const auto completion = completions.pop();
+            results[completion.ticket] = completion.success;
+        }
+
+        return results;
+    }
+
+    std::filesystem::path dir;
+};
+
+TEST_F(WriteEngineTest, writesInParallel)
+{
+    WriteEngine engine(WriteEngineConfig{4});
+    const std::vector<std::string> data{"aaaa", "bbbb", "cccc", "dddd"};
+    std::vector<std::filesystem::path> paths;
+    for (int i = 0; i < 8; ++i)
+    {
+        paths.push_back(createFile(std::to_string(i)));
+    }
+
+    uint64_t ticket{0};
+    for (const auto &path : paths)
+    {
+        for (uint64_t block = 0; block < data.size(); ++block)
+        {
+            engine.submit(WriteJob{ticket++, path, block * 4, {data[block]}});
+        }
+    }
+
+    const auto results = complete(engine);
+    ASSERT_EQ(results.size(), ticket);
+    for (const auto &[_, success] : results)
+    {
+        ASSERT_TRUE(success);
+    }
+
+    ASSERT_EQ(engine.getInFlight(), 0);
+    ASSERT_EQ(engine.getNumThreads(), 4);
+    for (const auto &path : paths)
+    {
+        ASSERT_EQ(readFile(path), "aaaabbbbccccdddd");
+    }
+}
+
+TEST_F(WriteEngineTest, keepsOrderPerFile)
+{
+    WriteEngine engine(WriteEngineConfig{4});
+    ASSERT_TRUE(engine.setDeviceConcurrency(dir, 2));
+    const auto path = createFile("a");
+
+    // Overlapping writes to a file land in the order they were submitted
+    const std::vector<std::string> data{"aaaa", "bbbb", "cccc"};
+    for (uint64_t i = 0; i < data.size(); ++i)
+    {
+        engine.submit(WriteJob{i, path, 0, {data[i]}});
+    }
+
+    complete(engine);
+    ASSERT_EQ(engine.getNumThreads(), 2);
+    ASSERT_EQ(readFile(path), "cccc");
+}
+
+TEST_F(WriteEngineTest, reportsFailedWrites)
+{
+    WriteEngine engine;
+    const auto path = createFile("a");
+    engine.submit(WriteJob{1, path, 0, {"ab", "cd"}});
+    engine.submit(WriteJob{2, dir / "missing", 0, {"abcd"}});
+
+    const auto results = complete(engine);
+    ASSERT_TRUE(results.at(1));
+    ASSERT_FALSE(results.at(2));
+    ASSERT_EQ(readFile(path), "abcd");
+}
+
+} // namespace fractals::disk
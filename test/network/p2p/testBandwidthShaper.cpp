@@ -0,0 +1,178 @@
+#include <fractals/common/Tagged.h>
+#include <fractals/network/http/Peer.h>
+#include <fractals/network/p2p/BandwidthShaper.h>
+
+#include <chrono>
+#include <gtest/gtest.h>
+
+namespace fractals::network::p2p
+{
+
+using namespace std::chrono_literals;
+
+class BandwidthShaperTest : public ::testing::Test
+{
+  public:
+    static constexpr common::InfoHash INFOHASH{"abcdef"};
+    static constexpr common::InfoHash INFOHASH2{"feghjk"};
+    static constexpr http::PeerId PEER1{"host", 1000};
+    static constexpr http::PeerId PEER2{"host", 1001};
+    static constexpr http::PeerId PEER3{"host", 1002};
+    static constexpr http::PeerId PEER4{"host", 1003};
+
+    std::chrono::nanoseconds now{1s};
+    BandwidthShaper shaper{[this]()
+                           {
+                               return now;
+                           }};
+};
+
+TEST_F(BandwidthShaperTest, unlimitedByDefault)
+{
+    ASSERT_EQ(shaper.acquire(PEER1, Direction::Down, 1'000'000), 1'000'000);
+    ASSERT_EQ(shaper.acquire(PEER1, Direction::Up, 1'000'000), 1'000'000);
+    ASSERT_EQ(shaper.retryAfter(PEER1, Direction::Down), 0ns);
+}
+
+TEST_F(BandwidthShaperTest, globalLimitWithBurst)
+{
+    shaper.setGlobalLimit(Direction::Down, RateLimit{1000, 500});
+
+    // Starts with a full bucket
+    ASSERT_EQ(shaper.acquire(PEER1, Direction::Down, 800), 500);
+    ASSERT_EQ(shaper.acquire(PEER2, Direction::Down, 800), 0);
+    ASSERT_EQ(shaper.retryAfter(PEER2, Direction::Down), 500ms);
+
+    // Refills at the configured rate, no more than the burst
+    now += 100ms;
+    ASSERT_EQ(shaper.acquire(PEER2, Direction::Down, 800), 100);
+    now += 10s;
+    ASSERT_EQ(shaper.acquire(PEER2, Direction::Down, 800), 500);
+
+    // Upload is not limited
+    ASSERT_EQ(shaper.acquire(PEER1, Direction::Up, 800), 800);
+}
+
+TEST_F(BandwidthShaperTest, defaultBurst)
+{
+    shaper.setGlobalLimit(Direction::Up, RateLimit{100});
+    ASSERT_EQ(shaper.acquire(PEER1, Direction::Up, 1'000'000), TokenBucket::MIN_BURST);
+
+    shaper.setGlobalLimit(Direction::Up, RateLimit{1'000'000});
+    now += 1s;
+    ASSERT_EQ(shaper.acquire(PEER1, Direction::Up, 2'000'000), 1'000'000);
+}
+
+TEST_F(BandwidthShaperTest, tightestLimitApplies)
+{
+    shaper.assignPeer(PEER1, INFOHASH);
+    shaper.assignPeer(PEER2, INFOHASH);
+    shaper.assignPeer(PEER3, INFOHASH2);
+    shaper.setGlobalLimit(Direction::Down, RateLimit{1000, 1000});
+    shaper.setTorrentLimit(INFOHASH, Direction::Down, RateLimit{1000, 300});
+    shaper.setPeerLimit(Direction::Down, RateLimit{1000, 200});
+
+    ASSERT_EQ(shaper.acquire(PEER1, Direction::Down, 1000), 200);
+    ASSERT_EQ(shaper.acquire(PEER2, Direction::Down, 1000), 100);
+    ASSERT_EQ(shaper.acquire(PEER3, Direction::Down, 1000), 200);
+
+    // Peer that is not assigned to a torrent has no bucket of its own
+    ASSERT_EQ(shaper.acquire(PEER4, Direction::Down, 300), 300);
+
+    shaper.setPeerLimit(Direction::Down, RateLimit{});
+    ASSERT_EQ(shaper.acquire(PEER3, Direction::Down, 1000), 200);
+    ASSERT_EQ(shaper.acquire(PEER4, Direction::Down, 1000), 0);
+}
+
+TEST_F(BandwidthShaperTest, removedPeerIsNotRecreated)
+{
+    shaper.assignPeer(PEER1, INFOHASH);
+    shaper.setPeerLimit(Direction::Down, RateLimit{1000, 200});
+    shaper.setGlobalLimit(Direction::Down, RateLimit{1000, 1000});
+    shaper.removePeer(PEER1);
+
+    // Late events of the peer are only held to the global limit
+    ASSERT_EQ(shaper.acquire(PEER1, Direction::Down, 500), 500);
+    ASSERT_EQ(shaper.acquire(PEER1, Direction::Down, 500), 500);
+    ASSERT_EQ(shaper.acquire(PEER1, Direction::Down, 500), 0);
+
+    now += 1s;
+    ASSERT_EQ(shaper.retryAfter(PEER1, Direction::Down), 0ns);
+    ASSERT_EQ(shaper.acquire(PEER1, Direction::Down, 500), 500);
+}
+
+TEST_F(BandwidthShaperTest, releaseReturnsUnusedTokens)
+{
+    shaper.assignPeer(PEER1, INFOHASH);
+    shaper.setTorrentLimit(INFOHASH, Direction::Up, RateLimit{1000, 1000});
+
+    const auto granted = shaper.acquire(PEER1, Direction::Up, 1000);
+    ASSERT_EQ(granted, 1000);
+    shaper.release(PEER1, Direction::Up, granted, 400);
+
+    ASSERT_EQ(shaper.acquire(PEER1, Direction::Up, 1000), 600);
+}
+
+TEST_F(BandwidthShaperTest, reconfigureLive)
+{
+    shaper.setGlobalLimit(Direction::Down, RateLimit{1000, 1000});
+    ASSERT_EQ(shaper.acquire(PEER1, Direction::Down, 600), 600);
+
+    // Lowering the burst caps the tokens that are left
+    shaper.setGlobalLimit(Direction::Down, RateLimit{1000, 100});
+    ASSERT_EQ(shaper.acquire(PEER1, Direction::Down, 600), 100);
+
+    shaper.setGlobalLimit(Direction::Down, RateLimit{});
+    ASSERT_EQ(shaper.acquire(PEER1, Direction::Down, 600), 600);
+}
+
+TEST_F(BandwidthShaperTest, measuresRates)
+{
+    shaper.assignPeer(PEER1, INFOHASH);
+    shaper.setTorrentLimit(INFOHASH, Direction::Down, RateLimit{5000, 5000});
+
+    // Meters start with the first transfer
+    shaper.release(PEER1, Direction::Down, 0, 0);
+    for (int i = 0; i < 4; ++i)
+    {
+        now += 500ms;
+        const auto granted = shaper.acquire(PEER1, Direction::Down, 1000);
+        shaper.release(PEER1, Direction::Down, granted, granted);
+    }
+
+    const auto rates = shaper.getRates(INFOHASH);
+    EXPECT_EQ(rates.download, 2000);
+    EXPECT_EQ(rates.upload, 0);
+    EXPECT_EQ(rates.downloadLimit, (RateLimit{5000, 5000}));
+    EXPECT_EQ(shaper.getRates().download, 2000);
+
+    EXPECT_EQ(shaper.getRates(INFOHASH2).download, 0);
+}
+
+TEST_F(BandwidthShaperTest, measuresRatesWithoutLimits)
+{
+    shaper.assignPeer(PEER1, INFOHASH);
+    shaper.assignPeer(PEER2, INFOHASH2);
+
+    shaper.release(PEER1, Direction::Up, 0, 0);
+    for (int i = 0; i < 4; ++i)
+    {
+        now += 500ms;
+        const auto granted = shaper.acquire(PEER1, Direction::Up, 1000);
+        ASSERT_EQ(granted, 1000);
+        shaper.release(PEER1, Direction::Up, granted, granted);
+        shaper.release(PEER2, Direction::Up, granted, granted / 2);
+    }
+
+    EXPECT_EQ(shaper.getRates(INFOHASH).upload, 2000);
+    EXPECT_EQ(shaper.getRates(INFOHASH2).upload, 1000);
+    EXPECT_EQ(shaper.getRates().upload, 3000);
+
+    // Limit that is removed again turns the fast path back on
+    shaper.setTorrentLimit(INFOHASH, Direction::Up, RateLimit{1000, 500});
+    ASSERT_EQ(shaper.acquire(PEER1, Direction::Up, 1000), 500);
+    shaper.removeTorrent(INFOHASH);
+    ASSERT_EQ(shaper.acquire(PEER1, Direction::Up, 1000), 1000);
+}
+
+} // namespace fractals::network::p2p
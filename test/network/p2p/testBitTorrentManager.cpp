@@ -7,6 +7,7 @@
 #include <fractals/network/http/AnnounceEventQueue.h>
 #include <fractals/network/http/Event.h>
 #include <fractals/network/http/Peer.h>
+#include <fractals/network/p2p/BandwidthShaper.h>
 #include <fractals/network/p2p/BitTorrentManager.ipp>
 #include <fractals/network/p2p/BitTorrentMsg.h>
 #include <fractals/network/p2p/BufferedQueueManager.h>
@@ -38,9 +39,9 @@ namespace fractals::network::p2p
 class MockPeerService
 {
   public:
-    EpollMsgQueue::LeftEndPoint getQueueEndPoint()
+    std::vector<EpollMsgQueue::LeftEndPoint> getQueueEndPoints()
     {
-        return queue.getLeftEnd();
+        return {queue.getLeftEnd()};
     }
 
     bool connect(http::PeerId, std::chrono::nanoseconds)
@@ -52,6 +53,36 @@ class MockPeerService
     {
     }
 
+    BandwidthShaper *getShaper()
+    {
+        return &shaper;
+    }
+
+    bool write(http::PeerId, BitTorrentMessage &&, std::chrono::nanoseconds)
+    {
+        return true;
+    }
+
+    bool canRead()
+    {
+        return false;
+    }
+
+    size_t readMany(std::chrono::nanoseconds, std::vector<PeerEvent> &, size_t)
+    {
+        return 0;
+    }
+
+    void beginBatch()
+    {
+    }
+
+    void endBatch()
+    {
+    }
+
+    BandwidthShaper shaper;
+
     MOCK_METHOD(std::optional<PeerEvent>, read, ());
     MOCK_METHOD(void, shutdown, ());
 
@@ -84,6 +115,7 @@ class BitTorrentManagerMock
     MOCK_METHOD(void, process, (const app::ResumeTorrent &));
     MOCK_METHOD(void, process, (const app::Shutdown &));
     MOCK_METHOD(void, process, (const app::RequestStats &));
+    MOCK_METHOD(void, process, (const app::SetRateLimit &));
     MOCK_METHOD(void, process, (const persist::AddedTorrent &));
     MOCK_METHOD(void, process, (const persist::TorrentExists &));
     MOCK_METHOD(void, process, (const persist::Pieces &));
@@ -97,6 +129,7 @@ class BitTorrentManagerMock
     MOCK_METHOD(void, process, (const http::Announce &));
     MOCK_METHOD(void, process, (const p2p::ConnectionDisconnected &));
     MOCK_METHOD(void, process, (const p2p::ConnectionEstablished &));
+    MOCK_METHOD(void, process, (const p2p::IncomingConnection &));
 
     template <typename T>
     std::pair<ProtocolState, common::InfoHash> forwardToPeer(http::PeerId peer, const T &t)
@@ -357,4 +390,50 @@ TEST_F(BitTorrentManagerTest, processRequestStats)
     }
 }
 
+TEST_F(BitTorrentManagerTest, processSetRateLimit)
+{
+    btManReal.process(app::StartTorrent{INFOHASH, persist::TorrentModel{}, {}});
+    appResponses.pop();
+
+    btManReal.process(
+        app::SetRateLimit{app::SetRateLimit::Scope::Torrent, INFOHASH, 100'000, 50'000});
+    btManReal.process(app::SetRateLimit{app::SetRateLimit::Scope::Global, {}, 200'000, 0});
+
+    const auto torrRates = peerService.shaper.getRates(INFOHASH);
+    EXPECT_EQ(torrRates.downloadLimit.rate, 100'000);
+    EXPECT_EQ(torrRates.uploadLimit.rate, 50'000);
+
+    const auto globalRates = peerService.shaper.getRates();
+    EXPECT_EQ(globalRates.downloadLimit.rate, 200'000);
+    EXPECT_EQ(globalRates.uploadLimit.rate, 0);
+
+    btManReal.process(app::RequestStats{{std::make_pair(0, INFOHASH)}});
+    ASSERT_EQ(appResponses.numToRead(), 1);
+    const auto msg = appResponses.pop();
+    ASSERT_TRUE(std::holds_alternative<app::PeerStats>(msg));
+    EXPECT_EQ(std::get<app::PeerStats>(msg).downloadLimit, 100'000);
+    EXPECT_EQ(std::get<app::PeerStats>(msg).uploadLimit, 50'000);
+}
+
+TEST_F(BitTorrentManagerTest, evalDrainsUpToBudget)
+{
+    using Source = BitTorrentManagerImpl<MockPeerService>::EventSource;
+    btManReal.setBudget(Source::App, 2);
+
+    for (int i = 0; i < 5; ++i)
+    {
+        appResponses.push(app::RequestStats{});
+    }
+
+    ASSERT_TRUE(btManReal.eval());
+    ASSERT_EQ(btManReal.getServiceCounts()[static_cast<size_t>(Source::App)], 2);
+    ASSERT_TRUE(btManReal.eval());
+    ASSERT_EQ(btManReal.getServiceCounts()[static_cast<size_t>(Source::App)], 4);
+    ASSERT_FALSE(btManReal.eval());
+    ASSERT_EQ(btManReal.getServiceCounts()[static_cast<size_t>(Source::App)], 5);
+
+    ASSERT_EQ(btManReal.getServiceCounts()[static_cast<size_t>(Source::Disk)], 0);
+    ASSERT_EQ(btManReal.getServiceCounts()[static_cast<size_t>(Source::Peer)], 0);
+}
+
 } // namespace fractals::network::p2p
\ No newline at end of file
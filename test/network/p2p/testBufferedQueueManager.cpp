@@ -11,6 +11,7 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <iterator>
+#include <sys/uio.h>
 #include <variant>
 #include <vector>
 
@@ -31,36 +32,37 @@ TEST(BUFFER_MANAGER, HandShakeRead)
 
     btMan.addToReadBuffer<std::vector<char>>(peer, {4});
 
-    auto *msgState = btMan.getReadBuffer(peer);
+    auto *ring = btMan.getReadBuffer(peer);
 
-    ASSERT_TRUE(msgState);
+    ASSERT_TRUE(ring);
 
-    ASSERT_TRUE(msgState->isInitialized());
-    ASSERT_FALSE(msgState->isComplete());
+    ASSERT_FALSE(ring->hasMessage());
 
     // pstr
     btMan.addToReadBuffer<std::vector<char>>(peer, {'a', 'b', 'c', 'd'});
 
-    ASSERT_FALSE(msgState->isComplete());
+    ASSERT_FALSE(ring->hasMessage());
 
     // reserved
     btMan.addToReadBuffer<std::vector<char>>(peer, {1, 2, 3, 4, 5, 6, 7, 8});
 
-    ASSERT_FALSE(msgState->isComplete());
+    ASSERT_FALSE(ring->hasMessage());
 
     // info hash
     btMan.addToReadBuffer<std::vector<char>>(peer, {1, 1, 1, 1, 2, 2, 2, 2, 3, 3});
     btMan.addToReadBuffer<std::vector<char>>(peer, {3, 3, 4, 4, 4, 4, 5, 5, 5, 5});
 
-    ASSERT_FALSE(msgState->isComplete());
+    ASSERT_FALSE(ring->hasMessage());
 
     // peer id
     btMan.addToReadBuffer<std::vector<char>>(peer, {5, 5, 5, 5, 6, 6, 6, 6, 7, 7});
     bool complete = btMan.addToReadBuffer<std::vector<char>>(peer, {7, 7, 8, 8, 8, 8, 9, 9, 9, 9});
 
     ASSERT_TRUE(complete);
-    ASSERT_TRUE(msgState->isComplete());
-    const auto msg = encoder.decodeHandShake(msgState->getBuffer());
+    const auto lease = btMan.popMessage(peer);
+    ASSERT_TRUE(lease);
+    ASSERT_FALSE(btMan.popMessage(peer));
+    const auto msg = encoder.decodeHandShake(*lease);
     ASSERT_TRUE(std::holds_alternative<HandShake>(msg));
 
     const auto handShake = std::get<HandShake>(msg);
@@ -129,24 +131,19 @@ TEST(BUFFER_MANAGER, KeepAliveRead)
     // HandShake
     btMan.addToReadBuffer<std::vector<char>>(peer, {0});
 
-    auto &deq = btMan.getReadBuffers(peer);
-
     bool completed = btMan.addToReadBuffer<std::vector<char>>(peer, std::vector<char>(48));
     ASSERT_TRUE(completed);
-    auto hs = (encoder.decodeHandShake(deq.back().getBuffer()));
+    auto hs = encoder.decodeHandShake(*btMan.popMessage(peer));
     ASSERT_TRUE(std::holds_alternative<HandShake>(hs));
-    deq.pop_back();
 
-    btMan.addToReadBuffer<std::vector<char>>(peer, {0});
-    ASSERT_FALSE(deq.back().isInitialized());
+    ASSERT_FALSE(btMan.addToReadBuffer<std::vector<char>>(peer, {0}));
 
-    btMan.addToReadBuffer<std::vector<char>>(peer, {0});
-    ASSERT_FALSE(deq.back().isInitialized());
+    ASSERT_FALSE(btMan.addToReadBuffer<std::vector<char>>(peer, {0}));
 
-    btMan.addToReadBuffer<std::vector<char>>(peer, {0, 0});
-    ASSERT_TRUE(deq.back().isInitialized());
-    ASSERT_TRUE(deq.back().isComplete());
-    ASSERT_TRUE(std::holds_alternative<KeepAlive>(encoder.decode(deq.back().getBuffer())));
+    ASSERT_TRUE(btMan.addToReadBuffer<std::vector<char>>(peer, {0, 0}));
+    const auto lease = btMan.popMessage(peer);
+    ASSERT_TRUE(lease);
+    ASSERT_TRUE(std::holds_alternative<KeepAlive>(encoder.decode(*lease)));
 }
 
 TEST(BUFFER_MANAGER, KeepAliveWrite)
@@ -201,38 +198,106 @@ TEST(BUFFER_MANAGER, BitfieldRead)
     // HandShake
     btMan.addToReadBuffer<std::vector<char>>(peer, {0});
 
-    auto &deq = btMan.getReadBuffers(peer);
-
     bool completed = btMan.addToReadBuffer(peer, std::vector<char>(48));
 
     ASSERT_TRUE(completed);
-    auto hs = encoder.decodeHandShake(deq.back().getBuffer());
+    auto hs = encoder.decodeHandShake(*btMan.popMessage(peer));
     ASSERT_TRUE(std::holds_alternative<HandShake>(hs));
-    // deq.pop_back();
 
     btMan.addToReadBuffer<std::vector<char>>(peer, {0});
 
-    ASSERT_FALSE(deq.back().isInitialized());
-
     btMan.addToReadBuffer<std::vector<char>>(peer, {0});
 
-    ASSERT_FALSE(deq.back().isInitialized());
-
     btMan.addToReadBuffer<std::vector<char>>(peer, {0, 50});
 
-    ASSERT_TRUE(deq.back().isInitialized());
-
     btMan.addToReadBuffer<std::vector<char>>(peer, {5}); // Bitfield type
 
     btMan.addToReadBuffer(peer, std::vector<char>(20));
 
+    ASSERT_FALSE(btMan.popMessage(peer));
+
     completed = btMan.addToReadBuffer(peer, std::vector<char>(29));
     ASSERT_TRUE(completed);
 
-    const auto msg = encoder.decode(deq.back().getBuffer());
+    const auto msg = encoder.decode(*btMan.popMessage(peer));
     ASSERT_TRUE(std::holds_alternative<Bitfield>(msg));
 }
 
+TEST(BUFFER_MANAGER, ReadWrapsAroundRing)
+{
+    BufferedQueueManager btMan(4096);
+
+    btMan.addToReadBuffer(peer, encoder.encode(HandShake{}));
+    ASSERT_TRUE(btMan.popMessage(peer));
+
+    const auto capacity = btMan.getReadBuffer(peer)->getCapacity();
+
+    // Enough messages to cycle through the ring a few times
+    const Bitfield bf{std::string(1000, 'x')};
+    for (uint32_t i = 0; i < 4 * capacity / 1000; ++i)
+    {
+        ASSERT_TRUE(btMan.addToReadBuffer(peer, encoder.encode(bf)));
+
+        const auto lease = btMan.popMessage(peer);
+        ASSERT_TRUE(lease);
+
+        const auto msg = encoder.decode(*lease);
+        ASSERT_TRUE(std::holds_alternative<Bitfield>(msg));
+        ASSERT_EQ(std::get<Bitfield>(msg), bf);
+    }
+}
+
+TEST(BUFFER_MANAGER, ReadStalledUntilLeaseReleased)
+{
+    BufferedQueueManager btMan(4096);
+
+    bool notified{false};
+    btMan.onReadSpaceAvailable(
+        [&]()
+        {
+            notified = true;
+        });
+
+    btMan.addToReadBuffer(peer, encoder.encode(HandShake{}));
+    auto handShake = btMan.popMessage(peer);
+    ASSERT_TRUE(handShake);
+
+    // Fill the remainder of the ring while holding on to the handshake lease
+    const auto capacity = btMan.getReadBuffer(peer)->getCapacity();
+    auto space = btMan.reserveRead(peer);
+    ASSERT_EQ(space.size(), capacity - handShake->size());
+    btMan.commitRead(peer, space.size());
+
+    ASSERT_TRUE(btMan.reserveRead(peer).empty());
+    ASSERT_TRUE(btMan.isReadStalled(peer));
+    ASSERT_FALSE(notified);
+
+    handShake.reset();
+
+    ASSERT_TRUE(notified);
+    ASSERT_FALSE(btMan.isReadStalled(peer));
+    ASSERT_FALSE(btMan.reserveRead(peer).empty());
+}
+
+TEST(BUFFER_MANAGER, OversizedMessage)
+{
+    BufferedQueueManager btMan(4096);
+
+    btMan.addToReadBuffer(peer, encoder.encode(HandShake{}));
+    ASSERT_TRUE(btMan.popMessage(peer));
+    ASSERT_FALSE(btMan.isReadOversized(peer));
+
+    // Length prefix alone tells that the message can never fit
+    const auto capacity = btMan.getReadBuffer(peer)->getCapacity();
+    const auto length = common::intToBytes(capacity);
+    ASSERT_FALSE(btMan.addToReadBuffer(peer, length));
+
+    ASSERT_TRUE(btMan.isReadOversized(peer));
+    ASSERT_FALSE(btMan.popMessage(peer));
+    ASSERT_TRUE(btMan.reserveRead(peer).empty());
+    ASSERT_FALSE(btMan.isReadStalled(peer));
+}
+
 TEST(BUFFER_MANAGER, BitfieldWrite)
 {
     BufferedQueueManager btMan;
@@ -263,4 +328,37 @@ TEST(BUFFER_MANAGER, BitfieldWrite)
     ASSERT_TRUE(wmsg->isComplete());
 }
 
+TEST(BUFFER_MANAGER, QueueMultipleWrites)
+{
+    BufferedQueueManager btMan;
+
+    btMan.addToWriteBuffer(peer, encoder.encode(Interested{}));
+    btMan.addToWriteBuffer(peer, encoder.encode(Request{1, 0, 16384}));
+    btMan.addToWriteBuffer(peer, encoder.encode(KeepAlive{}));
+
+    auto *wq = btMan.getWriteBuffer(peer);
+
+    ASSERT_TRUE(wq);
+    ASSERT_EQ(wq->size(), 3);
+    ASSERT_EQ(wq->remaining(), 5 + 17 + 4);
+
+    std::array<iovec, 8> iovs;
+    ASSERT_EQ(wq->gather(iovs, wq->remaining()), 3);
+    EXPECT_EQ(iovs[0].iov_len, 5);
+    EXPECT_EQ(iovs[1].iov_len, 17);
+    EXPECT_EQ(iovs[2].iov_len, 4);
+
+    // Partial write that ends halfway into the Request
+    ASSERT_EQ(wq->flush(10), 1);
+    ASSERT_EQ(wq->size(), 2);
+    ASSERT_EQ(wq->remaining(), 12 + 4);
+
+    ASSERT_EQ(wq->gather(iovs, 14), 2);
+    EXPECT_EQ(iovs[0].iov_len, 12);
+    EXPECT_EQ(iovs[1].iov_len, 2);
+
+    ASSERT_EQ(wq->flush(16), 2);
+    ASSERT_TRUE(wq->isComplete());
+}
+
 } // namespace fractals::network::p2p
\ No newline at end of file
@@ -1,19 +1,21 @@
+#include <fractals/common/TcpService.h>
 #include <fractals/common/encode.h>
 #include <fractals/common/utils.h>
 #include <fractals/network/http/Peer.h>
 #include <fractals/network/http/Request.h>
+#include <fractals/network/p2p/BandwidthShaper.h>
 #include <fractals/network/p2p/BufferedQueueManager.h>
 #include <fractals/network/p2p/EpollMsgQueue.h>
 #include <fractals/network/p2p/EpollService.h>
 #include <fractals/network/p2p/EpollService.ipp>
 #include <fractals/network/p2p/EpollServiceEvent.h>
 #include <fractals/network/p2p/PeerFd.h>
+#include <fractals/sync/Notifier.h>
 #include <fractals/torrent/Bencode.h>
 #include "neither/maybe.hpp"
 #include <boost/mp11/algorithm.hpp>
 #include <cassert>
 #include <chrono>
-#include <condition_variable>
 #include <cstdio>
 #include <epoll_wrapper/Epoll.h>
 #include <epoll_wrapper/EpollImpl.ipp>
@@ -28,7 +30,6 @@
 #include <fcntl.h>
 #include <iostream>
 #include <iterator>
-#include <mutex>
 #include <optional>
 #include <stdexcept>
 #include <string>
@@ -39,7 +40,8 @@
 #include <variant>
 #include <vector>
 
-#define ASSERT_READ(readEvent, v) EXPECT_THAT(readEvent.mMessage, v)
+#define ASSERT_READ(readEvent, v)                                                                  \
+    EXPECT_THAT(std::vector<char>(readEvent.mMessage.begin(), readEvent.mMessage.end()), v)
 
 namespace fractals::network::p2p
 {
@@ -51,61 +53,83 @@ class MockBufferedQueueManager
     {
     }
 
-    bool addToReadBuffer(PeerFd peer, std::vector<char> buf)
+    std::span<char> reserveRead(PeerFd peer)
     {
-        bool firstByte = true;
-        int s = 0;
-        ReadMsgState m;
+        return std::span<char>(readBuffer);
+    }
+
+    bool commitRead(PeerFd peer, uint32_t bytes)
+    {
+        auto &buf = partial[peer];
+        buf.insert(buf.end(), readBuffer.begin(), readBuffer.begin() + bytes);
 
-        for (int i = 0; i < buf.size(); ++i)
+        bool complete = false;
+        while (!buf.empty() && buf.size() > static_cast<uint8_t>(buf[0]))
         {
-            if (firstByte)
-            {
-                s = buf[i];
-                m.initialize(s);
-                firstByte = false;
-            }
-            else
-            {
-                m.append(std::string{buf[i]}, 1);
-                s--;
-
-                if (s == 0)
-                {
-                    bufMap[peer].push_back(m);
-                    m = ReadMsgState{};
-                    firstByte = true;
-                }
-            }
+            const auto end = buf.begin() + 1 + static_cast<uint8_t>(buf[0]);
+            bufMap[peer].emplace_back(buf.begin() + 1, end);
+            buf.erase(buf.begin(), end);
+            complete = true;
         }
 
-        return true;
+        return complete;
     }
 
-    void addToWriteBuffer(const PeerFd &p, std::vector<char> &&m)
+    std::optional<ReadLease> popMessage(PeerFd peer)
     {
+        auto &msgs = bufMap[peer];
+        if (msgs.empty())
+        {
+            return std::nullopt;
+        }
+
+        ReadLease lease{std::move(msgs.front())};
+        msgs.pop_front();
+        return lease;
     }
 
-    std::deque<ReadMsgState> &getReadBuffers(PeerFd peer)
+    bool isReadStalled(PeerFd peer) const
+    {
+        return false;
+    }
+
+    bool isReadOversized(PeerFd peer) const
+    {
+        return false;
+    }
+
+    void removeFromReadBuffer(PeerFd peer)
+    {
+        bufMap.erase(peer);
+        partial.erase(peer);
+    }
+
+    void onReadSpaceAvailable(std::function<void()> callback)
+    {
+    }
+
+    void addToWriteBuffer(const PeerFd &p, std::vector<char> &&m)
     {
-        return bufMap[peer];
     }
 
-    WriteMsgState *getWriteBuffer(PeerFd peer)
+    WriteQueue *getWriteBuffer(PeerFd peer)
     {
         return nullptr;
     }
 
     void removeFromWriteBuffer(PeerFd peer)
     {
-        bufMap.erase(peer);
     }
 
-    std::unordered_map<PeerFd, std::deque<ReadMsgState>> bufMap;
+    std::array<char, 512> readBuffer;
+    std::unordered_map<PeerFd, std::vector<char>> partial;
+    std::unordered_map<PeerFd, std::deque<std::vector<char>>> bufMap;
 };
 
 using MockReadHandler =
     EpollServiceImpl<PeerFd, epoll_wrapper::Epoll<PeerFd>, MockBufferedQueueManager, EpollMsgQueue>;
+using ReadHandler =
+    EpollServiceImpl<PeerFd, epoll_wrapper::Epoll<PeerFd>, BufferedQueueManager, EpollMsgQueue>;
 
 void writeToFd(int fd, std::string text)
 {
@@ -127,6 +151,14 @@ std::pair<int, PeerFd> createPeer()
     return {pipeFds[1], PeerFd{pId, pipeFds[0]}};
 }
 
+template <typename Pred> void waitUntil(sync::Notifier &notifier, Pred pred)
+{
+    while (!pred())
+    {
+        notifier.wait();
+    }
+}
+
 TEST(CONNECTION_READ, sub_and_unsub)
 {
     epoll_wrapper::CreateAction<epoll_wrapper::Epoll<PeerFd>> epoll =
@@ -185,10 +217,8 @@ TEST(CONNECTION_READ, one_subscriber_read_one)
 
     EpollMsgQueue epollQueue;
     auto queue = epollQueue.getLeftEnd();
-    std::mutex mutex;
-    std::condition_variable cv;
-    epollQueue.getRightEnd().attachNotifier(mutex, cv);
-    epollQueue.getLeftEnd().attachNotifier(mutex, cv);
+    sync::Notifier notifier;
+    epollQueue.getLeftEnd().attachNotifier(notifier, 0);
     MockBufferedQueueManager bqm;
     MockReadHandler mr(epoll.getEpoll(), bqm, epollQueue.getRightEnd());
 
@@ -202,26 +232,20 @@ TEST(CONNECTION_READ, one_subscriber_read_one)
             mr.run();
         });
 
-    {
-        std::unique_lock<std::mutex> lock(mutex);
-        cv.wait(lock,
-                [&]
-                {
-                    return queue.canPop();
-                });
-    }
+    waitUntil(notifier,
+              [&]()
+              {
+                  return queue.canPop();
+              });
 
     CtlResponse peerResp{peer, ""};
     ASSERT_EQ(std::get<CtlResponse>(queue.pop()), peerResp);
 
-    {
-        std::unique_lock<std::mutex> _l(mutex);
-        cv.wait(_l,
-                [&]()
-                {
-                    return queue.canPop();
-                });
-    }
+    waitUntil(notifier,
+              [&]()
+              {
+                  return queue.canPop();
+              });
     ReadEvent re = std::get<ReadEvent>(queue.pop());
     ASSERT_READ(re, testing::ContainerEq<std::vector<char>>({'t', 'e', 's', 't'}));
 
@@ -242,10 +266,8 @@ TEST(CONNECTION_READ, one_subscribed_read_multiple)
 
     EpollMsgQueue epollQueue;
     auto queue = epollQueue.getLeftEnd();
-    std::mutex mutex;
-    std::condition_variable cv;
-    epollQueue.getLeftEnd().attachNotifier(mutex, cv);
-    epollQueue.getRightEnd().attachNotifier(mutex, cv);
+    sync::Notifier notifier;
+    epollQueue.getLeftEnd().attachNotifier(notifier, 0);
     MockBufferedQueueManager bqm;
     MockReadHandler mr(epoll.getEpoll(), bqm, epollQueue.getRightEnd());
 
@@ -266,14 +288,11 @@ TEST(CONNECTION_READ, one_subscribed_read_multiple)
     writeToFd(writeFd, "\x05test2");
     writeToFd(writeFd, "\x05test3");
 
-    {
-        std::unique_lock<std::mutex> lock(mutex);
-        cv.wait(lock,
-                [&]
-                {
-                    return queue.numToRead() >= 5;
-                });
-    }
+    waitUntil(notifier,
+              [&]()
+              {
+                  return queue.numToRead() >= 5;
+              });
 
     CtlResponse ctl = std::get<CtlResponse>(queue.pop());
     ReadEvent re1 = std::get<ReadEvent>(queue.pop());
@@ -305,10 +324,8 @@ TEST(CONNECTION_READ, multiple_subscriber_read_one)
 
     EpollMsgQueue epollQueue;
     auto queue = epollQueue.getLeftEnd();
-    std::mutex mutex;
-    std::condition_variable cv;
-    epollQueue.getRightEnd().attachNotifier(mutex, cv);
-    epollQueue.getLeftEnd().attachNotifier(mutex, cv);
+    sync::Notifier notifier;
+    epollQueue.getLeftEnd().attachNotifier(notifier, 0);
     MockBufferedQueueManager bqm;
     MockReadHandler mr(epoll.getEpoll(), bqm, epollQueue.getRightEnd());
 
@@ -332,14 +349,11 @@ TEST(CONNECTION_READ, multiple_subscriber_read_one)
             mr.run();
         });
 
-    {
-        std::unique_lock<std::mutex> lock(mutex);
-        cv.wait(lock,
-                [&]
-                {
-                    return queue.numToRead() >= 6;
-                });
-    }
+    waitUntil(notifier,
+              [&]()
+              {
+                  return queue.numToRead() >= 6;
+              });
 
     CtlResponse resp1{peer1, ""};
     CtlResponse resp2{peer2, ""};
@@ -372,10 +386,8 @@ TEST(CONNECTION_READ, multiple_subscribed_read_multiple)
 
     EpollMsgQueue epollQueue;
     auto queue = epollQueue.getLeftEnd();
-    std::mutex mutex;
-    std::condition_variable cv;
-    epollQueue.getRightEnd().attachNotifier(mutex, cv);
-    epollQueue.getLeftEnd().attachNotifier(mutex, cv);
+    sync::Notifier notifier;
+    epollQueue.getLeftEnd().attachNotifier(notifier, 0);
     MockBufferedQueueManager bqm;
     MockReadHandler mr(epoll.getEpoll(), bqm, epollQueue.getRightEnd());
 
@@ -396,14 +408,11 @@ TEST(CONNECTION_READ, multiple_subscribed_read_multiple)
         peers.push_back(peerFd);
         writeToFd(writeFd, "\x0dmsg received" + std::to_string(p));
 
-        {
-            std::unique_lock<std::mutex> lock(mutex);
-            cv.wait(lock,
-                    [&]
-                    {
-                        return queue.numToRead() >= (p + 1) * 2;
-                    });
-        }
+        waitUntil(notifier,
+                  [&]()
+                  {
+                      return queue.numToRead() >= (p + 1) * 2;
+                  });
     }
 
     for (int p = 0; p < numPeers; p++)
@@ -423,4 +432,217 @@ TEST(CONNECTION_READ, multiple_subscribed_read_multiple)
     t.join();
 }
 
-} // namespace fractals::network::p2p
\ No newline at end of file
+TEST(CONNECTION_READ, edge_triggered_read_exceeds_budget)
+{
+    epoll_wrapper::CreateAction<epoll_wrapper::Epoll<PeerFd>> epoll =
+        epoll_wrapper::Epoll<PeerFd>::epollCreate();
+
+    ASSERT_TRUE(epoll);
+
+    EpollMsgQueue epollQueue;
+    auto queue = epollQueue.getLeftEnd();
+    sync::Notifier notifier;
+    epollQueue.getLeftEnd().attachNotifier(notifier, 0);
+    MockBufferedQueueManager bqm;
+    // Budget forces the service to come back to the peer a few times
+    MockReadHandler mr(epoll.getEpoll(), bqm, epollQueue.getRightEnd(),
+                       MockReadHandler::TriggerMode::Edge, 4);
+
+    auto [writeFd, peer] = createPeer();
+
+    queue.push(Subscribe{peer});
+    mr.notify();
+
+    writeToFd(writeFd, "\x05test1\x05test2\x05test3");
+
+    auto t = std::thread(
+        [&]()
+        {
+            mr.run();
+        });
+
+    waitUntil(notifier,
+              [&]()
+              {
+                  return queue.numToRead() >= 4;
+              });
+
+    CtlResponse ctl = std::get<CtlResponse>(queue.pop());
+    ReadEvent re1 = std::get<ReadEvent>(queue.pop());
+    ReadEvent re2 = std::get<ReadEvent>(queue.pop());
+    ReadEvent re3 = std::get<ReadEvent>(queue.pop());
+
+    ASSERT_READ(re1, testing::ContainerEq<std::vector<char>>({'t', 'e', 's', 't', '1'}));
+    ASSERT_READ(re2, testing::ContainerEq<std::vector<char>>({'t', 'e', 's', 't', '2'}));
+    ASSERT_READ(re3, testing::ContainerEq<std::vector<char>>({'t', 'e', 's', 't', '3'}));
+
+    queue.push(Deactivate{});
+    mr.notify();
+
+    t.join();
+}
+
+TEST(CONNECTION_READ, accept_inbound_and_read)
+{
+    epoll_wrapper::CreateAction<epoll_wrapper::Epoll<PeerFd>> epoll =
+        epoll_wrapper::Epoll<PeerFd>::epollCreate();
+
+    ASSERT_TRUE(epoll);
+
+    EpollMsgQueue epollQueue;
+    auto queue = epollQueue.getLeftEnd();
+    sync::Notifier notifier;
+    epollQueue.getLeftEnd().attachNotifier(notifier, 0);
+    MockBufferedQueueManager bqm;
+    MockReadHandler mr(epoll.getEpoll(), bqm, epollQueue.getRightEnd());
+
+    // Let the kernel pick a free port
+    common::TcpService tcpService;
+    const int listenFd = tcpService.listen(0);
+    ASSERT_GE(listenFd, 0);
+    sockaddr_in addr{};
+    socklen_t addrLen = sizeof(addr);
+    ASSERT_EQ(getsockname(listenFd, reinterpret_cast<sockaddr *>(&addr), &addrLen), 0);
+    const PeerFd listener{http::PeerId{"0.0.0.0", ntohs(addr.sin_port)}, listenFd};
+
+    queue.push(Listen{listener});
+    mr.notify();
+
+    auto t = std::thread(
+        [&]()
+        {
+            mr.run();
+        });
+
+    const int clientFd = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(connect(clientFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)), 0);
+    writeToFd(clientFd, "\x05test1");
+
+    waitUntil(notifier,
+              [&]()
+              {
+                  return queue.numToRead() >= 3;
+              });
+
+    ASSERT_EQ(std::get<CtlResponse>(queue.pop()), (CtlResponse{listener, ""}));
+    const PeerAccepted accepted = std::get<PeerAccepted>(queue.pop());
+    ASSERT_EQ(accepted.peer.getId().ip, "127.0.0.1");
+    ReadEvent re = std::get<ReadEvent>(queue.pop());
+    ASSERT_EQ(re.peer, accepted.peer);
+    ASSERT_READ(re, testing::ContainerEq<std::vector<char>>({'t', 'e', 's', 't', '1'}));
+
+    queue.push(Deactivate{});
+    mr.notify();
+
+    t.join();
+    close(clientFd);
+}
+
+TEST(CONNECTION_READ, throttled_read)
+{
+    epoll_wrapper::CreateAction<epoll_wrapper::Epoll<PeerFd>> epoll =
+        epoll_wrapper::Epoll<PeerFd>::epollCreate();
+
+    ASSERT_TRUE(epoll);
+
+    EpollMsgQueue epollQueue;
+    auto queue = epollQueue.getLeftEnd();
+    sync::Notifier notifier;
+    epollQueue.getLeftEnd().attachNotifier(notifier, 0);
+    MockBufferedQueueManager bqm;
+
+    // One message worth of tokens every 50ms
+    BandwidthShaper shaper;
+    shaper.setGlobalLimit(Direction::Down, RateLimit{2000, 100});
+    MockReadHandler mr(epoll.getEpoll(), bqm, epollQueue.getRightEnd(),
+                       MockReadHandler::TriggerMode::Level, MockReadHandler::DEFAULT_IO_BUDGET,
+                       &shaper);
+
+    auto [writeFd, peer] = createPeer();
+    queue.push(Subscribe{peer});
+    mr.notify();
+
+    const std::string message = '\x63' + std::string(99, 'a');
+    for (int i = 0; i < 4; ++i)
+    {
+        writeToFd(writeFd, message);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    auto t = std::thread(
+        [&]()
+        {
+            mr.run();
+        });
+
+    waitUntil(notifier,
+              [&]()
+              {
+                  return queue.numToRead() >= 5;
+              });
+
+    // The last three messages each had to wait for the bucket to refill
+    ASSERT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds{120});
+
+    ASSERT_EQ(std::get<CtlResponse>(queue.pop()), (CtlResponse{peer, ""}));
+    for (int i = 0; i < 4; ++i)
+    {
+        ReadEvent re = std::get<ReadEvent>(queue.pop());
+        ASSERT_EQ(re.mMessage.size(), 99);
+    }
+
+    queue.push(Deactivate{});
+    mr.notify();
+
+    t.join();
+}
+
+TEST(CONNECTION_READ, oversized_message_disconnects)
+{
+    epoll_wrapper::CreateAction<epoll_wrapper::Epoll<PeerFd>> epoll =
+        epoll_wrapper::Epoll<PeerFd>::epollCreate();
+
+    ASSERT_TRUE(epoll);
+
+    EpollMsgQueue epollQueue;
+    auto queue = epollQueue.getLeftEnd();
+    sync::Notifier notifier;
+    epollQueue.getLeftEnd().attachNotifier(notifier, 0);
+    BufferedQueueManager bqm(4096);
+    ReadHandler rh(epoll.getEpoll(), bqm, epollQueue.getRightEnd());
+
+    auto [writeFd, peer] = createPeer();
+    queue.push(Subscribe{peer});
+    rh.notify();
+
+    // HandShake followed by a length prefix that exceeds the receive ring
+    writeToFd(writeFd, '\x13' + std::string(67, 'h'));
+    const auto length = common::intToBytes<uint32_t>(1 << 20);
+    writeToFd(writeFd, std::string(length.begin(), length.end()));
+
+    auto t = std::thread(
+        [&]()
+        {
+            rh.run();
+        });
+
+    waitUntil(notifier,
+              [&]()
+              {
+                  return queue.numToRead() >= 4;
+              });
+
+    ASSERT_EQ(std::get<CtlResponse>(queue.pop()), (CtlResponse{peer, ""}));
+    ASSERT_EQ(std::get<ReadEvent>(queue.pop()).mMessage.size(), 68);
+    ASSERT_EQ(std::get<ConnectionCloseEvent>(queue.pop()), (ConnectionCloseEvent{peer.getId()}));
+    ASSERT_EQ(std::get<CtlResponse>(queue.pop()), (CtlResponse{peer, ""}));
+
+    queue.push(Deactivate{});
+    rh.notify();
+
+    t.join();
+    close(writeFd);
+}
+
+} // namespace fractals::network::p2p
@@ -51,39 +51,55 @@ class MockBufferedQueueManager
 
     void addToWriteBuffer(const PeerFd &p, std::vector<char> m)
     {
-        const auto it = mBuffers.find(p);
-        if (it == mBuffers.end())
-        {
-            mBuffers.emplace(p, WriteMsgState(std::move(m)));
-        }
-        else if (it->second.isComplete())
-        {
-            mBuffers.at(p) = WriteMsgState(std::move(m));
-        }
+        mBuffers[p].push(std::move(m));
     }
 
-    bool addToReadBuffer(const PeerFd &p, std::vector<char> data)
+    std::span<char> reserveRead(const PeerFd &p)
     {
-        return true;
+        return std::span<char>(readBuffer);
     }
 
-    void removeFromWriteBuffer(const PeerFd &p)
+    bool commitRead(const PeerFd &p, uint32_t bytes)
     {
-        mBuffers.erase(p);
+        return false;
+    }
+
+    std::optional<ReadLease> popMessage(const PeerFd &p)
+    {
+        return std::nullopt;
+    }
+
+    bool isReadStalled(const PeerFd &p) const
+    {
+        return false;
+    }
+
+    bool isReadOversized(const PeerFd &p) const
+    {
+        return false;
     }
 
-    std::deque<ReadMsgState> &getReadBuffers(const PeerFd &p)
+    void removeFromReadBuffer(const PeerFd &p)
     {
-        return readBuffers;
     }
 
-    WriteMsgState *getWriteBuffer(const PeerFd &p)
+    void onReadSpaceAvailable(std::function<void()> callback)
     {
-        return &mBuffers.at(p);
     }
 
-    std::unordered_map<PeerFd, WriteMsgState> mBuffers;
-    std::deque<ReadMsgState> readBuffers;
+    void removeFromWriteBuffer(const PeerFd &p)
+    {
+        mBuffers.erase(p);
+    }
+
+    WriteQueue *getWriteBuffer(const PeerFd &p)
+    {
+        const auto it = mBuffers.find(p);
+        return it != mBuffers.end() ? &it->second : nullptr;
+    }
+
+    std::unordered_map<PeerFd, WriteQueue> mBuffers;
+    std::array<char, 512> readBuffer;
 };
 
 using MockWriteHandler =
@@ -328,4 +344,47 @@ TEST(CONNECTION_WRITE, multiple_subscriber_write_one)
     t.join();
 }
 
+TEST(CONNECTION_WRITE, one_subscriber_write_back_to_back)
+{
+    epoll_wrapper::CreateAction<epoll_wrapper::Epoll<PeerFd>> epoll =
+        epoll_wrapper::Epoll<PeerFd>::epollCreate();
+
+    ASSERT_TRUE(epoll);
+
+    MockBufferedQueueManager bqm;
+    EpollMsgQueue epollQueue;
+    auto queue = epollQueue.getLeftEnd();
+    MockWriteHandler mw(epoll.getEpoll(), bqm, epollQueue.getRightEnd());
+
+    auto [readFd, peer] = createPeer();
+
+    // Both messages are queued before the peer becomes writable
+    queue.push(Subscribe{peer});
+    queue.push(WriteEvent{peer, {'f', 'i', 'r', 's', 't'}});
+    queue.push(WriteEvent{peer, {'s', 'e', 'c', 'o', 'n', 'd'}});
+
+    auto t = std::thread(
+        [&]()
+        {
+            mw.run();
+        });
+
+    mw.notify();
+
+    std::vector<char> receiveData;
+    while (receiveData.size() < 11)
+    {
+        const auto data = readFromFd(readFd);
+        receiveData.insert(receiveData.end(), data.begin(), data.end());
+    }
+
+    EXPECT_THAT(receiveData, testing::ContainerEq<std::vector<char>>(
+                                 {'f', 'i', 'r', 's', 't', 's', 'e', 'c', 'o', 'n', 'd'}));
+
+    queue.push(Deactivate{});
+    mw.notify();
+
+    t.join();
+}
+
 } // namespace fractals::network::p2p
\ No newline at end of file
@@ -0,0 +1,104 @@
+#include <fractals/network/p2p/HashService.h>
+
+#include <chrono>
+#include <gtest/gtest.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace fractals::network::p2p
+{
+
+namespace
+{
+HashRequest makeRequest(uint32_t piece, const std::string &data, uint64_t hashedBytes,
+                        bool corrupt = false)
+{
+    common::PieceBuffer buffer(data.size());
+    std::copy(data.begin(), data.end(), buffer.data());
+
+    common::Sha1 hasher;
+    hasher.update(std::string_view{data}.substr(0, hashedBytes));
+
+    auto expected = common::Sha1::digest(data);
+    if (corrupt)
+    {
+        expected[0] ^= 1;
+    }
+
+    return HashRequest{common::InfoHash{}, piece, std::move(buffer), hasher, hashedBytes,
+                       common::PieceHash{expected}};
+}
+} // namespace
+
+TEST(HASH_SERVICE, verifyInline)
+{
+    const std::string data(40000, 'x');
+    auto valid = HashService::verify(makeRequest(1, data, 16384));
+    ASSERT_TRUE(valid.valid);
+    ASSERT_EQ(valid.pieceIndex, 1);
+    ASSERT_EQ(valid.data.view(), data);
+
+    ASSERT_TRUE(HashService::verify(makeRequest(1, data, data.size())).valid);
+    ASSERT_FALSE(HashService::verify(makeRequest(1, data, 0, true)).valid);
+
+    std::vector<HashRequest> batch;
+    batch.push_back(makeRequest(3, data, 0, true));
+    batch.push_back(makeRequest(4, data, 100));
+    batch.push_back(makeRequest(5, data.substr(1), 0));
+    std::vector<HashResult> batchResults;
+    HashService::verifyBatch(batch, batchResults);
+    ASSERT_EQ(batchResults.size(), 3);
+    for (const auto &result : batchResults)
+    {
+        ASSERT_EQ(result.valid, result.pieceIndex != 3);
+    }
+
+    // Without workers the result is queued right away
+    HashService service(0);
+    auto results = service.getResultEndPoint();
+    ASSERT_FALSE(results.canPop());
+    service.push(makeRequest(2, data, 0));
+    ASSERT_TRUE(results.canPop());
+    ASSERT_TRUE(results.pop().valid);
+}
+
+TEST(HASH_SERVICE, workers)
+{
+    constexpr uint32_t NUM_PIECES = 64;
+    HashService service(3);
+    auto results = service.getResultEndPoint();
+
+    for (uint32_t piece = 0; piece < NUM_PIECES; ++piece)
+    {
+        const std::string data(16384 + piece, static_cast<char>(piece));
+        // Unhashed pieces are verified in batches
+        const uint64_t hashedBytes = piece % 3 == 0 ? piece * 100 : 0;
+        service.push(makeRequest(piece, data, hashedBytes, piece % 4 == 0));
+    }
+
+    std::unordered_map<uint32_t, bool> verified;
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (verified.size() < NUM_PIECES && std::chrono::steady_clock::now() < deadline)
+    {
+        if (!results.canPop())
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        auto result = results.pop();
+        ASSERT_EQ(result.data.size(), 16384 + result.pieceIndex);
+        verified.emplace(result.pieceIndex, result.valid);
+    }
+
+    ASSERT_EQ(verified.size(), NUM_PIECES);
+    for (const auto &[piece, valid] : verified)
+    {
+        ASSERT_EQ(valid, piece % 4 != 0);
+    }
+    ASSERT_EQ(service.getPending(), 0);
+}
+
+} // namespace fractals::network::p2p
@@ -45,6 +45,7 @@ class MockTcpService
   public:
     MockTcpService() = default;
     MOCK_METHOD(int32_t, connect, (const std::string &, uint32_t));
+    MOCK_METHOD(int32_t, listen, (uint16_t));
     MOCK_METHOD(bool, isActive, ());
 };
 
@@ -240,4 +241,129 @@ TEST_F(PeerServiceTest, onShutdown)
     EXPECT_CALL(epollService, notify()).Times(0);
 }
 
+TEST_F(PeerServiceTest, onListenAndAccept)
+{
+    EXPECT_CALL(tcpService, listen(6882)).WillOnce(Return(3));
+    EXPECT_CALL(epollService, notify());
+    ASSERT_TRUE(peerService.listen(6882));
+    ASSERT_EQ(std::get<Listen>(requestQueue.pop()).listener.getFileDescriptor(), 3);
+
+    queue.getRightEnd().push(PeerAccepted{PEERFD});
+    ASSERT_TRUE(peerService.canRead());
+    EXPECT_CALL(epollService, notify()).Times(0);
+    ASSERT_EQ(std::get<IncomingConnection>(peerService.read(0ns).value()),
+              IncomingConnection{PEERID});
+
+    // Accepted peer can be written to and its first message is a handshake
+    EXPECT_CALL(epollService, notify());
+    ASSERT_TRUE(peerService.write(PEERID, choke, 0ns));
+    ASSERT_TRUE(std::holds_alternative<WriteEvent>(requestQueue.pop()));
+
+    HandShake hs;
+    queue.getRightEnd().push(ReadEvent{PEERFD, encoder.encode(hs)});
+    const auto msg = std::get<Message>(peerService.read(0ns).value());
+    ASSERT_TRUE(std::holds_alternative<HandShake>(msg.message));
+}
+
+TEST_F(PeerServiceTest, onListenFailure)
+{
+    EXPECT_CALL(tcpService, listen(6882)).WillOnce(Return(-1));
+    EXPECT_CALL(epollService, notify()).Times(0);
+    ASSERT_FALSE(peerService.listen(6882));
+    ASSERT_FALSE(requestQueue.numToRead());
+}
+
+TEST(PeerServiceShards, routeToOwningShard)
+{
+    int epoll = 0;
+    MockTcpService tcpService;
+    EpollMsgQueue queue1;
+    EpollMsgQueue queue2;
+    MockEpollService epollService1(epoll, queue1.getRightEnd());
+    MockEpollService epollService2(epoll, queue2.getRightEnd());
+
+    using PeerServiceT = PeerServiceImpl<MockEpollService, MockTcpService>;
+    PeerServiceT peerService({PeerServiceT::Shard{queue1.getLeftEnd(), epollService1},
+                              PeerServiceT::Shard{queue2.getLeftEnd(), epollService2}},
+                             tcpService);
+
+    const http::PeerId peer1{"1.1.1.1", 1000};
+    const http::PeerId peer2{"2.2.2.2", 1000};
+
+    // Connections are spread over the shards
+    EXPECT_CALL(tcpService, connect(_, _)).WillOnce(Return(1)).WillOnce(Return(2));
+    EXPECT_CALL(epollService1, notify()).Times(2);
+    EXPECT_CALL(epollService2, notify()).Times(2);
+    ASSERT_TRUE(peerService.connect(peer1, 0ns));
+    ASSERT_TRUE(peerService.connect(peer2, 0ns));
+    ASSERT_TRUE(std::holds_alternative<Subscribe>(queue1.getRightEnd().pop()));
+    ASSERT_TRUE(std::holds_alternative<Subscribe>(queue2.getRightEnd().pop()));
+
+    // Writes go to the shard that owns the connection
+    ASSERT_TRUE(peerService.write(peer2, Choke{}, 0ns));
+    ASSERT_FALSE(queue1.getRightEnd().canPop());
+    ASSERT_TRUE(std::holds_alternative<WriteEvent>(queue2.getRightEnd().pop()));
+
+    ASSERT_TRUE(peerService.write(peer1, Choke{}, 0ns));
+    ASSERT_TRUE(std::holds_alternative<WriteEvent>(queue1.getRightEnd().pop()));
+
+    // Responses of either shard are read
+    ASSERT_FALSE(peerService.canRead());
+    queue2.getRightEnd().push(ConnectionAccepted{PeerFd{peer2, 2}});
+    ASSERT_TRUE(peerService.canRead());
+    ASSERT_TRUE(std::holds_alternative<ConnectionEstablished>(peerService.read(0ns).value()));
+    ASSERT_FALSE(peerService.canRead());
+}
+
+TEST(PeerServiceShards, readManyAndBatchNotify)
+{
+    int epoll = 0;
+    MockTcpService tcpService;
+    EpollMsgQueue queue1;
+    EpollMsgQueue queue2;
+    MockEpollService epollService1(epoll, queue1.getRightEnd());
+    MockEpollService epollService2(epoll, queue2.getRightEnd());
+
+    using PeerServiceT = PeerServiceImpl<MockEpollService, MockTcpService>;
+    PeerServiceT peerService({PeerServiceT::Shard{queue1.getLeftEnd(), epollService1},
+                              PeerServiceT::Shard{queue2.getLeftEnd(), epollService2}},
+                             tcpService);
+
+    const http::PeerId peer1{"1.1.1.1", 1000};
+    const http::PeerId peer2{"2.2.2.2", 1000};
+
+    EXPECT_CALL(tcpService, connect(_, _)).WillOnce(Return(1)).WillOnce(Return(2));
+    EXPECT_CALL(epollService1, notify()).Times(1);
+    EXPECT_CALL(epollService2, notify()).Times(1);
+    ASSERT_TRUE(peerService.connect(peer1, 0ns));
+    ASSERT_TRUE(peerService.connect(peer2, 0ns));
+    queue1.getRightEnd().pop();
+    queue2.getRightEnd().pop();
+
+    // Responses of both shards are drained, up to the max
+    queue1.getRightEnd().push(ConnectionAccepted{PeerFd{peer1, 1}});
+    queue1.getRightEnd().push(WriteEventResponse{PeerFd{peer1, 1}, ""});
+    queue1.getRightEnd().push(ConnectionCloseEvent{peer1});
+    queue2.getRightEnd().push(ConnectionAccepted{PeerFd{peer2, 2}});
+
+    std::vector<PeerEvent> events;
+    ASSERT_EQ(peerService.readMany(0ns, events, 3), 2);
+    ASSERT_EQ(events.size(), 2);
+    ASSERT_TRUE(std::holds_alternative<ConnectionEstablished>(events[0]));
+    ASSERT_TRUE(std::holds_alternative<ConnectionEstablished>(events[1]));
+
+    ASSERT_EQ(peerService.readMany(0ns, events, 3), 1);
+    ASSERT_TRUE(std::holds_alternative<ConnectionDisconnected>(events[2]));
+    ASSERT_FALSE(peerService.canRead());
+
+    // Writes of a batch wake up the reactor only once
+    EXPECT_CALL(epollService2, notify()).Times(1);
+    peerService.beginBatch();
+    ASSERT_TRUE(peerService.write(peer2, Choke{}, 0ns));
+    ASSERT_TRUE(peerService.write(peer2, UnChoke{}, 0ns));
+    ASSERT_TRUE(peerService.write(peer2, Interested{}, 0ns));
+    peerService.endBatch();
+    ASSERT_EQ(queue2.getRightEnd().numToRead(), 3);
+}
+
 } // namespace fractals::network::p2p
\ No newline at end of file
@@ -0,0 +1,68 @@
+#include <fractals/common/Tagged.h>
+#include <fractals/network/http/Announce.h>
+#include <fractals/network/http/Peer.h>
+#include <fractals/network/p2p/PeerTracker.h>
+
+#include <algorithm>
+#include <chrono>
+#include <gtest/gtest.h>
+#include <optional>
+
+using namespace std::chrono_literals;
+
+namespace fractals::network::p2p
+{
+
+std::optional<PeerCommand> findCommand(const std::vector<PeerCommand> &cmds, PeerCommandFlag flag)
+{
+    const auto it = std::find_if(cmds.begin(), cmds.end(),
+                                 [&](const PeerCommand &cmd)
+                                 {
+                                     return cmd.command == flag;
+                                 });
+    if (it == cmds.end())
+    {
+        return std::nullopt;
+    }
+
+    return *it;
+}
+
+TEST(PeerTracker, reconnectAfterSuccessResetsFailures)
+{
+    const common::InfoHash torrent{"test"};
+    const http::PeerId peer{"1.1.1.1", 1000};
+
+    PeerTracker tracker;
+    tracker.activateTorrent(torrent);
+    ASSERT_TRUE(findCommand(tracker.onAnnounce(http::Announce{torrent, 0, 0, {}, {peer}}),
+                            PeerCommandFlag::TRY_CONNECT));
+
+    // Peer that reconnects successfully every time is never forgotten, nor backed off further
+    for (int i = 0; i < 10; ++i)
+    {
+        (void)tracker.onPeerConnect(peer);
+
+        const auto reconnect =
+            findCommand(tracker.onPeerDisconnect(peer), PeerCommandFlag::RECONNECT_LATER);
+        ASSERT_TRUE(reconnect);
+        ASSERT_EQ(reconnect->delay, 5s);
+
+        const auto connect = findCommand(tracker.onReconnectDue(peer), PeerCommandFlag::TRY_CONNECT);
+        ASSERT_TRUE(connect);
+        ASSERT_EQ(connect->peer, peer);
+    }
+
+    // Consecutive failures double the delay
+    auto reconnect = findCommand(tracker.onPeerDisconnect(peer), PeerCommandFlag::RECONNECT_LATER);
+    ASSERT_TRUE(reconnect);
+    ASSERT_EQ(reconnect->delay, 10s);
+    ASSERT_TRUE(findCommand(tracker.onReconnectDue(peer), PeerCommandFlag::TRY_CONNECT));
+
+    (void)tracker.onPeerConnect(peer);
+    reconnect = findCommand(tracker.onPeerDisconnect(peer), PeerCommandFlag::RECONNECT_LATER);
+    ASSERT_TRUE(reconnect);
+    ASSERT_EQ(reconnect->delay, 5s);
+}
+
+} // namespace fractals::network::p2p
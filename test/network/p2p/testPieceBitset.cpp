@@ -0,0 +1,132 @@
+#include <fractals/network/p2p/PieceBitset.h>
+
+#include <gtest/gtest.h>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace fractals::network::p2p
+{
+
+TEST(PIECE_BITSET, setAndTest)
+{
+    PieceBitset bits(70);
+    ASSERT_EQ(bits.size(), 70);
+    ASSERT_TRUE(bits.none());
+
+    ASSERT_TRUE(bits.set(0));
+    ASSERT_TRUE(bits.set(69));
+    ASSERT_FALSE(bits.set(69));
+    ASSERT_FALSE(bits.set(70));
+    ASSERT_TRUE(bits.test(69));
+    ASSERT_FALSE(bits.test(70));
+    ASSERT_EQ(bits.count(), 2);
+
+    ASSERT_TRUE(bits.reset(0));
+    ASSERT_FALSE(bits.reset(0));
+    ASSERT_EQ(bits.findFirst(), 69);
+
+    // Shrinking drops the pieces past the new size
+    bits.resize(65);
+    ASSERT_TRUE(bits.none());
+    bits.resize(70);
+    ASSERT_FALSE(bits.test(69));
+}
+
+TEST(PIECE_BITSET, wireBitfield)
+{
+    // Spare bits of the last byte are ignored
+    const std::string wire{"\x80\x01\xff", 3};
+    const auto bits = PieceBitset::fromBitfield(20, wire);
+    ASSERT_EQ(bits.size(), 20);
+    ASSERT_TRUE(bits.test(0));
+    ASSERT_FALSE(bits.test(1));
+    ASSERT_TRUE(bits.test(15));
+    ASSERT_EQ(bits.count(), 6);
+    ASSERT_EQ(bits.toBitfield(), std::string("\x80\x01\xf0", 3));
+
+    // Short bitfields leave the remaining pieces unset
+    ASSERT_EQ(PieceBitset::fromBitfield(100, wire).count(), 10);
+    ASSERT_TRUE(PieceBitset::fromBitfield(0, wire).none());
+}
+
+TEST(PIECE_BITSET, setOperations)
+{
+    PieceBitset lhs(300, {1, 64, 128, 200, 299});
+    const PieceBitset rhs(300, {64, 200, 250});
+
+    ASSERT_TRUE(lhs.intersects(rhs));
+    ASSERT_EQ(lhs.countAnd(rhs), 2);
+    ASSERT_EQ(lhs.findFirstAnd(rhs), 64);
+    ASSERT_EQ(lhs.findFirstAnd(rhs, 65), 200);
+    ASSERT_EQ(lhs.findFirstAnd(rhs, 201), PieceBitset::NPOS);
+
+    std::vector<uint32_t> both;
+    lhs.forEachAnd(rhs,
+                   [&](uint32_t piece)
+                   {
+                       both.push_back(piece);
+                   });
+    ASSERT_EQ(both, (std::vector<uint32_t>{64, 200}));
+
+    auto onlyLhs = lhs;
+    onlyLhs.andNot(rhs);
+    ASSERT_EQ(onlyLhs, PieceBitset(300, {1, 128, 299}));
+
+    auto either = lhs;
+    either |= rhs;
+    ASSERT_EQ(either.count(), 6);
+
+    lhs &= rhs;
+    ASSERT_EQ(lhs, PieceBitset(300, {64, 200}));
+
+    // Only the pieces that both sets can hold take part
+    PieceBitset small(70, {64, 69});
+    small |= PieceBitset(300, {65, 71, 250});
+    ASSERT_EQ(small, PieceBitset(70, {64, 65, 69}));
+    ASSERT_FALSE(small.intersects(PieceBitset(300, {71})));
+}
+
+TEST(PIECE_BITSET, matchesOrderedSet)
+{
+    std::mt19937 rng{42};
+    for (uint32_t size : {1u, 63u, 64u, 257u, 5000u})
+    {
+        PieceBitset lhs(size);
+        PieceBitset rhs(size);
+        std::set<uint32_t> lhsSet;
+        std::set<uint32_t> rhsSet;
+        std::uniform_int_distribution<uint32_t> dist{0, size - 1};
+        for (uint32_t i = 0; i < size / 3 + 1; ++i)
+        {
+            const auto l = dist(rng);
+            const auto r = dist(rng);
+            ASSERT_EQ(lhs.set(l), lhsSet.insert(l).second);
+            ASSERT_EQ(rhs.set(r), rhsSet.insert(r).second);
+        }
+
+        ASSERT_EQ(lhs.count(), lhsSet.size());
+        ASSERT_EQ(lhs.findFirst(), *lhsSet.begin());
+
+        uint32_t common = 0;
+        std::vector<uint32_t> visited;
+        for (auto piece = lhs.findFirstAnd(rhs); piece != PieceBitset::NPOS;
+             piece = lhs.findFirstAnd(rhs, piece + 1))
+        {
+            ASSERT_TRUE(rhsSet.count(piece));
+            visited.push_back(piece);
+        }
+        for (auto piece : lhsSet)
+        {
+            common += rhsSet.count(piece);
+        }
+        ASSERT_EQ(lhs.countAnd(rhs), common);
+        ASSERT_EQ(visited.size(), common);
+
+        lhs.andNot(rhs);
+        ASSERT_EQ(lhs.count(), lhsSet.size() - common);
+    }
+}
+
+} // namespace fractals::network::p2p
@@ -0,0 +1,186 @@
+#include <fractals/network/p2p/PiecePicker.h>
+
+#include <algorithm>
+#include <gtest/gtest.h>
+#include <random>
+#include <unordered_set>
+#include <vector>
+
+namespace fractals::network::p2p
+{
+
+namespace
+{
+PieceBitset allPieces(uint32_t numPieces)
+{
+    PieceBitset pieces(numPieces);
+    for (uint32_t piece = 0; piece < numPieces; ++piece)
+    {
+        pieces.set(piece);
+    }
+
+    return pieces;
+}
+
+std::vector<uint32_t> pickAll(const PiecePicker &picker, const PieceBitset &peerPieces)
+{
+    std::vector<uint32_t> picked;
+    while (auto piece = picker.pickRarest(
+               peerPieces,
+               [&](uint32_t piece)
+               {
+                   return std::find(picked.begin(), picked.end(), piece) == picked.end();
+               }))
+    {
+        picked.push_back(*piece);
+    }
+
+    return picked;
+}
+} // namespace
+
+TEST(PIECE_PICKER, rarestFirst)
+{
+    PiecePicker picker;
+    picker.resize(5);
+    const auto peerPieces = allPieces(5);
+
+    // Nobody has any of the pieces
+    ASSERT_FALSE(picker.pickRarest(
+        peerPieces,
+        [](uint32_t)
+        {
+            return true;
+        }));
+
+    for (uint32_t piece : {0, 1, 2, 3, 4, 1, 2, 3, 1, 3, 3})
+    {
+        picker.addAvailability(piece);
+    }
+
+    ASSERT_EQ(picker.getAvailability(3), 4);
+    const auto order = pickAll(picker, peerPieces);
+    ASSERT_EQ(order.size(), 5);
+    for (size_t i = 1; i < order.size(); ++i)
+    {
+        ASSERT_LE(picker.getAvailability(order[i - 1]), picker.getAvailability(order[i]));
+    }
+    ASSERT_EQ(order[2], 2);
+    ASSERT_EQ(order[3], 1);
+    ASSERT_EQ(order[4], 3);
+
+    // Peer that has the rarest pieces went away
+    picker.removeAvailability(0);
+    picker.removeAvailability(4);
+    ASSERT_EQ(pickAll(picker, peerPieces), (std::vector<uint32_t>{2, 1, 3}));
+
+    // Rarest pieces that the peer does not have are skipped
+    ASSERT_EQ(pickAll(picker, PieceBitset(5, {0, 1, 3})), (std::vector<uint32_t>{1, 3}));
+}
+
+TEST(PIECE_PICKER, removeWantedPieces)
+{
+    PiecePicker picker;
+    picker.resize(6);
+    const auto peerPieces = allPieces(6);
+    for (uint32_t piece : {0, 1, 1, 2, 2, 2, 3, 3, 3, 3, 4, 5, 5})
+    {
+        picker.addAvailability(piece);
+    }
+
+    picker.remove(1);
+    picker.remove(4);
+    picker.remove(4);
+    ASSERT_FALSE(picker.isWanted(1));
+    ASSERT_EQ(pickAll(picker, peerPieces), (std::vector<uint32_t>{0, 5, 2, 3}));
+
+    // Availability of pieces that we have is still counted
+    picker.addAvailability(1);
+    ASSERT_EQ(picker.getAvailability(1), 3);
+    picker.removeAvailability(5);
+    picker.removeAvailability(5);
+    ASSERT_EQ(pickAll(picker, peerPieces), (std::vector<uint32_t>{0, 2, 3}));
+}
+
+TEST(PIECE_PICKER, matchesSortedOrder)
+{
+    constexpr uint32_t NUM_PIECES = 1000;
+    PiecePicker picker;
+    picker.resize(NUM_PIECES);
+    std::vector<uint32_t> availability(NUM_PIECES);
+    std::unordered_set<uint32_t> removed;
+
+    std::mt19937 rng{42};
+    std::uniform_int_distribution<uint32_t> pieces{0, NUM_PIECES - 1};
+    for (int i = 0; i < 20000; ++i)
+    {
+        const auto piece = pieces(rng);
+        switch (rng() % 4)
+        {
+        case 0:
+        case 1:
+            picker.addAvailability(piece);
+            ++availability[piece];
+            break;
+        case 2:
+            picker.removeAvailability(piece);
+            availability[piece] -= availability[piece] > 0;
+            break;
+        default:
+            if (rng() % 8 == 0)
+            {
+                picker.remove(piece);
+                removed.emplace(piece);
+            }
+        }
+    }
+
+    uint32_t previous = 0;
+    size_t count = 0;
+    for (uint32_t i = 0; i < NUM_PIECES; ++i)
+    {
+        ASSERT_EQ(picker.getAvailability(i), availability[i]);
+        ASSERT_EQ(picker.isWanted(i), !removed.contains(i));
+        count += availability[i] > 0 && !removed.contains(i);
+    }
+
+    const auto order = pickAll(picker, allPieces(NUM_PIECES));
+    ASSERT_EQ(order.size(), count);
+    for (auto piece : order)
+    {
+        ASSERT_GE(availability[piece], previous);
+        previous = availability[piece];
+    }
+}
+
+TEST(PIECE_PICKER, pickRandom)
+{
+    PiecePicker picker;
+    picker.resize(100);
+    PieceBitset peerPieces(100);
+    for (uint32_t piece = 0; piece < 100; piece += 2)
+    {
+        picker.addAvailability(piece);
+        peerPieces.set(piece);
+    }
+
+    std::mt19937 rng{7};
+    std::unordered_set<uint32_t> picked;
+    for (int i = 0; i < 50; ++i)
+    {
+        const auto piece = picker.pickRandom(
+            peerPieces,
+            [](uint32_t)
+            {
+                return true;
+            },
+            rng);
+        ASSERT_TRUE(piece);
+        ASSERT_EQ(*piece % 2, 0);
+        picked.emplace(*piece);
+    }
+
+    ASSERT_GT(picked.size(), 10);
+}
+
+} // namespace fractals::network::p2p
@@ -52,8 +52,9 @@ TEST(PieceStateManager, addBlock)
 {
     PieceStateManager psm;
     psm.populate(testPieces);
+    psm.addAvailability(1);
 
-    auto ps = psm.nextAvailablePiece({1});
+    auto ps = psm.nextAvailablePiece(PieceBitset(5, {1}));
 
     ASSERT_TRUE(ps);
     ASSERT_EQ(ps->getMaxSize(), 30);
@@ -61,21 +62,21 @@ TEST(PieceStateManager, addBlock)
     ASSERT_EQ(ps->getNextBeginIndex(), 0);
     ASSERT_FALSE(ps->isComplete());
 
-    ps->addBlock("123"); // Added 3 chars
+    ASSERT_TRUE(ps->addBlock(0, "123")); // Added 3 chars
 
     ASSERT_EQ(ps->getMaxSize(), 30);
     ASSERT_EQ(ps->getRemainingSize(), 27);
     ASSERT_EQ(ps->getNextBeginIndex(), 3);
     ASSERT_FALSE(ps->isComplete());
 
-    ps->addBlock("1234"); // Added 4 chars
+    ASSERT_TRUE(ps->addBlock(3, "1234")); // Added 4 chars
 
     ASSERT_EQ(ps->getMaxSize(), 30);
     ASSERT_EQ(ps->getRemainingSize(), 23);
     ASSERT_EQ(ps->getNextBeginIndex(), 7);
     ASSERT_FALSE(ps->isComplete());
 
-    ps->addBlock("12345678912345678111122"); // Added 23 chars
+    ASSERT_TRUE(ps->addBlock(7, "12345678912345678111122")); // Added 23 chars
 
     ASSERT_EQ(ps->getMaxSize(), 30);
     ASSERT_EQ(ps->getRemainingSize(), 0);
@@ -87,4 +88,346 @@ TEST(PieceStateManager, addBlock)
     EXPECT_EQ(strBuf, "123123412345678912345678111122");
 }
 
-} // namespace fractals::network::p2p
\ No newline at end of file
+TEST(PieceStateManager, blocksInAnyOrder)
+{
+    constexpr uint32_t BLOCK = PieceState::BLOCK_SIZE;
+    PieceState ps{0, 2 * BLOCK + 10, 0};
+    ASSERT_EQ(ps.getNumBlocks(), 3);
+    ASSERT_FALSE(ps.addBlock(0, "a"));
+    ASSERT_TRUE(ps.initialize());
+
+    const std::string first(BLOCK, 'a');
+    const std::string second(BLOCK, 'b');
+    const std::string last(10, 'c');
+
+    ASSERT_TRUE(ps.addBlock(2 * BLOCK, last));
+    ASSERT_TRUE(ps.hasBlock(2));
+    ASSERT_EQ(ps.getNextBeginIndex(), 0);
+    ASSERT_EQ(ps.getRemainingSize(), 2 * BLOCK);
+
+    // Same block again, data spanning two blocks and data beyond the piece are rejected
+    ASSERT_FALSE(ps.addBlock(2 * BLOCK, last));
+    ASSERT_FALSE(ps.addBlock(BLOCK / 2, first));
+    ASSERT_FALSE(ps.addBlock(2 * BLOCK, std::string(11, 'c')));
+
+    ASSERT_TRUE(ps.addBlock(0, first));
+    ASSERT_EQ(ps.getNextBeginIndex(), BLOCK);
+
+    // Partially received block is continued from its first missing byte
+    ASSERT_TRUE(ps.addBlock(BLOCK, second.substr(0, 100)));
+    ASSERT_FALSE(ps.hasBlock(1));
+    ASSERT_FALSE(ps.addBlock(BLOCK + 200, second.substr(200)));
+    ASSERT_EQ(ps.getNextBeginIndex(), BLOCK + 100);
+    ASSERT_TRUE(ps.addBlock(BLOCK + 100, second.substr(100)));
+
+    ASSERT_TRUE(ps.isComplete());
+    ASSERT_EQ(ps.getBuffer(), first + second + last);
+}
+
+TEST(PieceStateManager, reserveBlocks)
+{
+    constexpr uint32_t BLOCK = PieceState::BLOCK_SIZE;
+    constexpr uint32_t OWNER1 = 1;
+    constexpr uint32_t OWNER2 = 2;
+    PieceState ps{0, 2 * BLOCK + 10, 0};
+    ASSERT_TRUE(ps.initialize());
+    ASSERT_TRUE(ps.hasFreeBlocks());
+
+    ASSERT_EQ(ps.reserveBlock(OWNER1), (BlockRange{0, BLOCK}));
+    ASSERT_EQ(ps.reserveBlock(OWNER2), (BlockRange{BLOCK, BLOCK}));
+    ASSERT_EQ(ps.reserveBlock(OWNER1), (BlockRange{2 * BLOCK, 10}));
+    ASSERT_FALSE(ps.reserveBlock(OWNER2));
+    ASSERT_FALSE(ps.hasFreeBlocks());
+    ASSERT_EQ(ps.getOwner(1), OWNER2);
+
+    // Only the owner releases a reservation
+    ps.releaseBlock(BLOCK, OWNER1);
+    ASSERT_TRUE(ps.isReserved(1));
+
+    // Released block may be reserved again, only for the part that is missing
+    ASSERT_TRUE(ps.addBlock(BLOCK, std::string(10, 'a')));
+    ps.releaseBlock(BLOCK, OWNER2);
+    ASSERT_FALSE(ps.isReserved(1));
+    ASSERT_EQ(ps.reserveBlock(OWNER1), (BlockRange{BLOCK + 10, BLOCK - 10}));
+
+    // Received block is no longer reserved, whoever delivered it
+    ASSERT_TRUE(ps.addBlock(2 * BLOCK, std::string(10, 'b')));
+    ASSERT_FALSE(ps.isReserved(2));
+
+    ps.clear();
+    ASSERT_FALSE(ps.isReserved(0));
+    ASSERT_EQ(ps.getRemainingSize(), 2 * BLOCK + 10);
+    ASSERT_FALSE(ps.reserveBlock(OWNER2));
+    ASSERT_TRUE(ps.initialize());
+    ASSERT_EQ(ps.reserveBlock(OWNER2), (BlockRange{0, BLOCK}));
+}
+
+TEST(PieceStateManager, skipsReservedPieces)
+{
+    PieceStateManager psm;
+    psm.populate(testPieces);
+    psm.addAvailability(1);
+
+    auto *ps = psm.nextAvailablePiece(PieceBitset(5, {1}));
+    ASSERT_TRUE(ps);
+    const auto owner = psm.registerOwner();
+    ASSERT_TRUE(ps->reserveBlock(owner));
+    ASSERT_FALSE(psm.nextAvailablePiece(PieceBitset(5, {1})));
+
+    ps->releaseBlock(0, owner);
+    ASSERT_EQ(psm.nextAvailablePiece(PieceBitset(5, {1})), ps);
+}
+
+TEST(PieceStateManager, rarestPieceFirst)
+{
+    PieceStateManager psm;
+    psm.populate(testPieces);
+    psm.setRandomFirstPieces(0);
+
+    // Piece 3 is only known to a single peer
+    for (uint32_t piece : {0, 1, 2, 3, 4, 0, 1, 2, 4})
+    {
+        psm.addAvailability(piece);
+    }
+
+    auto *ps = psm.nextAvailablePiece(PieceBitset(5, {0, 1, 2, 3, 4}));
+    ASSERT_TRUE(ps);
+    ASSERT_EQ(ps->getPieceIndex(), 3);
+
+    // Piece that was started on is finished first, even if it is no longer the rarest
+    ASSERT_TRUE(ps->reserveBlock(1));
+    ps->releaseBlock(0, 1);
+    psm.addAvailability(3);
+    psm.addAvailability(3);
+    psm.removeAvailability(0);
+    ASSERT_EQ(psm.nextAvailablePiece(PieceBitset(5, {0, 1, 2, 3, 4})), ps);
+
+    psm.makeCompleted(3);
+    ps = psm.nextAvailablePiece(PieceBitset(5, {0, 1, 2, 3, 4}));
+    ASSERT_TRUE(ps);
+    ASSERT_EQ(ps->getPieceIndex(), 0);
+    ASSERT_EQ(psm.getAvailability(3), 3);
+}
+
+TEST(PieceStateManager, randomFirstPieces)
+{
+    PieceStateManager psm;
+    psm.populate(testPieces);
+    psm.setRandomFirstPieces(1);
+    for (uint32_t piece : {0, 1, 2, 3, 4})
+    {
+        psm.addAvailability(piece);
+    }
+
+    // Only pieces that the peer has are picked
+    auto *ps = psm.nextAvailablePiece(PieceBitset(5, {2, 4}));
+    ASSERT_TRUE(ps);
+    ASSERT_TRUE(ps->getPieceIndex() == 2 || ps->getPieceIndex() == 4);
+    ASSERT_FALSE(psm.nextAvailablePiece(PieceBitset(5, {1, 3})) == ps);
+}
+
+TEST(PieceStateManager, endgameDuplicates)
+{
+    PieceState ps(0, 3 * PieceState::BLOCK_SIZE, 0);
+    ps.initialize();
+    const auto noSkip = [](uint32_t)
+    {
+        return false;
+    };
+
+    // Only blocks reserved by other owners are duplicated
+    ASSERT_FALSE(ps.duplicateBlock(1, 1, noSkip));
+    ASSERT_EQ(ps.reserveBlock(1), (BlockRange{0, PieceState::BLOCK_SIZE}));
+    ASSERT_EQ(ps.reserveBlock(1), (BlockRange{PieceState::BLOCK_SIZE, PieceState::BLOCK_SIZE}));
+    ASSERT_FALSE(ps.duplicateBlock(1, 1, noSkip));
+
+    const auto skipFirst = [](uint32_t begin)
+    {
+        return begin == 0;
+    };
+    ASSERT_EQ(ps.duplicateBlock(2, 1, skipFirst),
+              (BlockRange{PieceState::BLOCK_SIZE, PieceState::BLOCK_SIZE}));
+    ASSERT_EQ(ps.duplicateBlock(2, 1, noSkip), (BlockRange{0, PieceState::BLOCK_SIZE}));
+    ASSERT_FALSE(ps.duplicateBlock(3, 1, noSkip));
+
+    // Limit applies again once a duplicate is given up on
+    ps.releaseDuplicate(0);
+    ASSERT_EQ(ps.duplicateBlock(3, 1, noSkip), (BlockRange{0, PieceState::BLOCK_SIZE}));
+
+    ASSERT_EQ(ps.getMissingBlocks(), 3);
+    ASSERT_TRUE(ps.addBlock(0, std::string(PieceState::BLOCK_SIZE, 'a')));
+    ASSERT_EQ(ps.getMissingBlocks(), 2);
+    ASSERT_EQ(ps.duplicateBlock(4, 2, noSkip),
+              (BlockRange{PieceState::BLOCK_SIZE, PieceState::BLOCK_SIZE}));
+}
+
+TEST(PieceStateManager, endgameThreshold)
+{
+    PieceStateManager psm;
+    psm.populate({{0, 0, 0, 2 * PieceState::BLOCK_SIZE, {}, false},
+                  {0, 0, 1, 2 * PieceState::BLOCK_SIZE, {}, false}});
+
+    psm.setEndgameConfig(EndgameConfig{3});
+    ASSERT_FALSE(psm.isEndgame());
+    psm.setEndgameConfig(EndgameConfig{4});
+    ASSERT_TRUE(psm.isEndgame());
+
+    psm.makeCompleted(0);
+    psm.setEndgameConfig(EndgameConfig{2});
+    ASSERT_TRUE(psm.isEndgame());
+
+    psm.setEndgameConfig(EndgameConfig{0});
+    ASSERT_FALSE(psm.isEndgame());
+}
+
+TEST(PieceStateManager, waitsForMemory)
+{
+    constexpr uint64_t PIECE = 64 * 1024;
+    common::BufferPool pool(common::BufferPoolConfig{2 * PIECE});
+    PieceStateManager psm;
+    psm.populate({{0, 0, 0, PIECE, {}, false},
+                  {0, 0, 1, PIECE, {}, false},
+                  {0, 0, 2, PIECE, {}, false}});
+    psm.setBufferPool(&pool);
+    psm.setRandomFirstPieces(0);
+    const PieceBitset peerPieces(3, {0, 1, 2});
+    for (uint32_t piece = 0; piece < 3; ++piece)
+    {
+        psm.addAvailability(piece);
+    }
+
+    // Two pieces fit in the budget, the third one is not started
+    auto *first = psm.nextAvailablePiece(peerPieces);
+    ASSERT_TRUE(first);
+    while (first->reserveBlock(1))
+    {
+    }
+    auto *second = psm.nextAvailablePiece(peerPieces);
+    ASSERT_TRUE(second);
+    while (second->reserveBlock(1))
+    {
+    }
+    ASSERT_FALSE(psm.nextAvailablePiece(peerPieces));
+    ASSERT_TRUE(psm.isWaitingForMemory());
+
+    // Buffer of a written piece is reused for the next one
+    auto data = first->extractData();
+    psm.makeCompleted(first->getPieceIndex());
+    ASSERT_FALSE(psm.nextAvailablePiece(peerPieces));
+    data = common::PieceBuffer{};
+    ASSERT_TRUE(psm.nextAvailablePiece(peerPieces));
+    ASSERT_FALSE(psm.isWaitingForMemory());
+    ASSERT_EQ(pool.getStats().reused, 1);
+}
+
+TEST(PieceStateManager, hasAvailablePiece)
+{
+    constexpr uint64_t PIECE = 64 * 1024;
+    common::BufferPool pool(common::BufferPoolConfig{PIECE});
+    PieceStateManager psm;
+    psm.populate({{0, 0, 0, PIECE, {}, false}, {0, 0, 1, PIECE, {}, false}});
+    psm.setBufferPool(&pool);
+
+    // Query does not start the piece
+    ASSERT_FALSE(psm.hasAvailablePiece(PieceBitset(2)));
+    ASSERT_TRUE(psm.hasAvailablePiece(PieceBitset(2, {0})));
+    ASSERT_EQ(pool.getStats().acquired, 0);
+    ASSERT_FALSE(psm.mInProgress.test(0));
+
+    auto *ps = psm.nextAvailablePiece(PieceBitset(2, {0}));
+    ASSERT_TRUE(ps);
+    while (ps->reserveBlock(1))
+    {
+    }
+    ASSERT_FALSE(psm.hasAvailablePiece(PieceBitset(2, {0})));
+
+    psm.makeCompleted(0);
+    ASSERT_FALSE(psm.hasAvailablePiece(PieceBitset(2, {0})));
+}
+
+TEST(PieceStateManager, incrementalHash)
+{
+    const uint32_t BLOCK = PieceState::BLOCK_SIZE;
+    std::string data(3 * BLOCK, 0);
+    for (size_t i = 0; i < data.size(); ++i)
+    {
+        data[i] = static_cast<char>(i % 251);
+    }
+    const auto hash = common::Sha1::digest(data);
+    const std::string_view view{data};
+
+    PieceStateManager psm;
+    psm.populate({{0, 0, 0, data.size(), {hash.begin(), hash.end()}, false},
+                  {0, 0, 1, data.size(), {hash.begin(), hash.end()}, false}});
+    HashService service(0);
+    psm.setHashService(&service);
+    auto results = service.getResultEndPoint();
+
+    // Data is hashed as it continues the hashed prefix, partial blocks included
+    auto *ps = psm.getPieceState(0);
+    ASSERT_TRUE(ps->initialize());
+    ASSERT_TRUE(ps->addBlock(0, view.substr(0, 100)));
+    ASSERT_EQ(ps->getHashedBytes(), 100);
+    ASSERT_TRUE(ps->addBlock(100, view.substr(100, BLOCK - 100)));
+    ASSERT_TRUE(ps->addBlock(BLOCK, view.substr(BLOCK, BLOCK)));
+    ASSERT_TRUE(ps->addBlock(2 * BLOCK, view.substr(2 * BLOCK)));
+    ASSERT_EQ(ps->getHashedBytes(), data.size());
+
+    // Fully hashed pieces are verified inline, even with a hash service
+    ASSERT_EQ(psm.verify({}, *ps), PieceStateManager::Verification::Valid);
+    ASSERT_FALSE(results.canPop());
+    ASSERT_FALSE(psm.isVerifying());
+
+    ps->clear();
+    ASSERT_EQ(ps->getHashedBytes(), 0);
+
+    // Corrupt data fails the check
+    ASSERT_TRUE(ps->initialize());
+    std::string corrupt{data};
+    corrupt[BLOCK] ^= 1;
+    for (uint32_t begin = 0; begin < data.size(); begin += BLOCK)
+    {
+        ASSERT_TRUE(ps->addBlock(begin, std::string_view{corrupt}.substr(begin, BLOCK)));
+    }
+    ASSERT_EQ(psm.verify({}, *ps), PieceStateManager::Verification::Invalid);
+}
+
+TEST(PieceStateManager, verifyOffThread)
+{
+    const uint32_t BLOCK = PieceState::BLOCK_SIZE;
+    const std::string data(3 * BLOCK, 'a');
+    const std::string_view view{data};
+    const auto hash = common::Sha1::digest(data);
+    PieceStateManager psm;
+    psm.populate({{0, 0, 0, data.size(), {hash.begin(), hash.end()}, false}});
+    HashService service(0);
+    psm.setHashService(&service);
+    auto results = service.getResultEndPoint();
+
+    // Block that arrived ahead of a gap is not hashed once the gap is filled
+    auto *ps = psm.getPieceState(0);
+    ASSERT_TRUE(ps->initialize());
+    ASSERT_TRUE(ps->addBlock(2 * BLOCK, view.substr(2 * BLOCK)));
+    ASSERT_TRUE(ps->addBlock(0, view.substr(0, BLOCK)));
+    ASSERT_TRUE(ps->addBlock(BLOCK, view.substr(BLOCK, BLOCK)));
+    ASSERT_TRUE(ps->isComplete());
+    ASSERT_EQ(ps->getHashedBytes(), 2 * BLOCK);
+
+    // Rest of the piece is hashed by the service, which takes the buffer
+    ASSERT_EQ(psm.verify({}, *ps), PieceStateManager::Verification::Pending);
+    ASSERT_TRUE(psm.isVerifying());
+    ASSERT_FALSE(ps->hasFreeBlocks());
+    ASSERT_EQ(psm.verify({}, *ps), PieceStateManager::Verification::Pending);
+
+    ASSERT_TRUE(results.canPop());
+    auto result = results.pop();
+    ASSERT_TRUE(result.valid);
+    ASSERT_EQ(result.pieceIndex, 0);
+    ASSERT_EQ(result.data.view(), data);
+    ASSERT_FALSE(results.canPop());
+
+    psm.finishVerification(0);
+    ASSERT_FALSE(psm.isVerifying());
+}
+
+} // namespace fractals::network::p2p
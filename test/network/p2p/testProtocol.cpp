@@ -19,6 +19,7 @@
 #include <variant>
 
 using namespace ::testing;
+using namespace std::chrono_literals;
 
 namespace fractals::network::p2p
 {
@@ -51,6 +52,7 @@ class ProtocolTest : public ::testing::Test
     ProtocolTest()
     {
         pieceRepo.populate(testHashDataMap);
+        pieceRepo.setRandomFirstPieces(0);
     }
 
     void SetUp() override
@@ -86,59 +88,49 @@ TEST_F(ProtocolTest, standardEval)
         ASSERT_TRUE(diskQueueE.numToRead() == 0);
     }
 
-    uint32_t pieceIndex = 4;
-    EXPECT_CALL(
-        peerService,
-        write(_, Eq(Request{pieceIndex, 0, static_cast<uint32_t>(testDataMap[pieceIndex].size())}),
-              _))
-        .Times(1);
-    prot.onMessage(UnChoke{}, now);
-
-    ASSERT_TRUE(diskQueueE.numToRead() == 0);
-
-    auto receiveAndRespond = [&]()
+    // Pipeline is filled with as many requests as its initial depth allows
+    for (uint32_t pieceIndex : {4, 3, 2, 1})
     {
-        const auto data = testDataMap[pieceIndex];
-
         EXPECT_CALL(peerService,
                     write(_,
-                          Eq(Request{pieceIndex - 1, 0,
-                                     static_cast<uint32_t>(testDataMap[pieceIndex - 1].size())}),
+                          Eq(Request{pieceIndex, 0,
+                                     static_cast<uint32_t>(testDataMap[pieceIndex].size())}),
                           _))
             .Times(1);
-        prot.onMessage(Piece(pieceIndex, 0, data), now);
+    }
+    ASSERT_EQ(prot.onMessage(UnChoke{}, now), ProtocolState::OPEN);
+    Mock::VerifyAndClearExpectations(&peerService);
 
-        {
-            ASSERT_EQ(diskQueueE.numToRead(), 1);
-            const auto diskEvent1 = diskQueueE.pop();
+    ASSERT_TRUE(diskQueueE.numToRead() == 0);
 
-            ASSERT_TRUE(std::holds_alternative<disk::WriteData>(diskEvent1));
-            const auto diskEvent = std::get<disk::WriteData>(diskEvent1);
+    auto receive = [&](uint32_t pieceIndex)
+    {
+        const auto data = testDataMap[pieceIndex];
+        const auto result = prot.onMessage(Piece(pieceIndex, 0, data), now);
 
-            ASSERT_EQ(diskEvent.mData.size(), data.size());
-            for (int i = 0; i < data.size(); ++i)
-            {
-                ASSERT_EQ(diskEvent.mData[i], data[i]);
-            }
-            ASSERT_EQ(diskEvent.mPieceIndex, pieceIndex);
+        EXPECT_EQ(diskQueueE.numToRead(), 1);
+        if (diskQueueE.canPop())
+        {
+            const auto diskEvent1 = diskQueueE.pop();
+            EXPECT_TRUE(std::holds_alternative<disk::WriteData>(diskEvent1));
+            const auto &diskEvent = std::get<disk::WriteData>(diskEvent1);
+            EXPECT_EQ(diskEvent.mData.view(), std::string_view(data.data(), data.size()));
+            EXPECT_EQ(diskEvent.mPieceIndex, pieceIndex);
         }
 
-        pieceIndex--;
+        return result;
     };
 
-    receiveAndRespond();
-    receiveAndRespond();
-    receiveAndRespond();
-    receiveAndRespond();
+    // Answered request makes room for the last piece
+    EXPECT_CALL(peerService, write(_, Eq(Request{0, 0, 2}), _)).Times(1);
+    ASSERT_EQ(receive(4), ProtocolState::OPEN);
+    Mock::VerifyAndClearExpectations(&peerService);
 
     EXPECT_CALL(peerService, write(_, _, _)).Times(0);
-    prot.onMessage(Piece(0, 0, testDataMap[0]), now);
-
-    ASSERT_EQ(diskQueueE.numToRead(), 1);
-    const auto diskEvent1 = diskQueueE.pop();
-    ASSERT_TRUE(std::holds_alternative<disk::WriteData>(diskEvent1));
-    EXPECT_THAT(std::get<disk::WriteData>(diskEvent1).mData, testDataMap[0]);
-    ASSERT_EQ(std::get<disk::WriteData>(diskEvent1).mPieceIndex, 0);
+    ASSERT_EQ(receive(3), ProtocolState::OPEN);
+    ASSERT_EQ(receive(2), ProtocolState::OPEN);
+    ASSERT_EQ(receive(1), ProtocolState::OPEN);
+    ASSERT_EQ(receive(0), ProtocolState::COMPLETE);
 }
 
 TEST_F(ProtocolTest, partial_pieces)
@@ -173,23 +165,251 @@ TEST_F(ProtocolTest, hash_check_fail)
         prot.onMessage(Have{0}, now);
         prot.onMessage(Have{1}, now);
         EXPECT_CALL(peerService, write(_, Eq(Request{1, 0, 2}), _)).Times(1);
+        EXPECT_CALL(peerService, write(_, Eq(Request{0, 0, 2}), _)).Times(1);
         prot.onMessage(UnChoke{}, now);
+        Mock::VerifyAndClearExpectations(&peerService);
     }
 
     {
-        EXPECT_CALL(peerService, write(_, _, _)).Times(0);
+        // Blocks may have come from several peers, the connection is kept and the failed piece
+        // is requested again
+        EXPECT_CALL(peerService, write(_, Eq(Request{0, 0, 2}), _)).Times(1);
         const auto result = prot.onMessage(Piece(0, 0, std::vector<char>{'a', 'c'}), now);
 
-        ASSERT_EQ(result, ProtocolState::HASH_CHECK_FAIL);
+        ASSERT_EQ(result, ProtocolState::OPEN);
         Mock::VerifyAndClearExpectations(&peerService);
     }
 
     {
-        EXPECT_CALL(peerService, write(_, Eq(Request{0, 0, 2}), _)).Times(1);
+        EXPECT_CALL(peerService, write(_, _, _)).Times(0);
         const auto result = prot.onMessage(Piece(1, 0, std::vector<char>{'d', 'e'}), now);
 
         ASSERT_EQ(result, ProtocolState::OPEN);
+        ASSERT_EQ(diskQueueE.numToRead(), 1);
+    }
+}
+
+class PipelineProtocolTest : public ProtocolTest
+{
+  public:
+    static constexpr uint32_t BLOCK = RequestPipeline::BLOCK_SIZE;
+
+    PipelineProtocolTest()
+    {
+        // Single piece of five and a half blocks
+        for (uint32_t i = 0; i < 5 * BLOCK + BLOCK / 2; ++i)
+        {
+            data.push_back(static_cast<char>(i % 251));
+        }
+
+        const auto hash = common::sha1_encode<20>(data);
+        bigRepo.populate({{0, 0, 0, data.size(), std::vector<char>(hash.begin(), hash.end())}});
+        bigRepo.setRandomFirstPieces(0);
+        bigRepo.setEndgameConfig(EndgameConfig{0});
+        bigRepo.setActive(true);
+    }
+
+    std::vector<char> block(uint32_t begin)
+    {
+        const auto end = std::min<size_t>(begin + BLOCK, data.size());
+        return std::vector<char>(data.begin() + begin, data.begin() + end);
+    }
+
+    std::vector<char> data;
+    PieceStateManager bigRepo;
+    Protocol<MockPeerService> bigProt{Protocol(Fractals::initAppId(), peer,
+                                               common::InfoHash{"test"}, peerService,
+                                               diskQueue.getLeftEnd(), bigRepo)};
+};
+
+TEST_F(PipelineProtocolTest, outOfOrderBlocks)
+{
+    EXPECT_CALL(peerService, write(_, Eq(Interested{}), _)).Times(1);
+    bigProt.onMessage(Have{0}, now);
+
+    for (uint32_t begin : {0u, BLOCK, 2 * BLOCK, 3 * BLOCK})
+    {
+        EXPECT_CALL(peerService, write(_, Eq(Request{0, begin, BLOCK}), _)).Times(1);
+    }
+    bigProt.onMessage(UnChoke{}, now);
+    Mock::VerifyAndClearExpectations(&peerService);
+    ASSERT_EQ(bigProt.getPendingRequestTime(), now);
+
+    // Blocks that arrive early are held until the gap in front of them is filled
+    EXPECT_CALL(peerService, write(_, Eq(Request{0, 4 * BLOCK, BLOCK}), _)).Times(1);
+    EXPECT_CALL(peerService, write(_, Eq(Request{0, 5 * BLOCK, BLOCK / 2}), _)).Times(1);
+    bigProt.onMessage(Piece(0, 2 * BLOCK, block(2 * BLOCK)), now + 1ms);
+    Mock::VerifyAndClearExpectations(&peerService);
+    ASSERT_EQ(bigRepo.getPieceState(0)->getNextBeginIndex(), 0);
+    ASSERT_EQ(bigProt.getPendingRequestTime(), now + 1ms);
+
+    EXPECT_CALL(peerService, write(_, _, _)).Times(0);
+    for (uint32_t begin : {5 * BLOCK, BLOCK, 3 * BLOCK, 4 * BLOCK})
+    {
+        bigProt.onMessage(Piece(0, begin, block(begin)), now + 2ms);
+    }
+    ASSERT_EQ(bigRepo.getPieceState(0)->getNextBeginIndex(), 0);
+    ASSERT_EQ(diskQueueE.numToRead(), 0);
+
+    ASSERT_EQ(bigProt.onMessage(Piece(0, 0, block(0)), now + 3ms), ProtocolState::COMPLETE);
+    ASSERT_EQ(diskQueueE.numToRead(), 1);
+    const auto diskEvent = diskQueueE.pop();
+    EXPECT_EQ(std::get<disk::WriteData>(diskEvent).mData.view(),
+              std::string_view(data.data(), data.size()));
+    ASSERT_FALSE(bigProt.getPendingRequestTime());
+}
+
+TEST_F(PipelineProtocolTest, chokeDiscardsRequests)
+{
+    EXPECT_CALL(peerService, write(_, Eq(Interested{}), _)).Times(1);
+    bigProt.onMessage(Have{0}, now);
+    EXPECT_CALL(peerService, write(_, _, _)).Times(4);
+    bigProt.onMessage(UnChoke{}, now);
+    Mock::VerifyAndClearExpectations(&peerService);
+
+    EXPECT_CALL(peerService, write(_, _, _)).Times(2);
+    bigProt.onMessage(Piece(0, 0, block(0)), now);
+    Mock::VerifyAndClearExpectations(&peerService);
+
+    bigProt.onMessage(Choke{}, now);
+    ASSERT_FALSE(bigProt.getPendingRequestTime());
+
+    // Discarded requests are sent again first
+    {
+        InSequence seq;
+        for (uint32_t begin : {BLOCK, 2 * BLOCK, 3 * BLOCK, 4 * BLOCK})
+        {
+            EXPECT_CALL(peerService, write(_, Eq(Request{0, begin, BLOCK}), _)).Times(1);
+        }
+        EXPECT_CALL(peerService, write(_, Eq(Request{0, 5 * BLOCK, BLOCK / 2}), _)).Times(1);
+    }
+    bigProt.onMessage(UnChoke{}, now);
+}
+
+TEST_F(PipelineProtocolTest, peersShareAPiece)
+{
+    network::http::PeerId peer2{"host", 1};
+    Protocol<MockPeerService> prot2{Protocol(Fractals::initAppId(), peer2,
+                                             common::InfoHash{"test"}, peerService,
+                                             diskQueue.getLeftEnd(), bigRepo)};
+
+    EXPECT_CALL(peerService, write(_, Eq(Interested{}), _)).Times(2);
+    bigProt.onMessage(Have{0}, now);
+    prot2.onMessage(Have{0}, now);
+
+    // Second peer continues with the blocks that the first peer was not asked for
+    EXPECT_CALL(peerService, write(Eq(peer), _, _)).Times(4);
+    bigProt.onMessage(UnChoke{}, now);
+    EXPECT_CALL(peerService, write(Eq(peer2), Eq(Request{0, 4 * BLOCK, BLOCK}), _)).Times(1);
+    EXPECT_CALL(peerService, write(Eq(peer2), Eq(Request{0, 5 * BLOCK, BLOCK / 2}), _)).Times(1);
+    prot2.onMessage(UnChoke{}, now);
+    Mock::VerifyAndClearExpectations(&peerService);
+
+    // Blocks of the peer that went away are picked up by the other peer
+    bigProt.releaseRequests();
+    for (uint32_t begin : {0u, BLOCK, 2 * BLOCK, 3 * BLOCK})
+    {
+        EXPECT_CALL(peerService, write(Eq(peer2), Eq(Request{0, begin, BLOCK}), _)).Times(1);
+    }
+    for (uint32_t begin : {5 * BLOCK, 4 * BLOCK, 0u, BLOCK, 2 * BLOCK})
+    {
+        ASSERT_EQ(prot2.onMessage(Piece(0, begin, block(begin)), now), ProtocolState::OPEN);
+    }
+    ASSERT_EQ(prot2.onMessage(Piece(0, 3 * BLOCK, block(3 * BLOCK)), now),
+              ProtocolState::COMPLETE);
+
+    ASSERT_EQ(diskQueueE.numToRead(), 1);
+    const auto diskEvent = diskQueueE.pop();
+    EXPECT_EQ(std::get<disk::WriteData>(diskEvent).mData.view(),
+              std::string_view(data.data(), data.size()));
+}
+
+TEST_F(PipelineProtocolTest, expiredRequestsGoToOtherPeers)
+{
+    network::http::PeerId peer2{"host", 1};
+    Protocol<MockPeerService> prot2{Protocol(Fractals::initAppId(), peer2,
+                                             common::InfoHash{"test"}, peerService,
+                                             diskQueue.getLeftEnd(), bigRepo)};
+
+    EXPECT_CALL(peerService, write(_, _, _)).Times(AnyNumber());
+    bigProt.onMessage(Have{0}, now);
+    prot2.onMessage(Have{0}, now);
+    bigProt.onMessage(UnChoke{}, now);
+    prot2.onMessage(UnChoke{}, now);
+    Mock::VerifyAndClearExpectations(&peerService);
+
+    // First peer answers one block and then goes quiet
+    EXPECT_CALL(peerService, write(_, _, _)).Times(0);
+    bigProt.onMessage(Piece(0, 0, block(0)), now + 100ms);
+    ASSERT_EQ(bigProt.getNextDeadline(), now + RequestPipeline::INITIAL_TIMEOUT);
+    ASSERT_EQ(bigProt.expireRequests(now + 1s), 0);
+    ASSERT_EQ(bigProt.expireRequests(now + RequestPipeline::INITIAL_TIMEOUT), 3);
+    ASSERT_TRUE(bigProt.getPipeline().empty());
+    Mock::VerifyAndClearExpectations(&peerService);
+
+    // Peer is still waited on since it last answered
+    ASSERT_EQ(bigProt.getPendingRequestTime(), now + 100ms);
+
+    // Second peer picks up the expired blocks
+    for (uint32_t begin : {BLOCK, 2 * BLOCK, 3 * BLOCK})
+    {
+        EXPECT_CALL(peerService, write(Eq(peer2), Eq(Request{0, begin, BLOCK}), _)).Times(1);
+    }
+    prot2.onMessage(Piece(0, 4 * BLOCK, block(4 * BLOCK)), now + 4s);
+    prot2.onMessage(Piece(0, 5 * BLOCK, block(5 * BLOCK)), now + 4s);
+    Mock::VerifyAndClearExpectations(&peerService);
+
+    // Late answer of the first peer is still used
+    EXPECT_CALL(peerService, write(_, _, _)).Times(0);
+    bigProt.onMessage(Piece(0, BLOCK, block(BLOCK)), now + 5s);
+    ASSERT_TRUE(bigRepo.getPieceState(0)->hasBlock(1));
+}
+
+TEST_F(PipelineProtocolTest, endgameCancelsDuplicates)
+{
+    bigRepo.setEndgameConfig(EndgameConfig{6, 1});
+    network::http::PeerId peer2{"host", 1};
+    Protocol<MockPeerService> prot2{Protocol(Fractals::initAppId(), peer2,
+                                             common::InfoHash{"test"}, peerService,
+                                             diskQueue.getLeftEnd(), bigRepo)};
+
+    EXPECT_CALL(peerService, write(Eq(peer), _, _)).Times(5);
+    bigProt.onMessage(Have{0}, now);
+    bigProt.onMessage(UnChoke{}, now);
+    Mock::VerifyAndClearExpectations(&peerService);
+    ASSERT_TRUE(bigRepo.isEndgame());
+
+    // Second peer also asks for the blocks that the first peer reserved
+    EXPECT_CALL(peerService, write(Eq(peer2), Eq(Interested{}), _)).Times(1);
+    {
+        InSequence seq;
+        EXPECT_CALL(peerService, write(Eq(peer2), Eq(Request{0, 4 * BLOCK, BLOCK}), _));
+        EXPECT_CALL(peerService, write(Eq(peer2), Eq(Request{0, 5 * BLOCK, BLOCK / 2}), _));
+        EXPECT_CALL(peerService, write(Eq(peer2), Eq(Request{0, 0, BLOCK}), _));
+        EXPECT_CALL(peerService, write(Eq(peer2), Eq(Request{0, BLOCK, BLOCK}), _));
     }
+    prot2.onMessage(Have{0}, now);
+    prot2.onMessage(UnChoke{}, now);
+    Mock::VerifyAndClearExpectations(&peerService);
+    ASSERT_EQ(bigRepo.getEndgameStats().duplicateRequests, 2);
+
+    // First copy wins, the request of the other peer is cancelled
+    EXPECT_CALL(peerService, write(Eq(peer2), _, _)).Times(AnyNumber());
+    prot2.onMessage(Piece(0, 0, block(0)), now + 1ms);
+    EXPECT_CALL(peerService, write(Eq(peer), Eq(Cancel{0, 0, BLOCK}), _)).Times(1);
+    ASSERT_EQ(bigProt.cancelReceived(now + 1ms), 1);
+    ASSERT_EQ(bigProt.cancelReceived(now + 1ms), 0);
+    ASSERT_EQ(bigProt.getPipeline().size(), 3);
+    Mock::VerifyAndClearExpectations(&peerService);
+
+    // Block that crossed the cancel on the wire is wasted
+    EXPECT_CALL(peerService, write(_, _, _)).Times(AnyNumber());
+    bigProt.onMessage(Piece(0, 0, block(0)), now + 2ms);
+    EXPECT_EQ(bigRepo.getEndgameStats().cancels, 1);
+    EXPECT_EQ(bigRepo.getEndgameStats().wastedBytes, BLOCK);
+
+    // Cancels of the other side do not close the connection
+    EXPECT_EQ(prot2.onMessage(Cancel{0, 0, BLOCK}, now + 3ms), ProtocolState::OPEN);
 }
 
-} // namespace fractals::network::p2p
\ No newline at end of file
+} // namespace fractals::network::p2p
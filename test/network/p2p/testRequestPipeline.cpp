@@ -0,0 +1,156 @@
+#include <fractals/network/p2p/RequestPipeline.h>
+
+#include <chrono>
+#include <gtest/gtest.h>
+
+namespace fractals::network::p2p
+{
+
+using namespace std::chrono_literals;
+
+class RequestPipelineTest : public ::testing::Test
+{
+  public:
+    static constexpr uint32_t BLOCK = RequestPipeline::BLOCK_SIZE;
+
+    void fill()
+    {
+        while (pipeline.canRequest())
+        {
+            pipeline.add(BlockRequest{0, next, BLOCK, now});
+            next += BLOCK;
+        }
+    }
+
+    // Answers the oldest request after the given round trip time
+    void answer(std::chrono::nanoseconds rtt)
+    {
+        const auto sentAt = *pipeline.oldestSentAt();
+        now = std::max(now, sentAt + rtt);
+        const auto begin = next - pipeline.size() * BLOCK;
+        ASSERT_TRUE(pipeline.complete(0, begin, BLOCK, now));
+    }
+
+    RequestPipeline pipeline;
+    uint32_t next{0};
+    std::chrono::nanoseconds now{1s};
+};
+
+TEST_F(RequestPipelineTest, startsWithInitialDepth)
+{
+    fill();
+    ASSERT_EQ(pipeline.size(), RequestPipeline::INITIAL_DEPTH);
+    ASSERT_FALSE(pipeline.canRequest());
+    ASSERT_EQ(pipeline.oldestSentAt(), 1s);
+}
+
+TEST_F(RequestPipelineTest, completesOutOfOrder)
+{
+    fill();
+
+    ASSERT_FALSE(pipeline.complete(1, 0, BLOCK, now));
+    const auto request = pipeline.complete(0, 2 * BLOCK, BLOCK, now + 10ms);
+    ASSERT_TRUE(request);
+    ASSERT_EQ(request->begin, 2 * BLOCK);
+    ASSERT_EQ(pipeline.size(), RequestPipeline::INITIAL_DEPTH - 1);
+    ASSERT_EQ(pipeline.getMinRtt(), 10ms);
+
+    // Block was already answered
+    ASSERT_FALSE(pipeline.complete(0, 2 * BLOCK, BLOCK, now + 20ms));
+}
+
+TEST_F(RequestPipelineTest, growsUntilRateIsKnown)
+{
+    fill();
+    answer(50ms);
+    answer(50ms);
+    ASSERT_EQ(pipeline.getDepth(), RequestPipeline::INITIAL_DEPTH + 2);
+}
+
+TEST_F(RequestPipelineTest, followsBandwidthDelayProduct)
+{
+    // Peer answers a block every 10 ms, 100 ms after it was requested if nothing is queued
+    for (int i = 0; i < 300; ++i)
+    {
+        fill();
+        const auto begin = next - pipeline.size() * BLOCK;
+        now = std::max(*pipeline.oldestSentAt() + 100ms, now + 10ms);
+        ASSERT_TRUE(pipeline.complete(0, begin, BLOCK, now));
+    }
+
+    // Ten blocks cover the round trip, plus half again as headroom
+    ASSERT_EQ(pipeline.getMinRtt(), 100ms);
+    ASSERT_GE(pipeline.getDepth(), 14);
+    ASSERT_LE(pipeline.getDepth(), 18);
+}
+
+TEST_F(RequestPipelineTest, shrinksForSlowPeer)
+{
+    for (int i = 0; i < 10; ++i)
+    {
+        fill();
+        now += 1s;
+        const auto begin = next - pipeline.size() * BLOCK;
+        ASSERT_TRUE(pipeline.complete(0, begin, BLOCK, now));
+    }
+
+    // A single block per round trip of a second
+    ASSERT_EQ(pipeline.getMinRtt(), 1s);
+    ASSERT_EQ(pipeline.getDepth(), 3);
+}
+
+TEST_F(RequestPipelineTest, takeAllAndRemovePiece)
+{
+    pipeline.add(BlockRequest{0, 0, BLOCK, now});
+    pipeline.add(BlockRequest{1, 0, BLOCK, now + 1ms});
+    pipeline.add(BlockRequest{1, BLOCK, BLOCK, now + 2ms});
+
+    pipeline.removePiece(0);
+    ASSERT_EQ(pipeline.oldestSentAt(), now + 1ms);
+
+    const auto requests = pipeline.takeAll();
+    ASSERT_EQ(requests.size(), 2);
+    ASSERT_TRUE(pipeline.empty());
+    ASSERT_FALSE(pipeline.oldestSentAt());
+}
+
+TEST_F(RequestPipelineTest, requestsExpire)
+{
+    ASSERT_EQ(pipeline.getTimeout(), RequestPipeline::INITIAL_TIMEOUT);
+    pipeline.add(BlockRequest{0, 0, BLOCK, now});
+    pipeline.add(BlockRequest{0, BLOCK, BLOCK, now + 1s});
+    ASSERT_EQ(pipeline.nextDeadline(), now + RequestPipeline::INITIAL_TIMEOUT);
+
+    const auto expired = pipeline.expire(now + RequestPipeline::INITIAL_TIMEOUT);
+    ASSERT_EQ(expired.size(), 1);
+    ASSERT_EQ(expired[0].begin, 0);
+    ASSERT_EQ(pipeline.size(), 1);
+    ASSERT_EQ(pipeline.getDepth(), RequestPipeline::MIN_DEPTH);
+
+    // Late answer is no longer expected
+    ASSERT_FALSE(pipeline.complete(0, 0, BLOCK, now + 4s));
+    ASSERT_TRUE(pipeline.expire(now + 3s).empty());
+}
+
+TEST_F(RequestPipelineTest, timeoutFollowsRoundTrip)
+{
+    for (int i = 0; i < 50; ++i)
+    {
+        fill();
+        answer(200ms);
+    }
+
+    // Stable round trip times converge to the smoothed round trip time, but not below the minimum
+    ASSERT_EQ(pipeline.getTimeout(), RequestPipeline::MIN_TIMEOUT);
+
+    for (int i = 0; i < 50; ++i)
+    {
+        fill();
+        answer(i % 2 ? 2s : 6s);
+    }
+
+    ASSERT_GT(pipeline.getTimeout(), 6s);
+    ASSERT_LE(pipeline.getTimeout(), RequestPipeline::MAX_TIMEOUT);
+}
+
+} // namespace fractals::network::p2p
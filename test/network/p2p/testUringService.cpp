@@ -0,0 +1,85 @@
+#include <fractals/network/http/Peer.h>
+#include <fractals/network/p2p/BufferedQueueManager.h>
+#include <fractals/network/p2p/EpollMsgQueue.h>
+#include <fractals/network/p2p/EpollServiceEvent.h>
+#include <fractals/network/p2p/PeerFd.h>
+#include <fractals/network/p2p/UringService.h>
+
+#include <gtest/gtest.h>
+
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace fractals::network::p2p
+{
+
+TEST(UringServiceTest, short_sends_keep_the_stream_in_order)
+{
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), 0);
+
+    // A tiny send buffer makes the kernel accept only part of every sendmsg
+    const int sndBuf = 4096;
+    ASSERT_EQ(setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndBuf, sizeof(sndBuf)), 0);
+
+    BufferedQueueManager bufMan;
+    EpollMsgQueue queue;
+    auto requests = queue.getLeftEnd();
+    UringService service(bufMan, queue.getRightEnd());
+
+    const PeerFd peer{http::PeerId{"1.1.1.1", 1000}, fds[0]};
+
+    // Each message is filled with its own index, so that interleaving shows up in the stream
+    constexpr size_t NUM_MESSAGES = 16;
+    constexpr size_t MESSAGE_SIZE = 32768;
+    std::vector<char> expected;
+    requests.push(Subscribe{peer});
+    for (size_t i = 0; i < NUM_MESSAGES; ++i)
+    {
+        std::vector<char> message(MESSAGE_SIZE, static_cast<char>(i));
+        expected.insert(expected.end(), message.begin(), message.end());
+        requests.push(WriteEvent{peer, std::move(message)});
+    }
+
+    std::thread runner(
+        [&]()
+        {
+            service.run();
+        });
+    service.notify();
+
+    std::vector<char> received;
+    std::vector<char> chunk(1024);
+    while (received.size() < expected.size())
+    {
+        // Read slowly so that the send buffer keeps filling up
+        const auto n = read(fds[1], chunk.data(), chunk.size());
+        if (n > 0)
+        {
+            received.insert(received.end(), chunk.begin(), chunk.begin() + n);
+        }
+        else
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+
+        while (requests.canPop())
+        {
+            requests.pop();
+        }
+    }
+
+    requests.push(Deactivate{});
+    service.notify();
+    runner.join();
+
+    ASSERT_EQ(received.size(), expected.size());
+    ASSERT_TRUE(received == expected);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+} // namespace fractals::network::p2p
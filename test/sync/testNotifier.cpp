@@ -0,0 +1,92 @@
+#include <fractals/common/FullDuplexQueue.h>
+#include <fractals/sync/Notifier.h>
+#include <fractals/sync/QueueCoordinator.h>
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <poll.h>
+#include <thread>
+
+namespace fractals::sync
+{
+
+using namespace std::chrono_literals;
+
+TEST(NOTIFIER, readyBits)
+{
+    Notifier notifier;
+    ASSERT_TRUE(notifier.isValid());
+    ASSERT_EQ(notifier.take(), 0);
+
+    notifier.notify(1);
+    notifier.notify(3);
+    notifier.notify(3);
+    ASSERT_EQ(notifier.wait(), 0b1010);
+    ASSERT_EQ(notifier.take(), 0);
+
+    // Sources share bits beyond the limit
+    notifier.notify(Notifier::MAX_SOURCES + 2);
+    ASSERT_EQ(notifier.take(), 0b100);
+}
+
+TEST(NOTIFIER, waitTimesOut)
+{
+    Notifier notifier;
+    const auto start = std::chrono::steady_clock::now();
+    ASSERT_EQ(notifier.wait(5ms), 0);
+    ASSERT_GE(std::chrono::steady_clock::now() - start, 5ms);
+}
+
+TEST(NOTIFIER, wakesUpWaitingThread)
+{
+    Notifier notifier;
+    std::thread producer(
+        [&]()
+        {
+            std::this_thread::sleep_for(5ms);
+            notifier.notify(7);
+        });
+
+    ASSERT_EQ(notifier.wait(), 1 << 7);
+    producer.join();
+}
+
+TEST(NOTIFIER, pollableFd)
+{
+    Notifier notifier;
+    pollfd pfd{notifier.getFileDescriptor(), POLLIN, 0};
+    ASSERT_EQ(poll(&pfd, 1, 0), 0);
+
+    notifier.notify(0);
+    ASSERT_EQ(poll(&pfd, 1, 0), 1);
+
+    ASSERT_EQ(notifier.take(), 1);
+    ASSERT_EQ(poll(&pfd, 1, 0), 0);
+}
+
+TEST(QUEUE_COORDINATOR, reportsReadyQueues)
+{
+    using Queue = common::FullDuplexQueue<8, int, int>;
+    using Consumer = QueueCoordinator::Consumer;
+
+    QueueCoordinator coordinator;
+    Queue q1;
+    Queue q2;
+    Queue q3;
+    const auto bit1 = coordinator.addPublisher(Consumer::PersistService, q1.getRightEnd());
+    const auto bit2 = coordinator.addPublisher(Consumer::PersistService, q2.getRightEnd());
+    const auto bit3 = coordinator.addPublisher(Consumer::DiskService, q3.getRightEnd());
+    ASSERT_NE(bit1, bit2);
+
+    q2.getLeftEnd().push(1);
+    q3.getLeftEnd().push(1);
+    ASSERT_EQ(coordinator.wait(Consumer::PersistService), bit2);
+    ASSERT_EQ(coordinator.wait(Consumer::DiskService), bit3);
+
+    coordinator.forceNotify(Consumer::PersistService);
+    ASSERT_EQ(coordinator.wait(Consumer::PersistService),
+              Notifier::ReadyBits{1} << QueueCoordinator::FORCE_SOURCE);
+}
+
+} // namespace fractals::sync